@@ -4,6 +4,8 @@
 #include <zephyr/net/net_ip.h>
 #include <zephyr/net/socket.h>
 #include <zephyr/net/http/client.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/mqtt.h>
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
@@ -13,18 +15,34 @@ LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
 
 /* IOTEMBSYS: Add required headers for settings */
 #include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell.h>
 #include <zephyr/storage/flash_map.h>
+#include <zephyr/storage/stream_flash.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/timing/timing.h>
 
 /* IOTEMBSYS: Add required headers for protobufs */
 #include <pb_encode.h>
 #include <pb_decode.h>
 #include "api/api.pb.h"
 
+#include <block_lz4/block_lz4.h>
+#include <delta_patch/delta_patch.h>
+#include <image_check/image_check.h>
+#include <lat_hist/lat_hist.h>
+#include <link_frame/link_frame.h>
+#include <quectel_bg96/quectel_bg96.h>
+#include <req_trace/req_trace.h>
+#include <trace_point/trace_point.h>
+#include <upload_sched/upload_sched.h>
+
 /* IOTEMBSYS: Add header for stats */
 #include <zephyr/stats/stats.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
 #include "app_version.h"
 
 // Helper for converting macros into strings
@@ -36,17 +54,62 @@ LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
 STATS_SECT_START(app_stats)
 STATS_SECT_ENTRY(ticks)
 STATS_SECT_ENTRY(button_press_count)
+STATS_SECT_ENTRY(button_long_press_count)
+/* Longest time spent in the joystick GPIO callback. */
+STATS_SECT_ENTRY(button_isr_max_us)
+/* Idle share of CPU time over the last telemetry interval. */
+STATS_SECT_ENTRY(idle_permille)
 STATS_SECT_END;
 
 /* Assign a name to the `ticks` stat. */
 STATS_NAME_START(app_stats)
 STATS_NAME(app_stats, ticks)
 STATS_NAME(app_stats, button_press_count)
+STATS_NAME(app_stats, button_long_press_count)
+STATS_NAME(app_stats, button_isr_max_us)
+STATS_NAME(app_stats, idle_permille)
 STATS_NAME_END(app_stats);
 
 /* Define an instance of the stats group. */
 STATS_SECT_DECL(app_stats) app_stats;
 
+/* OTA download stats. Timings and rates describe the most recent download;
+ * flash write latency per page is in the "app_flash_write" histogram.
+ */
+STATS_SECT_START(ota_stats)
+STATS_SECT_ENTRY(attempts)
+STATS_SECT_ENTRY(retries)
+STATS_SECT_ENTRY(failures)
+STATS_SECT_ENTRY(dns_ms)
+STATS_SECT_ENTRY(connect_ms)
+STATS_SECT_ENTRY(ttfb_ms)
+STATS_SECT_ENTRY(bytes)
+STATS_SECT_ENTRY(bytes_per_s)
+STATS_SECT_ENTRY(erase_ms)
+STATS_SECT_ENTRY(qird_cmds)
+STATS_SECT_END;
+
+STATS_NAME_START(ota_stats)
+STATS_NAME(ota_stats, attempts)
+STATS_NAME(ota_stats, retries)
+STATS_NAME(ota_stats, failures)
+STATS_NAME(ota_stats, dns_ms)
+STATS_NAME(ota_stats, connect_ms)
+STATS_NAME(ota_stats, ttfb_ms)
+STATS_NAME(ota_stats, bytes)
+STATS_NAME(ota_stats, bytes_per_s)
+STATS_NAME(ota_stats, erase_ms)
+STATS_NAME(ota_stats, qird_cmds)
+STATS_NAME_END(ota_stats);
+
+STATS_SECT_DECL(ota_stats) ota_stats;
+
+/* Latency histograms: each HTTP exchange from socket() to close(), and
+ * every flash program of OTA pages and telemetry records.
+ */
+static struct stats_lat_hist http_lat_;
+static struct stats_lat_hist flash_write_lat_;
+
 /* 1000 msec = 1 sec */
 #define DEFAULT_SLEEP_TIME_MS   1000
 
@@ -69,19 +132,20 @@ static const struct gpio_dt_spec sw3 = GPIO_DT_SPEC_GET_OR(SW3_NODE, gpios,
 							      {0});								  								  								  
 static const struct gpio_dt_spec sw4 = GPIO_DT_SPEC_GET_OR(SW4_NODE, gpios,
 							      {0});								  
-static struct gpio_callback button_cb_data_0;
-static struct gpio_callback button_cb_data_1;
-static struct gpio_callback button_cb_data_2;
-static struct gpio_callback button_cb_data_3;
-static struct gpio_callback button_cb_data_4;
 
 /* IOTEMBSYS: Define/declare partitions here */
+#define SLOT0_PARTITION slot0_partition
+#define SLOT0_PARTITION_ID FIXED_PARTITION_ID(SLOT0_PARTITION)
+
 #define SLOT1_PARTITION slot1_partition
 #define SLOT1_PARTITION_ID FIXED_PARTITION_ID(SLOT1_PARTITION)
 
 #define STORAGE_PARTITION storage_partition
 #define STORAGE_PARTITION_ID FIXED_PARTITION_ID(STORAGE_PARTITION)
 
+#define TELEMETRY_PARTITION telemetry_partition
+#define TELEMETRY_PARTITION_ID FIXED_PARTITION_ID(TELEMETRY_PARTITION)
+
 /*
  * A build error on this line means your board is unsupported.
  * See the blinky sample documentation for information on how to fix this.
@@ -99,8 +163,22 @@ typedef enum {
 	BUTTON_ACTION_OTA_DOWNLOAD,
 	BUTTON_ACTION_PROTO_REQ,
 	BUTTON_ACTION_GET_OTA_PATH,
+	// Not a button: the backend pushed an OTA offer (see mqtt_take_ota_push()).
+	BUTTON_ACTION_OTA_PUSH,
 } button_action_e;
 
+#define TELEMETRY_DEFAULT_INTERVAL_S (5 * 60)
+
+/* Samples status into the telemetry queue; see telemetry_sample_handler(). */
+static void telemetry_sample_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(telemetry_sample_work_, telemetry_sample_handler);
+// Set once the queue is usable; nothing schedules a sample before that.
+static bool telemetry_ready_;
+// Sampling period; a DeviceConfig push can change it.
+static uint32_t telemetry_interval_s_ = TELEMETRY_DEFAULT_INTERVAL_S;
+// The next sample was asked for by a button and is uploaded right away.
+static bool telemetry_urgent_;
+
 /* IOTEMBSYS: Add synchronization to pass the socket to the receiver task */
 struct k_fifo socket_queue_;
 
@@ -111,14 +189,205 @@ static uint8_t recv_buf_[MAX_RECV_BUF_LEN];
 /* IOTEMBSYS: Create a buffer for receiving the OTA path */
 // TODO(mskobov): this should not be static!
 static char ota_path_[128] = "zephyr.signed.bin";
+static OTAImageFormat ota_format_ = OTAImageFormat_OTA_IMAGE_FORMAT_FULL;
+static uint8_t ota_expected_hash_[IMAGE_CHECK_HASH_SIZE];
+static bool ota_has_expected_hash_;
+// The last OTAUpdateResponse offered an update.
+static bool ota_offered_;
 
 /* IOTEMBSYS: Consider provisioning a device ID. */
 static const char kDeviceId[] = "12345";
 
+// Toggles the heartbeat LED. Runs from the timer interrupt, so no thread
+// has to wake up for it.
+static void led_timer_handler(struct k_timer *timer) {
+	gpio_pin_toggle_dt(&led);
+	STATS_INC(app_stats, ticks);
+}
+
+K_TIMER_DEFINE(led_timer_, led_timer_handler, NULL);
+
 static void change_blink_interval(uint32_t new_interval_ms) {
 	blink_interval_ = new_interval_ms;
+	k_timer_start(&led_timer_, K_MSEC(blink_interval_), K_MSEC(blink_interval_));
+}
+
+// Updates app_stats.idle_permille with the idle share of CPU time since
+// the previous call, from the kernel's thread runtime stats.
+static void app_stats_update_idle(void) {
+	static uint64_t last_idle;
+	static uint64_t last_total;
+	k_thread_runtime_stats_t rt;
+	uint64_t idle;
+	uint64_t total;
+
+	if (k_thread_runtime_stats_all_get(&rt) != 0) {
+		return;
+	}
+	idle = rt.idle_cycles - last_idle;
+	total = rt.execution_cycles - last_total;
+	last_idle = rt.idle_cycles;
+	last_total = rt.execution_cycles;
+
+	if (total != 0) {
+		STATS_SET(app_stats, idle_permille, idle * 1000 / total);
+	}
+}
+
+static int cmd_idle(const struct shell *sh, size_t argc, char **argv) {
+	k_thread_runtime_stats_t rt;
+
+	if (k_thread_runtime_stats_all_get(&rt) != 0 || rt.execution_cycles == 0) {
+		shell_error(sh, "No runtime stats");
+		return -ENODATA;
+	}
+	shell_print(sh, "idle %llu of %llu cycles since boot (%llu permille)",
+		    rt.idle_cycles, rt.execution_cycles,
+		    rt.idle_cycles * 1000 / rt.execution_cycles);
+	return 0;
+}
+
+SHELL_CMD_REGISTER(idle, NULL, "Show idle residency since boot", cmd_idle);
+
+// Per-thread CPU share and stack high-water mark, collected once per
+// telemetry upload so stacks can be sized from field data.
+#define THREAD_STATS_MAX ARRAY_SIZE(((TelemetrySeries *)0)->threads)
+
+struct thread_usage {
+	k_tid_t tid;
+	uint64_t cycles;
+};
+
+struct thread_stats_walk {
+	ThreadStats stats[THREAD_STATS_MAX];
+	struct thread_usage usage[THREAD_STATS_MAX];
+	pb_size_t count;
+	// Threads beyond THREAD_STATS_MAX, which are left out.
+	uint32_t dropped;
+	// Cycles, idle included, since the previous collection.
+	uint64_t total;
+};
+
+static K_MUTEX_DEFINE(thread_stats_lock_);
+// Latest collection; only used under thread_stats_lock_.
+static struct thread_stats_walk thread_stats_;
+// Execution cycles of every thread at the previous collection.
+static struct thread_usage thread_usage_[THREAD_STATS_MAX];
+static uint64_t thread_usage_total_;
+
+static uint64_t thread_usage_last(k_tid_t tid) {
+	for (size_t i = 0; i < ARRAY_SIZE(thread_usage_); i++) {
+		if (thread_usage_[i].tid == tid) {
+			return thread_usage_[i].cycles;
+		}
+	}
+	return 0;
+}
+
+static void thread_stats_cb(const struct k_thread *thread, void *user_data) {
+	struct thread_stats_walk *walk = user_data;
+	k_tid_t tid = (k_tid_t)thread;
+	ThreadStats *stats;
+	k_thread_runtime_stats_t rt;
+	const char *name = k_thread_name_get(tid);
+	size_t unused;
+
+	if (walk->count >= THREAD_STATS_MAX) {
+		walk->dropped++;
+		return;
+	}
+	stats = &walk->stats[walk->count];
+	memset(stats, 0, sizeof(*stats));
+
+	if (name != NULL && name[0] != '\0') {
+		strncpy(stats->name, name, sizeof(stats->name) - 1);
+	} else {
+		snprintk(stats->name, sizeof(stats->name), "%p", tid);
+	}
+	if (k_thread_stack_space_get(tid, &unused) == 0) {
+		stats->stack_size = thread->stack_info.size;
+		stats->stack_used = thread->stack_info.size - unused;
+	}
+	if (k_thread_runtime_stats_get(tid, &rt) == 0) {
+		uint64_t last = thread_usage_last(tid);
+
+		// A thread restarted in the same struct k_thread starts over.
+		if (rt.execution_cycles < last) {
+			last = 0;
+		}
+		if (walk->total != 0) {
+			stats->cpu_permille = (rt.execution_cycles - last) * 1000 / walk->total;
+		}
+		walk->usage[walk->count].tid = tid;
+		walk->usage[walk->count].cycles = rt.execution_cycles;
+	}
+	walk->count++;
+}
+
+// Collects thread_stats_ for the interval since the previous call. The
+// walk runs with the thread list unlocked, since measuring the stacks
+// takes a while; a thread that starts or exits meanwhile may be missed.
+static void thread_stats_collect(void) {
+	// Kept off the HTTP thread's stack.
+	static struct thread_stats_walk walk;
+	k_thread_runtime_stats_t rt;
+
+	if (k_thread_runtime_stats_all_get(&rt) != 0) {
+		return;
+	}
+	memset(&walk, 0, sizeof(walk));
+	walk.total = rt.execution_cycles - thread_usage_total_;
+	thread_usage_total_ = rt.execution_cycles;
+
+	k_thread_foreach_unlocked(thread_stats_cb, &walk);
+	memcpy(thread_usage_, walk.usage, sizeof(thread_usage_));
+	if (walk.dropped > 0) {
+		LOG_WRN("Thread stats left out %u threads", walk.dropped);
+	}
+
+	k_mutex_lock(&thread_stats_lock_, K_FOREVER);
+	thread_stats_ = walk;
+	k_mutex_unlock(&thread_stats_lock_);
+}
+
+// Copies the latest collection into an outgoing series.
+static void thread_stats_add(TelemetrySeries *series) {
+	k_mutex_lock(&thread_stats_lock_, K_FOREVER);
+	series->threads_count = thread_stats_.count;
+	memcpy(series->threads, thread_stats_.stats, sizeof(series->threads));
+	k_mutex_unlock(&thread_stats_lock_);
 }
 
+static int cmd_threads(const struct shell *sh, size_t argc, char **argv) {
+	k_mutex_lock(&thread_stats_lock_, K_FOREVER);
+	if (thread_stats_.count == 0) {
+		k_mutex_unlock(&thread_stats_lock_);
+		shell_error(sh, "No thread stats yet");
+		return -ENODATA;
+	}
+	shell_print(sh, "%-16s %6s %13s %5s", "thread", "cpu", "stack", "used");
+	for (pb_size_t i = 0; i < thread_stats_.count; i++) {
+		const ThreadStats *stats = &thread_stats_.stats[i];
+
+		shell_print(sh, "%-16s %3u.%u%% %6u/%-6u %3u%%", stats->name,
+			    stats->cpu_permille / 10, stats->cpu_permille % 10,
+			    stats->stack_used, stats->stack_size,
+			    stats->stack_size ? stats->stack_used * 100 / stats->stack_size : 0);
+	}
+	k_mutex_unlock(&thread_stats_lock_);
+	return 0;
+}
+
+SHELL_CMD_REGISTER(threads, NULL, "Show CPU share and stack use per thread as of the last "
+		   "telemetry upload", cmd_threads);
+
+static int endpoint_settings_set(const char *name, size_t len,
+				 settings_read_cb read_cb, void *cb_arg);
+static int endpoint_settings_commit(void);
+static int endpoint_settings_export(int (*storage_func)(const char *name,
+							const void *value,
+							size_t val_len));
+
 /* IOTEMBSYS: Define a default settings val and configuration access */
 #define DEFAULT_BOOT_COUNT_VALUE 0
 static uint8_t boot_count = DEFAULT_BOOT_COUNT_VALUE;
@@ -145,85 +414,193 @@ static int foo_settings_set(const char *name, size_t len,
         return rc;
     }
 
-    return -ENOENT;
+    return endpoint_settings_set(name, len, read_cb, cb_arg);
 }
 
 static int foo_settings_export(int (*storage_func)(const char *name,
                                                    const void *value,
                                                    size_t val_len))
 {
-    return storage_func("provisioning/boot_count", &boot_count, sizeof(boot_count));
+    int rc = storage_func("provisioning/boot_count", &boot_count, sizeof(boot_count));
+
+    if (rc != 0) {
+        return rc;
+    }
+    return endpoint_settings_export(storage_func);
 }
 
 struct settings_handler my_conf = {
     .name = "provisioning",
     .h_set = foo_settings_set,
+    .h_commit = endpoint_settings_commit,
     .h_export = foo_settings_export
 };
 
-/* IOTEMBSYS: Add joystick press handler. Metaphorical bonus points for debouncing. */
-static void button_pressed(const struct device *dev, struct gpio_callback *cb,
-		    uint32_t pins) {
-	printk("Button %d pressed at %" PRIu32 "\n", pins, k_cycle_get_32());
-	k_msleep(100);
+//
+// Joystick input
+//
+// The GPIO callback only restarts the button's debounce work; everything
+// else runs on the system workqueue. A level that has been stable for
+// BUTTON_DEBOUNCE_MS is taken as the button state. Releasing the button
+// before BUTTON_LONG_PRESS_MS is a press. Holding it that long fires a long
+// press right away, and the release is then ignored.
+#define BUTTON_DEBOUNCE_MS 20
+#define BUTTON_LONG_PRESS_MS 1000
+
+struct button {
+	const struct gpio_dt_spec *spec;
+	struct gpio_callback cb;
+	struct k_work_delayable debounce_work;
+	struct k_work_delayable long_press_work;
+	// Debounced state; only touched on the system workqueue.
+	bool pressed;
+	bool long_press_fired;
+};
+
+static struct button buttons_[] = {
+	{ .spec = &sw0 },
+	{ .spec = &sw1 },
+	{ .spec = &sw2 },
+	{ .spec = &sw3 },
+	{ .spec = &sw4 },
+};
 
-	STATS_INC(app_stats, button_press_count);
+static void telemetry_sample_now(void) {
+	if (!telemetry_ready_) {
+		LOG_WRN("Telemetry queue unavailable");
+		return;
+	}
+	telemetry_urgent_ = true;
+	k_work_reschedule(&telemetry_sample_work_, K_NO_WAIT);
+}
 
+static void button_action(const struct button *button, bool long_press) {
+	const struct gpio_dt_spec *sw = button->spec;
 	uint32_t interval_ms = 0;
-	if (pins == BIT(sw0.pin)) {
+
+	LOG_INF("Button %d %s", sw->pin, long_press ? "long press" : "press");
+	STATS_INC(app_stats, button_press_count);
+
+	if (long_press) {
+		STATS_INC(app_stats, button_long_press_count);
+		if (sw == &sw0) {
+			// Center: report now and check for an update.
+			req_trace_trigger("button");
+			telemetry_sample_now();
+			k_event_post(&unblock_sender_, (1 << BUTTON_ACTION_GET_OTA_PATH));
+		}
+		return;
+	}
+
+	if (sw == &sw0) {
 		interval_ms = 100;
-	} else if (pins == BIT(sw1.pin)) {
+	} else if (sw == &sw1) {
 		// Down
 		interval_ms = 200;
-		k_event_set(&unblock_sender_, (1 << BUTTON_ACTION_OTA_DOWNLOAD));
-	} else if (pins == BIT(sw2.pin)) {
+		k_event_post(&unblock_sender_, (1 << BUTTON_ACTION_OTA_DOWNLOAD));
+	} else if (sw == &sw2) {
 		// Right
 		interval_ms = 500;
-		k_event_set(&unblock_sender_, (1 << BUTTON_ACTION_GENERIC_HTTP));
-	} else if (pins == BIT(sw3.pin)) {
+		k_event_post(&unblock_sender_, (1 << BUTTON_ACTION_GENERIC_HTTP));
+	} else if (sw == &sw3) {
 		// Up
 		interval_ms = 1000;
-		k_event_set(&unblock_sender_, (1 << BUTTON_ACTION_PROTO_REQ));
-	} else if (pins == BIT(sw4.pin)) {
+		req_trace_trigger("button");
+		telemetry_sample_now();
+	} else if (sw == &sw4) {
 		// Left
-		k_event_set(&unblock_sender_, (1 << BUTTON_ACTION_GET_OTA_PATH));
+		req_trace_trigger("button");
+		k_event_post(&unblock_sender_, (1 << BUTTON_ACTION_GET_OTA_PATH));
 		interval_ms = 2000;
-	} else {
-		printk("Unrecognized pin");
 	}
 
 	if (interval_ms != 0) {
-		printk("Setting interval to %d", interval_ms);
+		LOG_INF("Setting interval to %d", interval_ms);
 		change_blink_interval(interval_ms);
 	}
 }
 
-static int init_joystick_gpio(const struct gpio_dt_spec* button, struct gpio_callback* data) {
+static void button_debounce_handler(struct k_work *work) {
+	struct button *button = CONTAINER_OF(k_work_delayable_from_work(work),
+					     struct button, debounce_work);
+	bool pressed = gpio_pin_get_dt(button->spec) > 0;
+
+	if (pressed == button->pressed) {
+		// Bounced back.
+		return;
+	}
+	button->pressed = pressed;
+
+	if (pressed) {
+		button->long_press_fired = false;
+		k_work_schedule(&button->long_press_work,
+				K_MSEC(BUTTON_LONG_PRESS_MS - BUTTON_DEBOUNCE_MS));
+	} else {
+		k_work_cancel_delayable(&button->long_press_work);
+		if (!button->long_press_fired) {
+			button_action(button, false);
+		}
+	}
+}
+
+static void button_long_press_handler(struct k_work *work) {
+	struct button *button = CONTAINER_OF(k_work_delayable_from_work(work),
+					     struct button, long_press_work);
+
+	button->long_press_fired = true;
+	button_action(button, true);
+}
+
+// Runs in interrupt context for both edges, so it must stay short. Timed
+// with the CPU cycle counter (DWT): the system timer runs from LPTIM1 at
+// 32768 Hz, about 31 us per cycle, which is longer than the whole ISR.
+static void button_isr(const struct device *dev, struct gpio_callback *cb,
+		       uint32_t pins) {
+	timing_t start = timing_counter_get();
+	timing_t end;
+	struct button *button = CONTAINER_OF(cb, struct button, cb);
+	uint32_t isr_us;
+
+	k_work_reschedule(&button->debounce_work, K_MSEC(BUTTON_DEBOUNCE_MS));
+
+	end = timing_counter_get();
+	isr_us = DIV_ROUND_UP(timing_cycles_to_ns(timing_cycles_get(&start, &end)),
+			      NSEC_PER_USEC);
+	if (isr_us > app_stats.button_isr_max_us) {
+		STATS_SET(app_stats, button_isr_max_us, isr_us);
+	}
+}
+
+static int init_joystick_gpio(struct button *button) {
+	const struct gpio_dt_spec *sw = button->spec;
 	int ret = -1;
 
-	if (!gpio_is_ready_dt(button)) {
+	if (!gpio_is_ready_dt(sw)) {
 		printk("Error: button device %s is not ready\n",
-		       button->port->name);
+		       sw->port->name);
 		return ret;
 	}
 
-	ret = gpio_pin_configure_dt(button, GPIO_INPUT);
+	ret = gpio_pin_configure_dt(sw, GPIO_INPUT);
 	if (ret != 0) {
 		printk("Error %d: failed to configure %s pin %d\n",
-		       ret, button->port->name, button->pin);
+		       ret, sw->port->name, sw->pin);
 		return ret;
 	}
 
-	ret = gpio_pin_interrupt_configure_dt(button,
-					      GPIO_INT_EDGE_TO_ACTIVE);
+	k_work_init_delayable(&button->debounce_work, button_debounce_handler);
+	k_work_init_delayable(&button->long_press_work, button_long_press_handler);
+
+	// Both edges, so that releases restart the debounce too.
+	ret = gpio_pin_interrupt_configure_dt(sw, GPIO_INT_EDGE_BOTH);
 	if (ret != 0) {
 		printk("Error %d: failed to configure interrupt on %s pin %d\n",
-			ret, button->port->name, button->pin);
+			ret, sw->port->name, sw->pin);
 		return ret;
 	}
 
-	gpio_init_callback(data, button_pressed, BIT(button->pin));
-	gpio_add_callback(button->port, data);
+	gpio_init_callback(&button->cb, button_isr, BIT(sw->pin));
+	gpio_add_callback(sw->port, &button->cb);
 	return ret;
 }
 
@@ -238,25 +615,516 @@ static void dump_addrinfo(const struct addrinfo *ai) {
 	       ((struct sockaddr_in *)ai->ai_addr)->sin_port);
 }
 
-static int get_addr_if_needed(struct addrinfo **ai, const char* host, const char* port) {
-	if (*ai != NULL) {
-		// We already have the address.
-		return 0;
+//
+// Backend endpoints
+//
+// Every server the device talks to is an endpoint with a host and a port.
+// The values below are only defaults: each endpoint can be changed at
+// runtime through the "provisioning/<name>/host" and "provisioning/<name>/port"
+// settings (the mcumgr settings group or the "endpoint" shell command), or by
+// the backend in a StatusUpdateResponse or DeviceConfig. Addresses are
+// resolved by endpoint_prefetch_work_ once the modem is attached and again
+// after every change, so a request only waits for DNS if a lookup failed.
+
+// You will need to change this to match your host
+// WARNING: This will change with each new EC2 instance!
+#define EC2_HOST "ec2-204-236-202-14.compute-1.amazonaws.com"
+#define BACKEND_PORT 8080
+#define TCP_PORT 4242
+#define COAP_PORT 5683
+#define MQTT_PORT 1883
+#define OTA_HOST "nhan-iotemb-firmware-releases.s3.amazonaws.com"
+#define OTA_HTTP_PORT 80
+#define HTTPBIN_HOST "httpbin.org"
+#define HTTPBIN_PORT 80
+
+#define ENDPOINT_HOST_MAX_LEN 64
+// Room for "<host>:<port>", the HTTP Host header.
+#define ENDPOINT_HOST_HEADER_LEN (ENDPOINT_HOST_MAX_LEN + sizeof(":65535"))
+
+enum endpoint_id {
+	// HTTP API for status updates and OTA queries
+	ENDPOINT_BACKEND = 0,
+#if !defined(CONFIG_APP_BACKEND_HTTP)
+	// Link, CoAP or MQTT server, whichever transport is built in
+	ENDPOINT_TRANSPORT,
+#endif
+	// OTA image downloads over HTTP
+	ENDPOINT_OTA,
+	ENDPOINT_HTTPBIN,
+	ENDPOINT_COUNT,
+};
+
+struct endpoint {
+	const char *name;
+	char host[ENDPOINT_HOST_MAX_LEN];
+	uint16_t port;
+	struct sockaddr_in addr;
+	bool resolved;
+	// Bumped on every change, so a lookup that raced with one is dropped.
+	uint32_t generation;
+};
+
+static struct endpoint endpoints_[ENDPOINT_COUNT] = {
+	[ENDPOINT_BACKEND] = { .name = "backend", .host = EC2_HOST, .port = BACKEND_PORT },
+#if defined(CONFIG_APP_BACKEND_LINK)
+	[ENDPOINT_TRANSPORT] = { .name = "transport", .host = EC2_HOST, .port = TCP_PORT },
+#elif defined(CONFIG_APP_BACKEND_COAP)
+	[ENDPOINT_TRANSPORT] = { .name = "transport", .host = EC2_HOST, .port = COAP_PORT },
+#elif defined(CONFIG_APP_BACKEND_MQTT)
+	[ENDPOINT_TRANSPORT] = { .name = "transport", .host = EC2_HOST, .port = MQTT_PORT },
+#endif
+	[ENDPOINT_OTA] = { .name = "ota", .host = OTA_HOST, .port = OTA_HTTP_PORT },
+	[ENDPOINT_HTTPBIN] = { .name = "httpbin", .host = HTTPBIN_HOST, .port = HTTPBIN_PORT },
+};
+static K_MUTEX_DEFINE(endpoint_lock_);
+// The modem returns every getaddrinfo() result in the same static buffer,
+// so lookups are serialized and copied out before the next one.
+static K_MUTEX_DEFINE(endpoint_dns_lock_);
+// Set when settings changed an endpoint; endpoint_settings_commit() then
+// starts a prefetch.
+static bool endpoint_changed_;
+
+static struct endpoint *endpoint_find(const char *name, size_t len) {
+	for (size_t i = 0; i < ARRAY_SIZE(endpoints_); i++) {
+		if (strlen(endpoints_[i].name) == len &&
+		    strncmp(endpoints_[i].name, name, len) == 0) {
+			return &endpoints_[i];
+		}
 	}
-	struct addrinfo hints;
+	return NULL;
+}
+
+// Looks up @p id unless its address is already cached.
+static int endpoint_resolve(enum endpoint_id id) {
+	struct endpoint *ep = &endpoints_[id];
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *ai;
+	char host[ENDPOINT_HOST_MAX_LEN];
+	char port[sizeof("65535")];
+	uint32_t generation;
 	int st;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	st = getaddrinfo(host, port, &hints, ai);
-	LOG_INF("getaddrinfo status: %d\n", st);
+	k_mutex_lock(&endpoint_lock_, K_FOREVER);
+	if (ep->resolved) {
+		k_mutex_unlock(&endpoint_lock_);
+		return 0;
+	}
+	strncpy(host, ep->host, sizeof(host));
+	snprintk(port, sizeof(port), "%u", ep->port);
+	generation = ep->generation;
+	k_mutex_unlock(&endpoint_lock_);
+
+	k_mutex_lock(&endpoint_dns_lock_, K_FOREVER);
+	req_trace_mark(REQ_TRACE_DNS);
+	TRACE_SPAN_BEGIN("dns", id);
+	st = getaddrinfo(host, port, &hints, &ai);
+	TRACE_SPAN_END("dns", st);
+	req_trace_mark(REQ_TRACE_DNS_DONE);
+	LOG_INF("getaddrinfo %s status: %d", host, st);
 	if (st == 0) {
-		dump_addrinfo(*ai);
+		dump_addrinfo(ai);
+		k_mutex_lock(&endpoint_lock_, K_FOREVER);
+		if (ep->generation == generation) {
+			memcpy(&ep->addr, ai->ai_addr, sizeof(ep->addr));
+			ep->resolved = true;
+		}
+		k_mutex_unlock(&endpoint_lock_);
+		freeaddrinfo(ai);
+	}
+	k_mutex_unlock(&endpoint_dns_lock_);
+
+	return st == 0 ? 0 : -EHOSTUNREACH;
+}
+
+static void endpoint_prefetch_handler(struct k_work *work) {
+	for (size_t i = 0; i < ARRAY_SIZE(endpoints_); i++) {
+		if (endpoint_resolve(i) != 0) {
+			LOG_WRN("Prefetching %s failed", endpoints_[i].name);
+		}
+	}
+}
+
+K_WORK_DEFINE(endpoint_prefetch_work_, endpoint_prefetch_handler);
+
+// Copies the address of @p id, resolving it first if needed.
+static int endpoint_addr(enum endpoint_id id, struct sockaddr_in *addr) {
+	int err = endpoint_resolve(id);
+
+	if (err != 0) {
+		LOG_ERR("DNS lookup failed");
+		return err;
+	}
+
+	k_mutex_lock(&endpoint_lock_, K_FOREVER);
+	if (endpoints_[id].resolved) {
+		*addr = endpoints_[id].addr;
+	} else {
+		// Changed while it was being looked up.
+		err = -EAGAIN;
+	}
+	k_mutex_unlock(&endpoint_lock_);
+	return err;
+}
+
+// Connects @p sock to @p id. A failure drops the cached address, in case
+// the server moved, unless the modem reported its link down (-ENETDOWN).
+static int endpoint_connect(enum endpoint_id id, int sock) {
+	struct sockaddr_in addr;
+	int err = endpoint_addr(id, &addr);
+
+	if (err != 0) {
+		return err;
+	}
+	TRACE_SPAN_BEGIN("connect", id);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = -errno;
+		TRACE_SPAN_END("connect", err);
+		LOG_ERR("Connecting to socket failed: %d", err);
+		if (err == -ENETDOWN) {
+			return err;
+		}
+		k_mutex_lock(&endpoint_lock_, K_FOREVER);
+		endpoints_[id].resolved = false;
+		k_mutex_unlock(&endpoint_lock_);
+		return err;
+	}
+	TRACE_SPAN_END("connect", 0);
+	return 0;
+}
+
+// Writes the HTTP Host header value for @p id to @p buf.
+static void endpoint_host_header(enum endpoint_id id, char *buf, size_t buf_size) {
+	k_mutex_lock(&endpoint_lock_, K_FOREVER);
+	if (endpoints_[id].port == 80) {
+		snprintk(buf, buf_size, "%s", endpoints_[id].host);
+	} else {
+		snprintk(buf, buf_size, "%s:%u", endpoints_[id].host, endpoints_[id].port);
+	}
+	k_mutex_unlock(&endpoint_lock_);
+}
+
+// Changes @p ep; a NULL @p host or a zero @p port keeps that part. Returns
+// true if anything changed.
+static bool endpoint_update(struct endpoint *ep, const char *host, size_t host_len,
+			    uint16_t port) {
+	bool changed = false;
+
+	k_mutex_lock(&endpoint_lock_, K_FOREVER);
+	if (host != NULL &&
+	    (strlen(ep->host) != host_len || strncmp(ep->host, host, host_len) != 0)) {
+		memcpy(ep->host, host, host_len);
+		ep->host[host_len] = '\0';
+		changed = true;
+	}
+	if (port != 0 && port != ep->port) {
+		ep->port = port;
+		changed = true;
+	}
+	if (changed) {
+		ep->resolved = false;
+		ep->generation++;
+	}
+	k_mutex_unlock(&endpoint_lock_);
+	return changed;
+}
+
+// Applies a change from the shell or the backend, persists it and looks
+// the new address up in the background.
+static int endpoint_set(const char *name, const char *host, uint16_t port) {
+	struct endpoint *ep = endpoint_find(name, strlen(name));
+	char key[sizeof("provisioning//host") + 16];
+	size_t host_len = host ? strlen(host) : 0;
+
+	if (ep == NULL) {
+		return -ENOENT;
+	}
+	if (host != NULL && (host_len == 0 || host_len >= sizeof(ep->host))) {
+		return -EINVAL;
+	}
+	if (!endpoint_update(ep, host, host_len, port)) {
+		return 0;
+	}
+
+	LOG_INF("Endpoint %s is now %s:%u", ep->name, ep->host, ep->port);
+	if (host != NULL) {
+		snprintk(key, sizeof(key), "provisioning/%s/host", ep->name);
+		settings_save_one(key, host, host_len);
+	}
+	if (port != 0) {
+		snprintk(key, sizeof(key), "provisioning/%s/port", ep->name);
+		settings_save_one(key, &port, sizeof(port));
+	}
+	k_work_submit(&endpoint_prefetch_work_);
+	return 0;
+}
+
+// Handles "provisioning/<name>/host" and "provisioning/<name>/port".
+static int endpoint_settings_set(const char *name, size_t len,
+				 settings_read_cb read_cb, void *cb_arg) {
+	const char *next;
+	size_t name_len = settings_name_next(name, &next);
+	struct endpoint *ep = endpoint_find(name, name_len);
+	int rc;
+
+	if (ep == NULL || next == NULL) {
+		return -ENOENT;
+	}
+
+	if (settings_name_steq(next, "host", NULL)) {
+		char host[ENDPOINT_HOST_MAX_LEN];
+
+		if (len == 0 || len >= sizeof(host)) {
+			return -EINVAL;
+		}
+		rc = read_cb(cb_arg, host, len);
+		if (rc < 0) {
+			return rc;
+		}
+		endpoint_changed_ |= endpoint_update(ep, host, len, 0);
+		return 0;
+	} else if (settings_name_steq(next, "port", NULL)) {
+		uint16_t port;
+
+		if (len != sizeof(port)) {
+			return -EINVAL;
+		}
+		rc = read_cb(cb_arg, &port, sizeof(port));
+		if (rc < 0) {
+			return rc;
+		}
+		endpoint_changed_ |= endpoint_update(ep, NULL, 0, port);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int endpoint_settings_commit(void) {
+	if (endpoint_changed_) {
+		endpoint_changed_ = false;
+		k_work_submit(&endpoint_prefetch_work_);
+	}
+	return 0;
+}
+
+static int endpoint_settings_export(int (*storage_func)(const char *name,
+							const void *value,
+							size_t val_len)) {
+	char key[sizeof("provisioning//host") + 16];
+
+	for (size_t i = 0; i < ARRAY_SIZE(endpoints_); i++) {
+		struct endpoint *ep = &endpoints_[i];
+		int rc;
+
+		snprintk(key, sizeof(key), "provisioning/%s/host", ep->name);
+		rc = storage_func(key, ep->host, strlen(ep->host));
+		if (rc == 0) {
+			snprintk(key, sizeof(key), "provisioning/%s/port", ep->name);
+			rc = storage_func(key, &ep->port, sizeof(ep->port));
+		}
+		if (rc != 0) {
+			return rc;
+		}
+	}
+	return 0;
+}
+
+// Applies an endpoint pushed by the backend.
+static void endpoint_apply(const Endpoint *update) {
+	int err;
+
+	if (update->port > UINT16_MAX) {
+		LOG_WRN("Bad port for endpoint %s", update->name);
+		return;
+	}
+	err = endpoint_set(update->name, update->host[0] ? update->host : NULL, update->port);
+	if (err != 0) {
+		LOG_WRN("Endpoint %s not updated: %d", update->name, err);
+	}
+}
+
+static int cmd_endpoint_list(const struct shell *sh, size_t argc, char **argv) {
+	k_mutex_lock(&endpoint_lock_, K_FOREVER);
+	for (size_t i = 0; i < ARRAY_SIZE(endpoints_); i++) {
+		const struct endpoint *ep = &endpoints_[i];
+		char addr[NET_IPV4_ADDR_LEN] = "-";
+
+		if (ep->resolved) {
+			inet_ntop(AF_INET, &ep->addr.sin_addr, addr, sizeof(addr));
+		}
+		shell_print(sh, "%-10s %s:%u (%s)", ep->name, ep->host, ep->port, addr);
+	}
+	k_mutex_unlock(&endpoint_lock_);
+	return 0;
+}
+
+static int cmd_endpoint_set(const struct shell *sh, size_t argc, char **argv) {
+	unsigned long port = 0;
+	int err;
+
+	if (argc > 3) {
+		char *end;
+
+		port = strtoul(argv[3], &end, 10);
+		if (*end != '\0' || port == 0 || port > UINT16_MAX) {
+			shell_error(sh, "Bad port: %s", argv[3]);
+			return -EINVAL;
+		}
+	}
+
+	err = endpoint_set(argv[1], argv[2], port);
+	if (err != 0) {
+		shell_error(sh, "Failed to set %s: %d", argv[1], err);
+	}
+	return err;
+}
+
+static int cmd_endpoint_resolve(const struct shell *sh, size_t argc, char **argv) {
+	k_work_submit(&endpoint_prefetch_work_);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_endpoint,
+	SHELL_CMD(list, NULL, "List endpoints and their cached addresses", cmd_endpoint_list),
+	SHELL_CMD_ARG(set, NULL, "Change an endpoint: set <name> <host> [port]",
+		      cmd_endpoint_set, 3, 1),
+	SHELL_CMD(resolve, NULL, "Look up all endpoints again", cmd_endpoint_resolve),
+	SHELL_SUBCMD_SET_END
+);
+SHELL_CMD_REGISTER(endpoint, &sub_endpoint, "Backend endpoints", NULL);
+
+//
+// Upload Scheduling Section
+//
+
+// Uploads that can wait are held back until the signal is good or their
+// class deadline passes: at poor RSSI a transfer takes several times longer
+// and the radio burns that much more energy. Button presses bypass this.
+enum upload_class {
+	UPLOAD_CLASS_TELEMETRY,
+	UPLOAD_CLASS_OTA,
+	UPLOAD_CLASS_COUNT,
+};
+
+static const struct upload_sched_class upload_classes_[UPLOAD_CLASS_COUNT] = {
+	// Queued telemetry also goes along whenever the radio is busy anyway.
+	[UPLOAD_CLASS_TELEMETRY] = {
+		.min_rssi = -95, .max_delay_ms = 30 * 60 * MSEC_PER_SEC, .piggyback = true,
+	},
+	// A pushed OTA offer means a large download, so it waits for more.
+	[UPLOAD_CLASS_OTA] = {
+		.min_rssi = -85, .max_delay_ms = 6 * 60 * 60 * MSEC_PER_SEC,
+	},
+};
+
+static const char *const upload_class_names_[UPLOAD_CLASS_COUNT] = {
+	[UPLOAD_CLASS_TELEMETRY] = "telemetry",
+	[UPLOAD_CLASS_OTA] = "ota",
+};
+
+// What the HTTP thread is told to do once a class is due.
+static const uint32_t upload_events_[UPLOAD_CLASS_COUNT] = {
+	[UPLOAD_CLASS_TELEMETRY] = 1 << BUTTON_ACTION_PROTO_REQ,
+	[UPLOAD_CLASS_OTA] = 1 << BUTTON_ACTION_OTA_PUSH,
+};
+
+// Events whose handling begins a request trace; only these get a trigger,
+// so a trigger is never left for an unrelated trace to pick up.
+#define UPLOAD_TRACED_EVENTS ((1 << BUTTON_ACTION_PROTO_REQ) | (1 << BUTTON_ACTION_GET_OTA_PATH))
+
+// The driver refreshes its RSSI about this often while the modem is awake.
+#define UPLOAD_POLL_MS (30 * MSEC_PER_SEC)
+
+static struct upload_sched_ctx upload_sched_;
+static K_MUTEX_DEFINE(upload_lock_);
+static void upload_sched_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(upload_sched_work_, upload_sched_handler);
+
+// When the last RSSI fed to the scheduler was measured. A sleeping modem
+// reports nothing new, which keeps the average rather than forgetting it.
+static uint32_t upload_rssi_ms_;
+
+static int upload_init(void) {
+	const struct upload_sched_cfg cfg = {
+		.classes = upload_classes_,
+		.num_classes = UPLOAD_CLASS_COUNT,
+		// Ride out single fades; a sample moves the average by 1/4.
+		.smoothing_shift = 2,
+	};
+
+	return upload_sched_init(&upload_sched_, &cfg);
+}
+
+static void upload_sched_handler(struct k_work *work) {
+	uint32_t now = k_uptime_get_32();
+	uint32_t due;
+	int32_t next;
+	int16_t rssi;
+	uint32_t measured;
+
+	k_mutex_lock(&upload_lock_, K_FOREVER);
+	if (quectel_bg96_rssi_get(&rssi, &measured) == 0 && measured != upload_rssi_ms_) {
+		upload_rssi_ms_ = measured;
+		upload_sched_signal(&upload_sched_, rssi, measured);
+	}
+	due = upload_sched_take(&upload_sched_, now);
+	next = upload_sched_next(&upload_sched_, now);
+	k_mutex_unlock(&upload_lock_);
+
+	for (int cls = 0; cls < UPLOAD_CLASS_COUNT; cls++) {
+		if (due & BIT(cls)) {
+			LOG_INF("Uploading %s", upload_class_names_[cls]);
+			if (upload_events_[cls] & UPLOAD_TRACED_EVENTS) {
+				req_trace_trigger("upload_sched");
+			}
+			k_event_post(&unblock_sender_, upload_events_[cls]);
+		}
+	}
+	// Poll the signal until the earliest deadline while anything waits.
+	if (next >= 0) {
+		k_work_reschedule(&upload_sched_work_, K_MSEC(MIN(next, UPLOAD_POLL_MS)));
 	}
-	return st;
 }
 
+// Queues an upload of class cls; it goes out at once if the signal allows.
+static void upload_request(enum upload_class cls) {
+	k_mutex_lock(&upload_lock_, K_FOREVER);
+	upload_sched_request(&upload_sched_, cls, k_uptime_get_32());
+	k_mutex_unlock(&upload_lock_);
+	k_work_reschedule(&upload_sched_work_, K_NO_WAIT);
+}
+
+static int cmd_upload(const struct shell *sh, size_t argc, char **argv) {
+	uint32_t now = k_uptime_get_32();
+
+	k_mutex_lock(&upload_lock_, K_FOREVER);
+	if (upload_sched_rssi(&upload_sched_, now) == UPLOAD_SCHED_RSSI_UNKNOWN) {
+		shell_print(sh, "rssi unknown");
+	} else {
+		shell_print(sh, "rssi %d dBm (smoothed)", upload_sched_rssi(&upload_sched_, now));
+	}
+	for (int cls = 0; cls < UPLOAD_CLASS_COUNT; cls++) {
+		const struct upload_sched_class_stats *st = &upload_sched_.stats[cls];
+		uint32_t sent = st->by_signal + st->by_deadline + st->by_piggyback;
+
+		shell_print(sh, "%-9s %s, %u requests, sent %u by signal, %u by deadline, "
+			    "%u along; wait avg %u max %u s",
+			    upload_class_names_[cls],
+			    (upload_sched_.pending & BIT(cls)) ? "pending" : "idle",
+			    st->requests, st->by_signal, st->by_deadline, st->by_piggyback,
+			    sent ? st->wait_ms / sent / MSEC_PER_SEC : 0,
+			    st->max_wait_ms / MSEC_PER_SEC);
+	}
+	k_mutex_unlock(&upload_lock_);
+	return 0;
+}
+
+SHELL_CMD_REGISTER(upload, NULL, "Show deferred uploads and link quality", cmd_upload);
+
 //
 // Generic HTTP Request Section
 //
@@ -265,13 +1133,9 @@ static int get_addr_if_needed(struct addrinfo **ai, const char* host, const char
 // to get the latest IP.
 #define TCPBIN_IP "45.79.112.203"
 #define HTTPBIN_IP "54.204.94.184"
-#define TCP_PORT 4242
 #define IS_POST_REQ 1
 #define USE_PROTO 1
 
-#define HTTPBIN_PORT 80
-#define HTTPBIN_HOST "httpbin.org"
-static struct addrinfo* httpbin_addr_;
 
 /* IOTEMBSYS: Create a HTTP response handler/callback. */
 void http_response_cb(struct http_response *rsp,
@@ -318,12 +1182,8 @@ int http_payload_cb(int sock, struct http_request *req, void *user_data) {
 static void generic_http_request(void) {
 	int sock;
 	const int32_t timeout = 5 * MSEC_PER_SEC;
-
-	// Get the IP address of the domain
-	if (get_addr_if_needed(&httpbin_addr_, HTTPBIN_HOST, xstr(HTTPBIN_PORT)) != 0) {
-		LOG_ERR("DNS lookup failed");
-		return;
-	}
+	char host[ENDPOINT_HOST_HEADER_LEN];
+	uint32_t start = lat_hist_start();
 
 	// Create a socket using parameters that the modem allows.
 	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -331,10 +1191,11 @@ static void generic_http_request(void) {
 		LOG_ERR("Creating socket failed");
 		return;
 	}
-	if (connect(sock, httpbin_addr_->ai_addr, httpbin_addr_->ai_addrlen) < 0) {
-		LOG_ERR("Connecting to socket failed");
+	if (endpoint_connect(ENDPOINT_HTTPBIN, sock) < 0) {
+		close(sock);
 		return;
 	}
+	endpoint_host_header(ENDPOINT_HTTPBIN, host, sizeof(host));
 
 	struct http_request req;
 
@@ -351,7 +1212,7 @@ static void generic_http_request(void) {
 	// This must match the payload-generating function!
 	req.payload_len = 37;
 #endif // IS_POST_REQ
-	req.host = HTTPBIN_HOST;
+	req.host = host;
 	req.protocol = "HTTP/1.1";
 	req.response = http_response_cb;
 	req.recv_buf = recv_buf_;
@@ -359,7 +1220,9 @@ static void generic_http_request(void) {
 
 	// This request is synchronous and blocks the thread.
 	LOG_INF("Sending HTTP request");
+	TRACE_SPAN_BEGIN("http_req", req.method);
 	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
+	TRACE_SPAN_END("http_req", ret);
 	if (ret > 0) {
 		LOG_INF("HTTP request sent %d bytes", ret);
 	} else {
@@ -368,18 +1231,147 @@ static void generic_http_request(void) {
 
 	LOG_INF("Closing the socket");
 	close(sock);
+	lat_hist_stop(&http_lat_, start);
 }
 
 //
 // Backend Request Section
 //
 
-// You will need to change this to match your host
-// WARNING: This will change with each new EC2 instance!
-#define EC2_HOST "ec2-204-236-202-14.compute-1.amazonaws.com"
-#define BACKEND_PORT 8080
-#define BACKEND_HOST EC2_HOST ":8080"
-static struct addrinfo* backend_addr_;
+static int backend_status_;
+
+// Every registered stats group goes along with each telemetry batch as
+// StatsGroup messages, streamed straight from the counters, so a new stats
+// group or entry reaches the backend without touching api.proto or this
+// file.
+#if defined(CONFIG_APP_BACKEND_COAP)
+// A batch is one datagram, which the modem sends as a single AT+QISEND, so
+// samples are left for the next batch once it is full and the groups only
+// get the room the samples leave.
+#define TELEMETRY_STATS_MAX_SIZE 0
+#define TELEMETRY_PAYLOAD_MAX (COAP_MAX_MSG_LEN - COAP_HEADER_ROOM)
+#else
+#define TELEMETRY_STATS_MAX_SIZE 1024
+#define TELEMETRY_PAYLOAD_MAX (TelemetrySeries_size + TELEMETRY_STATS_MAX_SIZE)
+#endif
+#define TELEMETRY_SERIES_MAX_SIZE (TELEMETRY_PAYLOAD_MAX - TELEMETRY_STATS_MAX_SIZE)
+// TelemetrySeries.stats, which nanopb ignores (see api.options).
+#define TELEMETRY_SERIES_STATS_TAG 11
+
+static bool stats_encode_name(pb_ostream_t *stream, const pb_field_iter_t *field,
+			      void *const *arg) {
+	const char *name = *arg;
+
+	return pb_encode_tag_for_field(stream, field) &&
+	       pb_encode_string(stream, (const pb_byte_t *)name, strlen(name));
+}
+
+static uint64_t stats_value(const struct stats_hdr *hdr, uint16_t off) {
+	const uint8_t *entry = (const uint8_t *)hdr + off;
+
+	switch (hdr->s_size) {
+	case sizeof(uint16_t):
+		return *(const uint16_t *)entry;
+	case sizeof(uint32_t):
+		return *(const uint32_t *)entry;
+	case sizeof(uint64_t):
+		return *(const uint64_t *)entry;
+	default:
+		return 0;
+	}
+}
+
+// One group's counters, copied at once so that sizing and encoding it
+// (nanopb walks a submessage three times) all see the same values. A
+// counter that changed in between would fail the encode.
+#define STATS_SNAPSHOT_MAX_COUNTERS 32
+
+struct stats_snapshot {
+	pb_ostream_t *stream;
+	uint16_t count;
+	uint64_t values[STATS_SNAPSHOT_MAX_COUNTERS];
+};
+
+// Only ever used under telemetry_lock_, and too big for the stack.
+static struct stats_snapshot stats_snapshot_;
+
+static void stats_snapshot_take(struct stats_snapshot *snap, const struct stats_hdr *hdr) {
+	unsigned int key = irq_lock();
+
+	snap->count = MIN(hdr->s_cnt, STATS_SNAPSHOT_MAX_COUNTERS);
+	for (uint16_t i = 0; i < snap->count; i++) {
+		snap->values[i] = stats_value(hdr, sizeof(*hdr) + i * hdr->s_size);
+	}
+	irq_unlock(key);
+}
+
+static int stats_encode_counter(struct stats_hdr *hdr, void *arg, const char *name,
+				uint16_t off) {
+	const struct stats_snapshot *snap = arg;
+	uint16_t idx = (off - sizeof(*hdr)) / hdr->s_size;
+	StatsCounter counter = StatsCounter_init_zero;
+
+	if (idx >= snap->count) {
+		return 0;
+	}
+	counter.value = snap->values[idx];
+	if (counter.value == 0) {
+		return 0;
+	}
+	counter.name.funcs.encode = stats_encode_name;
+	counter.name.arg = (void *)name;
+	if (!pb_encode_tag(snap->stream, PB_WT_STRING, StatsGroup_counters_tag) ||
+	    !pb_encode_submessage(snap->stream, StatsCounter_fields, &counter)) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static bool stats_encode_counters(pb_ostream_t *stream, const pb_field_iter_t *field,
+				  void *const *arg) {
+	struct stats_hdr *hdr = *arg;
+
+	stats_snapshot_.stream = stream;
+	return stats_walk(hdr, stats_encode_counter, &stats_snapshot_) == 0;
+}
+
+// Appends one group if it fits; a group that does not is left out whole,
+// so the message stays valid.
+static int stats_encode_group(struct stats_hdr *hdr, void *arg) {
+	pb_ostream_t *stream = arg;
+	StatsGroup group = StatsGroup_init_zero;
+	size_t size;
+
+	if (hdr->s_cnt > STATS_SNAPSHOT_MAX_COUNTERS) {
+		LOG_WRN("Stats group %s truncated to %d counters", hdr->s_name,
+			STATS_SNAPSHOT_MAX_COUNTERS);
+	}
+	stats_snapshot_take(&stats_snapshot_, hdr);
+
+	group.name.funcs.encode = stats_encode_name;
+	group.name.arg = (void *)hdr->s_name;
+	group.counters.funcs.encode = stats_encode_counters;
+	group.counters.arg = hdr;
+
+	if (!pb_get_encoded_size(&size, StatsGroup_fields, &group)) {
+		return 0;
+	}
+	// Tag and length take at most 1 + 5 bytes.
+	if (stream->bytes_written + size + 6 > stream->max_size) {
+		LOG_DBG("No room for stats group %s", hdr->s_name);
+		return 0;
+	}
+	if (!pb_encode_tag(stream, PB_WT_STRING, TELEMETRY_SERIES_STATS_TAG) ||
+	    !pb_encode_submessage(stream, StatsGroup_fields, &group)) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// Appends every registered stats group to an encoded TelemetrySeries.
+static bool encode_stats_groups(pb_ostream_t *stream) {
+	return stats_group_walk(stats_encode_group, stream) == 0;
+}
 
 /* IOTEMBSYS: Add protobuf encoding and decoding. */
 static bool encode_status_update_request(uint8_t *buffer, size_t buffer_size, size_t *message_length)
@@ -406,9 +1398,11 @@ static bool encode_status_update_request(uint8_t *buffer, size_t buffer_size, si
 	strncpy(message.device_id, kDeviceId, sizeof(message.device_id));
 
 	// TODO(mskobov): Get RTC value
-	message.has_app_stats = true;
-	message.app_stats.ticks = app_stats.ticks;
-	message.app_stats.button_press_count = app_stats.button_press_count;
+
+	// The rest of app_stats and ota_stats is sent with each batch as stats
+	// groups (see encode_stats_groups()).
+	message.ticks = app_stats.ticks;
+	message.button_press_count = app_stats.button_press_count;
 
 	/* Now we are ready to encode the message! */
 	status = pb_encode(&stream, StatusUpdateRequest_fields, &message);
@@ -436,33 +1430,24 @@ static bool decode_status_update_response(uint8_t *buffer, size_t message_length
 	pb_istream_t stream = pb_istream_from_buffer(buffer, message_length);
 
 	/* Now we are ready to decode the message. */
+	req_trace_mark(REQ_TRACE_DECODE);
 	status = pb_decode(&stream, StatusUpdateResponse_fields, &message);
 
 	/* Check for errors... */
 	if (status) {
 		/* Print the data contained in the message. */
 		printk("Response message: %s\n", message.message);
+		for (pb_size_t i = 0; i < message.endpoints_count; i++) {
+			endpoint_apply(&message.endpoints[i]);
+		}
 	} else {
 		printk("Decoding failed: %s\n", PB_GET_ERROR(&stream));
 	}
+	req_trace_mark(REQ_TRACE_DECODED);
 
 	return status;
 }
 
-int http_proto_payload_gen(uint8_t* buffer, size_t buf_size) {
-	size_t message_length;
-
-	/* Encode our message */
-	if (!encode_status_update_request(buffer, buf_size, &message_length)) {
-		LOG_ERR("Encoding request failed");
-		return 0;
-	} else {
-		LOG_INF("Sending proto to server. Length: %d", (int)message_length);
-	}
-
-	return (int)message_length;
-}
-
 void http_proto_response_cb(struct http_response *rsp,
 			enum http_final_call final_data,
 			void *user_data)
@@ -475,6 +1460,7 @@ void http_proto_response_cb(struct http_response *rsp,
 		// Decode the protobuf response.
 		decode_status_update_response(rsp->body_frag_start, rsp->body_frag_len);
 	}
+	backend_status_ = rsp->http_status_code;
 
 	LOG_INF("Response to %s", (const char *)user_data);
 	LOG_INF("Response status %s", rsp->http_status);
@@ -482,45 +1468,49 @@ void http_proto_response_cb(struct http_response *rsp,
 
 
 /* IOTEMBSYS: Implement the HTTP client functionality */
-static void backend_http_request(void) {
+// Posts a protobuf payload to the backend. Returns 0 once the backend has
+// accepted it.
+static int backend_post(const char *url, const uint8_t *payload, size_t payload_len) {
 	int sock;
 	const int32_t timeout = 5 * MSEC_PER_SEC;
-
-	// Get the IP address of the domain
-	if (get_addr_if_needed(&backend_addr_, EC2_HOST, xstr(BACKEND_PORT)) != 0) {
-		LOG_ERR("DNS lookup failed");
-		return;
-	}
+	char host[ENDPOINT_HOST_HEADER_LEN];
+	uint32_t start = lat_hist_start();
+	int err;
 
 	// Create a socket using parameters that the modem allows.
 	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock < 0) {
 		LOG_ERR("Creating socket failed");
-		return;
+		return -errno;
 	}
-	if (connect(sock, backend_addr_->ai_addr, backend_addr_->ai_addrlen) < 0) {
-		LOG_ERR("Connecting to socket failed");
-		return;
+	err = endpoint_connect(ENDPOINT_BACKEND, sock);
+	if (err != 0) {
+		close(sock);
+		return err;
 	}
+	endpoint_host_header(ENDPOINT_BACKEND, host, sizeof(host));
 
 	struct http_request req;
 
 	memset(&req, 0, sizeof(req));
 	memset(recv_buf_, 0, sizeof(recv_buf_));
+	backend_status_ = 0;
 
 	req.method = HTTP_POST;
-	req.url = "/status_update";
-	req.host = BACKEND_HOST;
+	req.url = url;
+	req.host = host;
 	req.protocol = "HTTP/1.1";
-	req.payload_len = http_proto_payload_gen(recv_buf_, sizeof(recv_buf_));
-	req.payload = req.payload_len ? recv_buf_ : NULL;
+	req.payload_len = payload_len;
+	req.payload = (const char *)payload;
 	req.response = http_proto_response_cb;
 	req.recv_buf = recv_buf_;
 	req.recv_buf_len = sizeof(recv_buf_);
 
 	// This request is synchronous and blocks the thread.
 	LOG_INF("Sending HTTP request");
-	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
+	TRACE_SPAN_BEGIN("http_req", req.method);
+	int ret = http_client_req(sock, &req, timeout, "IPv4 POST");
+	TRACE_SPAN_END("http_req", ret);
 	if (ret > 0) {
 		LOG_INF("HTTP request sent %d bytes", ret);
 	} else {
@@ -529,300 +1519,3066 @@ static void backend_http_request(void) {
 
 	LOG_INF("Closing the socket");
 	close(sock);
+	lat_hist_stop(&http_lat_, start);
+
+	if (ret <= 0) {
+		return ret < 0 ? ret : -EIO;
+	}
+	return backend_status_ == 200 ? 0 : -EBADMSG;
 }
 
-/* IOTEMBSYS: Create a HTTP request and response with protobuf. */
-static bool encode_ota_update_request(uint8_t *buffer, size_t buffer_size, size_t *message_length)
-{
-	bool status;
+static bool encode_ota_update_request(uint8_t *buffer, size_t buffer_size, size_t *message_length);
+static bool decode_ota_update_response(uint8_t *buffer, size_t message_length);
 
-	/* Allocate space on the stack to store the message data.
-	 *
-	 * Nanopb generates simple struct definitions for all the messages.
-	 * - check out the contents of api.pb.h!
-	 * It is a good idea to always initialize your structures
-	 * so that you do not have garbage data from RAM in there.
-	 */
-	OTAUpdateRequest message = OTAUpdateRequest_init_zero;
+#if defined(CONFIG_APP_BACKEND_LINK)
+//
+// Backend link
+//
+// One long-lived TCP connection to the backend on TCP_PORT that carries
+// protobuf messages in link_frame frames. Each request gets an id that its
+// response echoes, so up to LINK_MAX_INFLIGHT requests can be sent before
+// the first response is read. A message costs a 4 byte header instead of
+// an HTTP request line and headers, and no connection setup once the link
+// is up. scripts/link_server.py is a stand-in backend for testing.
+#define LINK_MAX_INFLIGHT 4
+#define LINK_TIMEOUT_MS (5 * MSEC_PER_SEC)
+
+struct link_request {
+	uint8_t id;
+	// Sent, and the caller has not collected the result yet.
+	bool in_use;
+	// Still waiting for the response.
+	bool pending;
+	int result;
+};
 
-	/* Create a stream that will write to our buffer. */
-	pb_ostream_t stream = pb_ostream_from_buffer(buffer, buffer_size);
-	
-	/* TODO: fill out the actual state. */
-	message.state = OTAState_OTA_STATE_NONE;
-	strncpy(message.version, APP_VERSION_STR, sizeof(message.version));
-	strncpy(message.device_id, kDeviceId, sizeof(message.device_id));
+static int link_sock_ = -1;
+static uint8_t link_next_id_;
+static struct link_request link_requests_[LINK_MAX_INFLIGHT];
+static struct link_frame_ctx link_rx_;
+static uint8_t link_tx_buf_[LINK_FRAME_HEADER_SIZE + TELEMETRY_PAYLOAD_MAX];
 
-	/* Now we are ready to encode the message! */
-	status = pb_encode(&stream, OTAUpdateRequest_fields, &message);
-	*message_length = stream.bytes_written;
+// A larger response would be rejected by link_rx_ and drop the link.
+BUILD_ASSERT(CONFIG_LINK_FRAME_MAX_PAYLOAD >= MAX(StatusUpdateResponse_size, OTAUpdateResponse_size),
+	     "CONFIG_LINK_FRAME_MAX_PAYLOAD is too small for the backend's responses");
 
-	if (!status) {
-		printk("Encoding failed: %s\n", PB_GET_ERROR(&stream));
+static struct link_request *link_find(uint8_t id) {
+	for (size_t i = 0; i < ARRAY_SIZE(link_requests_); i++) {
+		if (link_requests_[i].in_use && link_requests_[i].id == id) {
+			return &link_requests_[i];
+		}
 	}
-
-	return status;
+	return NULL;
 }
 
-static bool decode_ota_update_response(uint8_t *buffer, size_t message_length)
-{
-	bool status = false;
-	if (message_length == 0) {
-		LOG_WRN("Message length is 0");
-		return status;
+// Drops the connection; requests still waiting for a response fail.
+static void link_close(void) {
+	if (link_sock_ >= 0) {
+		LOG_INF("Closing the backend link");
+		close(link_sock_);
+		link_sock_ = -1;
 	}
-
-	/* Allocate space for the decoded message. */
-	OTAUpdateResponse message = OTAUpdateResponse_init_zero;
-
-	/* Create a stream that reads from the buffer. */
-	pb_istream_t stream = pb_istream_from_buffer(buffer, message_length);
-
-	/* Now we are ready to decode the message. */
-	status = pb_decode(&stream, OTAUpdateResponse_fields, &message);
-
-	/* Check for errors... */
-	if (status) {
-		/* Print the data contained in the message. */
-		printk("OTA path: %s\n", message.path);
-		strncpy(ota_path_, message.path, sizeof(ota_path_));
-	} else {
-		printk("Decoding failed: %s\n", PB_GET_ERROR(&stream));
+	for (size_t i = 0; i < ARRAY_SIZE(link_requests_); i++) {
+		if (link_requests_[i].pending) {
+			link_requests_[i].pending = false;
+			link_requests_[i].result = -ECONNRESET;
+		}
 	}
-
-	return status;
 }
 
-/* IOTEMBSYS: Implement the HTTP client functionality */
-static int http_ota_proto_payload_get(uint8_t* buffer, size_t buf_size) {
-	size_t message_length;
+static int link_frame_cb(void *user_data, const struct link_frame_header *hdr,
+			 const uint8_t *payload) {
+	struct link_request *req = link_find(hdr->id);
 
-	/* Encode our message */
-	if (!encode_ota_update_request(buffer, buf_size, &message_length)) {
-		LOG_ERR("Encoding request failed");
+	if (req == NULL || !req->pending) {
+		LOG_WRN("Unexpected response %u (type %u)", hdr->id, hdr->type);
 		return 0;
-	} else {
-		LOG_INF("Sending proto to server. Length: %d", (int)message_length);
 	}
-	return (int)message_length;
-}
-
-static void http_ota_proto_response_cb(struct http_response *rsp,
-			enum http_final_call final_data,
-			void *user_data)
-{
-	if (final_data == HTTP_DATA_MORE) {
-		LOG_INF("Partial data received (%zd bytes)", rsp->data_len);
-	} else if (final_data == HTTP_DATA_FINAL) {
-		LOG_INF("All the data received (%zd bytes)", rsp->data_len);
 
-		// Decode the protobuf response.
-		decode_ota_update_response(rsp->body_frag_start, rsp->body_frag_len);
+	req->pending = false;
+	switch (hdr->type) {
+	case LinkMessageType_LINK_MESSAGE_STATUS_UPDATE_RESPONSE:
+		// An empty message is a valid (default) response.
+		if (hdr->length > 0) {
+			decode_status_update_response((uint8_t *)payload, hdr->length);
+		}
+		req->result = 0;
+		break;
+	case LinkMessageType_LINK_MESSAGE_OTA_UPDATE_RESPONSE:
+		req->result = (hdr->length == 0 ||
+			       decode_ota_update_response((uint8_t *)payload, hdr->length)) ?
+			0 : -EBADMSG;
+		break;
+	case LinkMessageType_LINK_MESSAGE_ERROR:
+		LOG_WRN("Backend rejected request %u", hdr->id);
+		req->result = -EREMOTEIO;
+		break;
+	default:
+		LOG_WRN("Unknown response type %u", hdr->type);
+		req->result = -EPROTO;
+		break;
 	}
-
-	LOG_INF("Response to %s", (const char *)user_data);
-	LOG_INF("Response status %s", rsp->http_status);
+	return 0;
 }
 
-static void backend_ota_http_request(void) {
+static int link_connect(void) {
+	static const struct link_frame_cfg cfg = {
+		.frame_cb = link_frame_cb,
+	};
 	int sock;
-	const int32_t timeout = 5 * MSEC_PER_SEC;
+	int err;
 
-	// Get the IP address of the domain
-	if (get_addr_if_needed(&backend_addr_, EC2_HOST, xstr(BACKEND_PORT)) != 0) {
-		LOG_ERR("DNS lookup failed");
-		return;
+	if (link_sock_ >= 0) {
+		return 0;
 	}
 
-	// Create a socket using parameters that the modem allows.
 	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock < 0) {
 		LOG_ERR("Creating socket failed");
-		return;
+		return -errno;
 	}
-	if (connect(sock, backend_addr_->ai_addr, backend_addr_->ai_addrlen) < 0) {
-		LOG_ERR("Connecting to socket failed");
-		return;
+	err = endpoint_connect(ENDPOINT_TRANSPORT, sock);
+	if (err != 0) {
+		close(sock);
+		return err;
 	}
 
-	struct http_request req;
-
-	memset(&req, 0, sizeof(req));
-	memset(recv_buf_, 0, sizeof(recv_buf_));
+	link_frame_init(&link_rx_, &cfg);
+	link_sock_ = sock;
+	LOG_INF("Backend link up");
+	return 0;
+}
 
-	req.host = BACKEND_HOST;
-	req.protocol = "HTTP/1.1";
-	req.method = HTTP_POST;
-	req.url = "/ota";
-	req.payload = recv_buf_;
-	req.payload_len = http_ota_proto_payload_get(recv_buf_, sizeof(recv_buf_));
-	req.payload = req.payload_len ? recv_buf_ : NULL;
-	req.response = http_ota_proto_response_cb;
-	req.recv_buf = recv_buf_;
-	req.recv_buf_len = sizeof(recv_buf_);
+// Sends one request frame without waiting for the response. Returns the
+// request id to pass to link_wait(), or a negative errno.
+static int link_send(uint8_t type, const uint8_t *payload, size_t len) {
+	struct link_request *req = NULL;
+	struct link_frame_header hdr = {
+		.type = type,
+		.length = len,
+	};
+	size_t frame_len = LINK_FRAME_HEADER_SIZE + len;
+	size_t sent = 0;
+	int err;
 
-	// This request is synchronous and blocks the thread.
-	LOG_INF("Sending OTA HTTP request");
-	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
-	if (ret > 0) {
-		LOG_INF("HTTP request sent %d bytes", ret);
-	} else {
-		LOG_ERR("HTTP request failed: %d", ret);
+	if (frame_len > sizeof(link_tx_buf_)) {
+		return -EMSGSIZE;
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(link_requests_); i++) {
+		if (!link_requests_[i].in_use) {
+			req = &link_requests_[i];
+			break;
+		}
+	}
+	if (req == NULL) {
+		return -EBUSY;
 	}
 
-	LOG_INF("Closing the socket");
-	close(sock);
-}
+	err = link_connect();
+	if (err != 0) {
+		return err;
+	}
 
-//
-// OTA Download Section
-//
-#define OTA_HTTP_PORT 80
-#define OTA_HOST "nhan-iotemb-firmware-releases.s3.amazonaws.com"
-static int total_read_size;
-static int total_write_size;
-static int content_length_;
-static struct flash_area *image_area;
-static struct addrinfo* ota_addr_;
+	hdr.id = link_next_id_++;
+	link_frame_encode_header(link_tx_buf_, sizeof(link_tx_buf_), &hdr);
+	memcpy(&link_tx_buf_[LINK_FRAME_HEADER_SIZE], payload, len);
 
-/* IOTEMBSYS: Implement the OTA HTTP download. */
-void http_ota_response_cb(struct http_response *rsp,
-			enum http_final_call final_data,
-			void *user_data)
-{
-	static uint8_t overflow_[8];
-	static uint8_t overflow_count_;
-	uint8_t overflow_inverse = 0;
-	size_t bytes_to_write = rsp->body_frag_len;
+	while (sent < frame_len) {
+		ssize_t ret = send(link_sock_, &link_tx_buf_[sent], frame_len - sent, 0);
 
-	if (total_read_size == 0) {
-		overflow_count_ = 0;
+		if (ret < 0) {
+			err = -errno;
+			LOG_ERR("Backend link send failed: %d", err);
+			link_close();
+			return err;
+		}
+		sent += ret;
 	}
 
-	if (overflow_count_ != 0) {
-		overflow_inverse = sizeof(overflow_) - overflow_count_;
-		
-		if (overflow_inverse > rsp->body_frag_len) {
-			LOG_INF("Not enough data; copy all to overflow");
-			memcpy(overflow_ + overflow_count_, rsp->body_frag_start, rsp->body_frag_len);
-			overflow_count_ += rsp->body_frag_len;
-			bytes_to_write -= rsp->body_frag_len;
-		} else {
-			memcpy(overflow_ + overflow_count_, rsp->body_frag_start, overflow_inverse);
-			bytes_to_write -= overflow_inverse;
-			int err = flash_area_write(image_area, total_read_size - overflow_count_, overflow_, sizeof(overflow_));
-			if (err != 0) {
-				LOG_ERR("Flash area write failed");
-			} else {
-				total_write_size += sizeof(overflow_);
-			}
-		}
+	req->id = hdr.id;
+	req->in_use = true;
+	req->pending = true;
+	req->result = -EINPROGRESS;
+	return hdr.id;
+}
+
+// Reads from the link until the response to @p id is in, handling any
+// other responses on the way. Returns the outcome of the request.
+static int link_wait(int id) {
+	struct link_request *req = link_find(id);
+	int result;
+
+	if (req == NULL) {
+		return -ENOENT;
 	}
 
-	if (bytes_to_write != 0) {
-		// This is specific to STM32 flash
-		// TODO(mskobov): don't write if < 8 bytes to write
-		overflow_count_ = bytes_to_write % 8;
-		int err = flash_area_write(image_area, total_read_size + overflow_inverse, rsp->body_frag_start + overflow_inverse, bytes_to_write - overflow_count_);
-		if (err != 0) {
-			LOG_ERR("Flash area write failed");
-		} else {
-			total_write_size += bytes_to_write - overflow_count_;
-		}
-		if (overflow_count_ != 0) {
-			memset(overflow_, 0, sizeof(overflow_));
-			memcpy(overflow_, rsp->body_frag_start + overflow_inverse + bytes_to_write - overflow_count_, overflow_count_);
-			if (final_data == HTTP_DATA_FINAL) {
-				err = flash_area_write(image_area, total_read_size + overflow_inverse + bytes_to_write - overflow_count_, overflow_, sizeof(overflow_));
-				if (err != 0) {
-					LOG_ERR("Flash area write failed");
-				} else {
-					// Technically, we could have written more, but we don't care about the alignment bytes.
-					total_write_size += overflow_count_;
-				}
-			}
+	while (req->pending && link_sock_ >= 0) {
+		struct zsock_pollfd pfd = {
+			.fd = link_sock_,
+			.events = ZSOCK_POLLIN,
+		};
+		uint8_t buf[128];
+		ssize_t ret;
+
+		ret = poll(&pfd, 1, LINK_TIMEOUT_MS);
+		if (ret <= 0) {
+			LOG_ERR("Backend link timed out");
+			link_close();
+			break;
+		}
+		ret = recv(link_sock_, buf, sizeof(buf), 0);
+		if (ret <= 0) {
+			LOG_WRN("Backend link closed by peer");
+			link_close();
+			break;
+		}
+		if (link_frame_feed(&link_rx_, buf, ret) != 0) {
+			LOG_ERR("Malformed frame from backend");
+			link_close();
 		}
 	}
 
-	// Count the read size to make sure it matches the content length header at the end.
-	total_read_size += rsp->body_frag_len;
-	content_length_ = rsp->content_length;
+	result = req->pending ? -ECONNRESET : req->result;
+	req->in_use = false;
+	req->pending = false;
+	return result;
 }
+#endif // CONFIG_APP_BACKEND_LINK
 
-/* IOTEMBSYS: Implement the HTTP OTA task */
-static void http_ota_request() {
-	int sock;
-	const int32_t timeout = 120 * MSEC_PER_SEC;
-
-	LOG_INF("Starting OTA...");
+#if defined(CONFIG_APP_BACKEND_COAP)
+//
+// CoAP backend
+//
+// Requests go out as confirmable CoAP messages on one UDP socket connected
+// to the transport endpoint (see the endpoint shell command; COAP_PORT by
+// default). There is no connection to set up, so a report costs one
+// request and its piggybacked ACK. Lost messages are retransmitted with the
+// RFC 7252 exponential backoff. scripts/coap_server.py is a stand-in
+// backend for testing.
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 4
+// How long a separate response may take after its empty ACK.
+#define COAP_RESPONSE_TIMEOUT_MS (30 * MSEC_PER_SEC)
+#define COAP_BLOCK_SIZE COAP_BLOCK_512
+// Room for the header, token and options on top of a payload.
+#define COAP_HEADER_ROOM 64
+// A message is one datagram, which the modem sends in one piece or not at
+// all.
+#define COAP_MAX_MSG_LEN QUECTEL_BG96_MAX_DATAGRAM
+BUILD_ASSERT(COAP_MAX_MSG_LEN >= COAP_HEADER_ROOM + 512, "a download block must fit");
+
+static int coap_sock_ = -1;
+static uint8_t coap_tx_buf_[COAP_MAX_MSG_LEN];
+static uint8_t coap_rx_buf_[COAP_MAX_MSG_LEN];
+
+static void coap_close(void) {
+	if (coap_sock_ >= 0) {
+		close(coap_sock_);
+		coap_sock_ = -1;
+	}
+}
 
-	total_read_size = 0;
-	total_write_size = 0;
+// Sends @p req as one datagram; a short send is an error, since the rest
+// would never arrive.
+static int coap_send(const struct coap_packet *req) {
+	ssize_t sent = send(coap_sock_, req->data, req->offset, 0);
 
-	// Erase a flash area if previously written to.
-	int err = flash_area_open(SLOT1_PARTITION_ID, (const struct flash_area **)&image_area);
-	if (err != 0) {
-		LOG_ERR("Flash area open failed");
-		return;
-	}
-	err = flash_area_erase(image_area, 0, image_area->fa_size);
-	if (err != 0) {
-		LOG_ERR("Flash area erase failed");
-		return;
+	if (sent < 0) {
+		return -errno;
 	}
+	return sent == req->offset ? 0 : -EMSGSIZE;
+}
 
-	// Get the IP address of the domain
-	if (get_addr_if_needed(&ota_addr_, OTA_HOST, xstr(OTA_HTTP_PORT)) != 0) {
-		LOG_ERR("DNS lookup failed");
-		return;
+static int coap_open(void) {
+	int sock;
+	int err;
+
+	if (coap_sock_ >= 0) {
+		return 0;
 	}
 
-	// Create a socket using parameters that the modem allows.
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (sock < 0) {
 		LOG_ERR("Creating socket failed");
-		return;
+		return -errno;
 	}
-	if (connect(sock, ota_addr_->ai_addr, ota_addr_->ai_addrlen) < 0) {
-		LOG_ERR("Connecting to socket failed");
-		return;
+	// Only sets the peer; nothing is sent.
+	err = endpoint_connect(ENDPOINT_TRANSPORT, sock);
+	if (err != 0) {
+		close(sock);
+		return err;
 	}
 
-	struct http_request req;
+	coap_sock_ = sock;
+	return 0;
+}
+
+// Appends one Uri-Path option per segment of @p path.
+static int coap_append_path(struct coap_packet *pkt, const char *path) {
+	while (*path != '\0') {
+		const char *end;
+
+		while (*path == '/') {
+			path++;
+		}
+		end = strchr(path, '/');
+		if (end == NULL) {
+			end = path + strlen(path);
+		}
+		if (end > path) {
+			int err = coap_packet_append_option(pkt, COAP_OPTION_URI_PATH,
+							    path, end - path);
+			if (err < 0) {
+				return err;
+			}
+		}
+		path = end;
+	}
+	return 0;
+}
+
+// Starts a confirmable request with a fresh message id and token.
+static int coap_request_init(struct coap_packet *req, uint8_t method, const char *path) {
+	int err = coap_packet_init(req, coap_tx_buf_, sizeof(coap_tx_buf_), COAP_VERSION_1,
+				   COAP_TYPE_CON, COAP_TOKEN_MAX_LEN, coap_next_token(),
+				   method, coap_next_id());
+
+	return err < 0 ? err : coap_append_path(req, path);
+}
+
+static bool coap_is_success(const struct coap_packet *rsp) {
+	// The class is the top three bits of the code: 2.xx is success.
+	return (coap_header_get_code(rsp) >> 5) == 2;
+}
+
+// Sends a confirmable request and waits for its response, retransmitting
+// with backoff until it is acknowledged. A separate response (an empty ACK
+// first, the response later as its own CON) is acknowledged in turn. On
+// success, @p rsp points into coap_rx_buf_.
+static int coap_exchange(struct coap_packet *req, struct coap_packet *rsp) {
+	uint16_t id = coap_header_get_id(req);
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t token_len = coap_header_get_token(req, token);
+	int timeout_ms = COAP_ACK_TIMEOUT_MS;
+	int retransmits = 0;
+	bool acked = false;
+	int err;
+
+	err = coap_open();
+	if (err != 0) {
+		return err;
+	}
+	err = coap_send(req);
+	if (err != 0) {
+		coap_close();
+		return err;
+	}
+
+	while (true) {
+		struct zsock_pollfd pfd = {
+			.fd = coap_sock_,
+			.events = ZSOCK_POLLIN,
+		};
+		uint8_t rsp_token[COAP_TOKEN_MAX_LEN];
+		ssize_t len;
+		int ret;
+
+		ret = poll(&pfd, 1, acked ? COAP_RESPONSE_TIMEOUT_MS : timeout_ms);
+		if (ret < 0) {
+			err = -errno;
+			coap_close();
+			return err;
+		}
+		if (ret == 0) {
+			if (acked || retransmits == COAP_MAX_RETRANSMIT) {
+				LOG_WRN("CoAP request timed out");
+				return -ETIMEDOUT;
+			}
+			retransmits++;
+			timeout_ms *= 2;
+			err = coap_send(req);
+			if (err != 0) {
+				coap_close();
+				return err;
+			}
+			continue;
+		}
+
+		len = recv(coap_sock_, coap_rx_buf_, sizeof(coap_rx_buf_), 0);
+		if (len <= 0) {
+			err = len < 0 ? -errno : -EIO;
+			coap_close();
+			return err;
+		}
+		if (coap_packet_parse(rsp, coap_rx_buf_, len, NULL, 0) < 0) {
+			continue;
+		}
+
+		uint8_t type = coap_header_get_type(rsp);
+		bool same_id = coap_header_get_id(rsp) == id;
+
+		if (type == COAP_TYPE_RESET && same_id) {
+			return -ECONNREFUSED;
+		}
+		if (type == COAP_TYPE_ACK && same_id &&
+		    coap_header_get_code(rsp) == COAP_CODE_EMPTY) {
+			acked = true;
+			continue;
+		}
+		// Anything else must be the response to this request.
+		if (coap_header_get_token(rsp, rsp_token) != token_len ||
+		    memcmp(rsp_token, token, token_len) != 0 ||
+		    (type == COAP_TYPE_ACK && !same_id)) {
+			continue;
+		}
+		if (type == COAP_TYPE_CON) {
+			struct coap_packet ack;
+			uint8_t ack_buf[4];
+
+			if (coap_packet_init(&ack, ack_buf, sizeof(ack_buf), COAP_VERSION_1,
+					     COAP_TYPE_ACK, 0, NULL, COAP_CODE_EMPTY,
+					     coap_header_get_id(rsp)) == 0) {
+				send(coap_sock_, ack.data, ack.offset, 0);
+			}
+		}
+		return 0;
+	}
+}
+
+// POSTs @p payload to @p path. The response payload, if any, is returned
+// through @p rsp_payload and stays valid until the next exchange.
+static int coap_post(const char *path, const uint8_t *payload, size_t len,
+		     const uint8_t **rsp_payload, uint16_t *rsp_len) {
+	struct coap_packet req;
+	struct coap_packet rsp;
+	int err;
+
+	err = coap_request_init(&req, COAP_METHOD_POST, path);
+	if (err == 0) {
+		err = coap_append_option_int(&req, COAP_OPTION_CONTENT_FORMAT,
+					     COAP_CONTENT_FORMAT_APP_OCTET_STREAM);
+	}
+	if (err == 0) {
+		err = coap_packet_append_payload_marker(&req);
+	}
+	if (err == 0) {
+		err = coap_packet_append_payload(&req, payload, len);
+	}
+	if (err < 0) {
+		LOG_ERR("Building CoAP request failed: %d", err);
+		return err;
+	}
+
+	err = coap_exchange(&req, &rsp);
+	if (err != 0) {
+		return err;
+	}
+	if (!coap_is_success(&rsp)) {
+		uint8_t code = coap_header_get_code(&rsp);
+
+		LOG_WRN("CoAP POST %s failed: %u.%02u", path, code >> 5, code & 0x1f);
+		return -EBADMSG;
+	}
+
+	*rsp_payload = coap_packet_get_payload(&rsp, rsp_len);
+	return 0;
+}
+#endif // CONFIG_APP_BACKEND_COAP
+
+#if defined(CONFIG_APP_BACKEND_MQTT)
+//
+// MQTT backend
+//
+// One MQTT session with the device id as client id and clean_session off,
+// so the broker keeps the subscriptions and queues QoS 1 messages while the
+// device is offline. Telemetry is published with QoS 1 to
+// devices/<id>/telemetry. The backend pushes OTAUpdateResponse messages to
+// devices/<id>/ota and DeviceConfig messages to devices/<id>/config; they
+// take effect as they arrive, with no polling. mqtt_thread owns the socket
+// and keeps the session alive; other threads only publish.
+// scripts/mqtt_backend.py drives a local broker for testing.
+// Long enough to let the modem idle, short enough for carrier NAT timeouts.
+#define MQTT_KEEPALIVE_S 240
+#define MQTT_RECONNECT_DELAY_MS (30 * MSEC_PER_SEC)
+#define MQTT_ACK_TIMEOUT_MS (10 * MSEC_PER_SEC)
+#define MQTT_MAX_INFLIGHT 4
+#define MQTT_TOPIC_MAX_LEN (sizeof("devices//ota/request") + sizeof(kDeviceId))
+
+struct mqtt_pending {
+	uint16_t id;
+	// Published, and the caller has not collected the result yet.
+	bool in_use;
+	// Still waiting for the PUBACK.
+	bool pending;
+	int result;
+};
+
+static struct mqtt_client mqtt_client_;
+static struct sockaddr_storage mqtt_broker_;
+static uint8_t mqtt_rx_buf_[256];
+static uint8_t mqtt_tx_buf_[128 + TELEMETRY_PAYLOAD_MAX];
+static bool mqtt_connected_;
+static uint16_t mqtt_next_id_;
+
+static char mqtt_topic_telemetry_[MQTT_TOPIC_MAX_LEN];
+static char mqtt_topic_ota_request_[MQTT_TOPIC_MAX_LEN];
+static char mqtt_topic_ota_[MQTT_TOPIC_MAX_LEN];
+static char mqtt_topic_config_[MQTT_TOPIC_MAX_LEN];
+
+static struct mqtt_pending mqtt_pending_[MQTT_MAX_INFLIGHT];
+static K_MUTEX_DEFINE(mqtt_lock_);
+static K_CONDVAR_DEFINE(mqtt_acked_);
+
+// The newest OTA offer, handed to the HTTP thread, which owns OTA state.
+static uint8_t mqtt_ota_push_[OTAUpdateResponse_size];
+static size_t mqtt_ota_push_len_;
+
+static void mqtt_fail_pending(int err) {
+	k_mutex_lock(&mqtt_lock_, K_FOREVER);
+	for (size_t i = 0; i < ARRAY_SIZE(mqtt_pending_); i++) {
+		if (mqtt_pending_[i].pending) {
+			mqtt_pending_[i].pending = false;
+			mqtt_pending_[i].result = err;
+		}
+	}
+	k_condvar_broadcast(&mqtt_acked_);
+	k_mutex_unlock(&mqtt_lock_);
+}
+
+// Message id 0 is reserved.
+static uint16_t mqtt_new_id(void) {
+	uint16_t id;
+
+	k_mutex_lock(&mqtt_lock_, K_FOREVER);
+	if (++mqtt_next_id_ == 0) {
+		mqtt_next_id_++;
+	}
+	id = mqtt_next_id_;
+	k_mutex_unlock(&mqtt_lock_);
+	return id;
+}
+
+static void mqtt_subscribe_topics(void) {
+	struct mqtt_topic topics[] = {
+		{
+			.topic = { .utf8 = mqtt_topic_ota_, .size = strlen(mqtt_topic_ota_) },
+			.qos = MQTT_QOS_1_AT_LEAST_ONCE,
+		},
+		{
+			.topic = { .utf8 = mqtt_topic_config_, .size = strlen(mqtt_topic_config_) },
+			.qos = MQTT_QOS_1_AT_LEAST_ONCE,
+		},
+	};
+	const struct mqtt_subscription_list list = {
+		.list = topics,
+		.list_count = ARRAY_SIZE(topics),
+		.message_id = mqtt_new_id(),
+	};
+	int err = mqtt_subscribe(&mqtt_client_, &list);
+
+	if (err != 0) {
+		LOG_ERR("MQTT subscribe failed: %d", err);
+	}
+}
+
+static void mqtt_apply_config(const uint8_t *buf, size_t len) {
+	DeviceConfig config = DeviceConfig_init_zero;
+	pb_istream_t stream = pb_istream_from_buffer(buf, len);
+
+	if (!pb_decode(&stream, DeviceConfig_fields, &config)) {
+		LOG_WRN("Bad config push: %s", PB_GET_ERROR(&stream));
+		return;
+	}
+
+	// Zero leaves a setting unchanged.
+	if (config.blink_interval_ms != 0) {
+		change_blink_interval(config.blink_interval_ms);
+	}
+	if (config.telemetry_interval_s != 0) {
+		telemetry_interval_s_ = config.telemetry_interval_s;
+		if (telemetry_ready_) {
+			k_work_reschedule(&telemetry_sample_work_, K_SECONDS(telemetry_interval_s_));
+		}
+	}
+	for (pb_size_t i = 0; i < config.endpoints_count; i++) {
+		endpoint_apply(&config.endpoints[i]);
+	}
+	LOG_INF("Config pushed: blink %u ms, telemetry every %u s",
+		config.blink_interval_ms, config.telemetry_interval_s);
+}
+
+static void mqtt_on_publish(struct mqtt_client *client, const struct mqtt_publish_param *pub) {
+	const struct mqtt_utf8 *topic = &pub->message.topic.topic;
+	static uint8_t buf[MAX(OTAUpdateResponse_size, DeviceConfig_size)];
+	size_t len = pub->message.payload.len;
+	int err;
+
+	if (len > sizeof(buf)) {
+		// Still has to be read off the socket.
+		LOG_WRN("Dropping %zu byte push", len);
+		while (len > 0) {
+			size_t chunk = MIN(len, sizeof(buf));
+
+			if (mqtt_readall_publish_payload(client, buf, chunk) != 0) {
+				return;
+			}
+			len -= chunk;
+		}
+	} else {
+		err = mqtt_readall_publish_payload(client, buf, len);
+		if (err != 0) {
+			LOG_ERR("MQTT payload read failed: %d", err);
+			return;
+		}
+
+		if (topic->size == strlen(mqtt_topic_ota_) &&
+		    memcmp(topic->utf8, mqtt_topic_ota_, topic->size) == 0) {
+			k_mutex_lock(&mqtt_lock_, K_FOREVER);
+			memcpy(mqtt_ota_push_, buf, len);
+			mqtt_ota_push_len_ = len;
+			k_mutex_unlock(&mqtt_lock_);
+			upload_request(UPLOAD_CLASS_OTA);
+		} else if (topic->size == strlen(mqtt_topic_config_) &&
+			   memcmp(topic->utf8, mqtt_topic_config_, topic->size) == 0) {
+			mqtt_apply_config(buf, len);
+		}
+	}
+
+	if (pub->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
+		const struct mqtt_puback_param ack = {
+			.message_id = pub->message_id,
+		};
+
+		mqtt_publish_qos1_ack(client, &ack);
+	}
+}
+
+static void mqtt_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt) {
+	switch (evt->type) {
+	case MQTT_EVT_CONNACK:
+		if (evt->result != 0) {
+			LOG_ERR("MQTT connection refused: %d", evt->result);
+			break;
+		}
+		mqtt_connected_ = true;
+		// A stored session still has our subscriptions.
+		if (!evt->param.connack.session_present_flag) {
+			mqtt_subscribe_topics();
+		}
+		LOG_INF("MQTT session up (%s)",
+			evt->param.connack.session_present_flag ? "resumed" : "new");
+		break;
+
+	case MQTT_EVT_DISCONNECT:
+		mqtt_connected_ = false;
+		mqtt_fail_pending(-ENOTCONN);
+		break;
+
+	case MQTT_EVT_PUBACK:
+		k_mutex_lock(&mqtt_lock_, K_FOREVER);
+		for (size_t i = 0; i < ARRAY_SIZE(mqtt_pending_); i++) {
+			if (mqtt_pending_[i].pending &&
+			    mqtt_pending_[i].id == evt->param.puback.message_id) {
+				mqtt_pending_[i].pending = false;
+				mqtt_pending_[i].result = evt->result;
+			}
+		}
+		k_condvar_broadcast(&mqtt_acked_);
+		k_mutex_unlock(&mqtt_lock_);
+		break;
+
+	case MQTT_EVT_PUBLISH:
+		mqtt_on_publish(client, &evt->param.publish);
+		break;
+
+	case MQTT_EVT_SUBACK:
+		LOG_INF("MQTT subscribed");
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int mqtt_session_connect(void) {
+	int err = endpoint_addr(ENDPOINT_TRANSPORT, (struct sockaddr_in *)&mqtt_broker_);
+
+	if (err != 0) {
+		return err;
+	}
+
+	mqtt_client_init(&mqtt_client_);
+	mqtt_client_.broker = &mqtt_broker_;
+	mqtt_client_.evt_cb = mqtt_evt_handler;
+	mqtt_client_.client_id.utf8 = (const uint8_t *)kDeviceId;
+	mqtt_client_.client_id.size = strlen(kDeviceId);
+	mqtt_client_.protocol_version = MQTT_VERSION_3_1_1;
+	mqtt_client_.clean_session = 0;
+	mqtt_client_.keepalive = MQTT_KEEPALIVE_S;
+	mqtt_client_.rx_buf = mqtt_rx_buf_;
+	mqtt_client_.rx_buf_size = sizeof(mqtt_rx_buf_);
+	mqtt_client_.tx_buf = mqtt_tx_buf_;
+	mqtt_client_.tx_buf_size = sizeof(mqtt_tx_buf_);
+	mqtt_client_.transport.type = MQTT_TRANSPORT_NON_SECURE;
+
+	return mqtt_connect(&mqtt_client_);
+}
+
+// Keeps the session up: reads incoming packets and sends keepalive pings,
+// reconnecting after any error.
+static void mqtt_thread(void* p1, void* p2, void* p3) {
+	snprintk(mqtt_topic_telemetry_, sizeof(mqtt_topic_telemetry_),
+		 "devices/%s/telemetry", kDeviceId);
+	snprintk(mqtt_topic_ota_request_, sizeof(mqtt_topic_ota_request_),
+		 "devices/%s/ota/request", kDeviceId);
+	snprintk(mqtt_topic_ota_, sizeof(mqtt_topic_ota_), "devices/%s/ota", kDeviceId);
+	snprintk(mqtt_topic_config_, sizeof(mqtt_topic_config_), "devices/%s/config", kDeviceId);
+
+	while (true) {
+		int err = mqtt_session_connect();
+
+		while (err == 0) {
+			struct zsock_pollfd pfd = {
+				.fd = mqtt_client_.transport.tcp.sock,
+				.events = ZSOCK_POLLIN,
+			};
+			int ret = poll(&pfd, 1, mqtt_keepalive_time_left(&mqtt_client_));
+
+			if (ret < 0) {
+				err = -errno;
+			} else if (ret > 0) {
+				err = mqtt_input(&mqtt_client_);
+			}
+			if (err == 0) {
+				err = mqtt_live(&mqtt_client_);
+				if (err == -EAGAIN) {
+					err = 0;
+				}
+			}
+		}
+
+		LOG_WRN("MQTT session lost (%d); reconnecting", err);
+		mqtt_abort(&mqtt_client_);
+		mqtt_connected_ = false;
+		mqtt_fail_pending(-ENOTCONN);
+		k_msleep(MQTT_RECONNECT_DELAY_MS);
+	}
+}
+
+K_THREAD_DEFINE(mqtt_tid, 2048 /*stack size*/,
+                mqtt_thread, NULL, NULL, NULL,
+                6 /*priority*/, 0, 0);
+
+// Publishes @p payload with QoS 1 without waiting for the PUBACK. Returns
+// the message id to pass to mqtt_wait_ack(), or a negative errno.
+static int mqtt_publish_qos1(const char *topic, const uint8_t *payload, size_t len) {
+	struct mqtt_pending *slot = NULL;
+	struct mqtt_publish_param param = { 0 };
+	int err;
+
+	k_mutex_lock(&mqtt_lock_, K_FOREVER);
+	if (!mqtt_connected_) {
+		k_mutex_unlock(&mqtt_lock_);
+		return -ENOTCONN;
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(mqtt_pending_); i++) {
+		if (!mqtt_pending_[i].in_use) {
+			slot = &mqtt_pending_[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		k_mutex_unlock(&mqtt_lock_);
+		return -EBUSY;
+	}
+	slot->id = mqtt_new_id();
+	slot->in_use = true;
+	slot->pending = true;
+	slot->result = -EINPROGRESS;
+	k_mutex_unlock(&mqtt_lock_);
+
+	param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+	param.message.topic.topic.utf8 = (const uint8_t *)topic;
+	param.message.topic.topic.size = strlen(topic);
+	param.message.payload.data = (uint8_t *)payload;
+	param.message.payload.len = len;
+	param.message_id = slot->id;
+
+	err = mqtt_publish(&mqtt_client_, &param);
+	if (err != 0) {
+		LOG_ERR("MQTT publish failed: %d", err);
+		k_mutex_lock(&mqtt_lock_, K_FOREVER);
+		slot->in_use = false;
+		slot->pending = false;
+		k_mutex_unlock(&mqtt_lock_);
+		return err;
+	}
+	return slot->id;
+}
+
+// Waits for the PUBACK of message @p id. Returns 0 once the broker has it.
+static int mqtt_wait_ack(int id) {
+	int64_t deadline = k_uptime_get() + MQTT_ACK_TIMEOUT_MS;
+	struct mqtt_pending *slot = NULL;
+	int result;
+
+	k_mutex_lock(&mqtt_lock_, K_FOREVER);
+	for (size_t i = 0; i < ARRAY_SIZE(mqtt_pending_); i++) {
+		if (mqtt_pending_[i].in_use && mqtt_pending_[i].id == id) {
+			slot = &mqtt_pending_[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		k_mutex_unlock(&mqtt_lock_);
+		return -ENOENT;
+	}
+
+	while (slot->pending) {
+		int64_t remaining = deadline - k_uptime_get();
+
+		if (remaining <= 0) {
+			break;
+		}
+		k_condvar_wait(&mqtt_acked_, &mqtt_lock_, K_MSEC(remaining));
+	}
+	result = slot->pending ? -ETIMEDOUT : slot->result;
+	slot->in_use = false;
+	slot->pending = false;
+	k_mutex_unlock(&mqtt_lock_);
+
+	return result;
+}
+
+// Decodes the newest pushed OTA offer on the HTTP thread. Returns true if
+// it offers an update.
+static bool mqtt_take_ota_push(void) {
+	uint8_t buf[OTAUpdateResponse_size];
+	size_t len;
+
+	k_mutex_lock(&mqtt_lock_, K_FOREVER);
+	len = mqtt_ota_push_len_;
+	memcpy(buf, mqtt_ota_push_, len);
+	mqtt_ota_push_len_ = 0;
+	k_mutex_unlock(&mqtt_lock_);
+
+	ota_offered_ = false;
+	return len > 0 && decode_ota_update_response(buf, len) && ota_offered_;
+}
+
+// Asks the backend for an offer; it arrives on the OTA topic.
+static int backend_ota_mqtt_request(void) {
+	uint8_t payload[OTAUpdateRequest_size];
+	size_t len;
+	int id;
+	int ret;
+
+	if (!encode_ota_update_request(payload, sizeof(payload), &len)) {
+		LOG_ERR("Encoding request failed");
+		return -ENOMEM;
+	}
+
+	id = mqtt_publish_qos1(mqtt_topic_ota_request_, payload, len);
+	ret = id < 0 ? id : mqtt_wait_ack(id);
+	if (ret != 0) {
+		LOG_ERR("OTA request failed: %d", ret);
+	}
+	return ret;
+}
+#endif // CONFIG_APP_BACKEND_MQTT
+
+//
+// Store-and-forward telemetry
+//
+// Status samples are encoded once and appended to a flash circular buffer
+// (FCB) in telemetry_partition, whatever the state of the network. The HTTP
+// thread drains the queue in batches whenever it gets the chance. Appends
+// are O(1), and FCB writes each sector in turn, so wear is spread evenly
+// over the partition. When the queue is full, the oldest sector of records
+// is dropped to make room.
+//
+// Sent records are tracked in RAM only, so a reboot may resend part of a
+// sector; the backend can drop duplicates by (device_id, boot_count,
+// uptime_ticks).
+#define TELEMETRY_MAGIC 0x544c4d31
+#define TELEMETRY_MAX_SECTORS 32
+#define TELEMETRY_BATCH_MAX ARRAY_SIZE(((TelemetrySeries *)0)->uptime_delta_ms)
+
+static struct fcb telemetry_fcb_;
+static struct flash_sector telemetry_sectors_[TELEMETRY_MAX_SECTORS];
+static K_MUTEX_DEFINE(telemetry_lock_);
+// Last record the backend has accepted; fe_sector is NULL before the first.
+static struct fcb_entry telemetry_cursor_;
+static uint32_t telemetry_drops_;
+static uint8_t telemetry_batch_buf_[TELEMETRY_PAYLOAD_MAX];
+// Batch being assembled; only used under telemetry_lock_.
+static TelemetrySeries telemetry_series_;
+
+static int telemetry_init(void) {
+	uint32_t count = ARRAY_SIZE(telemetry_sectors_);
+	int err;
+
+	err = flash_area_get_sectors(TELEMETRY_PARTITION_ID, &count, telemetry_sectors_);
+	if (err != 0) {
+		LOG_ERR("Telemetry partition layout failed: %d", err);
+		return err;
+	}
+
+	telemetry_fcb_.f_magic = TELEMETRY_MAGIC;
+	telemetry_fcb_.f_version = 1;
+	telemetry_fcb_.f_sectors = telemetry_sectors_;
+	telemetry_fcb_.f_sector_cnt = count;
+	telemetry_fcb_.f_scratch_cnt = 0;
+
+	err = fcb_init(TELEMETRY_PARTITION_ID, &telemetry_fcb_);
+	if (err != 0) {
+		// Not an FCB (or a different version of it); start over.
+		const struct flash_area *fa;
+
+		LOG_WRN("Telemetry queue unreadable (%d); erasing", err);
+		err = flash_area_open(TELEMETRY_PARTITION_ID, &fa);
+		if (err == 0) {
+			err = flash_area_erase(fa, 0, fa->fa_size);
+			flash_area_close(fa);
+		}
+		if (err == 0) {
+			err = fcb_init(TELEMETRY_PARTITION_ID, &telemetry_fcb_);
+		}
+	}
+	return err;
+}
+
+static int telemetry_append(const uint8_t *data, size_t len) {
+	struct fcb_entry loc;
+	int err;
+
+	k_mutex_lock(&telemetry_lock_, K_FOREVER);
+	err = fcb_append(&telemetry_fcb_, len, &loc);
+	if (err == -ENOSPC) {
+		LOG_WRN("Telemetry queue full; dropping the oldest records");
+		if (telemetry_cursor_.fe_sector == telemetry_fcb_.f_oldest) {
+			telemetry_cursor_.fe_sector = NULL;
+		}
+		telemetry_drops_++;
+		err = fcb_rotate(&telemetry_fcb_);
+		if (err == 0) {
+			err = fcb_append(&telemetry_fcb_, len, &loc);
+		}
+	}
+	if (err == 0) {
+		uint32_t start = lat_hist_start();
+
+		err = flash_area_write(telemetry_fcb_.fap, FCB_ENTRY_FA_DATA_OFF(loc), data, len);
+		lat_hist_stop(&flash_write_lat_, start);
+	}
+	if (err == 0) {
+		err = fcb_append_finish(&telemetry_fcb_, &loc);
+	}
+	k_mutex_unlock(&telemetry_lock_);
+
+	return err;
+}
+
+// Adds one sample to the series as deltas from the previous one. Returns
+// false if it belongs to another boot, whose uptime starts over.
+static bool telemetry_series_add(TelemetrySeries *series, const StatusUpdateRequest *sample) {
+	const StatusUpdateRequest *prev = &series->latest;
+	pb_size_t n = series->uptime_delta_ms_count;
+
+	if (n == 0) {
+		strncpy(series->device_id, sample->device_id, sizeof(series->device_id));
+		series->boot_count = sample->boot_count;
+		series->base_uptime_ms = sample->uptime_ticks;
+		series->base_rtc_clock = sample->rtc_clock;
+		series->uptime_delta_ms[n] = 0;
+		series->ticks_delta[n] = sample->ticks;
+		series->button_press_delta[n] = sample->button_press_count;
+	} else {
+		if (sample->boot_count != series->boot_count) {
+			return false;
+		}
+		series->uptime_delta_ms[n] = sample->uptime_ticks - prev->uptime_ticks;
+		series->ticks_delta[n] = sample->ticks - prev->ticks;
+		series->button_press_delta[n] =
+			sample->button_press_count - prev->button_press_count;
+	}
+
+	series->uptime_delta_ms_count = n + 1;
+	series->ticks_delta_count = n + 1;
+	series->button_press_delta_count = n + 1;
+	series->latest = *sample;
+	series->has_latest = true;
+	return true;
+}
+
+// Takes back the last telemetry_series_add(); @p prev is the sample that
+// was latest before it.
+static void telemetry_series_drop_last(TelemetrySeries *series,
+				       const StatusUpdateRequest *prev) {
+	pb_size_t n = series->uptime_delta_ms_count - 1;
+
+	series->uptime_delta_ms_count = n;
+	series->ticks_delta_count = n;
+	series->button_press_delta_count = n;
+	series->latest = *prev;
+}
+
+static bool telemetry_series_fits(const TelemetrySeries *series) {
+	size_t size;
+
+	return pb_get_encoded_size(&size, TelemetrySeries_fields, series) &&
+	       size <= TELEMETRY_SERIES_MAX_SIZE;
+}
+
+// Reads up to TELEMETRY_BATCH_MAX records after @p last from one boot into
+// telemetry_series_, as many as fit in TELEMETRY_SERIES_MAX_SIZE. The queue
+// holds full StatusUpdateRequests; only the time-varying fields go into the
+// packed arrays, and the newest sample is sent in full for everything else.
+static size_t telemetry_read_batch(struct fcb_entry *last) {
+	// Only used under telemetry_lock_.
+	static uint8_t record[StatusUpdateRequest_size];
+	struct fcb_entry loc = *last;
+	TelemetrySeries *series = &telemetry_series_;
+
+	memset(series, 0, sizeof(*series));
+	thread_stats_add(series);
+	while (series->uptime_delta_ms_count < TELEMETRY_BATCH_MAX &&
+	       fcb_getnext(&telemetry_fcb_, &loc) == 0) {
+		StatusUpdateRequest sample = StatusUpdateRequest_init_zero;
+		pb_istream_t stream;
+
+		if (loc.fe_data_len > sizeof(record) ||
+		    flash_area_read(telemetry_fcb_.fap, FCB_ENTRY_FA_DATA_OFF(loc),
+				    record, loc.fe_data_len) != 0) {
+			LOG_WRN("Skipping unreadable telemetry record");
+			*last = loc;
+			continue;
+		}
+		stream = pb_istream_from_buffer(record, loc.fe_data_len);
+		if (!pb_decode(&stream, StatusUpdateRequest_fields, &sample)) {
+			LOG_WRN("Skipping undecodable telemetry record");
+			*last = loc;
+			continue;
+		}
+		StatusUpdateRequest prev = series->latest;
+
+		if (!telemetry_series_add(series, &sample)) {
+			break;
+		}
+		// Only a series capped below its largest size can outgrow it.
+		if (TELEMETRY_SERIES_MAX_SIZE < TelemetrySeries_size &&
+		    series->uptime_delta_ms_count > 1 && !telemetry_series_fits(series)) {
+			telemetry_series_drop_last(series, &prev);
+			break;
+		}
+		*last = loc;
+	}
+	return series->uptime_delta_ms_count;
+}
+
+#if defined(CONFIG_APP_BACKEND_LINK)
+// Batches are pipelined on the backend link.
+#define TELEMETRY_PIPELINE_DEPTH LINK_MAX_INFLIGHT
+
+static int telemetry_submit(const uint8_t *payload, size_t len) {
+	return link_send(LinkMessageType_LINK_MESSAGE_TELEMETRY_SERIES, payload, len);
+}
+
+static int telemetry_wait(int handle) {
+	return link_wait(handle);
+}
+#elif defined(CONFIG_APP_BACKEND_MQTT)
+// QoS 1 publishes are pipelined; each is done once its PUBACK is in.
+#define TELEMETRY_PIPELINE_DEPTH MQTT_MAX_INFLIGHT
+
+static int telemetry_submit(const uint8_t *payload, size_t len) {
+	return mqtt_publish_qos1(mqtt_topic_telemetry_, payload, len);
+}
+
+static int telemetry_wait(int handle) {
+	return mqtt_wait_ack(handle);
+}
+#elif defined(CONFIG_APP_BACKEND_COAP)
+#define TELEMETRY_PIPELINE_DEPTH 1
+
+// Confirmable POSTs complete in telemetry_submit().
+static int telemetry_submit(const uint8_t *payload, size_t len) {
+	const uint8_t *rsp;
+	uint16_t rsp_len;
+	int err = coap_post("/telemetry_series", payload, len, &rsp, &rsp_len);
+
+	if (err == 0 && rsp_len > 0) {
+		decode_status_update_response((uint8_t *)rsp, rsp_len);
+	}
+	return err;
+}
+
+static int telemetry_wait(int handle) {
+	return 0;
+}
+#else
+#define TELEMETRY_PIPELINE_DEPTH 1
+
+// HTTP posts complete in telemetry_submit().
+static int telemetry_submit(const uint8_t *payload, size_t len) {
+	return backend_post("/telemetry_series", payload, len);
+}
+
+static int telemetry_wait(int handle) {
+	return 0;
+}
+#endif
+
+// Moves the cursor past records the backend has accepted (or that were
+// skipped), and erases sectors that hold only such records.
+static void telemetry_commit(const struct fcb_entry *pos, uint32_t drops) {
+	k_mutex_lock(&telemetry_lock_, K_FOREVER);
+	// If records were dropped meanwhile, the batch may have come from an
+	// erased sector; restart from the oldest record rather than trust it.
+	telemetry_cursor_ = *pos;
+	if (drops != telemetry_drops_) {
+		telemetry_cursor_.fe_sector = NULL;
+	}
+	// Sectors before the cursor hold only sent records.
+	while (telemetry_cursor_.fe_sector != NULL &&
+	       telemetry_fcb_.f_oldest != telemetry_cursor_.fe_sector) {
+		if (fcb_rotate(&telemetry_fcb_) != 0) {
+			break;
+		}
+	}
+	k_mutex_unlock(&telemetry_lock_);
+}
+
+// Posts queued records until the queue is empty or the backend can't be
+// reached. Runs on the HTTP thread; the queue lock is never held across
+// network calls, so sampling is never held up by the network. Up to
+// TELEMETRY_PIPELINE_DEPTH batches are sent before waiting for the first
+// response, and the cursor only moves past batches that were accepted in
+// order. Returns 0 once the queue is empty.
+static int telemetry_drain(void) {
+	struct fcb_entry ends[TELEMETRY_PIPELINE_DEPTH];
+	int handles[TELEMETRY_PIPELINE_DEPTH];
+
+	// Once per upload; every batch of it carries the same thread stats.
+	thread_stats_collect();
+
+	while (true) {
+		struct fcb_entry start;
+		struct fcb_entry pos;
+		uint32_t drops;
+		size_t sent = 0;
+		size_t acked;
+		bool failed = false;
+
+		k_mutex_lock(&telemetry_lock_, K_FOREVER);
+		start = telemetry_cursor_;
+		drops = telemetry_drops_;
+		k_mutex_unlock(&telemetry_lock_);
+		pos = start;
+
+		while (sent < TELEMETRY_PIPELINE_DEPTH) {
+			pb_ostream_t stream = pb_ostream_from_buffer(telemetry_batch_buf_,
+								     sizeof(telemetry_batch_buf_));
+			size_t count = 0;
+			bool encoded = true;
+
+			k_mutex_lock(&telemetry_lock_, K_FOREVER);
+			if (drops == telemetry_drops_) {
+				count = telemetry_read_batch(&pos);
+			}
+			if (count > 0) {
+				encoded = pb_encode(&stream, TelemetrySeries_fields, &telemetry_series_) &&
+					  encode_stats_groups(&stream);
+			}
+			k_mutex_unlock(&telemetry_lock_);
+
+			if (!encoded) {
+				LOG_ERR("Encoding telemetry failed: %s", PB_GET_ERROR(&stream));
+				failed = true;
+				break;
+			}
+			if (count == 0) {
+				break;
+			}
+
+			LOG_INF("Sending %zu queued samples in %zu bytes", count, stream.bytes_written);
+			handles[sent] = telemetry_submit(telemetry_batch_buf_, stream.bytes_written);
+			if (handles[sent] < 0) {
+				failed = true;
+				break;
+			}
+			ends[sent++] = pos;
+		}
+
+		for (acked = 0; acked < sent; acked++) {
+			if (telemetry_wait(handles[acked]) != 0) {
+				failed = true;
+				break;
+			}
+		}
+		// Collect the rest so their slots are free again.
+		for (size_t i = acked + 1; i < sent; i++) {
+			telemetry_wait(handles[i]);
+		}
+
+		if (failed) {
+			if (acked > 0) {
+				telemetry_commit(&ends[acked - 1], drops);
+			}
+			LOG_WRN("Telemetry upload failed; keeping records queued");
+			return -EIO;
+		}
+		// pos is past any unreadable records that trail the last batch.
+		if (pos.fe_sector != start.fe_sector || pos.fe_elem_off != start.fe_elem_off) {
+			telemetry_commit(&pos, drops);
+		}
+		if (sent < TELEMETRY_PIPELINE_DEPTH) {
+			return 0;
+		}
+	}
+}
+
+// Periodic (and button-triggered) status sample. Appending only touches
+// flash; the upload is left to the HTTP thread, after the upload scheduler
+// unless a button asked for it.
+static void telemetry_sample_handler(struct k_work *work) {
+	// Kept off the system workqueue stack.
+	static uint8_t record[StatusUpdateRequest_size];
+	size_t len;
+
+	app_stats_update_idle();
+	if (encode_status_update_request(record, sizeof(record), &len)) {
+		int err = telemetry_append(record, len);
+		if (err != 0) {
+			LOG_ERR("Telemetry append failed: %d", err);
+		}
+	}
+
+	if (telemetry_urgent_) {
+		telemetry_urgent_ = false;
+		k_event_post(&unblock_sender_, (1 << BUTTON_ACTION_PROTO_REQ));
+	} else {
+		upload_request(UPLOAD_CLASS_TELEMETRY);
+	}
+	k_work_schedule(&telemetry_sample_work_, K_SECONDS(telemetry_interval_s_));
+}
+
+static int backend_http_request(void) {
+	return telemetry_drain();
+}
+
+/* IOTEMBSYS: Create a HTTP request and response with protobuf. */
+static bool encode_ota_update_request(uint8_t *buffer, size_t buffer_size, size_t *message_length)
+{
+	bool status;
+
+	/* Allocate space on the stack to store the message data.
+	 *
+	 * Nanopb generates simple struct definitions for all the messages.
+	 * - check out the contents of api.pb.h!
+	 * It is a good idea to always initialize your structures
+	 * so that you do not have garbage data from RAM in there.
+	 */
+	OTAUpdateRequest message = OTAUpdateRequest_init_zero;
+
+	/* Create a stream that will write to our buffer. */
+	pb_ostream_t stream = pb_ostream_from_buffer(buffer, buffer_size);
+	
+	/* TODO: fill out the actual state. */
+	message.state = OTAState_OTA_STATE_NONE;
+	strncpy(message.version, APP_VERSION_STR, sizeof(message.version));
+	strncpy(message.device_id, kDeviceId, sizeof(message.device_id));
+	message.accepts_delta = true;
+	message.accepts_compressed = true;
+
+	/* Now we are ready to encode the message! */
+	status = pb_encode(&stream, OTAUpdateRequest_fields, &message);
+	*message_length = stream.bytes_written;
+
+	if (!status) {
+		printk("Encoding failed: %s\n", PB_GET_ERROR(&stream));
+	}
+
+	return status;
+}
+
+static bool decode_ota_update_response(uint8_t *buffer, size_t message_length)
+{
+	bool status = false;
+	if (message_length == 0) {
+		LOG_WRN("Message length is 0");
+		return status;
+	}
+
+	/* Allocate space for the decoded message. */
+	OTAUpdateResponse message = OTAUpdateResponse_init_zero;
+
+	/* Create a stream that reads from the buffer. */
+	pb_istream_t stream = pb_istream_from_buffer(buffer, message_length);
+
+	/* Now we are ready to decode the message. */
+	req_trace_mark(REQ_TRACE_DECODE);
+	status = pb_decode(&stream, OTAUpdateResponse_fields, &message);
+
+	/* Check for errors... */
+	if (status) {
+		/* Print the data contained in the message. */
+		printk("OTA path: %s (format %d)\n", message.path, message.format);
+		strncpy(ota_path_, message.path, sizeof(ota_path_));
+		ota_format_ = message.format;
+		ota_offered_ = message.do_update;
+		ota_has_expected_hash_ = message.sha256.size == sizeof(ota_expected_hash_);
+		if (ota_has_expected_hash_) {
+			memcpy(ota_expected_hash_, message.sha256.bytes, sizeof(ota_expected_hash_));
+		}
+	} else {
+		printk("Decoding failed: %s\n", PB_GET_ERROR(&stream));
+	}
+	req_trace_mark(REQ_TRACE_DECODED);
+
+	return status;
+}
+
+/* IOTEMBSYS: Implement the HTTP client functionality */
+static int http_ota_proto_payload_get(uint8_t* buffer, size_t buf_size) {
+	size_t message_length;
+
+	/* Encode our message */
+	if (!encode_ota_update_request(buffer, buf_size, &message_length)) {
+		LOG_ERR("Encoding request failed");
+		return 0;
+	} else {
+		LOG_INF("Sending proto to server. Length: %d", (int)message_length);
+	}
+	return (int)message_length;
+}
+
+// Whether the last HTTP OTA query got a response that decoded.
+static bool ota_query_decoded_;
+
+static void http_ota_proto_response_cb(struct http_response *rsp,
+			enum http_final_call final_data,
+			void *user_data)
+{
+	if (final_data == HTTP_DATA_MORE) {
+		LOG_INF("Partial data received (%zd bytes)", rsp->data_len);
+	} else if (final_data == HTTP_DATA_FINAL) {
+		LOG_INF("All the data received (%zd bytes)", rsp->data_len);
+
+		// Decode the protobuf response.
+		ota_query_decoded_ = decode_ota_update_response(rsp->body_frag_start,
+								rsp->body_frag_len);
+	}
+
+	LOG_INF("Response to %s", (const char *)user_data);
+	LOG_INF("Response status %s", rsp->http_status);
+}
+
+#if defined(CONFIG_APP_BACKEND_LINK)
+static int backend_ota_link_request(void) {
+	uint8_t payload[OTAUpdateRequest_size];
+	size_t len;
+	int id;
+
+	if (!encode_ota_update_request(payload, sizeof(payload), &len)) {
+		LOG_ERR("Encoding request failed");
+		return -ENOMEM;
+	}
+
+	id = link_send(LinkMessageType_LINK_MESSAGE_OTA_UPDATE_REQUEST, payload, len);
+	if (id < 0) {
+		LOG_ERR("OTA request failed: %d", id);
+		return id;
+	}
+	int ret = link_wait(id);
+	if (ret != 0) {
+		LOG_ERR("OTA request failed: %d", ret);
+	}
+	return ret;
+}
+#endif
+
+#if defined(CONFIG_APP_BACKEND_COAP)
+static int backend_ota_coap_request(void) {
+	uint8_t payload[OTAUpdateRequest_size];
+	const uint8_t *rsp;
+	uint16_t rsp_len;
+	size_t len;
+	int err;
+
+	if (!encode_ota_update_request(payload, sizeof(payload), &len)) {
+		LOG_ERR("Encoding request failed");
+		return -ENOMEM;
+	}
+
+	err = coap_post("/ota", payload, len, &rsp, &rsp_len);
+	if (err != 0) {
+		LOG_ERR("OTA request failed: %d", err);
+		return err;
+	}
+	if (rsp_len > 0 && !decode_ota_update_response((uint8_t *)rsp, rsp_len)) {
+		return -EBADMSG;
+	}
+	return 0;
+}
+#endif
+
+static int backend_ota_http_request(void) {
+	int sock;
+	const int32_t timeout = 5 * MSEC_PER_SEC;
+	char host[ENDPOINT_HOST_HEADER_LEN];
+	uint32_t start = lat_hist_start();
+
+	// Create a socket using parameters that the modem allows.
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		LOG_ERR("Creating socket failed");
+		return -errno;
+	}
+	int err = endpoint_connect(ENDPOINT_BACKEND, sock);
+	if (err < 0) {
+		close(sock);
+		return err;
+	}
+	endpoint_host_header(ENDPOINT_BACKEND, host, sizeof(host));
+
+	struct http_request req;
+
+	memset(&req, 0, sizeof(req));
+	memset(recv_buf_, 0, sizeof(recv_buf_));
+
+	req.host = host;
+	req.protocol = "HTTP/1.1";
+	req.method = HTTP_POST;
+	req.url = "/ota";
+	req.payload = recv_buf_;
+	req.payload_len = http_ota_proto_payload_get(recv_buf_, sizeof(recv_buf_));
+	req.payload = req.payload_len ? recv_buf_ : NULL;
+	req.response = http_ota_proto_response_cb;
+	req.recv_buf = recv_buf_;
+	req.recv_buf_len = sizeof(recv_buf_);
+
+	// This request is synchronous and blocks the thread.
+	LOG_INF("Sending OTA HTTP request");
+	ota_query_decoded_ = false;
+	TRACE_SPAN_BEGIN("http_req", req.method);
+	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
+	TRACE_SPAN_END("http_req", ret);
+	if (ret > 0) {
+		LOG_INF("HTTP request sent %d bytes", ret);
+	} else {
+		LOG_ERR("HTTP request failed: %d", ret);
+	}
+
+	LOG_INF("Closing the socket");
+	close(sock);
+	lat_hist_stop(&http_lat_, start);
+	if (ret < 0) {
+		return ret;
+	}
+	return ota_query_decoded_ ? 0 : -EBADMSG;
+}
+
+//
+// OTA Download Section
+//
+
+// Each OTA buffer holds exactly one STM32L4 flash page, so every buffer handed
+// to the writer thread turns into a single page program.
+#define OTA_WRITE_BUF_SIZE 2048
+#define OTA_WRITE_BUF_COUNT 2
+#define OTA_WRITER_STACK_SIZE 1024
+// Lower priority than the HTTP client thread, so receiving from the modem
+// preempts flash programming whenever there is data to read.
+#define OTA_WRITER_PRIORITY 6
+// MCUboot keeps the image magic and swap status in a trailer at the end of
+// the slot, laid out as in bootutil's boot_trailer_sz(): three status
+// entries per sector, four flag fields, each one flash write block, and the
+// magic. bootloader.conf sets CONFIG_BOOT_MAX_IMG_SECTORS to the number of
+// pages in the slot, so that is the status entry count. The trailer is
+// never covered by the image, so its pages are erased explicitly instead of
+// with the image pages.
+#define OTA_FLASH_WRITE_BLOCK DT_PROP(DT_CHOSEN(zephyr_flash), write_block_size)
+#define OTA_SLOT_SECTORS (FIXED_PARTITION_SIZE(SLOT1_PARTITION) / OTA_WRITE_BUF_SIZE)
+#define OTA_MCUBOOT_TRAILER_SIZE ((OTA_SLOT_SECTORS * 3 + 4) * OTA_FLASH_WRITE_BLOCK + \
+				  ROUND_UP(16, OTA_FLASH_WRITE_BLOCK))
+#define OTA_SLOT_TRAILER_SIZE ROUND_UP(OTA_MCUBOOT_TRAILER_SIZE, OTA_WRITE_BUF_SIZE)
+BUILD_ASSERT(OTA_SLOT_TRAILER_SIZE < FIXED_PARTITION_SIZE(SLOT1_PARTITION),
+	     "MCUboot trailer does not fit in slot1");
+
+// Progress is persisted every this many bytes. Checkpoints always land on a
+// page boundary, so a resumed download starts on a page that is still unused.
+#define OTA_CHECKPOINT_INTERVAL (16 * OTA_WRITE_BUF_SIZE)
+#define OTA_MAX_ATTEMPTS 5
+#define OTA_RETRY_DELAY_MS 2000
+#define OTA_ETAG_MAX_LEN 64
+
+// Parallel mode splits the image into checkpoint-sized segments and fetches
+// them with ranged GETs over up to this many modem sockets. 1 disables it.
+#define OTA_MAX_CONNECTIONS CONFIG_APP_OTA_MAX_CONNECTIONS
+#define OTA_SEGMENT_SIZE OTA_CHECKPOINT_INTERVAL
+#define OTA_MAX_SEGMENTS DIV_ROUND_UP(FIXED_PARTITION_SIZE(SLOT1_PARTITION), OTA_SEGMENT_SIZE)
+#define OTA_WORKER_STACK_SIZE 2560
+// Another connection is only added while each connection still gets at least
+// this share of the single-connection rate, i.e. while the link is latency
+// bound rather than bandwidth bound.
+#define OTA_SCALE_UP_PCT 80
+
+/* A filled buffer handed from the HTTP callback to the flash writer thread. */
+struct ota_write_req {
+	uint8_t *buf;
+	size_t len;
+	bool flush;
+	bool last;
+};
+
+/* Verified OTA progress; stored as a single settings value so the offset and
+ * the CRC over [0, offset) can never be persisted out of step.
+ */
+struct ota_written {
+	uint32_t offset;
+	uint32_t crc;
+};
+
+/* Download progress persisted under the "ota" settings subtree. */
+struct ota_progress {
+	char url[sizeof(ota_path_)];
+	char etag[OTA_ETAG_MAX_LEN];
+	uint32_t image_size;
+	struct ota_written written;
+};
+
+static int total_read_size;
+static int total_write_size;
+static int content_length_;
+static const struct flash_area *image_area;
+static const struct flash_area *base_area;
+#if !defined(CONFIG_APP_BACKEND_COAP)
+static struct sockaddr_in ota_addr_;
+// Host header for the download in progress.
+static char ota_host_[ENDPOINT_HOST_HEADER_LEN];
+static int ota_sock_ = -1;
+// Set once the response callback has stopped the transfer on ota_sock_.
+static bool ota_aborted_;
+#endif
+static struct image_check_ctx ota_check_;
+// Only one decoder runs at a time, and the LZ4 window dominates.
+static union {
+	struct delta_patch_ctx delta;
+	struct block_lz4_ctx lz4;
+} ota_decoder_;
+
+static uint8_t ota_bufs_[OTA_WRITE_BUF_COUNT][OTA_WRITE_BUF_SIZE] __aligned(8);
+static uint8_t ota_stream_buf_[OTA_WRITE_BUF_SIZE] __aligned(8);
+static struct stream_flash_ctx ota_stream_;
+static uint8_t ota_buf_idx_;
+static size_t ota_buf_fill_;
+static int ota_write_err_;
+static bool ota_started_;
+static int64_t ota_request_ms_;
+static int64_t ota_start_ms_;
+
+static struct ota_progress ota_progress_;
+static uint32_t ota_checkpoint_offset_;
+static uint32_t ota_resume_offset_;
+static uint32_t ota_image_size_;
+
+// Response headers captured for the current attempt.
+static char ota_etag_[OTA_ETAG_MAX_LEN];
+#if !defined(CONFIG_APP_BACKEND_COAP)
+static int ota_http_status_;
+static uint32_t ota_range_total_;
+static enum {
+	OTA_HEADER_OTHER = 0,
+	OTA_HEADER_ETAG,
+	OTA_HEADER_CONTENT_RANGE,
+} ota_header_;
+#endif
+
+K_MSGQ_DEFINE(ota_write_q_, sizeof(struct ota_write_req), OTA_WRITE_BUF_COUNT, 4);
+static struct k_sem ota_buf_free_;
+static struct k_sem ota_write_done_;
+
+#if !defined(CONFIG_APP_BACKEND_COAP)
+static int ota_lookup_host(void) {
+	int64_t start = k_uptime_get();
+	int err = endpoint_addr(ENDPOINT_OTA, &ota_addr_);
+
+	endpoint_host_header(ENDPOINT_OTA, ota_host_, sizeof(ota_host_));
+	STATS_SET(ota_stats, dns_ms, k_uptime_get() - start);
+	return err;
+}
+
+static int ota_connect(int sock) {
+	int64_t start = k_uptime_get();
+	int ret = connect(sock, (struct sockaddr *)&ota_addr_, sizeof(ota_addr_));
+
+	STATS_SET(ota_stats, connect_ms, k_uptime_get() - start);
+	return ret;
+}
+#endif // !CONFIG_APP_BACKEND_COAP
+
+static int ota_erase(off_t offset, size_t len) {
+	int64_t start = k_uptime_get();
+	int err = flash_area_erase(image_area, offset, len);
+
+	STATS_INCN(ota_stats, erase_ms, k_uptime_get() - start);
+	return err;
+}
+
+// Reads the modem driver's AT+QIRD counter, which lives in its own "bg96"
+// stats group.
+static int ota_qird_walk(struct stats_hdr *hdr, void *arg, const char *name, uint16_t off) {
+	if (strcmp(name, "qird_cmds") == 0) {
+		*(uint32_t *)arg = *(uint32_t *)((uint8_t *)hdr + off);
+	}
+	return 0;
+}
+
+static uint32_t ota_qird_cmds(void) {
+	struct stats_hdr *hdr = stats_group_find("bg96");
+	uint32_t count = 0;
+
+	if (hdr != NULL) {
+		stats_walk(hdr, ota_qird_walk, &count);
+	}
+	return count;
+}
+
+static int ota_settings_set(const char *name, size_t len,
+                            settings_read_cb read_cb, void *cb_arg)
+{
+	const char *next;
+	char *str = NULL;
+	void *dest = NULL;
+	size_t dest_len = 0;
+	int rc;
+
+	if (settings_name_steq(name, "url", &next) && !next) {
+		str = ota_progress_.url;
+		dest_len = sizeof(ota_progress_.url) - 1;
+	} else if (settings_name_steq(name, "etag", &next) && !next) {
+		str = ota_progress_.etag;
+		dest_len = sizeof(ota_progress_.etag) - 1;
+	} else if (settings_name_steq(name, "size", &next) && !next) {
+		if (len != sizeof(ota_progress_.image_size)) {
+			return -EINVAL;
+		}
+		dest = &ota_progress_.image_size;
+		dest_len = len;
+	} else if (settings_name_steq(name, "written", &next) && !next) {
+		if (len != sizeof(ota_progress_.written)) {
+			return -EINVAL;
+		}
+		dest = &ota_progress_.written;
+		dest_len = len;
+	} else {
+		return -ENOENT;
+	}
+
+	if (len > dest_len) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, str ? str : dest, len);
+	if (rc < 0) {
+		return rc;
+	}
+	if (str) {
+		str[rc] = '\0';
+	}
+	return 0;
+}
+
+struct settings_handler ota_conf = {
+	.name = "ota",
+	.h_set = ota_settings_set,
+};
+
+// Records a fresh download, so that it can be resumed if it is interrupted.
+static void ota_progress_begin(const char *url, const char *etag, uint32_t image_size) {
+	memset(&ota_progress_, 0, sizeof(ota_progress_));
+	strncpy(ota_progress_.url, url, sizeof(ota_progress_.url) - 1);
+	strncpy(ota_progress_.etag, etag, sizeof(ota_progress_.etag) - 1);
+	ota_progress_.image_size = image_size;
+	ota_checkpoint_offset_ = 0;
+
+	settings_save_one("ota/url", ota_progress_.url, strlen(ota_progress_.url));
+	settings_save_one("ota/etag", ota_progress_.etag, strlen(ota_progress_.etag));
+	settings_save_one("ota/size", &ota_progress_.image_size, sizeof(ota_progress_.image_size));
+	settings_save_one("ota/written", &ota_progress_.written, sizeof(ota_progress_.written));
+}
+
+static void ota_progress_clear(void) {
+	memset(&ota_progress_, 0, sizeof(ota_progress_));
+	ota_checkpoint_offset_ = 0;
+
+	settings_delete("ota/url");
+	settings_delete("ota/etag");
+	settings_delete("ota/size");
+	settings_delete("ota/written");
+}
+
+// Rejects images that MCUboot would refuse to boot from slot0, as soon as
+// the header and vector table have arrived.
+static int ota_check_header_cb(void *user_data, const struct image_check_header *hdr) {
+	LOG_INF("OTA image version %u.%u.%u+%u", hdr->ver_major, hdr->ver_minor,
+		hdr->ver_revision, hdr->ver_build);
+
+	if (hdr->flags & (IMAGE_CHECK_F_ENCRYPTED_AES128 | IMAGE_CHECK_F_ENCRYPTED_AES256 |
+			  IMAGE_CHECK_F_NON_BOOTABLE | IMAGE_CHECK_F_RAM_LOAD)) {
+		LOG_ERR("Unsupported OTA image flags 0x%x", hdr->flags);
+		return -ENOEXEC;
+	}
+
+#ifdef CONFIG_CPU_CORTEX_M
+	// The image is linked to run from slot0, right after its header.
+	uint32_t code_start = CONFIG_FLASH_BASE_ADDRESS + FIXED_PARTITION_OFFSET(SLOT0_PARTITION) +
+			      hdr->hdr_size;
+	uint32_t sram_start = CONFIG_SRAM_BASE_ADDRESS;
+	uint32_t reset = hdr->vector[1] & ~1U;
+
+	if (hdr->vector[0] <= sram_start || hdr->vector[0] > sram_start + CONFIG_SRAM_SIZE * 1024 ||
+	    reset < code_start || reset >= code_start + hdr->img_size) {
+		LOG_ERR("OTA image is built for another target (SP 0x%08x, reset 0x%08x)",
+			hdr->vector[0], hdr->vector[1]);
+		return -ENOEXEC;
+	}
+#endif
+	return 0;
+}
+
+// Starts hashing a new image. The checker is fed the image in order, from
+// the network for a single stream and for segment 0 of a parallel download,
+// and from flash otherwise.
+static void ota_check_begin(uint32_t image_size) {
+	struct image_check_cfg cfg = {
+		.header_cb = ota_check_header_cb,
+		.expected_hash = ota_has_expected_hash_ ? ota_expected_hash_ : NULL,
+	};
+
+	image_check_init(&ota_check_, image_size, &cfg);
+}
+
+// Returns the offset a download of `url` can resume from, or 0. The part of
+// slot1 that was already written is read back and checked against the CRC
+// of the last checkpoint (or of the previous attempt, after a dropped
+// connection) before it is trusted.
+static uint32_t ota_progress_resume_offset(const char *url) {
+	uint32_t offset = ota_progress_.written.offset;
+	uint32_t crc = 0;
+
+	if (offset == 0 || ota_progress_.etag[0] == '\0' ||
+	    strcmp(ota_progress_.url, url) != 0 ||
+	    offset >= ota_progress_.image_size ||
+	    offset % OTA_WRITE_BUF_SIZE != 0) {
+		return 0;
+	}
+
+	// The pipeline is idle here, so its buffer doubles as read-back scratch.
+	// The image hash restarts as well, from what is already in slot1.
+	ota_check_begin(ota_progress_.image_size);
+	for (uint32_t pos = 0; pos < offset; pos += OTA_WRITE_BUF_SIZE) {
+		size_t chunk = MIN(OTA_WRITE_BUF_SIZE, offset - pos);
+
+		if (flash_area_read(image_area, pos, ota_bufs_[0], chunk) != 0) {
+			LOG_ERR("Flash area read failed");
+			return 0;
+		}
+		crc = crc32_ieee_update(crc, ota_bufs_[0], chunk);
+		if (image_check_update(&ota_check_, ota_bufs_[0], chunk) != 0) {
+			LOG_WRN("OTA checkpoint holds a bad image; restarting download");
+			return 0;
+		}
+	}
+
+	if (crc != ota_progress_.written.crc) {
+		LOG_WRN("OTA checkpoint CRC mismatch; restarting download");
+		return 0;
+	}
+
+	ota_checkpoint_offset_ = offset;
+	return offset;
+}
+
+// Called by stream_flash from the writer thread with the data read back from
+// flash after each page is programmed.
+static int ota_stream_cb(uint8_t *buf, size_t len, size_t offset) {
+	if (offset - image_area->fa_off != ota_progress_.written.offset) {
+		LOG_ERR("Unexpected OTA write offset %zu", offset - image_area->fa_off);
+		return -EINVAL;
+	}
+
+	ota_progress_.written.crc = crc32_ieee_update(ota_progress_.written.crc, buf, len);
+	ota_progress_.written.offset += len;
+
+	if (ota_progress_.url[0] != '\0' &&
+	    ota_progress_.written.offset % OTA_WRITE_BUF_SIZE == 0 &&
+	    ota_progress_.written.offset - ota_checkpoint_offset_ >= OTA_CHECKPOINT_INTERVAL) {
+		settings_save_one("ota/written", &ota_progress_.written,
+				  sizeof(ota_progress_.written));
+		ota_checkpoint_offset_ = ota_progress_.written.offset;
+	}
+
+	return 0;
+}
+
+// Programs the buffers filled by the HTTP callback. Running this in its own
+// thread lets the next buffer be read from the modem while the previous one
+// is written to slot1 (which sits in the second flash bank on the STM32L496).
+static void ota_writer_thread(void* p1, void* p2, void* p3) {
+	struct ota_write_req req;
+
+	while (true) {
+		k_msgq_get(&ota_write_q_, &req, K_FOREVER);
+
+		if (ota_write_err_ == 0 && (req.len > 0 || req.flush)) {
+			// Includes the erase stream_flash does ahead of each new page.
+			uint32_t start = lat_hist_start();
+			int err;
+
+			TRACE_SPAN_BEGIN("ota_write", req.len);
+			err = stream_flash_buffered_write(&ota_stream_, req.buf, req.len, req.flush);
+			TRACE_SPAN_END("ota_write", err);
+			lat_hist_stop(&flash_write_lat_, start);
+			if (err != 0) {
+				LOG_ERR("Flash stream write failed: %d", err);
+				ota_write_err_ = err;
+			}
+		}
+
+		k_sem_give(&ota_buf_free_);
+		if (req.last) {
+			k_sem_give(&ota_write_done_);
+		}
+	}
+}
+
+K_THREAD_DEFINE(ota_writer_tid, OTA_WRITER_STACK_SIZE,
+                ota_writer_thread, NULL, NULL, NULL,
+                OTA_WRITER_PRIORITY, 0, 0);
+
+static void ota_pipeline_reset(void) {
+	ota_buf_idx_ = 0;
+	ota_buf_fill_ = 0;
+	ota_write_err_ = 0;
+	ota_started_ = false;
+	ota_start_ms_ = 0;
+	k_sem_init(&ota_buf_free_, OTA_WRITE_BUF_COUNT, OTA_WRITE_BUF_COUNT);
+	k_sem_init(&ota_write_done_, 0, 1);
+}
+
+// Called once the response headers are known. Nothing in slot1 is erased
+// before this point: the stream covers [start, page-rounded image size) and
+// stream_flash erases each page from the writer thread just before the first
+// write into it, so erasing overlaps with the download.
+static int ota_pipeline_start(size_t image_size, size_t start) {
+	size_t max_image_size = image_area->fa_size - OTA_SLOT_TRAILER_SIZE;
+	int err;
+
+	if (image_size == 0 || image_size > max_image_size || start >= image_size) {
+		LOG_ERR("Invalid OTA image size %zu (max %zu)", image_size, max_image_size);
+		return -EFBIG;
+	}
+
+	if (start == 0) {
+		ota_check_begin(image_size);
+		err = ota_erase(max_image_size, OTA_SLOT_TRAILER_SIZE);
+		if (err != 0) {
+			LOG_ERR("Slot trailer erase failed: %d", err);
+			return err;
+		}
+	}
+
+	err = stream_flash_init(&ota_stream_, flash_area_get_device(image_area),
+				ota_stream_buf_, sizeof(ota_stream_buf_),
+				image_area->fa_off + start,
+				ROUND_UP(image_size, OTA_WRITE_BUF_SIZE) - start,
+				ota_stream_cb);
+	if (err != 0) {
+		LOG_ERR("Flash stream init failed: %d", err);
+		return err;
+	}
+
+	ota_started_ = true;
+	return 0;
+}
+
+static void ota_pipeline_submit(bool flush, bool last) {
+	struct ota_write_req req = {
+		.buf = ota_bufs_[ota_buf_idx_],
+		.len = ota_buf_fill_,
+		.flush = flush,
+		.last = last,
+	};
+
+	k_msgq_put(&ota_write_q_, &req, K_FOREVER);
+	ota_buf_idx_ = (ota_buf_idx_ + 1) % OTA_WRITE_BUF_COUNT;
+	ota_buf_fill_ = 0;
+}
+
+static void ota_pipeline_write(const uint8_t *data, size_t len) {
+	TRACE_POINT("ota_chunk", len);
+	if (ota_write_err_ == 0) {
+		int err = image_check_update(&ota_check_, data, len);
+		if (err != 0) {
+			LOG_ERR("OTA image rejected: %d", err);
+			ota_write_err_ = err;
+		}
+	}
+
+	while (len > 0) {
+		if (ota_buf_fill_ == 0) {
+			// Only blocks if the writer still owns both buffers.
+			k_sem_take(&ota_buf_free_, K_FOREVER);
+		}
+
+		size_t copy_len = MIN(len, OTA_WRITE_BUF_SIZE - ota_buf_fill_);
+		memcpy(ota_bufs_[ota_buf_idx_] + ota_buf_fill_, data, copy_len);
+		ota_buf_fill_ += copy_len;
+		data += copy_len;
+		len -= copy_len;
+
+		if (ota_buf_fill_ == OTA_WRITE_BUF_SIZE) {
+			ota_pipeline_submit(false, false);
+		}
+	}
+}
+
+// Waits until the writer has programmed everything handed to it. A complete
+// download also flushes the last partial page; an interrupted one drops it, so
+// the written offset stays page-aligned and the download can be resumed.
+static int ota_pipeline_finish(bool complete) {
+	if (!ota_started_) {
+		return ota_write_err_ ? ota_write_err_ : -ENODATA;
+	}
+
+	if (ota_buf_fill_ == 0) {
+		k_sem_take(&ota_buf_free_, K_FOREVER);
+	} else if (!complete) {
+		ota_buf_fill_ = 0;
+	}
+	ota_pipeline_submit(complete, true);
+	k_sem_take(&ota_write_done_, K_FOREVER);
+
+	total_write_size = ota_resume_offset_ + stream_flash_bytes_written(&ota_stream_);
+	return ota_write_err_;
+}
+
+#if !defined(CONFIG_APP_BACKEND_COAP)
+static int ota_on_header_field(struct http_parser *parser, const char *at, size_t length) {
+	ota_http_status_ = parser->status_code;
+
+	if (length == strlen("ETag") && strncasecmp(at, "ETag", length) == 0) {
+		ota_header_ = OTA_HEADER_ETAG;
+	} else if (length == strlen("Content-Range") &&
+		   strncasecmp(at, "Content-Range", length) == 0) {
+		ota_header_ = OTA_HEADER_CONTENT_RANGE;
+	} else {
+		ota_header_ = OTA_HEADER_OTHER;
+	}
+	return 0;
+}
+
+static int ota_on_header_value(struct http_parser *parser, const char *at, size_t length) {
+	if (ota_header_ == OTA_HEADER_ETAG) {
+		length = MIN(length, sizeof(ota_etag_) - 1);
+		memcpy(ota_etag_, at, length);
+		ota_etag_[length] = '\0';
+	} else if (ota_header_ == OTA_HEADER_CONTENT_RANGE) {
+		// Content-Range: bytes <first>-<last>/<total>
+		const char *total = memchr(at, '/', length);
+		if (total != NULL) {
+			ota_range_total_ = strtoul(total + 1, NULL, 10);
+		}
+	}
+	return 0;
+}
+
+static const struct http_parser_settings ota_http_cb = {
+	.on_header_field = ota_on_header_field,
+	.on_header_value = ota_on_header_value,
+};
+
+// Picks up where the previous attempt left off, or starts a fresh download
+// if the server answered a range request with the full image.
+static int ota_download_begin(const struct http_response *rsp) {
+	uint32_t start = 0;
+
+	if (ota_http_status_ == 206 && ota_resume_offset_ > 0) {
+		start = ota_resume_offset_;
+		ota_image_size_ = ota_range_total_ ? ota_range_total_ : start + rsp->content_length;
+		if (ota_image_size_ != ota_progress_.image_size) {
+			LOG_ERR("OTA image size changed: %u -> %u", ota_progress_.image_size, ota_image_size_);
+			return -EBADMSG;
+		}
+		LOG_INF("Resuming OTA at %u / %u", start, ota_image_size_);
+	} else if (ota_http_status_ == 200) {
+		if (ota_resume_offset_ > 0) {
+			LOG_WRN("Server returned the full image; restarting download");
+		}
+		ota_resume_offset_ = 0;
+		ota_image_size_ = rsp->content_length;
+		ota_progress_begin(ota_path_, ota_etag_, ota_image_size_);
+	} else {
+		LOG_ERR("Unexpected OTA response status %d", ota_http_status_);
+		return -EBADMSG;
+	}
+
+	return ota_pipeline_start(ota_image_size_, start);
+}
+#endif // !CONFIG_APP_BACKEND_COAP
+
+// Delta updates: the patch is applied against the running image in slot0
+// while it downloads, and the reconstructed image goes through the same
+// writer pipeline as a full image. The patch carries the CRC of the exact
+// signed target image, so the result is byte-identical to
+// zephyr.signed.bin and MCUboot validates it as usual.
+static int ota_delta_header_cb(void *user_data, const struct delta_patch_header *hdr) {
+	uint32_t crc = 0;
+
+	if (hdr->source_size > base_area->fa_size) {
+		return -ENOEXEC;
+	}
+
+	// The pipeline has not started yet, so its buffer is free for scratch.
+	for (uint32_t pos = 0; pos < hdr->source_size; pos += OTA_WRITE_BUF_SIZE) {
+		size_t chunk = MIN(OTA_WRITE_BUF_SIZE, hdr->source_size - pos);
+
+		if (flash_area_read(base_area, pos, ota_bufs_[0], chunk) != 0) {
+			return -EIO;
+		}
+		crc = crc32_ieee_update(crc, ota_bufs_[0], chunk);
+	}
+	if (crc != hdr->source_crc) {
+		LOG_ERR("Delta patch does not apply to the running image");
+		return -ENOEXEC;
+	}
+
+	LOG_INF("Applying delta patch: %u -> %u bytes", hdr->source_size, hdr->target_size);
+	ota_image_size_ = hdr->target_size;
+	return ota_pipeline_start(hdr->target_size, 0);
+}
+
+static int ota_delta_read_cb(void *user_data, size_t offset, uint8_t *buf, size_t len) {
+	return flash_area_read(base_area, offset, buf, len);
+}
+
+static int ota_decoded_write_cb(void *user_data, const uint8_t *buf, size_t len) {
+	ota_pipeline_write(buf, len);
+	return 0;
+}
+
+static const struct delta_patch_cfg ota_delta_cfg = {
+	.header_cb = ota_delta_header_cb,
+	.read_cb = ota_delta_read_cb,
+	.write_cb = ota_decoded_write_cb,
+};
+
+// Compressed images are LZ4 blocks of at most CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE
+// bytes, decompressed one block at a time into the writer pipeline.
+static int ota_lz4_header_cb(void *user_data, const struct block_lz4_header *hdr) {
+	LOG_INF("Decompressing OTA image: %u bytes in %u byte blocks",
+		hdr->image_size, hdr->block_size);
+	ota_image_size_ = hdr->image_size;
+	return ota_pipeline_start(hdr->image_size, 0);
+}
+
+static const struct block_lz4_cfg ota_lz4_cfg = {
+	.header_cb = ota_lz4_header_cb,
+	.write_cb = ota_decoded_write_cb,
+};
+
+// Delta and compressed images are always downloaded from the start: the
+// decoder state is not part of the checkpoint, so any stale full-image
+// progress is dropped.
+static int ota_decoder_begin(void) {
+	ota_progress_clear();
+	if (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_DELTA) {
+		return delta_patch_init(&ota_decoder_.delta, &ota_delta_cfg);
+	}
+	return block_lz4_init(&ota_decoder_.lz4, &ota_lz4_cfg);
+}
+
+static int ota_decoder_write(const uint8_t *data, size_t len) {
+	if (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_DELTA) {
+		return delta_patch_write(&ota_decoder_.delta, data, len);
+	}
+	return block_lz4_write(&ota_decoder_.lz4, data, len);
+}
+
+static int ota_decoder_finish(void) {
+	if (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_DELTA) {
+		return delta_patch_finish(&ota_decoder_.delta);
+	}
+	return block_lz4_finish(&ota_decoder_.lz4);
+}
+
+#if !defined(CONFIG_APP_BACKEND_COAP)
+/* IOTEMBSYS: Implement the OTA HTTP download. */
+void http_ota_response_cb(struct http_response *rsp,
+			enum http_final_call final_data,
+			void *user_data)
+{
+	if (rsp->body_frag_start != NULL && rsp->body_frag_len > 0) {
+		if (total_read_size == 0) {
+			ota_start_ms_ = k_uptime_get();
+			LOG_INF("OTA time to first byte: %lld ms", ota_start_ms_ - ota_request_ms_);
+			STATS_SET(ota_stats, ttfb_ms, ota_start_ms_ - ota_request_ms_);
+
+			int err;
+
+			if (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+				err = ota_download_begin(rsp);
+			} else if (ota_http_status_ != 200) {
+				LOG_ERR("Unexpected OTA response status %d", ota_http_status_);
+				err = -EBADMSG;
+			} else {
+				err = ota_decoder_begin();
+			}
+			if (err != 0) {
+				// Aborted below, before this fragment goes anywhere.
+				LOG_ERR("OTA start failed: %d", err);
+				ota_write_err_ = err;
+			}
+		}
+		if (ota_write_err_ == 0 && ota_format_ != OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+			int err = ota_decoder_write(rsp->body_frag_start, rsp->body_frag_len);
+			if (err != 0) {
+				LOG_ERR("OTA image decoding failed: %d", err);
+				ota_write_err_ = err;
+			}
+		} else if (ota_write_err_ == 0 && ota_started_) {
+			ota_pipeline_write(rsp->body_frag_start, rsp->body_frag_len);
+		}
+
+		// Count the read size to make sure it matches the content length header at the end.
+		total_read_size += rsp->body_frag_len;
+		STATS_INCN(ota_stats, bytes, rsp->body_frag_len);
+
+		// Nothing after an error will be written, so stop the transfer
+		// instead of downloading the rest of a rejected image. Shutting the
+		// socket down makes the client's next recv() fail; the descriptor
+		// is only closed once http_client_req() has returned, so it can't
+		// be handed to another thread while the client still reads it.
+		if (ota_write_err_ != 0 && !ota_aborted_) {
+			LOG_WRN("Aborting OTA transfer after %d bytes", total_read_size);
+			ota_aborted_ = true;
+			(void)shutdown(ota_sock_, SHUT_RDWR);
+		}
+	}
+	content_length_ = rsp->content_length;
+}
+
+// Runs a single GET for the rest of the image. Returns 0 once the whole image
+// is in slot1, or a negative error if another attempt is needed.
+static int ota_download_attempt(void) {
+	int sock;
+	const int32_t timeout = 120 * MSEC_PER_SEC;
+	static char range_header[sizeof("Range: bytes=4294967295-\r\n")];
+	static char if_range_header[sizeof("If-Range: \r\n") + OTA_ETAG_MAX_LEN];
+	const char *headers[3] = { NULL };
+	int err;
+
+	total_read_size = 0;
+	total_write_size = 0;
+	content_length_ = 0;
+	ota_http_status_ = 0;
+	ota_etag_[0] = '\0';
+	ota_range_total_ = 0;
+	ota_request_ms_ = k_uptime_get();
+	ota_resume_offset_ = (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_FULL) ?
+			     ota_progress_resume_offset(ota_path_) : 0;
+
+	// Get the IP address of the domain
+	if (ota_lookup_host() != 0) {
+		LOG_ERR("DNS lookup failed");
+		return -EHOSTUNREACH;
+	}
+
+	// Create a socket using parameters that the modem allows.
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		LOG_ERR("Creating socket failed");
+		return -errno;
+	}
+	if (ota_connect(sock) < 0) {
+		LOG_ERR("Connecting to socket failed");
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	ota_sock_ = sock;
+	ota_aborted_ = false;
+	ota_pipeline_reset();
+
+	struct http_request req;
 
 	memset(&req, 0, sizeof(req));
 	memset(recv_buf_, 0, sizeof(recv_buf_));
 
-	req.method = HTTP_GET;
+	// If-Range makes the server send the full image (200) instead of the
+	// range (206) when the file changed since the checkpoint.
+	if (ota_resume_offset_ > 0) {
+		snprintk(range_header, sizeof(range_header), "Range: bytes=%u-\r\n", ota_resume_offset_);
+		snprintk(if_range_header, sizeof(if_range_header), "If-Range: %s\r\n", ota_progress_.etag);
+		headers[0] = range_header;
+		headers[1] = if_range_header;
+	}
+
+	req.method = HTTP_GET;
+	req.url = ota_path_;
+	req.host = ota_host_;
+	req.protocol = "HTTP/1.1";
+	req.optional_headers = headers;
+	req.payload_len = 0;
+	req.payload_cb = NULL;
+	req.http_cb = &ota_http_cb;
+	req.response = http_ota_response_cb;
+	req.recv_buf = recv_buf_;
+	req.recv_buf_len = sizeof(recv_buf_);
+
+	// This request is synchronous and blocks the thread.
+	TRACE_SPAN_BEGIN("http_req", req.method);
+	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
+	TRACE_SPAN_END("http_req", ret);
+
+	// Always drain the pipeline, even on failure, so the writer is idle
+	// before the image area is closed.
+	err = ota_pipeline_finish(ret > 0 && total_read_size == content_length_);
+	if (err == 0 && ota_format_ != OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+		err = ota_decoder_finish();
+	}
+	if (err != 0) {
+		LOG_ERR("Flash write failed: %d", err);
+	}
+
+	LOG_INF("Closing the socket");
+	close(sock);
+	ota_sock_ = -1;
+
+	if (ret <= 0) {
+		LOG_ERR("HTTP request failed: %d", ret);
+		if (err != 0 && err != -ENODATA) {
+			return err;
+		}
+		return ret < 0 ? ret : -EIO;
+	}
+
+	int64_t elapsed_ms = k_uptime_get() - ota_start_ms_;
+
+	LOG_INF("HTTP request sent %d bytes", ret);
+	LOG_INF("Received: %d", total_read_size);
+	if (ota_start_ms_ != 0 && elapsed_ms > 0) {
+		int64_t rate = (int64_t)(total_write_size - ota_resume_offset_) * MSEC_PER_SEC / elapsed_ms;
+
+		LOG_INF("OTA throughput: %lld bytes/s (%d bytes in %lld ms)", rate,
+			total_write_size - ota_resume_offset_, elapsed_ms);
+		STATS_SET(ota_stats, bytes_per_s, rate);
+	}
+
+	if (err != 0) {
+		return err;
+	}
+	if (content_length_ != total_read_size || total_write_size != ota_image_size_) {
+		LOG_ERR("Content length mismatch. Read: %d\tWrote: %d\tExpected: %d", total_read_size, total_write_size, content_length_);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+#if OTA_MAX_CONNECTIONS > 1
+//
+// Parallel OTA download
+//
+enum ota_segment_state {
+	OTA_SEGMENT_PENDING = 0,
+	OTA_SEGMENT_ACTIVE,
+	OTA_SEGMENT_DONE,
+};
+
+/* One connection of a parallel download; fetches one segment at a time. */
+struct ota_worker {
+	struct k_thread thread;
+	struct http_request req;
+	uint8_t recv_buf[MAX_RECV_BUF_LEN];
+	uint8_t page[OTA_WRITE_BUF_SIZE] __aligned(8);
+	size_t page_fill;
+	uint32_t offset;
+	uint32_t end;
+	int err;
+	// Fetching segment 0, which goes through the image check as it arrives.
+	bool check;
+};
+
+K_THREAD_STACK_ARRAY_DEFINE(ota_worker_stacks_, OTA_MAX_CONNECTIONS, OTA_WORKER_STACK_SIZE);
+static struct ota_worker ota_workers_[OTA_MAX_CONNECTIONS];
+
+static uint8_t ota_segments_[OTA_MAX_SEGMENTS];
+static int ota_segment_count_;
+static int ota_segment_failures_;
+static bool ota_abort_;
+static int ota_abort_err_;
+K_MUTEX_DEFINE(ota_segment_lock_);
+K_SEM_DEFINE(ota_segment_done_, 0, OTA_MAX_SEGMENTS);
+
+// Connection permits: a worker holds one while it has a segment in flight.
+// Shrinking the pool takes a free permit or, if none is free, leaves a debt
+// that the next finishing worker pays off instead of returning its permit.
+static struct k_sem ota_conn_permits_;
+static int ota_conn_debt_;
+static uint8_t ota_active_conns_;
+static uint32_t ota_conn_rate_[OTA_MAX_CONNECTIONS + 1];
+
+static void ota_parallel_response_cb(struct http_response *rsp,
+			enum http_final_call final_data,
+			void *user_data);
+
+static void ota_conn_release(void) {
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	if (ota_conn_debt_ > 0) {
+		ota_conn_debt_--;
+	} else {
+		k_sem_give(&ota_conn_permits_);
+	}
+	k_mutex_unlock(&ota_segment_lock_);
+}
+
+static void ota_conn_set_active(uint8_t active) {
+	while (ota_active_conns_ < active) {
+		ota_active_conns_++;
+		ota_conn_release();
+	}
+	while (ota_active_conns_ > active) {
+		ota_active_conns_--;
+		if (k_sem_take(&ota_conn_permits_, K_NO_WAIT) != 0) {
+			k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+			ota_conn_debt_++;
+			k_mutex_unlock(&ota_segment_lock_);
+		}
+	}
+}
+
+// Picks the connection count for the next window from the per-connection
+// rate measured with `active` connections. Latency-bound links keep most of
+// the single-connection rate per connection as connections are added;
+// bandwidth-bound links split it, so extra connections stop paying off.
+static uint8_t ota_conn_adapt(uint8_t active, uint32_t per_conn_rate) {
+	uint32_t aggregate = active * per_conn_rate;
+
+	ota_conn_rate_[active] = per_conn_rate;
+
+	if (active > 1 && aggregate <= (active - 1) * ota_conn_rate_[active - 1]) {
+		return active - 1;
+	}
+	if (active < OTA_MAX_CONNECTIONS &&
+	    (uint64_t)per_conn_rate * 100 >= (uint64_t)ota_conn_rate_[1] * OTA_SCALE_UP_PCT &&
+	    (ota_conn_rate_[active + 1] == 0 ||
+	     (active + 1) * ota_conn_rate_[active + 1] > aggregate)) {
+		return active + 1;
+	}
+	return active;
+}
+
+static int ota_segment_claim(void) {
+	int seg = -1;
+
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	for (int i = 0; i < ota_segment_count_ && !ota_abort_; i++) {
+		if (ota_segments_[i] == OTA_SEGMENT_PENDING) {
+			ota_segments_[i] = OTA_SEGMENT_ACTIVE;
+			seg = i;
+			break;
+		}
+	}
+	k_mutex_unlock(&ota_segment_lock_);
+	return seg;
+}
+
+static void ota_segment_complete(int seg, int err) {
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	if (err == 0) {
+		ota_segments_[seg] = OTA_SEGMENT_DONE;
+	} else {
+		ota_segments_[seg] = OTA_SEGMENT_PENDING;
+		if (err == -ENOTSUP || err == -ESTALE || err == -EBADMSG ||
+		    err == -ENOEXEC || err == -EFBIG ||
+		    ++ota_segment_failures_ >= OTA_MAX_ATTEMPTS) {
+			ota_abort_ = true;
+			ota_abort_err_ = err;
+		}
+	}
+	k_mutex_unlock(&ota_segment_lock_);
+	k_sem_give(&ota_segment_done_);
+}
+
+static bool ota_segment_is_done(uint32_t offset) {
+	bool done;
+
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	done = ota_segments_[offset / OTA_SEGMENT_SIZE] == OTA_SEGMENT_DONE;
+	k_mutex_unlock(&ota_segment_lock_);
+	return done;
+}
+
+static bool ota_segment_aborted(void) {
+	bool aborted;
+
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	aborted = ota_abort_;
+	k_mutex_unlock(&ota_segment_lock_);
+	return aborted;
+}
+
+// Erases the page at the worker's offset and programs whatever is buffered,
+// padded to the flash write block size.
+static int ota_worker_program(struct ota_worker *worker) {
+	size_t len = ROUND_UP(worker->page_fill, flash_area_align(image_area));
+	int err;
+
+	memset(worker->page + worker->page_fill, 0xff, len - worker->page_fill);
+	err = ota_erase(worker->offset, OTA_WRITE_BUF_SIZE);
+	if (err == 0) {
+		uint32_t start = lat_hist_start();
+
+		err = flash_area_write(image_area, worker->offset, worker->page, len);
+		lat_hist_stop(&flash_write_lat_, start);
+	}
+	worker->offset += worker->page_fill;
+	worker->page_fill = 0;
+	return err;
+}
+
+static void ota_parallel_response_cb(struct http_response *rsp,
+			enum http_final_call final_data,
+			void *user_data)
+{
+	struct ota_worker *worker = user_data;
+	const uint8_t *data = rsp->body_frag_start;
+	size_t len = rsp->body_frag_len;
+
+	if (data == NULL || len == 0 || worker->err != 0) {
+		return;
+	}
+
+	if (rsp->http_status_code != 206) {
+		// 200 means the server ignores ranges, 412 that If-Match failed.
+		worker->err = rsp->http_status_code == 200 ? -ENOTSUP :
+			      rsp->http_status_code == 412 ? -ESTALE : -EBADMSG;
+		return;
+	}
+
+	if (worker->offset + worker->page_fill + len > worker->end) {
+		worker->err = -EMSGSIZE;
+		return;
+	}
+	// The header and vector table are checked as soon as they arrive, not
+	// once segment 0 is back from flash.
+	if (worker->check) {
+		int err = image_check_update(&ota_check_, data, len);
+
+		if (err != 0) {
+			LOG_ERR("OTA image rejected: %d", err);
+			worker->err = err;
+			return;
+		}
+	}
+	STATS_INCN(ota_stats, bytes, len);
+
+	while (len > 0) {
+		size_t copy_len = MIN(len, OTA_WRITE_BUF_SIZE - worker->page_fill);
+
+		memcpy(worker->page + worker->page_fill, data, copy_len);
+		worker->page_fill += copy_len;
+		data += copy_len;
+		len -= copy_len;
+
+		if (worker->page_fill == OTA_WRITE_BUF_SIZE) {
+			worker->err = ota_worker_program(worker);
+			if (worker->err != 0) {
+				return;
+			}
+		}
+	}
+}
+
+static int ota_worker_fetch(struct ota_worker *worker, int seg) {
+	const int32_t timeout = 60 * MSEC_PER_SEC;
+	char range_header[sizeof("Range: bytes=4294967295-4294967295\r\n")];
+	char if_match_header[sizeof("If-Match: \r\n") + OTA_ETAG_MAX_LEN];
+	const char *headers[] = { range_header, if_match_header, NULL };
+	int sock;
+	int ret;
+
+	worker->offset = seg * OTA_SEGMENT_SIZE;
+	worker->end = MIN(worker->offset + OTA_SEGMENT_SIZE, ota_image_size_);
+	worker->page_fill = 0;
+	worker->err = 0;
+	worker->check = seg == 0;
+	if (worker->check) {
+		// Starts over if an earlier try at segment 0 failed part way.
+		ota_check_begin(ota_image_size_);
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		return -errno;
+	}
+	if (ota_connect(sock) < 0) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+
+	snprintk(range_header, sizeof(range_header), "Range: bytes=%u-%u\r\n",
+		 worker->offset, worker->end - 1);
+	snprintk(if_match_header, sizeof(if_match_header), "If-Match: %s\r\n",
+		 ota_progress_.etag);
+
+	memset(&worker->req, 0, sizeof(worker->req));
+	worker->req.method = HTTP_GET;
+	worker->req.url = ota_path_;
+	worker->req.host = ota_host_;
+	worker->req.protocol = "HTTP/1.1";
+	worker->req.optional_headers = headers;
+	worker->req.response = ota_parallel_response_cb;
+	worker->req.recv_buf = worker->recv_buf;
+	worker->req.recv_buf_len = sizeof(worker->recv_buf);
+
+	ret = http_client_req(sock, &worker->req, timeout, worker);
+	close(sock);
+
+	if (worker->err == 0 && worker->page_fill > 0 && worker->offset + worker->page_fill == worker->end) {
+		// Only the last segment of the image ends off a page boundary.
+		worker->err = ota_worker_program(worker);
+	}
+	if (worker->err != 0) {
+		return worker->err;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	return worker->offset == worker->end ? 0 : -EAGAIN;
+}
+
+static void ota_worker_thread(void* p1, void* p2, void* p3) {
+	struct ota_worker *worker = p1;
+	int id = (int)(intptr_t)p2;
+
+	while (true) {
+		k_sem_take(&ota_conn_permits_, K_FOREVER);
+
+		int seg = ota_segment_claim();
+		if (seg < 0) {
+			// Let the next parked worker see that there is nothing left.
+			k_sem_give(&ota_conn_permits_);
+			break;
+		}
+
+		int64_t start_ms = k_uptime_get();
+		int err = ota_worker_fetch(worker, seg);
+		int64_t elapsed_ms = MAX(k_uptime_get() - start_ms, 1);
+
+		if (err == 0) {
+			LOG_INF("OTA segment %d on conn %d: %lld bytes/s", seg, id,
+				(int64_t)(worker->end - seg * OTA_SEGMENT_SIZE) * MSEC_PER_SEC / elapsed_ms);
+		} else {
+			LOG_WRN("OTA segment %d on conn %d failed: %d", seg, id, err);
+		}
+
+		ota_segment_complete(seg, err);
+		ota_conn_release();
+	}
+}
+
+// Extends the verified prefix over segments that have completed, in order,
+// by reading them back and folding them into the checkpoint CRC and, past
+// segment 0, the image check.
+static int ota_progress_advance(void) {
+	uint32_t offset = ota_progress_.written.offset;
+
+	while (offset < ota_image_size_ && ota_segment_is_done(offset)) {
+		uint32_t end = MIN(ROUND_DOWN(offset, OTA_SEGMENT_SIZE) + OTA_SEGMENT_SIZE,
+				   ota_image_size_);
+
+		for (uint32_t pos = offset; pos < end; pos += OTA_WRITE_BUF_SIZE) {
+			size_t chunk = MIN(OTA_WRITE_BUF_SIZE, end - pos);
+
+			if (flash_area_read(image_area, pos, ota_bufs_[0], chunk) != 0) {
+				LOG_ERR("Flash area read failed");
+				return -EIO;
+			}
+			ota_progress_.written.crc = crc32_ieee_update(ota_progress_.written.crc,
+								      ota_bufs_[0], chunk);
+			if (pos < OTA_SEGMENT_SIZE) {
+				// Checked by its worker as it arrived.
+				continue;
+			}
+			int err = image_check_update(&ota_check_, ota_bufs_[0], chunk);
+			if (err != 0) {
+				LOG_ERR("OTA image rejected: %d", err);
+				return err;
+			}
+		}
+		offset = end;
+	}
+
+	if (offset != ota_progress_.written.offset) {
+		ota_progress_.written.offset = offset;
+		settings_save_one("ota/written", &ota_progress_.written,
+				  sizeof(ota_progress_.written));
+		ota_checkpoint_offset_ = offset;
+	}
+	return 0;
+}
+
+static void ota_probe_response_cb(struct http_response *rsp,
+			enum http_final_call final_data,
+			void *user_data)
+{
+	content_length_ = rsp->content_length;
+}
+
+// Fetches the image size and ETag with a HEAD request.
+static int ota_probe_image(void) {
+	const int32_t timeout = 30 * MSEC_PER_SEC;
+	struct http_request req;
+	int sock;
+	int ret;
+
+	content_length_ = 0;
+	ota_http_status_ = 0;
+	ota_etag_[0] = '\0';
+
+	if (ota_lookup_host() != 0) {
+		LOG_ERR("DNS lookup failed");
+		return -EHOSTUNREACH;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		return -errno;
+	}
+	if (ota_connect(sock) < 0) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.method = HTTP_HEAD;
 	req.url = ota_path_;
-	req.host = OTA_HOST;
+	req.host = ota_host_;
 	req.protocol = "HTTP/1.1";
-	req.payload_len = 0;
-	req.payload_cb = NULL;
-	req.response = http_ota_response_cb;
+	req.http_cb = &ota_http_cb;
+	req.response = ota_probe_response_cb;
 	req.recv_buf = recv_buf_;
 	req.recv_buf_len = sizeof(recv_buf_);
 
-	// This request is synchronous and blocks the thread.
-	int ret = http_client_req(sock, &req, timeout, "IPv4 GET");
-	if (ret > 0) {
-		LOG_INF("HTTP request sent %d bytes", ret);
-		LOG_INF("Received: %d", total_read_size);
-		if (content_length_ != total_read_size || total_write_size != total_read_size) {
-			LOG_ERR("Content length mismatch. Read: %d\tWrote: %d\tExpected: %d", total_read_size, total_write_size, content_length_);
+	ret = http_client_req(sock, &req, timeout, "IPv4 HEAD");
+	close(sock);
+	if (ret < 0) {
+		return ret;
+	}
+	if (ota_http_status_ != 200) {
+		LOG_ERR("Unexpected OTA response status %d", ota_http_status_);
+		return -EBADMSG;
+	}
+	if (ota_etag_[0] == '\0') {
+		// Without an ETag the segments can't be tied to one version of the file.
+		return -ENOTSUP;
+	}
+
+	ota_image_size_ = content_length_;
+	return 0;
+}
+
+// Downloads the image as independent ranged GETs over several sockets. The
+// number of connections starts at one and follows ota_conn_adapt().
+static int ota_parallel_download(void) {
+	int err;
+	uint32_t resume = 0;
+	uint32_t window_bytes = 0;
+	int window_segments = 0;
+	int64_t window_start_ms;
+
+	err = ota_probe_image();
+	if (err != 0) {
+		return err;
+	}
+
+	if (ota_image_size_ == 0 || ota_image_size_ > image_area->fa_size - OTA_SLOT_TRAILER_SIZE) {
+		LOG_ERR("Invalid OTA image size %u", ota_image_size_);
+		return -EFBIG;
+	}
+
+	if (ota_progress_.image_size == ota_image_size_ &&
+	    strcmp(ota_progress_.etag, ota_etag_) == 0) {
+		resume = ota_progress_resume_offset(ota_path_);
+	}
+	if (resume == 0) {
+		ota_check_begin(ota_image_size_);
+		ota_progress_begin(ota_path_, ota_etag_, ota_image_size_);
+		err = ota_erase(image_area->fa_size - OTA_SLOT_TRAILER_SIZE, OTA_SLOT_TRAILER_SIZE);
+		if (err != 0) {
+			return err;
+		}
+	}
+	LOG_INF("Parallel OTA of %u bytes from offset %u", ota_image_size_, resume);
+
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	ota_segment_count_ = DIV_ROUND_UP(ota_image_size_, OTA_SEGMENT_SIZE);
+	for (int i = 0; i < ota_segment_count_; i++) {
+		ota_segments_[i] = (i + 1) * OTA_SEGMENT_SIZE <= resume ?
+				   OTA_SEGMENT_DONE : OTA_SEGMENT_PENDING;
+	}
+	ota_segment_failures_ = 0;
+	ota_abort_ = false;
+	ota_abort_err_ = 0;
+	ota_conn_debt_ = 0;
+	k_mutex_unlock(&ota_segment_lock_);
+	ota_active_conns_ = 1;
+	memset(ota_conn_rate_, 0, sizeof(ota_conn_rate_));
+	k_sem_init(&ota_conn_permits_, 1, OTA_MAX_CONNECTIONS);
+	k_sem_reset(&ota_segment_done_);
+
+	ota_start_ms_ = k_uptime_get();
+	window_start_ms = ota_start_ms_;
+
+	for (int i = 0; i < OTA_MAX_CONNECTIONS; i++) {
+		k_thread_create(&ota_workers_[i].thread, ota_worker_stacks_[i],
+				K_THREAD_STACK_SIZEOF(ota_worker_stacks_[i]),
+				ota_worker_thread, &ota_workers_[i], (void *)(intptr_t)i, NULL,
+				OTA_WRITER_PRIORITY, 0, K_NO_WAIT);
+	}
+
+	while (ota_progress_.written.offset < ota_image_size_ && !ota_segment_aborted()) {
+		uint32_t before = ota_progress_.written.offset;
+
+		k_sem_take(&ota_segment_done_, K_FOREVER);
+		err = ota_progress_advance();
+		if (err != 0) {
+			k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+			ota_abort_err_ = err;
+			k_mutex_unlock(&ota_segment_lock_);
+			break;
+		}
+
+		window_bytes += ota_progress_.written.offset - before;
+		window_segments++;
+		if (window_segments >= ota_active_conns_ && window_bytes > 0) {
+			int64_t elapsed_ms = MAX(k_uptime_get() - window_start_ms, 1);
+			uint32_t per_conn = window_bytes * MSEC_PER_SEC / elapsed_ms / ota_active_conns_;
+			uint8_t active = ota_conn_adapt(ota_active_conns_, per_conn);
+
+			LOG_INF("OTA: %d connection(s), %u bytes/s each", ota_active_conns_, per_conn);
+			ota_conn_set_active(active);
+			window_bytes = 0;
+			window_segments = 0;
+			window_start_ms = k_uptime_get();
+		}
+	}
+
+	// Wake any parked workers so they can see there is nothing left to do.
+	k_mutex_lock(&ota_segment_lock_, K_FOREVER);
+	ota_abort_ = ota_abort_ || ota_progress_.written.offset < ota_image_size_;
+	k_mutex_unlock(&ota_segment_lock_);
+	k_sem_give(&ota_conn_permits_);
+	for (int i = 0; i < OTA_MAX_CONNECTIONS; i++) {
+		k_thread_join(&ota_workers_[i].thread, K_FOREVER);
+	}
+
+	total_write_size = ota_progress_.written.offset;
+	if (total_write_size != ota_image_size_) {
+		return ota_abort_err_ ? ota_abort_err_ : -EAGAIN;
+	}
+
+	int64_t elapsed_ms = MAX(k_uptime_get() - ota_start_ms_, 1);
+	int64_t rate = (int64_t)(total_write_size - resume) * MSEC_PER_SEC / elapsed_ms;
+
+	LOG_INF("OTA throughput: %lld bytes/s (%u bytes in %lld ms)", rate,
+		total_write_size - resume, elapsed_ms);
+	STATS_SET(ota_stats, bytes_per_s, rate);
+	return 0;
+}
+#endif // OTA_MAX_CONNECTIONS > 1
+#endif // !CONFIG_APP_BACKEND_COAP
+
+/* IOTEMBSYS: Implement the HTTP OTA task */
+#if defined(CONFIG_APP_BACKEND_COAP)
+//
+// CoAP OTA download
+//
+// The image comes from the CoAP backend in Block2 blocks, fetched in order
+// on the backend socket and fed to the same pipeline and decoders as an
+// HTTP download. The first request asks for Size2 to learn the image size.
+// The server's ETag plays the part of the HTTP one, so a checkpoint is only
+// resumed against the same image; resuming just starts at a later block.
+
+// Handles the first block of a download.
+static int ota_coap_begin(const struct coap_packet *rsp, uint32_t size) {
+	struct coap_option etag;
+
+	ota_start_ms_ = k_uptime_get();
+	LOG_INF("OTA time to first byte: %lld ms", ota_start_ms_ - ota_request_ms_);
+	STATS_SET(ota_stats, ttfb_ms, ota_start_ms_ - ota_request_ms_);
+
+	if (size == 0) {
+		LOG_ERR("OTA server sent no image size");
+		return -EBADMSG;
+	}
+	content_length_ = size - ota_resume_offset_;
+	if (coap_find_options(rsp, COAP_OPTION_ETAG, &etag, 1) == 1) {
+		bin2hex(etag.value, etag.len, ota_etag_, sizeof(ota_etag_));
+	}
+
+	if (ota_format_ != OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+		return ota_decoder_begin();
+	}
+
+	ota_image_size_ = size;
+	if (ota_resume_offset_ > 0) {
+		if (size != ota_progress_.image_size || strcmp(ota_etag_, ota_progress_.etag) != 0) {
+			return -ESTALE;
 		}
-		k_msleep(1000);
+		LOG_INF("Resuming OTA at %u / %u", ota_resume_offset_, ota_image_size_);
 	} else {
-		LOG_ERR("HTTP request failed: %d", ret);
-		k_msleep(1000);
+		ota_progress_begin(ota_path_, ota_etag_, ota_image_size_);
 	}
+	return ota_pipeline_start(ota_image_size_, ota_resume_offset_);
+}
+
+static void ota_coap_block(const uint8_t *data, size_t len) {
+	if (ota_format_ != OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+		if (ota_write_err_ == 0) {
+			int err = ota_decoder_write(data, len);
+			if (err != 0) {
+				LOG_ERR("OTA image decoding failed: %d", err);
+				ota_write_err_ = err;
+			}
+		}
+	} else if (ota_started_) {
+		ota_pipeline_write(data, len);
+	}
+
+	total_read_size += len;
+	STATS_INCN(ota_stats, bytes, len);
+}
+
+// Fetches the rest of the image. Returns 0 once the whole image is in
+// slot1, or a negative error if another attempt is needed.
+static int ota_coap_download_attempt(void) {
+	struct coap_block_context blk;
+	bool first = true;
+	bool more = true;
+	int err = 0;
+
+	total_read_size = 0;
+	total_write_size = 0;
+	content_length_ = 0;
+	ota_etag_[0] = '\0';
+	ota_start_ms_ = 0;
+	ota_request_ms_ = k_uptime_get();
+	ota_resume_offset_ = (ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_FULL) ?
+			     ota_progress_resume_offset(ota_path_) : 0;
+	ota_pipeline_reset();
+
+	coap_block_transfer_init(&blk, COAP_BLOCK_SIZE, 0);
+	blk.current = ota_resume_offset_;
+
+	while (more && err == 0 && ota_write_err_ == 0) {
+		struct coap_packet req;
+		struct coap_packet rsp;
+		const uint8_t *payload;
+		uint16_t len;
+
+		err = coap_request_init(&req, COAP_METHOD_GET, ota_path_);
+		if (err == 0) {
+			err = coap_append_block2_option(&req, &blk);
+		}
+		if (err == 0 && first) {
+			// Size2 of 0 asks the server for the total size.
+			err = coap_append_size2_option(&req, &blk);
+		}
+		if (err == 0) {
+			err = coap_exchange(&req, &rsp);
+		}
+		if (err != 0) {
+			break;
+		}
+		if (!coap_is_success(&rsp) || coap_update_from_block(&rsp, &blk) != 0) {
+			LOG_ERR("Unexpected OTA block response %u", coap_header_get_code(&rsp));
+			err = -EBADMSG;
+			break;
+		}
+
+		payload = coap_packet_get_payload(&rsp, &len);
+		if (first) {
+			first = false;
+			err = ota_coap_begin(&rsp, blk.total_size);
+			if (err != 0) {
+				break;
+			}
+		}
+		if (payload != NULL && len > 0) {
+			ota_coap_block(payload, len);
+		}
+		more = coap_next_block(&rsp, &blk) != 0;
+	}
+
+	bool complete = err == 0 && !more && total_read_size == content_length_;
+	int write_err = ota_pipeline_finish(complete);
+
+	if (write_err == 0 && ota_format_ != OTAImageFormat_OTA_IMAGE_FORMAT_FULL) {
+		write_err = ota_decoder_finish();
+	}
+	if (write_err != 0 && write_err != -ENODATA) {
+		LOG_ERR("Flash write failed: %d", write_err);
+		return write_err;
+	}
+	if (err != 0) {
+		LOG_ERR("CoAP OTA transfer failed: %d", err);
+		return err;
+	}
+	if (write_err != 0) {
+		return write_err;
+	}
+
+	int64_t elapsed_ms = k_uptime_get() - ota_start_ms_;
+
+	if (ota_start_ms_ != 0 && elapsed_ms > 0) {
+		int64_t rate = (int64_t)(total_write_size - ota_resume_offset_) * MSEC_PER_SEC / elapsed_ms;
+
+		LOG_INF("OTA throughput: %lld bytes/s (%d bytes in %lld ms)", rate,
+			total_write_size - ota_resume_offset_, elapsed_ms);
+		STATS_SET(ota_stats, bytes_per_s, rate);
+	}
+	if (!complete || total_write_size != ota_image_size_) {
+		LOG_ERR("OTA size mismatch. Read: %d\tWrote: %d\tExpected: %d",
+			total_read_size, total_write_size, content_length_);
+		return -EAGAIN;
+	}
+	return 0;
+}
+#endif // CONFIG_APP_BACKEND_COAP
+
+static int ota_download(bool parallel) {
+#if defined(CONFIG_APP_BACKEND_COAP)
+	// Block2 transfers are fetched in order, so there is nothing to split.
+	ARG_UNUSED(parallel);
+	return ota_coap_download_attempt();
+#elif OTA_MAX_CONNECTIONS > 1
+	return parallel ? ota_parallel_download() : ota_download_attempt();
+#else
+	ARG_UNUSED(parallel);
+	return ota_download_attempt();
+#endif
+}
+
+static void http_ota_request() {
+	int err;
+	uint32_t qird_start = ota_qird_cmds();
+
+	LOG_INF("Starting OTA...");
+	STATS_SET(ota_stats, bytes, 0);
+	STATS_SET(ota_stats, erase_ms, 0);
+
+	// Slot1 is erased lazily by the writer once the image size is known.
+	err = flash_area_open(SLOT1_PARTITION_ID, &image_area);
+	if (err != 0) {
+		LOG_ERR("Flash area open failed");
+		return;
+	}
+	err = flash_area_open(SLOT0_PARTITION_ID, &base_area);
+	if (err != 0) {
+		LOG_ERR("Flash area open failed");
+		flash_area_close(image_area);
+		return;
+	}
+
+	// Patches and compressed images have to be decoded in order, so only
+	// full images are split across connections.
+	bool parallel = OTA_MAX_CONNECTIONS > 1 &&
+			ota_format_ == OTAImageFormat_OTA_IMAGE_FORMAT_FULL;
+
+	for (int attempt = 1; attempt <= OTA_MAX_ATTEMPTS; attempt++) {
+		STATS_INC(ota_stats, attempts);
+		if (attempt > 1) {
+			STATS_INC(ota_stats, retries);
+		}
+		err = ota_download(parallel);
+		if (err == 0 || err == -EFBIG || err == -EBADMSG || err == -ENOEXEC) {
+			break;
+		}
+		if (err == -ENOTSUP) {
+			LOG_WRN("Server can't serve ranges; using a single connection");
+			parallel = false;
+		} else if (err == -ESTALE) {
+			LOG_WRN("OTA image changed during download; starting over");
+			ota_progress_clear();
+		}
+
+		LOG_WRN("OTA attempt %d/%d failed (%d); %u bytes kept", attempt,
+			OTA_MAX_ATTEMPTS, err, ota_progress_.written.offset);
+		k_msleep(OTA_RETRY_DELAY_MS);
+	}
+
+	if (err == 0) {
+		err = image_check_finish(&ota_check_);
+		if (err != 0) {
+			// Erase the header so the image can never be marked for test.
+			LOG_ERR("OTA image verification failed: %d", err);
+			ota_erase(0, OTA_WRITE_BUF_SIZE);
+			ota_progress_clear();
+		}
+	}
+
+	if (err == 0) {
+		LOG_INF("OTA download complete and verified: %u bytes", ota_image_size_);
+		ota_progress_clear();
+	} else {
+		LOG_ERR("OTA download failed: %d", err);
+		STATS_INC(ota_stats, failures);
+	}
+	STATS_SET(ota_stats, qird_cmds, ota_qird_cmds() - qird_start);
 
-	LOG_INF("Closing the socket");
-	close(sock);
 	LOG_INF("Close image area");
+	flash_area_close(base_area);
 	flash_area_close(image_area);
 }
 
+// Backend exchanges are traced stage by stage, from the button press or
+// upload scheduler that asked for them to the decoded response; the DNS,
+// socket and decode stages are marked where they happen. Each finished
+// trace is logged as one line, which goes out over RTT with rtt.conf.
+static void backend_trace_end(int result) {
+	// Only used on the HTTP thread.
+	static struct req_trace trace;
+	static char line[192];
+
+	if (req_trace_end(result) && req_trace_last(&trace) == 0) {
+		req_trace_format(&trace, line, sizeof(line));
+		LOG_INF("Trace %s", line);
+	}
+}
+
+static int cmd_trace(const struct shell *sh, size_t argc, char **argv) {
+	static struct req_trace trace;
+	static char line[192];
+
+	if (req_trace_last(&trace) != 0) {
+		shell_error(sh, "No request traced yet");
+		return -ENODATA;
+	}
+	req_trace_format(&trace, line, sizeof(line));
+	shell_print(sh, "%s", line);
+	return 0;
+}
+
+SHELL_CMD_REGISTER(trace, NULL, "Show the stages of the last backend exchange", cmd_trace);
+
 // This thread is responsible for making all HTTP requests in the app.
 // This enforces simplicity, and prevents requests from stepping on one another.
 void http_client_thread(void* p1, void* p2, void* p3) {
@@ -832,24 +4588,42 @@ void http_client_thread(void* p1, void* p2, void* p3) {
 		uint32_t  events;
 
 		LOG_INF("Waiting for button");
-		events = k_event_wait(&unblock_sender_, 0xFFF, true, K_FOREVER);
+		// Clear only what is handled here; anything posted while a request
+		// runs stays set for the next pass.
+		events = k_event_wait(&unblock_sender_, 0xFFF, false, K_FOREVER);
 		if (events == 0) {
 			printk("This should not be happening!");
 			continue;
 		}
+		k_event_clear(&unblock_sender_, events);
 
 		// Multiple button events are possible, so handle all without exclusion.
 		if (events & (1 << BUTTON_ACTION_GENERIC_HTTP)) {
 			generic_http_request();
 		}
+#if defined(CONFIG_APP_BACKEND_MQTT)
+		if ((events & (1 << BUTTON_ACTION_OTA_PUSH)) && mqtt_take_ota_push()) {
+			events |= (1 << BUTTON_ACTION_OTA_DOWNLOAD);
+		}
+#endif
 		if (events & (1 << BUTTON_ACTION_OTA_DOWNLOAD)) {
 			http_ota_request();
 		}
 		if (events & (1 << BUTTON_ACTION_PROTO_REQ)) {
-			backend_http_request();
+			req_trace_begin("telemetry");
+			backend_trace_end(backend_http_request());
 		}
 		if (events & (1 << BUTTON_ACTION_GET_OTA_PATH)) {
-			backend_ota_http_request();
+			req_trace_begin("ota_query");
+#if defined(CONFIG_APP_BACKEND_LINK)
+			backend_trace_end(backend_ota_link_request());
+#elif defined(CONFIG_APP_BACKEND_COAP)
+			backend_trace_end(backend_ota_coap_request());
+#elif defined(CONFIG_APP_BACKEND_MQTT)
+			backend_trace_end(backend_ota_mqtt_request());
+#else
+			backend_trace_end(backend_ota_http_request());
+#endif
 		}
 	}
 }
@@ -889,6 +4663,7 @@ void main(void)
 	/* IOTEMBSYS: Initialize settings subsystem. */
 	settings_subsys_init();
     settings_register(&my_conf);
+    settings_register(&ota_conf);
     settings_load();
 
 	/* IOTEMBSYS: Initialize stats subsystem. */
@@ -897,6 +4672,24 @@ void main(void)
 	if (ret < 0) {
 		return;
 	}
+	ret = STATS_INIT_AND_REG(ota_stats, STATS_SIZE_32, "ota_stats");
+	if (ret < 0) {
+		return;
+	}
+	(void)lat_hist_register(&http_lat_, "app_http");
+	(void)lat_hist_register(&flash_write_lat_, "app_flash_write");
+
+	ret = upload_init();
+	if (ret < 0) {
+		LOG_ERR("Upload scheduler init failed: %d", ret);
+		return;
+	}
+
+	ret = telemetry_init();
+	if (ret == 0) {
+		telemetry_ready_ = true;
+		k_work_schedule(&telemetry_sample_work_, K_SECONDS(telemetry_interval_s_));
+	}
 
 	/* IOTEMBSYS: Increment boot count. */
 	boot_count++;
@@ -905,26 +4698,23 @@ void main(void)
     LOG_INF("boot_count: %d\n", boot_count);
 	LOG_INF("Version: 1.1");
 	/* IOTEMBSYS: Configure joystick GPIOs. */
-	init_joystick_gpio(&sw0, &button_cb_data_0);
-	init_joystick_gpio(&sw1, &button_cb_data_1);
-	init_joystick_gpio(&sw2, &button_cb_data_2);
-	init_joystick_gpio(&sw3, &button_cb_data_3);
-	init_joystick_gpio(&sw4, &button_cb_data_4);
+	timing_init();
+	timing_start();
+	for (size_t i = 0; i < ARRAY_SIZE(buttons_); i++) {
+		init_joystick_gpio(&buttons_[i]);
+	}
 
 	modem = DEVICE_DT_GET(DT_NODELABEL(quectel_bg96));
 	if (!device_is_ready(modem)) {
 		LOG_ERR("Modem is not ready");
 		return;
 	}
+	// The modem driver attaches during init, so DNS works from here on.
+	k_work_submit(&endpoint_prefetch_work_);
 
 	LOG_INF("Running blinky");
-	while (1) {
-		ret = gpio_pin_toggle_dt(&led);
-		/* IOTEMBSYS: Print GPIO state to console. */
-		if (ret < 0) {
-			return;
-		}
-		STATS_INC(app_stats, ticks);
-		k_msleep(blink_interval_);
-	}
+	k_timer_start(&led_timer_, K_MSEC(blink_interval_), K_MSEC(blink_interval_));
+
+	// Everything from here on is driven by timers, work items and the
+	// worker threads, so the main thread is done.
 }
\ No newline at end of file
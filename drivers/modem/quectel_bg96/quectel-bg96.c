@@ -9,14 +9,135 @@
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(modem_quectel_bg96, CONFIG_MODEM_LOG_LEVEL);
 
+#include <zephyr/pm/policy.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/stats/stats.h>
+
+#include <lat_hist/lat_hist.h>
+#include <quectel_bg96/quectel_bg96.h>
+#include <req_trace/req_trace.h>
+#include <trace_point/trace_point.h>
+
 #include "quectel-bg96.h"
 
+BUILD_ASSERT(QUECTEL_BG96_MAX_DATAGRAM == MDM_MAX_DATA_LENGTH,
+	     "the public datagram limit must match AT+QISEND");
+
 static struct k_thread	       modem_rx_thread;
 static struct k_work_q	       modem_workq;
+static struct k_spinlock       rssi_lock;
 static struct modem_data       mdata;
 static struct modem_context    mctx;
 static const struct socket_op_vtable offload_socket_fd_op_vtable;
 
+/* AT+QIRD round trips, readable as the "bg96" stats group. */
+STATS_SECT_START(bg96_stats)
+STATS_SECT_ENTRY(qird_cmds)
+STATS_SECT_ENTRY(qird_waits)
+STATS_SECT_ENTRY(qird_ms)
+/* Wake-ups from sleep, and how many of them had to leave PSM. */
+STATS_SECT_ENTRY(wakes)
+STATS_SECT_ENTRY(psm_wakes)
+/* From asserting DTR to the first reply, for the last and slowest wake. */
+STATS_SECT_ENTRY(wake_ms)
+STATS_SECT_ENTRY(wake_max_ms)
+/* Boots that found the modem already running and skipped the power key. */
+STATS_SECT_ENTRY(warm_boots)
+/* Lost links, which recovery tier brought each back, and how long the
+ * successful tier took last time. link_down_ms is the last whole outage.
+ */
+STATS_SECT_ENTRY(link_losses)
+STATS_SECT_ENTRY(pdp_recoveries)
+STATS_SECT_ENTRY(attach_recoveries)
+STATS_SECT_ENTRY(power_recoveries)
+STATS_SECT_ENTRY(recovery_failures)
+STATS_SECT_ENTRY(pdp_recovery_ms)
+STATS_SECT_ENTRY(attach_recovery_ms)
+STATS_SECT_ENTRY(power_recovery_ms)
+STATS_SECT_ENTRY(link_down_ms)
+/* From modem_setup() to registered, whether the attach started on the
+ * cached band, and whether that timed out into a full scan.
+ */
+STATS_SECT_ENTRY(attach_ms)
+STATS_SECT_ENTRY(attach_cached)
+STATS_SECT_ENTRY(attach_fallbacks)
+STATS_SECT_END;
+
+STATS_NAME_START(bg96_stats)
+STATS_NAME(bg96_stats, qird_cmds)
+STATS_NAME(bg96_stats, qird_waits)
+STATS_NAME(bg96_stats, qird_ms)
+STATS_NAME(bg96_stats, wakes)
+STATS_NAME(bg96_stats, psm_wakes)
+STATS_NAME(bg96_stats, wake_ms)
+STATS_NAME(bg96_stats, wake_max_ms)
+STATS_NAME(bg96_stats, warm_boots)
+STATS_NAME(bg96_stats, link_losses)
+STATS_NAME(bg96_stats, pdp_recoveries)
+STATS_NAME(bg96_stats, attach_recoveries)
+STATS_NAME(bg96_stats, power_recoveries)
+STATS_NAME(bg96_stats, recovery_failures)
+STATS_NAME(bg96_stats, pdp_recovery_ms)
+STATS_NAME(bg96_stats, attach_recovery_ms)
+STATS_NAME(bg96_stats, power_recovery_ms)
+STATS_NAME(bg96_stats, link_down_ms)
+STATS_NAME(bg96_stats, attach_ms)
+STATS_NAME(bg96_stats, attach_cached)
+STATS_NAME(bg96_stats, attach_fallbacks)
+STATS_NAME_END(bg96_stats);
+
+static STATS_SECT_DECL(bg96_stats) bg96_stats;
+
+/* Latency histograms, readable as the "bg96_at", "bg96_connect",
+ * "bg96_send" and "bg96_recv" stats groups. Socket calls count only when
+ * they succeed, and recv leaves out the wait for data to arrive.
+ */
+static struct stats_lat_hist at_lat_;
+static struct stats_lat_hist connect_lat_;
+static struct stats_lat_hist send_lat_;
+static struct stats_lat_hist recv_lat_;
+
+/* Func: at_cmd_tag
+ * Desc: Packs up to four characters of the command name after "AT+" into a
+ * trace point argument, so "AT+QIRD=0,1024" is traced as "QIRD".
+ */
+static uint32_t at_cmd_tag(const uint8_t *buf)
+{
+	uint32_t tag = 0;
+
+	if (strncmp((const char *)buf, "AT", 2) == 0) {
+		buf += 2;
+	}
+	if (*buf == '+') {
+		buf++;
+	}
+	for (int i = 0; i < 4 && isalnum(buf[i]); i++) {
+		tag |= (uint32_t)buf[i] << (8 * i);
+	}
+	return tag;
+}
+
+/* Func: modem_at_send
+ * Desc: Sends one AT command and waits for its final result, like
+ * modem_cmd_send(), and records the round trip in at_lat_.
+ */
+static int modem_at_send(const struct modem_cmd *handler_cmds,
+			 size_t handler_cmds_len, const uint8_t *buf,
+			 struct k_sem *sem, k_timeout_t timeout)
+{
+	uint32_t start = lat_hist_start();
+	int ret;
+
+	TRACE_SPAN_BEGIN("bg96_cmd", at_cmd_tag(buf));
+	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
+			     handler_cmds, handler_cmds_len, buf, sem,
+			     timeout);
+	TRACE_SPAN_END("bg96_cmd", ret);
+
+	lat_hist_stop(&at_lat_, start);
+	return ret;
+}
+
 #if defined(CONFIG_DNS_RESOLVER)
 static struct zsock_addrinfo result;
 static struct sockaddr result_addr;
@@ -26,6 +147,11 @@ static char result_canonname[DNS_MAX_NAME_SIZE + 1];
 
 static K_KERNEL_STACK_DEFINE(modem_rx_stack, CONFIG_MODEM_QUECTEL_BG96_RX_STACK_SIZE);
 static K_KERNEL_STACK_DEFINE(modem_workq_stack, CONFIG_MODEM_QUECTEL_BG96_RX_WORKQ_STACK_SIZE);
+/* Named so that per-thread stats can tell the modem threads apart. */
+static const struct k_work_queue_config modem_workq_cfg = {
+	.name = "modem_workq",
+};
+
 NET_BUF_POOL_DEFINE(mdm_recv_pool, MDM_RECV_MAX_BUF, MDM_RECV_BUF_SIZE, 0, NULL);
 
 static const struct gpio_dt_spec power_gpio = GPIO_DT_SPEC_INST_GET(0, mdm_power_gpios);
@@ -234,9 +360,8 @@ static void socket_close(struct modem_socket *sock)
 	snprintk(buf, sizeof(buf), "AT+QICLOSE=%d", sock->id);
 
 	/* Tell the modem to close the socket. */
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     NULL, 0U, buf,
-			     &mdata.sem_response, MDM_CMD_TIMEOUT);
+	ret = modem_at_send(NULL, 0U, buf, &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
 	if (ret < 0) {
 		LOG_ERR("%s ret:%d", buf, ret);
 	}
@@ -297,15 +422,43 @@ MODEM_CMD_DEFINE(on_cmd_atcmdinfo_rssi_csq)
 		mdata.mdm_rssi = -1000;
 	}
 
-	LOG_INF("RSSI: %d", mdata.mdm_rssi);
+	if (mdata.mdm_rssi > -1000) {
+		k_spinlock_key_t key = k_spin_lock(&rssi_lock);
+
+		mdata.mdm_rssi_last = mdata.mdm_rssi;
+		mdata.mdm_rssi_last_ms = k_uptime_get_32();
+		k_spin_unlock(&rssi_lock, key);
+	}
+
+	LOG_DBG("RSSI: %d", mdata.mdm_rssi);
 	return 0;
 }
 
+/* Func: quectel_bg96_rssi_get
+ * Desc: Returns the last valid RSSI and when it was measured. Unlike
+ * mdm_rssi it is not reset while the modem sleeps.
+ */
+int quectel_bg96_rssi_get(int16_t *rssi_dbm, uint32_t *measured_ms)
+{
+	k_spinlock_key_t key = k_spin_lock(&rssi_lock);
+	int ret = -ENODATA;
+
+	if (mdata.mdm_rssi_last_ms != 0) {
+		*rssi_dbm = mdata.mdm_rssi_last;
+		*measured_ms = mdata.mdm_rssi_last_ms;
+		ret = 0;
+	}
+
+	k_spin_unlock(&rssi_lock, key);
+	return ret;
+}
+
 /* Handler: +QIOPEN: <connect_id>[0], <err>[1] */
 MODEM_CMD_DEFINE(on_cmd_atcmdinfo_sockopen)
 {
 	int err = ATOI(argv[1], 0, "sock_err");
 
+	TRACE_POINT("bg96_urc_open", err);
 	LOG_INF("AT+QIOPEN: %d", err);
 	modem_cmd_handler_set_error(data, err);
 	k_sem_give(&mdata.sem_sock_conn);
@@ -418,16 +571,35 @@ typedef enum {
 // TODO: move to modem data struct
 static bool registered_;
 
-// Note: this was added by course instructors, and is does not decode
-// all CEREG payloads.
+/* Cleared when a URC reports a lost link, set again once it is recovered;
+ * see "Connection manager".
+ */
+static bool link_up_;
+static void link_lost(k_timeout_t delay);
+static void link_registered(void);
+
+/* Grace period for the modem to re-register on its own. */
+#define MDM_LINK_LOSS_GRACE	K_SECONDS(10)
+
+/* Handler: +CEREG: [<n>,]<stat>
+ * Both the AT+CEREG? response and the AT+CEREG=1 URC, which has no <n>,
+ * end up here; the response cmds come before any handler cmds.
+ */
 MODEM_CMD_DEFINE(on_cmd_registration_status)
 {
-	int status = ATOI(argv[1], 0, "cereg");
+	bool was_registered = registered_;
+	int status = ATOI(argv[argc == 1 ? 0 : 1], 0, "cereg");
 
 	LOG_INF("AT+CEREG: %d", status);
 
 	registered_ = (status == BG9X_CEREG_STATUS_REGISTERED_HOME || status == BG9X_CEREG_STATUS_REGISTERED_ROAMING);
-	k_sem_give(&mdata.sem_sock_conn);
+	if (argc == 1) {
+		if (was_registered && !registered_) {
+			link_lost(MDM_LINK_LOSS_GRACE);
+		} else if (!was_registered && registered_) {
+			link_registered();
+		}
+	}
 	return 0;
 }
 
@@ -481,6 +653,7 @@ MODEM_CMD_DEFINE(on_cmd_unsol_recv)
 	int		sock_fd;
 
 	sock_fd = ATOI(argv[0], 0, "sock_fd");
+	TRACE_POINT("bg96_urc_recv", sock_fd);
 
 	/* Socket pointer from FD. */
 	sock = modem_socket_from_fd(&mdata.socket_config, sock_fd);
@@ -510,6 +683,7 @@ MODEM_CMD_DEFINE(on_cmd_unsol_close)
 	int		     sock_fd;
 
 	sock_fd = ATOI(argv[0], 0, "sock_fd");
+	TRACE_POINT("bg96_urc_closed", sock_fd);
 	sock	= modem_socket_from_fd(&mdata.socket_config, sock_fd);
 	if (!sock) {
 		return 0;
@@ -523,6 +697,17 @@ MODEM_CMD_DEFINE(on_cmd_unsol_close)
 	return 0;
 }
 
+/* Handler: +QIURC: "pdpdeact",<contextID>
+ * The network dropped the PDP context, and with it every socket.
+ */
+MODEM_CMD_DEFINE(on_cmd_unsol_pdpdeact)
+{
+	TRACE_POINT("bg96_urc_pdpdeact", 0);
+	LOG_WRN("PDP context %s deactivated", argv[0]);
+	link_lost(K_NO_WAIT);
+	return 0;
+}
+
 /* Handler: Modem initialization ready. */
 MODEM_CMD_DEFINE(on_cmd_unsol_rdy)
 {
@@ -553,6 +738,231 @@ MODEM_CMD_DEFINE(on_cmd_dns)
 }
 #endif
 
+/* The UART stops in the STM32 stop modes and cannot wake the MCU, so stop
+ * modes are only allowed while the modem has nothing to send: in PSM, or
+ * asleep with DTR released.
+ */
+static bool modem_pm_held_;
+
+static void modem_pm_hold(bool hold)
+{
+	if (hold == modem_pm_held_) {
+		return;
+	}
+	modem_pm_held_ = hold;
+	if (hold) {
+		pm_policy_state_lock_get(PM_STATE_SUSPEND_TO_IDLE, PM_ALL_SUBSTATES);
+	} else {
+		pm_policy_state_lock_put(PM_STATE_SUSPEND_TO_IDLE, PM_ALL_SUBSTATES);
+	}
+}
+
+/*
+ * Power saving
+ *
+ * With CONFIG_MODEM_QUECTEL_BG96_SLEEP the modem sleeps whenever no socket
+ * is open and no DNS query runs: AT+QSCLK=1 lets it sleep once DTR is
+ * released. Users call modem_wake() first and modem_release() when done.
+ * Registration and the PDP context survive sleep, so modem_wake() only
+ * asserts DTR and waits for the UART to answer. If the modem went into PSM
+ * meanwhile it does not answer; PWRKEY then takes it out of PSM, and
+ * modem_resume() checks registration and the PDP context instead of
+ * running modem_setup() again.
+ */
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+BUILD_ASSERT(DT_INST_NODE_HAS_PROP(0, mdm_dtr_gpios),
+	     "CONFIG_MODEM_QUECTEL_BG96_SLEEP needs mdm-dtr-gpios");
+#endif
+
+#define MDM_PROBE_TIMEOUT	K_MSEC(300)
+#define MDM_PROBE_COUNT		3
+/* Long enough to leave PSM, well short of the 650 ms power-off press. */
+#define MDM_PSM_WAKE_PULSE	K_MSEC(200)
+#define MDM_PSM_WAKE_COUNT	20
+#define MDM_RESUME_REG_COUNT	15
+
+static K_MUTEX_DEFINE(modem_pm_mutex);
+static int modem_users_;
+static bool pdp_active_;
+
+static void modem_registration_query_work(void);
+static int modem_pdp_context_activate(void);
+
+/* Handler: +QIACT: <contextID>,<context_state>,<context_type>[,<IP_address>] */
+MODEM_CMD_DEFINE(on_cmd_qiact)
+{
+	if (ATOI(argv[0], 0, "context_id") == 1 && ATOI(argv[1], 0, "context_state") == 1) {
+		pdp_active_ = true;
+	}
+	return 0;
+}
+
+/* Sends AT until the modem answers; returns 0 once it did. */
+static int modem_probe(int attempts)
+{
+	int ret = -ETIMEDOUT;
+
+	while (attempts-- > 0) {
+		ret = modem_at_send(NULL, 0U, "AT", &mdata.sem_response,
+				    MDM_PROBE_TIMEOUT);
+		if (ret == 0) {
+			break;
+		}
+	}
+	return ret;
+}
+
+/* Asks for the state of PDP context 1; returns 1 if it is active. */
+static int modem_pdp_query(void)
+{
+	static const struct modem_cmd cmd =
+		MODEM_CMD_ARGS_MAX("+QIACT: ", on_cmd_qiact, 3U, 4U, ",");
+	int ret;
+
+	pdp_active_ = false;
+	ret = modem_at_send(&cmd, 1U, "AT+QIACT?", &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
+	if (ret < 0) {
+		return ret;
+	}
+	return pdp_active_;
+}
+
+/* Brings a modem that is (or is about to be) attached back into service:
+ * waits up to @p attempts registration queries, then activates the PDP
+ * context unless it survived.
+ */
+static int modem_resume(int attempts)
+{
+	int ret;
+
+	for (int i = 0; i < attempts; i++) {
+		modem_registration_query_work();
+		if (registered_) {
+			break;
+		}
+		k_sleep(MDM_WAIT_FOR_RSSI_DELAY);
+	}
+	if (!registered_) {
+		LOG_WRN("Not registered after resume");
+		return -ENETUNREACH;
+	}
+
+	ret = modem_pdp_query();
+	if (ret == 0) {
+		return modem_pdp_context_activate();
+	}
+	return ret < 0 ? ret : 0;
+}
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+static bool modem_asleep_;
+
+static void modem_sleep_work_handler(struct k_work *work)
+{
+	k_mutex_lock(&modem_pm_mutex, K_FOREVER);
+	if (modem_users_ == 0 && !modem_asleep_) {
+		LOG_DBG("Modem going to sleep");
+		gpio_pin_set_dt(&dtr_gpio, 0);
+		modem_asleep_ = true;
+		modem_pm_hold(false);
+	}
+	k_mutex_unlock(&modem_pm_mutex);
+}
+
+static K_WORK_DELAYABLE_DEFINE(modem_sleep_work, modem_sleep_work_handler);
+
+static int modem_wake_locked(void)
+{
+	int64_t start = k_uptime_get();
+	uint32_t wake_ms;
+	int ret;
+
+	modem_pm_hold(true);
+	gpio_pin_set_dt(&dtr_gpio, 1);
+
+	ret = modem_probe(MDM_PROBE_COUNT);
+#if defined(CONFIG_MODEM_QUECTEL_BG96_PSM)
+	if (ret < 0) {
+		LOG_INF("No answer; waking the modem from PSM");
+		STATS_INC(bg96_stats, psm_wakes);
+		gpio_pin_set_dt(&power_gpio, 1);
+		k_sleep(MDM_PSM_WAKE_PULSE);
+		gpio_pin_set_dt(&power_gpio, 0);
+		ret = modem_probe(MDM_PSM_WAKE_COUNT);
+		if (ret == 0) {
+			ret = modem_resume(MDM_RESUME_REG_COUNT);
+		}
+	}
+#endif
+	if (ret < 0) {
+		LOG_ERR("Modem did not wake up: %d", ret);
+		return ret;
+	}
+
+	modem_asleep_ = false;
+	wake_ms = k_uptime_get() - start;
+	STATS_INC(bg96_stats, wakes);
+	STATS_SET(bg96_stats, wake_ms, wake_ms);
+	if (wake_ms > bg96_stats.wake_max_ms) {
+		STATS_SET(bg96_stats, wake_max_ms, wake_ms);
+	}
+	return 0;
+}
+#endif /* CONFIG_MODEM_QUECTEL_BG96_SLEEP */
+
+/* Keeps the modem awake until the matching modem_release(). */
+static int modem_wake(void)
+{
+	int ret = 0;
+
+	k_mutex_lock(&modem_pm_mutex, K_FOREVER);
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+	k_work_cancel_delayable(&modem_sleep_work);
+	if (modem_asleep_) {
+		ret = modem_wake_locked();
+	}
+#endif
+	if (ret == 0) {
+		modem_users_++;
+	}
+	k_mutex_unlock(&modem_pm_mutex);
+	return ret;
+}
+
+/* Like modem_wake(), but leaves a sleeping modem asleep. Returns true if
+ * the caller holds the modem and has to modem_release() it.
+ */
+static bool modem_hold_if_awake(void)
+{
+	bool held = true;
+
+	k_mutex_lock(&modem_pm_mutex, K_FOREVER);
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+	held = !modem_asleep_;
+	if (held) {
+		k_work_cancel_delayable(&modem_sleep_work);
+	}
+#endif
+	if (held) {
+		modem_users_++;
+	}
+	k_mutex_unlock(&modem_pm_mutex);
+	return held;
+}
+
+static void modem_release(void)
+{
+	k_mutex_lock(&modem_pm_mutex, K_FOREVER);
+	if (modem_users_ > 0 && --modem_users_ == 0) {
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+		k_work_reschedule_for_queue(&modem_workq, &modem_sleep_work,
+				K_MSEC(CONFIG_MODEM_QUECTEL_BG96_SLEEP_DELAY_MS));
+#endif
+	}
+	k_mutex_unlock(&modem_pm_mutex);
+}
+
 /* Func: send_socket_data
  * Desc: This function will send "binary" data over the socket object.
  */
@@ -564,6 +974,7 @@ static ssize_t send_socket_data(struct modem_socket *sock,
 				k_timeout_t timeout)
 {
 	int  ret;
+	ssize_t written;
 	char send_buf[sizeof("AT+QISEND=##,####")] = {0};
 	char ctrlz = 0x1A;
 
@@ -571,15 +982,20 @@ static ssize_t send_socket_data(struct modem_socket *sock,
 		buf_len = MDM_MAX_DATA_LENGTH;
 	}
 
+	TRACE_SPAN_BEGIN("bg96_send", buf_len);
+
 	/* Create a buffer with the correct params. */
-	mdata.sock_written = buf_len;
 	snprintk(send_buf, sizeof(send_buf), "AT+QISEND=%d,%ld", sock->id, (long) buf_len);
 
-	/* Setup the locks correctly. */
+	/* Setup the locks correctly. mdata.sock_written belongs to whoever
+	 * holds the TX lock, as sends on other sockets share it.
+	 */
 	k_sem_take(&mdata.cmd_handler_data.sem_tx_lock, K_FOREVER);
+	mdata.sock_written = buf_len;
 	k_sem_reset(&mdata.sem_tx_ready);
 
 	/* Send the Modem command. */
+	req_trace_mark(REQ_TRACE_SEND);
 	ret = modem_cmd_send_nolock(&mctx.iface, &mctx.cmd_handler,
 				    NULL, 0U, send_buf, NULL, K_NO_WAIT);
 	if (ret < 0) {
@@ -601,6 +1017,7 @@ static ssize_t send_socket_data(struct modem_socket *sock,
 		LOG_DBG("Timeout waiting for tx");
 		goto exit;
 	}
+	req_trace_mark(REQ_TRACE_SEND_PROMPT);
 
 	/* Write all data on the console and send CTRL+Z. */
 	mctx.iface.write(&mctx.iface, buf, buf_len);
@@ -617,20 +1034,24 @@ static ssize_t send_socket_data(struct modem_socket *sock,
 	ret = modem_cmd_handler_get_error(&mdata.cmd_handler_data);
 	if (ret != 0) {
 		LOG_DBG("Failed to send data");
+	} else {
+		req_trace_mark(REQ_TRACE_SENT);
 	}
 
 exit:
 	/* unset handler commands and ignore any errors */
 	(void)modem_cmd_handler_update_cmds(&mdata.cmd_handler_data,
 					    NULL, 0U, false);
+	written = mdata.sock_written;
 	k_sem_give(&mdata.cmd_handler_data.sem_tx_lock);
+	TRACE_SPAN_END("bg96_send", ret);
 
 	if (ret < 0) {
 		return ret;
 	}
 
 	/* Return the amount of data written on the socket. */
-	return mdata.sock_written;
+	return written;
 }
 
 /* Func: offload_sendto
@@ -641,6 +1062,7 @@ static ssize_t offload_sendto(void *obj, const void *buf, size_t len,
 			      socklen_t tolen)
 {
 	int ret;
+	uint32_t start;
 	struct modem_socket *sock = (struct modem_socket *) obj;
 
 	/* Here's how sending data works,
@@ -667,17 +1089,23 @@ static ssize_t offload_sendto(void *obj, const void *buf, size_t len,
 		return -1;
 	}
 
-	/* UDP is not supported. */
-	if (sock->ip_proto == IPPROTO_UDP) {
-		errno = ENOTSUP;
+	/* UDP sockets are opened as "UDP" clients, so they must be connected
+	 * and can only send to the connected peer.
+	 */
+	if (!sock->is_connected) {
+		errno = ENOTCONN;
 		return -1;
 	}
 
-	if (!sock->is_connected) {
-		errno = ENOTCONN;
+	/* One AT+QISEND carries at most MDM_MAX_DATA_LENGTH bytes. A stream
+	 * send may be short, but a datagram cut there would be sent truncated.
+	 */
+	if (sock->ip_proto == IPPROTO_UDP && len > MDM_MAX_DATA_LENGTH) {
+		errno = EMSGSIZE;
 		return -1;
 	}
 
+	start = lat_hist_start();
 	ret = send_socket_data(sock, to, cmd, ARRAY_SIZE(cmd), buf, len,
 			       MDM_CMD_TIMEOUT);
 	if (ret < 0) {
@@ -686,10 +1114,25 @@ static ssize_t offload_sendto(void *obj, const void *buf, size_t len,
 	}
 
 	/* Data was written successfully. */
+	lat_hist_stop(&send_lat_, start);
 	errno = 0;
 	return ret;
 }
 
+/* Func: qird_send
+ * Desc: Sends one AT+QIRD command and accounts for its round trip.
+ */
+static int qird_send(struct modem_cmd *cmds, size_t cmds_len, const char *buf)
+{
+	int64_t start = k_uptime_get();
+	int ret = modem_at_send(cmds, cmds_len, buf, &mdata.sem_response,
+				MDM_CMD_TIMEOUT);
+
+	STATS_INC(bg96_stats, qird_cmds);
+	STATS_INCN(bg96_stats, qird_ms, k_uptime_get() - start);
+	return ret;
+}
+
 /* Func: offload_recvfrom
  * Desc: This function will receive data on the socket object.
  */
@@ -700,14 +1143,35 @@ static ssize_t offload_recvfrom(void *obj, void *buf, size_t len,
 	struct modem_socket *sock = (struct modem_socket *)obj;
 	char   sendbuf[sizeof("AT+QIRD=##,####")] = {0};
 	int    ret;
+	uint32_t start = lat_hist_start();
 	struct socket_read_data sock_data;
 
+	if (!buf || len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & ZSOCK_MSG_PEEK) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* Closed by the peer, or invalidated by link recovery. */
+	if (!sock->is_connected) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	/* Both +QIRD handlers resolve the socket through mdata.sock_fd. */
+	TRACE_SPAN_BEGIN("bg96_recv", len);
+	req_trace_mark(REQ_TRACE_RECV);
+	k_mutex_lock(&mdata.sock_lock, K_FOREVER);
+	mdata.sock_fd = sock->sock_fd;
+
 	/* Modem does not tell packet size. Set dummy for receive. */
 	struct modem_cmd check_cmd[] = { MODEM_CMD("+QIRD: ", on_cmd_sock_checkdata, 3U, ",") };
 	snprintk(sendbuf, sizeof(sendbuf), "AT+QIRD=%d,0", sock->id);
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-				check_cmd, 1, sendbuf, &mdata.sem_response,
-				MDM_CMD_TIMEOUT);
+	ret = qird_send(check_cmd, 1, sendbuf);
 	if (ret < 0) {
 		LOG_ERR("Error reading from socket");
 		modem_socket_packet_size_update(&mdata.socket_config, sock, 0);
@@ -716,16 +1180,6 @@ static ssize_t offload_recvfrom(void *obj, void *buf, size_t len,
 	/* Modem command to read the data. */
 	struct modem_cmd data_cmd[] = { MODEM_CMD("+QIRD: ", on_cmd_sock_readdata, 0U, "") };
 
-	if (!buf || len == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if (flags & ZSOCK_MSG_PEEK) {
-		errno = ENOTSUP;
-		return -1;
-	}
-
 	snprintk(sendbuf, sizeof(sendbuf), "AT+QIRD=%d,%zd", sock->id, len);
 
 	/* Socket read settings */
@@ -734,12 +1188,10 @@ static ssize_t offload_recvfrom(void *obj, void *buf, size_t len,
 	sock_data.recv_buf_len = len;
 	sock_data.recv_addr    = from;
 	sock->data	       = &sock_data;
-	mdata.sock_fd	       = sock->sock_fd;
 
 	/* Tell the modem to give us data (AT+QIRD=id,data_len). */
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     data_cmd, ARRAY_SIZE(data_cmd), sendbuf, &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+	ret = qird_send(data_cmd, ARRAY_SIZE(data_cmd), sendbuf);
+	k_mutex_unlock(&mdata.sock_lock);
 	LOG_DBG("QIRD cmd complete");
 	if (ret < 0) {
 		// Experimental addition by IOT course instructors
@@ -749,11 +1201,22 @@ static ssize_t offload_recvfrom(void *obj, void *buf, size_t len,
 			goto exit;
 		}
 
+		/* Don't hold the lock while waiting, other sockets may have data. */
 		LOG_DBG("modem_socket_wait_data");
+		STATS_INC(bg96_stats, qird_waits);
+		req_trace_mark(REQ_TRACE_RECV_WAIT);
 		modem_socket_wait_data(&mdata.socket_config, sock);
-		ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     data_cmd, ARRAY_SIZE(data_cmd), sendbuf, &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+		if (!sock->is_connected) {
+			errno = ENOTCONN;
+			ret = -1;
+			goto exit;
+		}
+		req_trace_mark(REQ_TRACE_RECV_READY);
+		start = lat_hist_start();
+		k_mutex_lock(&mdata.sock_lock, K_FOREVER);
+		mdata.sock_fd = sock->sock_fd;
+		ret = qird_send(data_cmd, ARRAY_SIZE(data_cmd), sendbuf);
+		k_mutex_unlock(&mdata.sock_lock);
 		if (ret < 0) {
 			errno = -ret;
 			ret = -1;
@@ -768,12 +1231,15 @@ static ssize_t offload_recvfrom(void *obj, void *buf, size_t len,
 	}
 
 	/* return length of received data */
+	lat_hist_stop(&recv_lat_, start);
+	req_trace_mark(REQ_TRACE_RECV_DONE);
 	errno = 0;
 	ret = sock_data.recv_read_len;
 
 exit:
 	/* clear socket data */
 	sock->data = NULL;
+	TRACE_SPAN_END("bg96_recv", ret);
 	return ret;
 }
 
@@ -827,7 +1293,7 @@ static int offload_ioctl(void *obj, unsigned int request, va_list args)
 }
 
 /* Func: offload_connect
- * Desc: This function will connect with a provided TCP.
+ * Desc: This function will connect with a provided TCP or UDP peer.
  */
 static int offload_connect(void *obj, const struct sockaddr *addr,
 						   socklen_t addrlen)
@@ -840,6 +1306,7 @@ static int offload_connect(void *obj, const struct sockaddr *addr,
 				       "####.####.####.####.####.####.####.####,######,"
 				       "0,0")] = {0};
 	int		    ret;
+	uint32_t	    start;
 	char		    ip_str[NET_IPV6_ADDR_LEN];
 
 	/* Verify socket has been allocated */
@@ -857,6 +1324,12 @@ static int offload_connect(void *obj, const struct sockaddr *addr,
 		return -1;
 	}
 
+	/* Fail fast while the link is being recovered. */
+	if (!link_up_) {
+		errno = ENETDOWN;
+		return -1;
+	}
+
 	/* Find the correct destination port. */
 	if (addr->sa_family == AF_INET6) {
 		dst_port = ntohs(net_sin6(addr)->sin6_port);
@@ -864,14 +1337,11 @@ static int offload_connect(void *obj, const struct sockaddr *addr,
 		dst_port = ntohs(net_sin(addr)->sin_port);
 	}
 
-	/* UDP is not supported. */
+	/* A "UDP" client keeps one remote peer, like a connected socket. */
 	if (sock->ip_proto == IPPROTO_UDP) {
-		errno = ENOTSUP;
-		return -1;
+		protocol = "UDP";
 	}
 
-	k_sem_reset(&mdata.sem_sock_conn);
-
 	ret = modem_context_sprint_ip_addr(addr, ip_str, sizeof(ip_str));
 	if (ret != 0) {
 		LOG_ERR("Error formatting IP string %d", ret);
@@ -881,22 +1351,31 @@ static int offload_connect(void *obj, const struct sockaddr *addr,
 		return -1;
 	}
 
+	/* Only one +QIOPEN can be outstanding, since they share sem_sock_conn. */
+	TRACE_SPAN_BEGIN("bg96_connect", sock->id);
+	start = lat_hist_start();
+	k_mutex_lock(&mdata.sock_lock, K_FOREVER);
+	k_sem_reset(&mdata.sem_sock_conn);
+
 	/* Formulate the complete string. */
 	snprintk(buf, sizeof(buf), "AT+QIOPEN=%d,%d,\"%s\",\"%s\",%d,0,0", 1, sock->id, protocol,
 		 ip_str, dst_port);
 
 	/* Send out the command. */
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     NULL, 0U, buf,
-			     &mdata.sem_response, K_SECONDS(1));
+	req_trace_mark(REQ_TRACE_CONNECT);
+	ret = modem_at_send(NULL, 0U, buf, &mdata.sem_response, K_SECONDS(1));
 	if (ret < 0) {
 		LOG_ERR("%s ret:%d", buf, ret);
 		LOG_ERR("Closing the socket!!!");
 		socket_close(sock);
+		k_mutex_unlock(&mdata.sock_lock);
+		TRACE_SPAN_END("bg96_connect", ret);
 		errno = -ret;
 		return -1;
 	}
 
+	req_trace_mark(REQ_TRACE_CONNECT_OK);
+
 	/* set command handlers */
 	ret = modem_cmd_handler_update_cmds(&mdata.cmd_handler_data,
 					    cmd, ARRAY_SIZE(cmd), true);
@@ -921,13 +1400,19 @@ static int offload_connect(void *obj, const struct sockaddr *addr,
 	}
 
 	/* Connected successfully. */
+	req_trace_mark(REQ_TRACE_CONNECTED);
 	sock->is_connected = true;
+	k_mutex_unlock(&mdata.sock_lock);
+	lat_hist_stop(&connect_lat_, start);
+	TRACE_SPAN_END("bg96_connect", 0);
 	errno = 0;
 	return 0;
 
 exit:
 	(void) modem_cmd_handler_update_cmds(&mdata.cmd_handler_data,
 					     NULL, 0U, false);
+	k_mutex_unlock(&mdata.sock_lock);
+	TRACE_SPAN_END("bg96_connect", ret);
 	errno = -ret;
 	return -1;
 }
@@ -940,6 +1425,9 @@ static int offload_close(void *obj)
 {
 	struct modem_socket *sock = (struct modem_socket *) obj;
 
+	/* Every descriptor from offload_socket() holds the modem awake. */
+	modem_release();
+
 	/* Make sure socket is allocated */
 	if (modem_socket_is_allocated(&mdata.socket_config, sock) == false) {
 		return 0;
@@ -948,11 +1436,48 @@ static int offload_close(void *obj)
 	/* Close the socket only if it is connected. */
 	if (sock->is_connected) {
 		socket_close(sock);
+	} else {
+		/* Never connected, or already closed on the modem by link
+		 * recovery; just free the slot.
+		 */
+		modem_socket_put(&mdata.socket_config, sock->sock_fd);
 	}
 
 	return 0;
 }
 
+/* Func: offload_shutdown
+ * Desc: This function closes the connection on the modem but keeps the
+ * socket allocated until offload_close(). The modem can only close both
+ * directions, so how is ignored. A pending or later recv() fails with
+ * ENOTCONN.
+ */
+static int offload_shutdown(void *obj, int how)
+{
+	struct modem_socket *sock = (struct modem_socket *) obj;
+	char buf[sizeof("AT+QICLOSE=##")];
+	int ret;
+
+	if (!sock->is_connected) {
+		return 0;
+	}
+
+	snprintk(buf, sizeof(buf), "AT+QICLOSE=%d", sock->id);
+	ret = modem_at_send(NULL, 0U, buf, &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
+	if (ret < 0) {
+		LOG_ERR("%s ret:%d", buf, ret);
+	}
+	sock->is_connected = false;
+
+	/* Same trick as the recv URC: make poll() and recv() return. */
+	if (modem_socket_next_packet_size(&mdata.socket_config, sock) <= 1) {
+		modem_socket_packet_size_update(&mdata.socket_config, sock, 1);
+	}
+	modem_socket_data_ready(&mdata.socket_config, sock);
+	return 0;
+}
+
 /* Func: offload_sendmsg
  * Desc: This function sends messages to the modem.
  */
@@ -1046,9 +1571,12 @@ static int offload_getaddrinfo(const char *node, const char *service,
 
 
 	snprintk(sendbuf, sizeof(sendbuf), "AT+QIDNSGIP=1,\"%s\"", node);
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     &cmd, 1U, sendbuf, &mdata.sem_dns,
-			     MDM_DNS_TIMEOUT);
+	ret = modem_wake();
+	if (ret < 0) {
+		return DNS_EAI_AGAIN;
+	}
+	ret = modem_at_send(&cmd, 1U, sendbuf, &mdata.sem_dns, MDM_DNS_TIMEOUT);
+	modem_release();
 	if (ret < 0) {
 		return ret;
 	}
@@ -1097,14 +1625,25 @@ static void modem_rssi_query_work(struct k_work *work)
 	static char *send_cmd = "AT+CSQ";
 	int ret;
 
+	/* The periodic query must not keep the modem awake; a sleeping modem
+	 * reports an unknown signal until something else wakes it.
+	 */
+	if (work && !modem_hold_if_awake()) {
+		mdata.mdm_rssi = -1000;
+		goto reschedule;
+	}
+
 	/* query modem RSSI */
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     &cmd, 1U, send_cmd, &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+	ret = modem_at_send(&cmd, 1U, send_cmd, &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
 	if (ret < 0) {
 		LOG_ERR("AT+CSQ ret:%d", ret);
 	}
+	if (work) {
+		modem_release();
+	}
 
+reschedule:
 	/* Re-start RSSI query work */
 	if (work) {
 		k_work_reschedule_for_queue(&modem_workq,
@@ -1116,16 +1655,16 @@ static void modem_rssi_query_work(struct k_work *work)
 /* Func: modem_registration_query_work
  * Desc: Routine to get Modem registration status.
  */
-static void modem_registration_query_work()
+static void modem_registration_query_work(void)
 {
-	struct modem_cmd cmd  = MODEM_CMD("+CEREG: ", on_cmd_registration_status, 2U, ",");
 	static char *send_cmd = "AT+CEREG?";
 	int ret;
 
-	/* query modem registration status */
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     &cmd, 1U, send_cmd, &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+	/* query modem registration status; the reply goes to the +CEREG URC
+	 * handler, which tells both forms apart.
+	 */
+	ret = modem_at_send(NULL, 0U, send_cmd, &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
 	if (ret < 0) {
 		LOG_ERR("AT+CEREG? ret:%d", ret);
 	}
@@ -1177,10 +1716,25 @@ static const struct modem_cmd response_cmds[] = {
 static const struct modem_cmd unsol_cmds[] = {
 	MODEM_CMD("+QIURC: \"recv\",",	   on_cmd_unsol_recv,  1U, ""),
 	MODEM_CMD("+QIURC: \"closed\",",   on_cmd_unsol_close, 1U, ""),
+	MODEM_CMD("+QIURC: \"pdpdeact\",", on_cmd_unsol_pdpdeact, 1U, ""),
+	MODEM_CMD_ARGS_MAX("+CEREG: ", on_cmd_registration_status, 1U, 5U, ","),
 	//MODEM_CMD("+QIRD: ",  on_cmd_sock_checkdata, 3U, ","),
 	MODEM_CMD("RDY", on_cmd_unsol_rdy, 0U, ""),
 };
 
+#if defined(CONFIG_MODEM_QUECTEL_BG96_PSM)
+#define MDM_PSM_CMD "AT+CPSMS=1,,,\"" CONFIG_MODEM_QUECTEL_BG96_PSM_TAU "\",\"" \
+	CONFIG_MODEM_QUECTEL_BG96_PSM_ACTIVE_TIME "\""
+#else
+#define MDM_PSM_CMD "AT+CPSMS=0"
+#endif
+#if defined(CONFIG_MODEM_QUECTEL_BG96_EDRX)
+/* Access technology 4 is LTE-M. */
+#define MDM_EDRX_CMD "AT+CEDRXS=1,4,\"" CONFIG_MODEM_QUECTEL_BG96_EDRX_VALUE "\""
+#else
+#define MDM_EDRX_CMD "AT+CEDRXS=0"
+#endif
+
 /* Commands sent to the modem to set it up at boot time. */
 static const struct setup_cmd setup_cmds[] = {
 	// Turn off echo mode
@@ -1195,17 +1749,15 @@ static const struct setup_cmd setup_cmds[] = {
 	SETUP_CMD_NOHANDLE("ATH"),
     // IOTEMBSYS: Set default error message format (numeric values)
 	SETUP_CMD_NOHANDLE("AT+CMEE=1"),
-    // IOTEMBSYS: Disable power save mode
-    SETUP_CMD_NOHANDLE("AT+CPSMS=0"),
-
-	/* Commands to read info from the modem (things like IMEI, Model etc). */
-	SETUP_CMD("AT+CGMI", "", on_cmd_atcmdinfo_manufacturer, 0U, ""),
-	// IOTEMBSYS: Get the model info
-	SETUP_CMD("AT+CGMM", "", on_cmd_atcmdinfo_model, 0U, ""),
-	// IOTEMBSYS: Get the modem firmware revision
-	SETUP_CMD("AT+CGMR", "", on_cmd_atcmdinfo_revision, 0U, ""),
-	// IOTEMBSYS: Get the modem IMEI
-	SETUP_CMD("AT+CGSN", "", on_cmd_atcmdinfo_imei, 0U, ""),
+	// Report registration changes, so a lost network is noticed
+	SETUP_CMD_NOHANDLE("AT+CEREG=1"),
+#if defined(CONFIG_MODEM_QUECTEL_BG96_SLEEP)
+	// Sleep whenever DTR is released
+	SETUP_CMD_NOHANDLE("AT+QSCLK=1"),
+#endif
+	// Power saving mode and eDRX, as configured
+	SETUP_CMD_NOHANDLE(MDM_PSM_CMD),
+	SETUP_CMD_NOHANDLE(MDM_EDRX_CMD),
 
     // Go into minimum functionality mode
     SETUP_CMD_NOHANDLE("AT+CFUN=0,0"),
@@ -1219,11 +1771,20 @@ static const struct setup_cmd setup_cmds[] = {
     // Set allowable RATs; 3 = LTE-only, 1 = take effect immediately
     SETUP_CMD_NOHANDLE("AT+QCFG=\"nwscanmode\",3,1"),
 
-    // Set the band configuration to any
-    //SETUP_CMD_NOHANDLE("AT+QCFG=\"band\",0xf,0x400a0e189f,0xa0e189f,1"),
+    // The band configuration and AT+CFUN=1 follow in attach_begin()
+};
 
-    // IOTEMBSYS: Go into full functionality mode
-    SETUP_CMD_NOHANDLE("AT+CFUN=1,0"),
+/* Commands to read info from the modem (things like IMEI, Model etc). Also
+ * run on a warm boot, since the IMEI seeds the interface MAC address.
+ */
+static const struct setup_cmd setup_cmds_info[] = {
+	SETUP_CMD("AT+CGMI", "", on_cmd_atcmdinfo_manufacturer, 0U, ""),
+	// IOTEMBSYS: Get the model info
+	SETUP_CMD("AT+CGMM", "", on_cmd_atcmdinfo_model, 0U, ""),
+	// IOTEMBSYS: Get the modem firmware revision
+	SETUP_CMD("AT+CGMR", "", on_cmd_atcmdinfo_revision, 0U, ""),
+	// IOTEMBSYS: Get the modem IMEI
+	SETUP_CMD("AT+CGSN", "", on_cmd_atcmdinfo_imei, 0U, ""),
 };
 
 // These are commands that can sometimes fail, so they are declared separately.
@@ -1251,16 +1812,14 @@ static int modem_pdp_context_activate(void)
 	int retry_count = 0;
 
 	LOG_INF("Activating context");
-	ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     NULL, 0U, "AT+QIACT=1", &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+	ret = modem_at_send(NULL, 0U, "AT+QIACT=1", &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
 
 	/* If there is trouble activating the PDP context, we try to deactivate/reactive it. */
 	while (ret == -EIO && retry_count < MDM_PDP_ACT_RETRY_COUNT) {
 		LOG_INF("Deactivating context");
-		ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     NULL, 0U, "AT+QIDEACT=1", &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+		ret = modem_at_send(NULL, 0U, "AT+QIDEACT=1",
+				    &mdata.sem_response, MDM_CMD_TIMEOUT);
 
 		/* If there's any error for AT+QIDEACT, restart the module. */
 		if (ret != 0) {
@@ -1268,9 +1827,8 @@ static int modem_pdp_context_activate(void)
 		}
 
 		LOG_INF("Reactivating context");
-		ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-			     NULL, 0U, "AT+QIACT=1", &mdata.sem_response,
-			     MDM_CMD_TIMEOUT);
+		ret = modem_at_send(NULL, 0U, "AT+QIACT=1", &mdata.sem_response,
+				    MDM_CMD_TIMEOUT);
 
 		retry_count++;
 	}
@@ -1292,9 +1850,8 @@ static int modem_pdp_context_activate(void)
 #endif
 
 		/* Tell the modem to close the socket. */
-		ret = modem_cmd_send(&mctx.iface, &mctx.cmd_handler,
-					NULL, 0U, buf,
-					&mdata.sem_response, MDM_CMD_TIMEOUT);
+		ret = modem_at_send(NULL, 0U, buf, &mdata.sem_response,
+				    MDM_CMD_TIMEOUT);
 		if (ret < 0) {
 			LOG_ERR("%s ret:%d", buf, ret);
 			// Ignore DNS server config failure
@@ -1306,25 +1863,331 @@ static int modem_pdp_context_activate(void)
 	return ret;
 }
 
+/*
+ * Attach cache
+ *
+ * Scanning every band dominates the attach time. After each registration
+ * AT+QNWINFO reports the serving RAT, operator, band and EARFCN, which are
+ * stored under "bg96/attach". The next attach locks the modem to that band
+ * and RAT and goes back to a full scan if it is not registered after
+ * CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE_TIMEOUT seconds. The BG96 cannot
+ * lock an EARFCN, and AT+COPS would block until the attach, so those two
+ * are kept for reference only.
+ */
+#define MDM_BANDS_CATM_ALL "0x400a0e189f"
+#define MDM_BANDS_NB_ALL "0xa0e189f"
+/* nwscanseq 00 is automatic, 02 is LTE-M first, 03 is NB-IoT first. */
+#define MDM_SCANSEQ_ALL "00"
+
+struct attach_params {
+	char rat[12];
+	char oper[8];
+	uint16_t band;
+	uint32_t earfcn;
+};
+
+static struct attach_params attach_seen_;
+static int64_t attach_start_;
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+static struct attach_params attach_cache_;
+static bool attach_locked_;
+#endif
+
+/* Values of the last AT+QCFG query, after the setting's name. */
+static char qcfg_values_[3][sizeof("0x0000000000000000")];
+static int qcfg_count_;
+
+static void copy_unquoted(char *dst, size_t size, const char *src)
+{
+	size_t len;
+
+	if (*src == '"') {
+		src++;
+	}
+	len = strcspn(src, "\"");
+	len = MIN(len, size - 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/* Handler: +QCFG: "<name>",<value>[,<value>...] */
+MODEM_CMD_DEFINE(on_cmd_qcfg)
+{
+	qcfg_count_ = MIN(argc - 1, ARRAY_SIZE(qcfg_values_));
+	for (int i = 0; i < qcfg_count_; i++) {
+		copy_unquoted(qcfg_values_[i], sizeof(qcfg_values_[i]), argv[i + 1]);
+	}
+	return 0;
+}
+
+/* Func: qcfg_query
+ * Desc: Reads the setting AT+QCFG="<name>" into qcfg_values_.
+ */
+static int qcfg_query(const char *name)
+{
+	static const struct modem_cmd cmd =
+		MODEM_CMD_ARGS_MAX("+QCFG: ", on_cmd_qcfg, 2U, 4U, ",");
+	char buf[sizeof("AT+QCFG=\"nwscanseq\"")];
+
+	qcfg_count_ = 0;
+	snprintk(buf, sizeof(buf), "AT+QCFG=\"%s\"", name);
+	return modem_at_send(&cmd, 1U, buf, &mdata.sem_response, MDM_CMD_TIMEOUT);
+}
+
+/* Both settings below live in the modem's NVM, and writing one restarts the
+ * network search, so they are only written when they differ.
+ */
+static int attach_set_scanseq(const char *seq)
+{
+	char buf[sizeof("AT+QCFG=\"nwscanseq\",00,1")];
+
+	/* The modem reports the whole order, e.g. 020301 after writing 02. */
+	if (qcfg_query("nwscanseq") == 0 && qcfg_count_ == 1 &&
+	    strncmp(qcfg_values_[0], seq, strlen(seq)) == 0) {
+		return 0;
+	}
+	snprintk(buf, sizeof(buf), "AT+QCFG=\"nwscanseq\",%s,1", seq);
+	return modem_at_send(NULL, 0U, buf, &mdata.sem_response, MDM_CMD_TIMEOUT);
+}
+
+/* Sets the LTE-M and NB-IoT band masks, given in hex; GSM keeps every band. */
+static int attach_set_bands(const char *catm, const char *nb)
+{
+	char buf[sizeof("AT+QCFG=\"band\",0xf,0x0000000000000000,0x0000000000000000,1")];
+
+	if (qcfg_query("band") == 0 && qcfg_count_ == 3 &&
+	    strtoull(qcfg_values_[0], NULL, 16) == 0xf &&
+	    strtoull(qcfg_values_[1], NULL, 16) == strtoull(catm, NULL, 16) &&
+	    strtoull(qcfg_values_[2], NULL, 16) == strtoull(nb, NULL, 16)) {
+		return 0;
+	}
+	snprintk(buf, sizeof(buf), "AT+QCFG=\"band\",0xf,%s,%s,1", catm, nb);
+	return modem_at_send(NULL, 0U, buf, &mdata.sem_response, MDM_CMD_TIMEOUT);
+}
+
+/* Handler: +QNWINFO: "<act>","<oper>","<band>",<channel> */
+MODEM_CMD_DEFINE(on_cmd_qnwinfo)
+{
+	char band[sizeof("LTE BAND ###")];
+	char *num;
+
+	/* "No Service" has no fields to speak of. */
+	if (argc < 4) {
+		return 0;
+	}
+
+	copy_unquoted(attach_seen_.rat, sizeof(attach_seen_.rat), argv[0]);
+	copy_unquoted(attach_seen_.oper, sizeof(attach_seen_.oper), argv[1]);
+	copy_unquoted(band, sizeof(band), argv[2]);
+	num = strrchr(band, ' ');
+	attach_seen_.band = num ? strtoul(num + 1, NULL, 10) : 0;
+	attach_seen_.earfcn = strtoul(argv[3], NULL, 10);
+	return 0;
+}
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+static int attach_settings_set(const char *name, size_t len,
+			       settings_read_cb read_cb, void *cb_arg)
+{
+	const char *next;
+	int rc;
+
+	if (!settings_name_steq(name, "attach", &next) || next) {
+		return -ENOENT;
+	}
+	if (len != sizeof(attach_cache_)) {
+		return -EINVAL;
+	}
+	rc = read_cb(cb_arg, &attach_cache_, len);
+	if (rc < 0) {
+		return rc;
+	}
+	attach_cache_.rat[sizeof(attach_cache_.rat) - 1] = '\0';
+	attach_cache_.oper[sizeof(attach_cache_.oper) - 1] = '\0';
+	return 0;
+}
+
+static struct settings_handler attach_settings = {
+	.name = "bg96",
+	.h_set = attach_settings_set,
+};
+
+/* Runs from modem_init(), before the application loads its settings. */
+static void attach_cache_load(void)
+{
+	int ret = settings_subsys_init();
+
+	if (ret == 0) {
+		ret = settings_register(&attach_settings);
+	}
+	if (ret == 0) {
+		ret = settings_load_subtree("bg96");
+	}
+	if (ret < 0) {
+		LOG_WRN("Attach cache not loaded: %d", ret);
+	}
+}
+
+/* The band mask for the cached band; false if it cannot be expressed. */
+static bool attach_lock_mask(char *mask, size_t size)
+{
+	uint16_t band = attach_cache_.band;
+
+	if (band == 0 || band > 64) {
+		return false;
+	}
+	if (band > 32) {
+		snprintk(mask, size, "0x%x%08x", (unsigned int)BIT(band - 33), 0U);
+	} else {
+		snprintk(mask, size, "0x%x", (unsigned int)BIT(band - 1));
+	}
+	return true;
+}
+#endif /* CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE */
+
+static int attach_full_scan(void)
+{
+	int ret;
+
+	ret = attach_set_scanseq(MDM_SCANSEQ_ALL);
+	if (ret == 0) {
+		ret = attach_set_bands(MDM_BANDS_CATM_ALL, MDM_BANDS_NB_ALL);
+	}
+	return ret;
+}
+
+/* Configures the bands to scan and goes into full functionality mode. The
+ * band setting is kept in the modem's NVM, so a full scan is configured
+ * explicitly rather than left to whatever the last lock was.
+ */
+static int attach_begin(void)
+{
+	int ret = -ENOENT;
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+	char mask[sizeof("0x0000000000000000")];
+	bool nb = strstr(attach_cache_.rat, "NB") != NULL;
+
+	attach_locked_ = false;
+	if (attach_lock_mask(mask, sizeof(mask))) {
+		LOG_INF("Attaching on cached %s band %u (%s)", attach_cache_.rat,
+			attach_cache_.band, attach_cache_.oper);
+		ret = attach_set_scanseq(nb ? "03" : "02");
+		if (ret == 0) {
+			ret = attach_set_bands(nb ? MDM_BANDS_CATM_ALL : mask,
+					       nb ? mask : MDM_BANDS_NB_ALL);
+		}
+		attach_locked_ = (ret == 0);
+		STATS_SET(bg96_stats, attach_cached, attach_locked_);
+	}
+#endif
+	if (ret < 0) {
+		ret = attach_full_scan();
+		if (ret < 0) {
+			LOG_WRN("Band configuration failed: %d", ret);
+		}
+	}
+
+	// IOTEMBSYS: Go into full functionality mode
+	return modem_at_send(NULL, 0U, "AT+CFUN=1,0", &mdata.sem_response,
+			     MDM_REGISTRATION_TIMEOUT);
+}
+
+/* Called while waiting for service; drops the band lock once it had its
+ * chance.
+ */
+static void attach_check_fallback(void)
+{
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+	if (!attach_locked_ || k_uptime_get() - attach_start_ <
+	    CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE_TIMEOUT * MSEC_PER_SEC) {
+		return;
+	}
+	LOG_WRN("No service on cached band %u; scanning all bands",
+		attach_cache_.band);
+	attach_locked_ = false;
+	STATS_INC(bg96_stats, attach_fallbacks);
+	(void)attach_full_scan();
+#endif
+}
+
+/* Records the time to register and the serving cell, and remembers it for
+ * the next attach.
+ */
+static void attach_registered(void)
+{
+	static const struct modem_cmd cmd =
+		MODEM_CMD_ARGS_MAX("+QNWINFO: ", on_cmd_qnwinfo, 1U, 4U, ",");
+	uint32_t elapsed = k_uptime_get() - attach_start_;
+	int ret;
+
+	STATS_SET(bg96_stats, attach_ms, elapsed);
+
+	/* Keep the signal strength current for the application. */
+	k_work_reschedule_for_queue(&modem_workq, &mdata.rssi_query_work,
+				    K_SECONDS(RSSI_TIMEOUT_SECS));
+
+	memset(&attach_seen_, 0, sizeof(attach_seen_));
+	ret = modem_at_send(&cmd, 1U, "AT+QNWINFO", &mdata.sem_response,
+			    MDM_CMD_TIMEOUT);
+	LOG_INF("Registered after %u ms on %s %s band %u EARFCN %u", elapsed,
+		attach_seen_.rat, attach_seen_.oper, attach_seen_.band,
+		attach_seen_.earfcn);
+	if (ret < 0 || attach_seen_.band == 0) {
+		return;
+	}
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+	if (memcmp(&attach_seen_, &attach_cache_, sizeof(attach_cache_)) != 0) {
+		attach_cache_ = attach_seen_;
+		ret = settings_save_one("bg96/attach", &attach_cache_,
+					sizeof(attach_cache_));
+		if (ret < 0) {
+			LOG_WRN("Attach cache not saved: %d", ret);
+		}
+	}
+#endif
+}
+
 /* Func: modem_setup
  * Desc: This function is used to setup the modem from zero. The idea
  * is that this function will be called right after the modem is
  * powered on to do the stuff necessary to talk to the modem.
+ * reg_count limits how often registration is polled before giving up;
+ * 0 waits for as long as it takes.
  */
-static int modem_setup(void)
+static int modem_setup(int reg_count)
 {
 	int ret = 0, counter;
-	int rssi_retry_count = 0, init_retry_count = 0;
+	int rssi_retry_count = 0, init_retry_count = 0, reg_polls = 0;
 
-	/* Setup the pins to ensure that Modem is enabled. */
-	pin_init();
+	attach_start_ = k_uptime_get();
 
-	/* Let the modem respond. */
-	LOG_INF("Waiting for modem to respond");
-	ret = k_sem_take(&mdata.sem_response, MDM_MAX_BOOT_TIME);
-	if (ret < 0) {
-		LOG_ERR("Timeout waiting for RDY");
-		goto error;
+	/* A modem that kept running across an MCU reset is still registered;
+	 * the power key would switch it off.
+	 */
+	if (modem_probe(MDM_PROBE_COUNT) == 0) {
+		LOG_INF("Modem already on; resuming");
+		STATS_INC(bg96_stats, warm_boots);
+		ret = modem_cmd_handler_setup_cmds(&mctx.iface, &mctx.cmd_handler,
+						   setup_cmds_info, ARRAY_SIZE(setup_cmds_info),
+						   &mdata.sem_response, MDM_CMD_TIMEOUT);
+		if (ret == 0 && modem_resume(MDM_RESUME_REG_COUNT) == 0) {
+			attach_registered();
+			return 0;
+		}
+		LOG_WRN("Resume failed; running full setup");
+	} else {
+		/* Setup the pins to ensure that Modem is enabled. */
+		pin_init();
+
+		/* Let the modem respond. */
+		LOG_INF("Waiting for modem to respond");
+		ret = k_sem_take(&mdata.sem_response, MDM_MAX_BOOT_TIME);
+		if (ret < 0) {
+			LOG_ERR("Timeout waiting for RDY");
+			goto error;
+		}
 	}
 
 	/* Run setup commands on the modem. */
@@ -1334,6 +2197,16 @@ static int modem_setup(void)
 	if (ret < 0) {
 		goto error;
 	}
+	ret = modem_cmd_handler_setup_cmds(&mctx.iface, &mctx.cmd_handler,
+					   setup_cmds_info, ARRAY_SIZE(setup_cmds_info),
+					   &mdata.sem_response, MDM_CMD_TIMEOUT);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = attach_begin();
+	if (ret < 0) {
+		goto error;
+	}
 
 restart:
 
@@ -1363,6 +2236,7 @@ restart_rssi:
 	LOG_INF("RSSI query %d / %d", rssi_retry_count, MDM_NETWORK_RETRY_COUNT);
 	while (counter++ < MDM_WAIT_FOR_RSSI_COUNT &&
 	      (mdata.mdm_rssi >= 0 || mdata.mdm_rssi <= -1000)) {
+		attach_check_fallback();
 		modem_rssi_query_work(NULL);
 		k_sleep(MDM_WAIT_FOR_RSSI_DELAY);
 	}
@@ -1389,9 +2263,16 @@ restart_registration:
 
 	if (!registered_) {
 		LOG_INF("Not registered on network");
+		if (reg_count > 0 && ++reg_polls >= reg_count) {
+			LOG_ERR("Not registered after %d queries", reg_polls);
+			ret = -ENETUNREACH;
+			goto error;
+		}
+		attach_check_fallback();
 		k_sleep(MDM_WAIT_FOR_RSSI_DELAY);
 		goto restart_registration;
 	}
+	attach_registered();
 
 	/* Network is ready - Start RSSI work in the background. */
 	LOG_INF("Network is ready.");
@@ -1407,6 +2288,211 @@ error:
 	return ret;
 }
 
+/*
+ * Connection manager
+ *
+ * +CEREG URCs (after a grace period to re-register) and +QIURC: "pdpdeact"
+ * report a lost link. Recovery runs on the driver work queue and escalates
+ * only as far as it has to: re-activate the PDP context, then detach and
+ * re-attach, then power cycle the modem and run modem_setup() again. Open
+ * sockets are closed on the modem first and then fail with ENOTCONN, so
+ * their users reconnect as soon as offload_connect() stops failing with
+ * ENETDOWN.
+ */
+#define MDM_CFUN_TIMEOUT	K_SECONDS(15)
+#define MDM_REATTACH_REG_COUNT	60
+/* Registration queries after a power cycle, MDM_WAIT_FOR_RSSI_DELAY apart.
+ * Without coverage, recovery gives up and frees modem_workq until the next
+ * retry instead of polling forever.
+ */
+#define MDM_RECOVERY_REG_COUNT	90
+#define MDM_POWER_DOWN_TIME	K_SECONDS(5)
+#define MDM_POWER_KEY_OFF	K_MSEC(750)
+#define MDM_LINK_RETRY_DELAY	K_SECONDS(60)
+
+enum link_tier {
+	LINK_TIER_PDP = 0,
+	LINK_TIER_ATTACH,
+	LINK_TIER_POWER,
+	LINK_TIER_COUNT,
+};
+
+static const char *const link_tier_names[LINK_TIER_COUNT] = {
+	"PDP re-activation", "re-attach", "power cycle",
+};
+
+static int64_t link_down_at_;
+
+static void link_recovery_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(link_recovery_work, link_recovery_handler);
+
+/* Called from URC handlers, so it may only schedule work. */
+static void link_lost(k_timeout_t delay)
+{
+	if (!link_up_) {
+		/* Not up yet, or already recovering. */
+		return;
+	}
+	link_up_ = false;
+	link_down_at_ = k_uptime_get();
+	STATS_INC(bg96_stats, link_losses);
+	k_work_reschedule_for_queue(&modem_workq, &link_recovery_work, delay);
+}
+
+/* Registered again within the grace period: check right away. */
+static void link_registered(void)
+{
+	if (k_work_delayable_is_pending(&link_recovery_work)) {
+		k_work_reschedule_for_queue(&modem_workq, &link_recovery_work, K_NO_WAIT);
+	}
+}
+
+/* Closes every connected socket on the modem and wakes its users. The
+ * slots stay allocated until the application closes its descriptors.
+ */
+static void link_invalidate_sockets(void)
+{
+	char buf[sizeof("AT+QICLOSE=##")];
+
+	k_mutex_lock(&mdata.sock_lock, K_FOREVER);
+	for (int i = 0; i < ARRAY_SIZE(mdata.sockets); i++) {
+		struct modem_socket *sock = &mdata.sockets[i];
+
+		if (!modem_socket_is_allocated(&mdata.socket_config, sock) ||
+		    !sock->is_connected) {
+			continue;
+		}
+
+		snprintk(buf, sizeof(buf), "AT+QICLOSE=%d", sock->id);
+		(void)modem_at_send(NULL, 0U, buf, &mdata.sem_response,
+				    MDM_CMD_TIMEOUT);
+		sock->is_connected = false;
+
+		/* Same trick as the recv URC: make poll() and recv() return. */
+		if (modem_socket_next_packet_size(&mdata.socket_config, sock) <= 1) {
+			modem_socket_packet_size_update(&mdata.socket_config, sock, 1);
+		}
+		modem_socket_data_ready(&mdata.socket_config, sock);
+		LOG_INF("Socket %d invalidated", sock->sock_fd);
+	}
+	k_mutex_unlock(&mdata.sock_lock);
+}
+
+static int link_reattach(void)
+{
+	int ret;
+
+	ret = modem_at_send(NULL, 0U, "AT+CFUN=0", &mdata.sem_response,
+			    MDM_CFUN_TIMEOUT);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = modem_at_send(NULL, 0U, "AT+CFUN=1", &mdata.sem_response,
+			    MDM_CFUN_TIMEOUT);
+	if (ret < 0) {
+		return ret;
+	}
+	return modem_resume(MDM_REATTACH_REG_COUNT);
+}
+
+static int link_power_cycle(void)
+{
+	if (modem_probe(MDM_PROBE_COUNT) == 0) {
+		(void)modem_at_send(NULL, 0U, "AT+QPOWD=1", &mdata.sem_response,
+				    MDM_CMD_TIMEOUT);
+	} else {
+		/* Hung; a long press on the power key switches it off. */
+		gpio_pin_set_dt(&power_gpio, 1);
+		k_sleep(MDM_POWER_KEY_OFF);
+		gpio_pin_set_dt(&power_gpio, 0);
+	}
+	k_sleep(MDM_POWER_DOWN_TIME);
+
+	/* The probe in modem_setup() now fails, so it powers the modem up. */
+	return modem_setup(MDM_RECOVERY_REG_COUNT);
+}
+
+static int link_try_tier(enum link_tier tier)
+{
+	int64_t start = k_uptime_get();
+	uint32_t elapsed;
+	int ret;
+
+	LOG_INF("Link recovery: %s", link_tier_names[tier]);
+	switch (tier) {
+	case LINK_TIER_PDP:
+		ret = modem_resume(MDM_RESUME_REG_COUNT);
+		break;
+	case LINK_TIER_ATTACH:
+		ret = link_reattach();
+		break;
+	default:
+		ret = link_power_cycle();
+		break;
+	}
+	elapsed = k_uptime_get() - start;
+	if (ret < 0) {
+		LOG_WRN("Link recovery: %s failed after %u ms: %d",
+			link_tier_names[tier], elapsed, ret);
+		return ret;
+	}
+
+	LOG_INF("Link recovery: %s took %u ms", link_tier_names[tier], elapsed);
+	switch (tier) {
+	case LINK_TIER_PDP:
+		STATS_INC(bg96_stats, pdp_recoveries);
+		STATS_SET(bg96_stats, pdp_recovery_ms, elapsed);
+		break;
+	case LINK_TIER_ATTACH:
+		STATS_INC(bg96_stats, attach_recoveries);
+		STATS_SET(bg96_stats, attach_recovery_ms, elapsed);
+		break;
+	default:
+		STATS_INC(bg96_stats, power_recoveries);
+		STATS_SET(bg96_stats, power_recovery_ms, elapsed);
+		break;
+	}
+	return 0;
+}
+
+static void link_recovery_handler(struct k_work *work)
+{
+	bool awake = (modem_wake() == 0);
+	int ret;
+
+	/* A short outage may have left registration and the PDP context, and
+	 * so the sockets, intact.
+	 */
+	if (awake) {
+		modem_registration_query_work();
+		if (registered_ && modem_pdp_query() == 1) {
+			LOG_INF("Link came back by itself");
+			goto up;
+		}
+	}
+
+	link_invalidate_sockets();
+	ret = -ENETDOWN;
+	for (int tier = 0; tier < LINK_TIER_COUNT && ret < 0; tier++) {
+		ret = link_try_tier(tier);
+	}
+	if (ret < 0) {
+		LOG_ERR("Link recovery failed; retrying later");
+		STATS_INC(bg96_stats, recovery_failures);
+		k_work_reschedule_for_queue(&modem_workq, &link_recovery_work,
+					    MDM_LINK_RETRY_DELAY);
+		goto out;
+	}
+
+up:
+	STATS_SET(bg96_stats, link_down_ms, k_uptime_get() - link_down_at_);
+	link_up_ = true;
+out:
+	if (awake) {
+		modem_release();
+	}
+}
+
 static const struct socket_op_vtable offload_socket_fd_op_vtable = {
 	.fd_vtable = {
 		.read	= offload_read,
@@ -1414,6 +2500,7 @@ static const struct socket_op_vtable offload_socket_fd_op_vtable = {
 		.close	= offload_close,
 		.ioctl	= offload_ioctl,
 	},
+	.shutdown	= offload_shutdown,
 	.bind		= NULL,
 	.connect	= offload_connect,
 	.sendto		= offload_sendto,
@@ -1457,24 +2544,32 @@ static bool offload_is_supported(int family, int type, int proto)
 		return false;
 	}
 
-	if (type != SOCK_STREAM) {
-		return false;
+	if (type == SOCK_STREAM && proto == IPPROTO_TCP) {
+		return true;
 	}
 
-	if (proto != IPPROTO_TCP) {
-		return false;
+	/* Connected UDP only; see offload_connect(). */
+	if (type == SOCK_DGRAM && proto == IPPROTO_UDP) {
+		return true;
 	}
 
-	return true;
+	return false;
 }
 
 static int offload_socket(int family, int type, int proto)
 {
 	int ret;
 
+	ret = modem_wake();
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
 	/* defer modem's socket create call to bind() */
 	ret = modem_socket_get(&mdata.socket_config, family, type, proto);
 	if (ret < 0) {
+		modem_release();
 		errno = -ret;
 		return -1;
 	}
@@ -1487,13 +2582,29 @@ static int modem_init(const struct device *dev)
 {
 	int ret; ARG_UNUSED(dev);
 
+	/* The modem is awake until it is told to sleep. */
+	modem_pm_hold(true);
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96_ATTACH_CACHE)
+	attach_cache_load();
+#endif
+
 	k_sem_init(&mdata.sem_response,	 0, 1);
 	k_sem_init(&mdata.sem_tx_ready,	 0, 1);
 	k_sem_init(&mdata.sem_sock_conn, 0, 1);
 	k_sem_init(&mdata.sem_dns, 0, 1);
+	k_mutex_init(&mdata.sock_lock);
+	ret = STATS_INIT_AND_REG(bg96_stats, STATS_SIZE_32, "bg96");
+	if (ret < 0) {
+		LOG_WRN("Failed to register stats: %d", ret);
+	}
+	(void)lat_hist_register(&at_lat_, "bg96_at");
+	(void)lat_hist_register(&connect_lat_, "bg96_connect");
+	(void)lat_hist_register(&send_lat_, "bg96_send");
+	(void)lat_hist_register(&recv_lat_, "bg96_recv");
 	k_work_queue_start(&modem_workq, modem_workq_stack,
 			   K_KERNEL_STACK_SIZEOF(modem_workq_stack),
-			   K_PRIO_COOP(7), NULL);
+			   K_PRIO_COOP(7), &modem_workq_cfg);
 
 	/* socket config */
 	ret = modem_socket_init(&mdata.socket_config, &mdata.sockets[0], ARRAY_SIZE(mdata.sockets),
@@ -1603,10 +2714,18 @@ static int modem_init(const struct device *dev)
 			K_KERNEL_STACK_SIZEOF(modem_rx_stack),
 			(k_thread_entry_t) modem_rx,
 			NULL, NULL, NULL, K_PRIO_COOP(7), 0, K_NO_WAIT);
+	k_thread_name_set(&modem_rx_thread, "modem_rx");
 
 	/* Init RSSI query */
 	k_work_init_delayable(&mdata.rssi_query_work, modem_rssi_query_work);
-	return modem_setup();
+	ret = modem_setup(0);
+	if (ret == 0) {
+		link_up_ = true;
+		/* Sleep until the first socket. */
+		modem_wake();
+		modem_release();
+	}
+	return ret;
 
 error:
 	return ret;
@@ -102,6 +102,9 @@ struct modem_data {
 	char mdm_iccid[MDM_ICCID_LENGTH];
 #endif /* #if defined(CONFIG_MODEM_SIM_NUMBERS) */
 	int mdm_rssi;
+	/* Last valid RSSI and when it was measured, kept while asleep. */
+	int mdm_rssi_last;
+	uint32_t mdm_rssi_last_ms;
 
 	/* bytes written to socket in last transaction */
 	int sock_written;
@@ -114,6 +117,11 @@ struct modem_data {
 	struct k_sem sem_tx_ready;
 	struct k_sem sem_sock_conn;
 	struct k_sem sem_dns;
+
+	/* Serializes socket commands that share driver state (sock_fd,
+	 * sem_sock_conn), so several sockets can be used from different threads.
+	 */
+	struct k_mutex sock_lock;
 };
 
 /* Socket read callback data */
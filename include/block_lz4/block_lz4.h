@@ -0,0 +1,99 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_BLOCK_LZ4_BLOCK_LZ4_H_
+#define EXAMPLE_APPLICATION_INCLUDE_BLOCK_LZ4_BLOCK_LZ4_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Stream format (all integers little-endian):
+ *
+ *   header: "LZB1" block_size:u32 image_size:u32 image_crc:u32
+ *   blocks: length:u32 data[length & ~BLOCK_LZ4_STORED]
+ *
+ * The image is cut into block_size chunks (the last one may be shorter) and
+ * each chunk is compressed on its own as a raw LZ4 block, so matches never
+ * reach back past the start of the current chunk. A chunk that does not
+ * compress is sent as is with BLOCK_LZ4_STORED set in its length. The CRC
+ * is CRC-32/IEEE over the whole decompressed image.
+ */
+#define BLOCK_LZ4_MAGIC "LZB1"
+#define BLOCK_LZ4_HEADER_SIZE 16
+#define BLOCK_LZ4_STORED 0x80000000U
+
+struct block_lz4_header {
+	uint32_t block_size;
+	uint32_t image_size;
+	uint32_t image_crc;
+};
+
+/**
+ * @brief Called once the stream header is parsed, before any output.
+ *
+ * Returning a negative errno aborts decompression.
+ */
+typedef int (*block_lz4_header_cb_t)(void *user_data,
+				     const struct block_lz4_header *hdr);
+
+/** @brief Consumes the next @p len bytes of the decompressed image. */
+typedef int (*block_lz4_write_cb_t)(void *user_data, const uint8_t *buf,
+				    size_t len);
+
+struct block_lz4_cfg {
+	block_lz4_header_cb_t header_cb;
+	block_lz4_write_cb_t write_cb;
+	void *user_data;
+};
+
+/* Decoder state; treat as opaque. */
+struct block_lz4_ctx {
+	struct block_lz4_cfg cfg;
+	struct block_lz4_header hdr;
+	uint8_t hdr_buf[BLOCK_LZ4_HEADER_SIZE];
+	uint8_t state;
+	uint8_t token;
+	uint32_t read;
+	uint32_t block_in;
+	uint32_t block_out;
+	uint32_t count;
+	uint16_t offset;
+	uint32_t written;
+	uint32_t crc;
+	int err;
+	uint8_t window[CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE];
+};
+
+/**
+ * @brief Prepare @p ctx to decompress a new stream.
+ *
+ * @returns 0 on success, -EINVAL if the write callback is missing
+ */
+int block_lz4_init(struct block_lz4_ctx *ctx, const struct block_lz4_cfg *cfg);
+
+/**
+ * @brief Feed the next chunk of the compressed stream.
+ *
+ * Chunks may be split at any byte. Each block is decoded straight into a
+ * block_size window and handed to the write callback once it is complete,
+ * so RAM use is bounded by CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE.
+ *
+ * @returns 0 on success
+ * @returns -EBADMSG if the stream is malformed
+ * @returns -EFBIG if block_size exceeds CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE
+ * @returns a negative errno returned by one of the callbacks
+ */
+int block_lz4_write(struct block_lz4_ctx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Check that the whole image was produced.
+ *
+ * @returns 0 if image_size bytes matching image_crc were written
+ * @returns -ENODATA if the stream ended early
+ * @returns -EILSEQ if the image CRC does not match
+ */
+int block_lz4_finish(struct block_lz4_ctx *ctx);
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_BLOCK_LZ4_BLOCK_LZ4_H_ */
@@ -0,0 +1,114 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_DELTA_PATCH_DELTA_PATCH_H_
+#define EXAMPLE_APPLICATION_INCLUDE_DELTA_PATCH_DELTA_PATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Patch format (all integers little-endian):
+ *
+ *   header: "DLT1" source_size:u32 source_crc:u32 target_size:u32 target_crc:u32
+ *   ops:    COPY   0x01 offset:varint length:varint
+ *           ADD    0x02 offset:varint length:varint diff[length]
+ *           INSERT 0x03 length:varint data[length]
+ *
+ * Varints are unsigned LEB128. COPY emits source bytes, ADD emits source
+ * bytes plus the matching diff bytes (mod 256) and INSERT emits literal
+ * bytes. The patch ends once target_size bytes have been emitted. CRCs are
+ * CRC-32/IEEE over the whole source and target images.
+ */
+#define DELTA_PATCH_MAGIC "DLT1"
+#define DELTA_PATCH_HEADER_SIZE 20
+
+#define DELTA_PATCH_OP_COPY 0x01
+#define DELTA_PATCH_OP_ADD 0x02
+#define DELTA_PATCH_OP_INSERT 0x03
+
+struct delta_patch_header {
+	uint32_t source_size;
+	uint32_t source_crc;
+	uint32_t target_size;
+	uint32_t target_crc;
+};
+
+/**
+ * @brief Called once the patch header is parsed, before any output.
+ *
+ * Returning a negative errno aborts the patch, e.g. when the source image
+ * does not match source_crc.
+ */
+typedef int (*delta_patch_header_cb_t)(void *user_data,
+				       const struct delta_patch_header *hdr);
+
+/** @brief Reads @p len bytes of the source image at @p offset. */
+typedef int (*delta_patch_read_cb_t)(void *user_data, size_t offset,
+				     uint8_t *buf, size_t len);
+
+/** @brief Consumes the next @p len bytes of the target image. */
+typedef int (*delta_patch_write_cb_t)(void *user_data, const uint8_t *buf,
+				      size_t len);
+
+struct delta_patch_cfg {
+	delta_patch_header_cb_t header_cb;
+	delta_patch_read_cb_t read_cb;
+	delta_patch_write_cb_t write_cb;
+	void *user_data;
+};
+
+/* Decoder state; treat as opaque. */
+struct delta_patch_ctx {
+	struct delta_patch_cfg cfg;
+	struct delta_patch_header hdr;
+	uint8_t hdr_buf[DELTA_PATCH_HEADER_SIZE];
+	uint8_t state;
+	uint8_t op;
+	uint8_t arg_count;
+	uint8_t arg_idx;
+	uint8_t arg_shift;
+	uint32_t args[2];
+	uint32_t remaining;
+	uint32_t src_pos;
+	uint32_t read;
+	uint32_t written;
+	uint32_t crc;
+	int err;
+	uint8_t buf[CONFIG_DELTA_PATCH_BUF_SIZE];
+};
+
+/**
+ * @brief Prepare @p ctx to apply a new patch.
+ *
+ * @returns 0 on success, -EINVAL if a callback is missing
+ */
+int delta_patch_init(struct delta_patch_ctx *ctx,
+		     const struct delta_patch_cfg *cfg);
+
+/**
+ * @brief Feed the next chunk of the patch stream.
+ *
+ * Chunks may be split at any byte. Target data is handed to the write
+ * callback as soon as it can be produced, so RAM use does not depend on the
+ * image size.
+ *
+ * @returns 0 on success
+ * @returns -EBADMSG if the patch is malformed or references data outside
+ *          the source or target images
+ * @returns a negative errno returned by one of the callbacks
+ */
+int delta_patch_write(struct delta_patch_ctx *ctx, const uint8_t *data,
+		      size_t len);
+
+/**
+ * @brief Check that the whole target image was produced.
+ *
+ * @returns 0 if target_size bytes matching target_crc were written
+ * @returns -ENODATA if the patch stream ended early
+ * @returns -EILSEQ if the target CRC does not match
+ */
+int delta_patch_finish(struct delta_patch_ctx *ctx);
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_DELTA_PATCH_DELTA_PATCH_H_ */
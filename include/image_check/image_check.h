@@ -0,0 +1,119 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_IMAGE_CHECK_IMAGE_CHECK_H_
+#define EXAMPLE_APPLICATION_INCLUDE_IMAGE_CHECK_IMAGE_CHECK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tinycrypt/sha256.h>
+
+/*
+ * MCUboot image layout (all integers little-endian):
+ *
+ *   header:          magic:u32 load_addr:u32 hdr_size:u16 protect_tlv_size:u16
+ *                    img_size:u32 flags:u32 version:u8.u8.u16.u32 pad:u32
+ *   payload:         img_size bytes starting at hdr_size
+ *   protected TLVs:  protect_tlv_size bytes, if any
+ *   TLVs:            magic:u16 (0x6907) total:u16, then type:u8 pad:u8 len:u16
+ *                    value[len] entries
+ *
+ * The SHA-256 TLV covers everything before the unprotected TLV area.
+ */
+#define IMAGE_CHECK_MAGIC 0x96f3b83d
+#define IMAGE_CHECK_HEADER_SIZE 32
+#define IMAGE_CHECK_TLV_INFO_MAGIC 0x6907
+#define IMAGE_CHECK_TLV_SHA256 0x10
+#define IMAGE_CHECK_HASH_SIZE 32
+
+#define IMAGE_CHECK_F_ENCRYPTED_AES128 0x04
+#define IMAGE_CHECK_F_ENCRYPTED_AES256 0x08
+#define IMAGE_CHECK_F_NON_BOOTABLE 0x10
+#define IMAGE_CHECK_F_RAM_LOAD 0x20
+
+struct image_check_header {
+	uint32_t load_addr;
+	uint16_t hdr_size;
+	uint16_t protect_tlv_size;
+	uint32_t img_size;
+	uint32_t flags;
+	uint8_t ver_major;
+	uint8_t ver_minor;
+	uint16_t ver_revision;
+	uint32_t ver_build;
+	/* First two payload words: the Cortex-M initial SP and reset vector. */
+	uint32_t vector[2];
+};
+
+/**
+ * @brief Called once the header and the first payload words are in.
+ *
+ * This is the place to reject images built for another target. Returning
+ * a negative errno aborts the check.
+ */
+typedef int (*image_check_header_cb_t)(void *user_data,
+				       const struct image_check_header *hdr);
+
+struct image_check_cfg {
+	image_check_header_cb_t header_cb;
+	/* Digest the image must have, or NULL to trust the SHA-256 TLV. */
+	const uint8_t *expected_hash;
+	void *user_data;
+};
+
+/* Checker state; treat as opaque. */
+struct image_check_ctx {
+	struct image_check_cfg cfg;
+	struct image_check_header hdr;
+	struct tc_sha256_state_struct sha;
+	uint32_t image_size;
+	uint32_t pos;
+	uint32_t hashed_end;
+	uint32_t tlv_pos;
+	uint32_t tlv_end;
+	uint8_t state;
+	uint16_t tlv_type;
+	uint16_t tlv_len;
+	uint8_t buf[IMAGE_CHECK_HEADER_SIZE];
+	uint8_t buf_fill;
+	uint8_t tlv_hash[IMAGE_CHECK_HASH_SIZE];
+	uint8_t tlv_hash_fill;
+	int err;
+};
+
+/**
+ * @brief Prepare @p ctx to check an image of @p image_size bytes.
+ *
+ * @returns 0 on success
+ */
+int image_check_init(struct image_check_ctx *ctx, uint32_t image_size,
+		     const struct image_check_cfg *cfg);
+
+/**
+ * @brief Feed the next bytes of the image, in order.
+ *
+ * The header is validated as soon as it is complete, so an image that is
+ * not an MCUboot image, or whose layout does not match @p image_size, is
+ * rejected within the first bytes.
+ *
+ * @returns 0 on success
+ * @returns -EBADMSG if the header or TLV area is malformed
+ * @returns -EFBIG if more than image_size bytes are fed
+ * @returns a negative errno returned by the header callback
+ */
+int image_check_update(struct image_check_ctx *ctx, const uint8_t *data,
+		       size_t len);
+
+/**
+ * @brief Compare the computed digest once the whole image was fed.
+ *
+ * @returns 0 if the digest matches the SHA-256 TLV and the expected hash
+ * @returns -ENODATA if the image is incomplete
+ * @returns -EBADMSG if the image has no SHA-256 TLV
+ * @returns -EILSEQ if the digest does not match
+ */
+int image_check_finish(struct image_check_ctx *ctx);
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_IMAGE_CHECK_IMAGE_CHECK_H_ */
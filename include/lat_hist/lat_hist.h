@@ -0,0 +1,96 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_LAT_HIST_LAT_HIST_H_
+#define EXAMPLE_APPLICATION_INCLUDE_LAT_HIST_LAT_HIST_H_
+
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/stats/stats.h>
+
+/*
+ * A latency histogram is a stats group with these 32-bit entries:
+ *
+ *   count   samples recorded
+ *   max_us  longest sample
+ *   lt2 .. lt8M, ge8M
+ *           samples per log2 bucket. Bucket n (named by its exclusive
+ *           upper bound in microseconds, k = 1024 and M = 1048576) holds
+ *           samples from 2^n up to 2^(n+1) us; bucket 0 also holds 0 us
+ *           and the last one everything from 8M us (about 8.4 s) up.
+ *
+ * Times come from k_cycle_get_32(), which keeps counting in the low-power
+ * states a tickless kernel enters while a thread waits. Its resolution is
+ * that of the system timer, and a single sample must not be longer than
+ * one wrap of the 32-bit cycle counter. With the 32768 Hz LPTIM1 timer of
+ * this board a cycle is about 31 us: lt2 only gets samples shorter than
+ * one cycle, recorded as 0 us, and lt4 .. lt16 can never be reached.
+ */
+#define LAT_HIST_BUCKETS 24
+
+STATS_SECT_START(lat_hist)
+STATS_SECT_ENTRY32(count)
+STATS_SECT_ENTRY32(max_us)
+STATS_SECT_ENTRY32(bucket[LAT_HIST_BUCKETS])
+STATS_SECT_END;
+
+/**
+ * @brief Index of the bucket that a sample of @p us falls into.
+ */
+static inline int lat_hist_bucket(uint32_t us)
+{
+	int n = us < 2 ? 0 : 31 - __builtin_clz(us);
+
+	return n < LAT_HIST_BUCKETS ? n : LAT_HIST_BUCKETS - 1;
+}
+
+#if defined(CONFIG_LAT_HIST)
+
+/**
+ * @brief Zero @p hist and register it as the stats group @p name.
+ *
+ * @p name must stay valid for as long as the group is registered.
+ *
+ * @returns 0 on success, or the error from stats_init_and_reg()
+ */
+int lat_hist_register(struct stats_lat_hist *hist, const char *name);
+
+/**
+ * @brief Add a sample of @p us microseconds. Safe from any context.
+ */
+void lat_hist_record(struct stats_lat_hist *hist, uint32_t us);
+
+#else
+
+static inline int lat_hist_register(struct stats_lat_hist *hist, const char *name)
+{
+	return 0;
+}
+
+static inline void lat_hist_record(struct stats_lat_hist *hist, uint32_t us)
+{
+}
+
+#endif /* CONFIG_LAT_HIST */
+
+/**
+ * @brief Timestamp to pass to lat_hist_stop() when the operation ends.
+ */
+static inline uint32_t lat_hist_start(void)
+{
+	return IS_ENABLED(CONFIG_LAT_HIST) ? k_cycle_get_32() : 0;
+}
+
+/**
+ * @brief Record the time since @p start, a lat_hist_start() timestamp.
+ */
+static inline void lat_hist_stop(struct stats_lat_hist *hist, uint32_t start)
+{
+	if (IS_ENABLED(CONFIG_LAT_HIST)) {
+		lat_hist_record(hist, k_cyc_to_us_floor32(k_cycle_get_32() - start));
+	}
+}
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_LAT_HIST_LAT_HIST_H_ */
@@ -0,0 +1,90 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_LINK_FRAME_LINK_FRAME_H_
+#define EXAMPLE_APPLICATION_INCLUDE_LINK_FRAME_LINK_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame format (integers little-endian):
+ *
+ *   type:u8 id:u8 length:u16 payload[length]
+ *
+ * The type says how to decode the payload, and the id pairs a response
+ * with its request, so several requests can be in flight on one
+ * connection. Both are opaque to the codec.
+ */
+#define LINK_FRAME_HEADER_SIZE 4
+#define LINK_FRAME_MAX_LENGTH UINT16_MAX
+
+struct link_frame_header {
+	uint8_t type;
+	uint8_t id;
+	uint16_t length;
+};
+
+/**
+ * @brief Called for every complete frame.
+ *
+ * @p payload is only valid during the call. Returning a negative errno
+ * stops decoding.
+ */
+typedef int (*link_frame_cb_t)(void *user_data, const struct link_frame_header *hdr,
+			       const uint8_t *payload);
+
+struct link_frame_cfg {
+	link_frame_cb_t frame_cb;
+	void *user_data;
+};
+
+/* Decoder state; treat as opaque. */
+struct link_frame_ctx {
+	struct link_frame_cfg cfg;
+	struct link_frame_header hdr;
+	uint8_t hdr_buf[LINK_FRAME_HEADER_SIZE];
+	uint32_t fill;
+	int err;
+	uint8_t payload[CONFIG_LINK_FRAME_MAX_PAYLOAD];
+};
+
+/**
+ * @brief Write the header for a frame into @p buf.
+ *
+ * @returns LINK_FRAME_HEADER_SIZE on success
+ * @returns -ENOBUFS if @p buf_size is smaller than the header
+ */
+int link_frame_encode_header(uint8_t *buf, size_t buf_size,
+			     const struct link_frame_header *hdr);
+
+/**
+ * @brief Prepare @p ctx to decode a new stream.
+ *
+ * @returns 0 on success
+ * @returns -EINVAL if no frame callback is given
+ */
+int link_frame_init(struct link_frame_ctx *ctx, const struct link_frame_cfg *cfg);
+
+/**
+ * @brief Feed the next bytes received from the stream.
+ *
+ * Bytes may arrive split at any point; the callback runs once per frame,
+ * as soon as its last byte is in.
+ *
+ * @returns 0 on success
+ * @returns -EMSGSIZE if a frame is larger than CONFIG_LINK_FRAME_MAX_PAYLOAD
+ * @returns a negative errno returned by the frame callback
+ */
+int link_frame_feed(struct link_frame_ctx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Check whether the stream ended on a frame boundary.
+ *
+ * @returns 0 if no frame is partially received
+ * @returns -ENODATA if the stream stopped inside a frame
+ */
+int link_frame_finish(struct link_frame_ctx *ctx);
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_LINK_FRAME_LINK_FRAME_H_ */
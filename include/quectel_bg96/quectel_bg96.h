@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_QUECTEL_BG96_QUECTEL_BG96_H_
+#define EXAMPLE_APPLICATION_INCLUDE_QUECTEL_BG96_QUECTEL_BG96_H_
+
+#include <errno.h>
+#include <stdint.h>
+
+/*
+ * Driver extensions of the Quectel BG96 offloaded modem that the
+ * application uses directly.
+ */
+
+/*
+ * Largest UDP datagram the modem sends, as one AT+QISEND. Larger sends
+ * fail with EMSGSIZE.
+ */
+#define QUECTEL_BG96_MAX_DATAGRAM 1024
+
+#if defined(CONFIG_MODEM_QUECTEL_BG96)
+
+/**
+ * @brief Latest valid signal strength the modem reported.
+ *
+ * The driver asks for it every RSSI_TIMEOUT_SECS while the modem is
+ * awake, but never wakes the modem to do so. A sleeping modem therefore
+ * keeps the last measurement, and @p measured_ms only changes when there
+ * is a new one.
+ *
+ * @param rssi_dbm set to the RSSI in dBm
+ * @param measured_ms set to k_uptime_get_32() at the measurement
+ *
+ * @returns 0 on success, or -ENODATA if there has been no valid
+ *          measurement yet
+ */
+int quectel_bg96_rssi_get(int16_t *rssi_dbm, uint32_t *measured_ms);
+
+#else
+
+static inline int quectel_bg96_rssi_get(int16_t *rssi_dbm, uint32_t *measured_ms)
+{
+	return -ENODATA;
+}
+
+#endif /* CONFIG_MODEM_QUECTEL_BG96 */
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_QUECTEL_BG96_QUECTEL_BG96_H_ */
@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_REQ_TRACE_REQ_TRACE_H_
+#define EXAMPLE_APPLICATION_INCLUDE_REQ_TRACE_REQ_TRACE_H_
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A request trace follows one backend exchange from what triggered it to
+ * the decoded response, as a list of timestamped stages. The time between
+ * two stages shows where it went: the modem's answer to a command is the
+ * AT layer, the URC that follows it is the radio and the network, and the
+ * rest is our own code.
+ *
+ * One trace runs at a time, owned by the thread that began it. Stages
+ * marked from other threads or from interrupts are ignored, so the socket
+ * layer can mark stages unconditionally.
+ */
+#if defined(CONFIG_REQ_TRACE)
+#define REQ_TRACE_MAX_EVENTS CONFIG_REQ_TRACE_MAX_EVENTS
+#else
+#define REQ_TRACE_MAX_EVENTS 1
+#endif
+
+enum req_trace_stage {
+	REQ_TRACE_TRIGGER,	/* button press or upload scheduler */
+	REQ_TRACE_START,	/* picked up by the requesting thread */
+	REQ_TRACE_DNS,		/* lookup sent */
+	REQ_TRACE_DNS_DONE,
+	REQ_TRACE_CONNECT,	/* socket open command sent */
+	REQ_TRACE_CONNECT_OK,	/* modem accepted the command */
+	REQ_TRACE_CONNECTED,	/* modem reported the socket open */
+	REQ_TRACE_SEND,		/* send command sent */
+	REQ_TRACE_SEND_PROMPT,	/* modem ready for the data */
+	REQ_TRACE_SENT,		/* modem reported the data sent */
+	REQ_TRACE_RECV,		/* read asked for */
+	REQ_TRACE_RECV_WAIT,	/* nothing buffered; waiting for data */
+	REQ_TRACE_RECV_READY,	/* modem reported data */
+	REQ_TRACE_RECV_DONE,	/* data read from the modem */
+	REQ_TRACE_DECODE,
+	REQ_TRACE_DECODED,
+	REQ_TRACE_END,
+	REQ_TRACE_STAGE_COUNT,
+};
+
+struct req_trace_event {
+	uint8_t stage;
+	/* Microseconds since the trigger. */
+	uint32_t us;
+};
+
+struct req_trace {
+	uint32_t id;
+	/* What was traced, as passed to req_trace_begin(). */
+	const char *name;
+	/* What triggered it, as passed to req_trace_trigger(), or NULL. */
+	const char *source;
+	int result;
+	uint16_t count;
+	/* Stages that did not fit in events. */
+	uint16_t dropped;
+	struct req_trace_event events[REQ_TRACE_MAX_EVENTS];
+};
+
+/**
+ * @brief Short name of @p stage, as used by req_trace_format().
+ */
+const char *req_trace_stage_name(enum req_trace_stage stage);
+
+/**
+ * @brief Format @p trace as one line.
+ *
+ * The line names the trace and its trigger, the total time, and every
+ * stage with the milliseconds since the one before it, e.g.
+ * "#3 telemetry (button) 1830 ms: start+2 connect+1 connect_ok+41 ...".
+ *
+ * @returns the length of the line, truncated to fit @p len
+ */
+int req_trace_format(const struct req_trace *trace, char *buf, size_t len);
+
+#if defined(CONFIG_REQ_TRACE)
+
+/**
+ * @brief Note that an exchange was asked for. Safe from any context.
+ *
+ * The next req_trace_begin() takes its start time from the first trigger
+ * since the previous trace, unless that is more than
+ * CONFIG_REQ_TRACE_TRIGGER_MAX_AGE_MS old. @p source must be a string
+ * literal.
+ */
+void req_trace_trigger(const char *source);
+
+/**
+ * @brief Start tracing from the calling thread.
+ *
+ * Does nothing if another trace is running. @p name must be a string
+ * literal.
+ */
+void req_trace_begin(const char *name);
+
+/**
+ * @brief Record @p stage if the calling thread owns the running trace.
+ */
+void req_trace_mark(enum req_trace_stage stage);
+
+/**
+ * @brief Finish the calling thread's trace with @p result.
+ *
+ * The trace is then available from req_trace_last().
+ *
+ * @returns true if the calling thread had a trace running
+ */
+bool req_trace_end(int result);
+
+/**
+ * @brief Copy the last finished trace to @p trace.
+ *
+ * @returns 0 on success, or -ENODATA if no trace has finished yet
+ */
+int req_trace_last(struct req_trace *trace);
+
+#else
+
+static inline void req_trace_trigger(const char *source)
+{
+}
+
+static inline void req_trace_begin(const char *name)
+{
+}
+
+static inline void req_trace_mark(enum req_trace_stage stage)
+{
+}
+
+static inline bool req_trace_end(int result)
+{
+	return false;
+}
+
+static inline int req_trace_last(struct req_trace *trace)
+{
+	return -ENODATA;
+}
+
+#endif /* CONFIG_REQ_TRACE */
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_REQ_TRACE_REQ_TRACE_H_ */
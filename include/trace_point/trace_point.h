@@ -0,0 +1,48 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_TRACE_POINT_TRACE_POINT_H_
+#define EXAMPLE_APPLICATION_INCLUDE_TRACE_POINT_TRACE_POINT_H_
+
+#include <stdint.h>
+
+/*
+ * Custom points in the kernel trace (see app/tracing.conf), read back by
+ * scripts/ctf_timing.py. Each is a Zephyr named event: a name of up to 19
+ * characters and two 32-bit arguments. The first argument is free; the
+ * second tells the script whether the event begins or ends a span on the
+ * current thread, or stands alone. A span's end carries the result.
+ *
+ * Without CONFIG_TRACING they compile to nothing, but still reference
+ * their arguments, so helpers that only feed trace points stay used.
+ */
+#define TRACE_POINT_INSTANT 0
+#define TRACE_POINT_BEGIN 1
+#define TRACE_POINT_END 2
+
+#if defined(CONFIG_TRACING)
+#include <zephyr/tracing/tracing.h>
+
+#define TRACE_POINT_EMIT(name, arg, kind) \
+	sys_trace_named_event(name, (uint32_t)(arg), kind)
+#else
+#define TRACE_POINT_EMIT(name, arg, kind) \
+	do { \
+		if (0) { \
+			(void)(name); \
+			(void)(arg); \
+		} \
+	} while (0)
+#endif
+
+/** @brief Mark a single point, with @p arg. */
+#define TRACE_POINT(name, arg) TRACE_POINT_EMIT(name, arg, TRACE_POINT_INSTANT)
+
+/** @brief Begin the span @p name, with @p arg. */
+#define TRACE_SPAN_BEGIN(name, arg) TRACE_POINT_EMIT(name, arg, TRACE_POINT_BEGIN)
+
+/** @brief End the span @p name with the result @p ret. */
+#define TRACE_SPAN_END(name, ret) TRACE_POINT_EMIT(name, ret, TRACE_POINT_END)
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_TRACE_POINT_TRACE_POINT_H_ */
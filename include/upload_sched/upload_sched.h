@@ -0,0 +1,126 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EXAMPLE_APPLICATION_INCLUDE_UPLOAD_SCHED_UPLOAD_SCHED_H_
+#define EXAMPLE_APPLICATION_INCLUDE_UPLOAD_SCHED_UPLOAD_SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Uploads are grouped into classes. A requested upload of a class is due
+ * as soon as the smoothed signal strength reaches the class threshold, or
+ * when it has waited max_delay_ms, whichever comes first. A transfer at
+ * poor signal takes several times longer and costs as much more energy,
+ * so holding back what can wait pays off.
+ *
+ * Times are milliseconds from any monotonic clock that wraps at 2^32,
+ * such as k_uptime_get_32(). The scheduler never reads the clock itself.
+ */
+
+/* Signal sample value for "no valid measurement". */
+#define UPLOAD_SCHED_RSSI_UNKNOWN INT16_MIN
+
+struct upload_sched_class {
+	/* Smoothed RSSI in dBm at or above which uploads go right away. */
+	int16_t min_rssi;
+	/* Longest an upload waits for that signal; 0 sends it at once. */
+	uint32_t max_delay_ms;
+	/* Also due whenever another class is, since the radio is up anyway. */
+	bool piggyback;
+};
+
+struct upload_sched_cfg {
+	const struct upload_sched_class *classes;
+	uint8_t num_classes;
+	/* A new sample moves the average by 1/2^smoothing_shift of the
+	 * difference; 0 uses the latest sample as is.
+	 */
+	uint8_t smoothing_shift;
+	/* Samples older than this count as unknown; 0 never expires them. */
+	uint32_t max_sample_age_ms;
+};
+
+struct upload_sched_class_stats {
+	uint32_t requests;
+	/* Why pending uploads became due. */
+	uint32_t by_signal;
+	uint32_t by_deadline;
+	uint32_t by_piggyback;
+	/* Total and longest time from request to due. */
+	uint32_t wait_ms;
+	uint32_t max_wait_ms;
+};
+
+/* Scheduler state. pending and stats may be read directly; change it only
+ * through the functions below.
+ */
+struct upload_sched_ctx {
+	struct upload_sched_cfg cfg;
+	/* Average RSSI in 1/16 dBm. */
+	int32_t rssi_avg;
+	uint32_t sample_ms;
+	bool have_sample;
+	uint32_t pending;
+	uint32_t requested_ms[CONFIG_UPLOAD_SCHED_MAX_CLASSES];
+	struct upload_sched_class_stats stats[CONFIG_UPLOAD_SCHED_MAX_CLASSES];
+};
+
+/**
+ * @brief Prepare @p ctx with no uploads pending and no signal known.
+ *
+ * @returns 0 on success
+ * @returns -EINVAL if there are no classes or more than
+ *          CONFIG_UPLOAD_SCHED_MAX_CLASSES
+ */
+int upload_sched_init(struct upload_sched_ctx *ctx, const struct upload_sched_cfg *cfg);
+
+/**
+ * @brief Feed a signal sample taken at @p now_ms.
+ *
+ * UPLOAD_SCHED_RSSI_UNKNOWN forgets the average, so the next valid
+ * sample starts it over.
+ */
+void upload_sched_signal(struct upload_sched_ctx *ctx, int16_t rssi_dbm, uint32_t now_ms);
+
+/**
+ * @brief Smoothed RSSI in dBm at @p now_ms.
+ *
+ * @returns UPLOAD_SCHED_RSSI_UNKNOWN without a valid, fresh sample
+ */
+int16_t upload_sched_rssi(const struct upload_sched_ctx *ctx, uint32_t now_ms);
+
+/**
+ * @brief Ask for an upload of class @p cls.
+ *
+ * A request for a class that is already pending keeps the earlier
+ * deadline.
+ *
+ * @returns 0 on success
+ * @returns -EINVAL if @p cls is not a configured class
+ */
+int upload_sched_request(struct upload_sched_ctx *ctx, uint8_t cls, uint32_t now_ms);
+
+/**
+ * @brief Take the classes whose uploads are due at @p now_ms.
+ *
+ * The returned classes are no longer pending; request them again if the
+ * upload fails.
+ *
+ * @returns a bit mask with bit n set for class n
+ */
+uint32_t upload_sched_take(struct upload_sched_ctx *ctx, uint32_t now_ms);
+
+/**
+ * @brief Time until the next pending deadline.
+ *
+ * Signal can make uploads due earlier, so callers that poll for that
+ * should also feed samples and call upload_sched_take() periodically.
+ *
+ * @returns milliseconds, 0 if an upload is overdue
+ * @returns -1 if nothing is pending
+ */
+int32_t upload_sched_next(const struct upload_sched_ctx *ctx, uint32_t now_ms);
+
+#endif /* EXAMPLE_APPLICATION_INCLUDE_UPLOAD_SCHED_UPLOAD_SCHED_H_ */
@@ -0,0 +1,312 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include <block_lz4/block_lz4.h>
+
+/* LZ4 sequences are at least 4 bytes long; the token stores the excess. */
+#define LZ4_MIN_MATCH 4
+#define LZ4_RUN_MASK 0x0f
+
+enum block_lz4_state {
+	BLOCK_LZ4_STATE_HEADER = 0,
+	BLOCK_LZ4_STATE_BLOCK_LEN,
+	BLOCK_LZ4_STATE_STORED,
+	BLOCK_LZ4_STATE_TOKEN,
+	BLOCK_LZ4_STATE_LIT_LEN,
+	BLOCK_LZ4_STATE_LITERALS,
+	BLOCK_LZ4_STATE_OFFSET_LO,
+	BLOCK_LZ4_STATE_OFFSET_HI,
+	BLOCK_LZ4_STATE_MATCH_LEN,
+	BLOCK_LZ4_STATE_DONE,
+};
+
+static int emit(struct block_lz4_ctx *ctx, const uint8_t *buf, size_t len)
+{
+	ctx->crc = crc32_ieee_update(ctx->crc, buf, len);
+	ctx->written += len;
+	return ctx->cfg.write_cb(ctx->cfg.user_data, buf, len);
+}
+
+/* Decompressed size of the current block. */
+static uint32_t block_size(struct block_lz4_ctx *ctx)
+{
+	return MIN(ctx->hdr.block_size, ctx->hdr.image_size - ctx->written);
+}
+
+static void next_block(struct block_lz4_ctx *ctx)
+{
+	ctx->read = 0;
+	ctx->state = (ctx->written == ctx->hdr.image_size) ?
+		BLOCK_LZ4_STATE_DONE : BLOCK_LZ4_STATE_BLOCK_LEN;
+}
+
+static int parse_header(struct block_lz4_ctx *ctx)
+{
+	if (memcmp(ctx->hdr_buf, BLOCK_LZ4_MAGIC, 4) != 0) {
+		return -EBADMSG;
+	}
+
+	ctx->hdr.block_size = sys_get_le32(&ctx->hdr_buf[4]);
+	ctx->hdr.image_size = sys_get_le32(&ctx->hdr_buf[8]);
+	ctx->hdr.image_crc = sys_get_le32(&ctx->hdr_buf[12]);
+
+	if (ctx->hdr.block_size == 0) {
+		return -EBADMSG;
+	}
+	if (ctx->hdr.block_size > sizeof(ctx->window)) {
+		return -EFBIG;
+	}
+
+	if (ctx->cfg.header_cb) {
+		int err = ctx->cfg.header_cb(ctx->cfg.user_data, &ctx->hdr);
+
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	next_block(ctx);
+	return 0;
+}
+
+static int parse_block_len(struct block_lz4_ctx *ctx)
+{
+	uint32_t len = sys_get_le32(ctx->hdr_buf);
+
+	ctx->block_in = len & ~BLOCK_LZ4_STORED;
+	ctx->block_out = 0;
+
+	if (len & BLOCK_LZ4_STORED) {
+		if (ctx->block_in != block_size(ctx)) {
+			return -EBADMSG;
+		}
+		ctx->state = BLOCK_LZ4_STATE_STORED;
+	} else {
+		if (ctx->block_in == 0) {
+			return -EBADMSG;
+		}
+		ctx->state = BLOCK_LZ4_STATE_TOKEN;
+	}
+	return 0;
+}
+
+/* The last sequence of a block has literals only, so a block may end here. */
+static int end_literals(struct block_lz4_ctx *ctx)
+{
+	if (ctx->block_in > 0) {
+		ctx->state = BLOCK_LZ4_STATE_OFFSET_LO;
+		return 0;
+	}
+	if (ctx->block_out != block_size(ctx)) {
+		return -EBADMSG;
+	}
+
+	int err = emit(ctx, ctx->window, ctx->block_out);
+
+	next_block(ctx);
+	return err;
+}
+
+static int start_literals(struct block_lz4_ctx *ctx)
+{
+	if (ctx->count > block_size(ctx) - ctx->block_out) {
+		return -EBADMSG;
+	}
+	if (ctx->count == 0) {
+		return end_literals(ctx);
+	}
+	ctx->state = BLOCK_LZ4_STATE_LITERALS;
+	return 0;
+}
+
+/* Matches may overlap their own output, so copy front to back. */
+static int copy_match(struct block_lz4_ctx *ctx)
+{
+	uint32_t len = ctx->count + LZ4_MIN_MATCH;
+
+	if (len > block_size(ctx) - ctx->block_out) {
+		return -EBADMSG;
+	}
+
+	for (uint32_t i = 0; i < len; i++) {
+		ctx->window[ctx->block_out] = ctx->window[ctx->block_out - ctx->offset];
+		ctx->block_out++;
+	}
+
+	ctx->state = BLOCK_LZ4_STATE_TOKEN;
+	return 0;
+}
+
+/* Consumes bytes of a compressed block; returns bytes used or errno. */
+static int process_lz4(struct block_lz4_ctx *ctx, const uint8_t *data, size_t len)
+{
+	uint8_t byte = *data;
+	size_t used = 1;
+	int err = 0;
+
+	/* Every state below needs more input from the current block. */
+	if (ctx->block_in == 0) {
+		return -EBADMSG;
+	}
+
+	switch (ctx->state) {
+	case BLOCK_LZ4_STATE_TOKEN:
+		ctx->token = byte;
+		ctx->count = byte >> 4;
+		ctx->block_in--;
+		if (ctx->count == LZ4_RUN_MASK) {
+			ctx->state = BLOCK_LZ4_STATE_LIT_LEN;
+		} else {
+			err = start_literals(ctx);
+		}
+		break;
+
+	case BLOCK_LZ4_STATE_LIT_LEN:
+		ctx->count += byte;
+		ctx->block_in--;
+		if (byte != 0xff) {
+			err = start_literals(ctx);
+		}
+		break;
+
+	case BLOCK_LZ4_STATE_LITERALS:
+		used = MIN(MIN(len, ctx->count), ctx->block_in);
+		memcpy(&ctx->window[ctx->block_out], data, used);
+		ctx->block_out += used;
+		ctx->block_in -= used;
+		ctx->count -= used;
+		if (ctx->count == 0) {
+			err = end_literals(ctx);
+		}
+		break;
+
+	case BLOCK_LZ4_STATE_OFFSET_LO:
+		ctx->offset = byte;
+		ctx->block_in--;
+		ctx->state = BLOCK_LZ4_STATE_OFFSET_HI;
+		break;
+
+	case BLOCK_LZ4_STATE_OFFSET_HI:
+		ctx->offset |= (uint16_t)byte << 8;
+		ctx->block_in--;
+		if (ctx->offset == 0 || ctx->offset > ctx->block_out) {
+			err = -EBADMSG;
+			break;
+		}
+		ctx->count = ctx->token & LZ4_RUN_MASK;
+		if (ctx->count == LZ4_RUN_MASK) {
+			ctx->state = BLOCK_LZ4_STATE_MATCH_LEN;
+		} else {
+			err = copy_match(ctx);
+		}
+		break;
+
+	case BLOCK_LZ4_STATE_MATCH_LEN:
+		ctx->count += byte;
+		ctx->block_in--;
+		if (byte != 0xff) {
+			err = copy_match(ctx);
+		}
+		break;
+
+	default:
+		err = -EBADMSG;
+		break;
+	}
+
+	return err ? err : (int)used;
+}
+
+int block_lz4_init(struct block_lz4_ctx *ctx, const struct block_lz4_cfg *cfg)
+{
+	if (!cfg->write_cb) {
+		return -EINVAL;
+	}
+
+	memset(ctx, 0, offsetof(struct block_lz4_ctx, window));
+	ctx->cfg = *cfg;
+	ctx->state = BLOCK_LZ4_STATE_HEADER;
+	return 0;
+}
+
+int block_lz4_write(struct block_lz4_ctx *ctx, const uint8_t *data, size_t len)
+{
+	int err = 0;
+
+	while (len > 0 && err == 0 && ctx->err == 0) {
+		int used;
+
+		switch (ctx->state) {
+		case BLOCK_LZ4_STATE_HEADER:
+			used = MIN(len, BLOCK_LZ4_HEADER_SIZE - ctx->read);
+			memcpy(&ctx->hdr_buf[ctx->read], data, used);
+			ctx->read += used;
+			if (ctx->read == BLOCK_LZ4_HEADER_SIZE) {
+				err = parse_header(ctx);
+			}
+			break;
+
+		case BLOCK_LZ4_STATE_BLOCK_LEN:
+			used = MIN(len, sizeof(uint32_t) - ctx->read);
+			memcpy(&ctx->hdr_buf[ctx->read], data, used);
+			ctx->read += used;
+			if (ctx->read == sizeof(uint32_t)) {
+				err = parse_block_len(ctx);
+			}
+			break;
+
+		case BLOCK_LZ4_STATE_STORED:
+			used = MIN(len, ctx->block_in);
+			err = emit(ctx, data, used);
+			ctx->block_in -= used;
+			if (ctx->block_in == 0) {
+				next_block(ctx);
+			}
+			break;
+
+		case BLOCK_LZ4_STATE_DONE:
+			/* Trailing bytes after the complete image. */
+			err = -EBADMSG;
+			used = 0;
+			break;
+
+		default:
+			used = process_lz4(ctx, data, len);
+			if (used < 0) {
+				err = used;
+				used = 0;
+			}
+			break;
+		}
+
+		data += used;
+		len -= used;
+	}
+
+	if (err != 0) {
+		ctx->err = err;
+	}
+	return ctx->err;
+}
+
+int block_lz4_finish(struct block_lz4_ctx *ctx)
+{
+	if (ctx->err != 0) {
+		return ctx->err;
+	}
+	if (ctx->state != BLOCK_LZ4_STATE_DONE) {
+		return -ENODATA;
+	}
+	if (ctx->crc != ctx->hdr.image_crc) {
+		return -EILSEQ;
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include <delta_patch/delta_patch.h>
+
+enum delta_patch_state {
+	DELTA_PATCH_STATE_HEADER = 0,
+	DELTA_PATCH_STATE_OPCODE,
+	DELTA_PATCH_STATE_ARGS,
+	DELTA_PATCH_STATE_DATA,
+	DELTA_PATCH_STATE_DONE,
+};
+
+static int emit(struct delta_patch_ctx *ctx, const uint8_t *buf, size_t len)
+{
+	ctx->crc = crc32_ieee_update(ctx->crc, buf, len);
+	ctx->written += len;
+	return ctx->cfg.write_cb(ctx->cfg.user_data, buf, len);
+}
+
+static void next_op(struct delta_patch_ctx *ctx)
+{
+	ctx->state = (ctx->written == ctx->hdr.target_size) ?
+		DELTA_PATCH_STATE_DONE : DELTA_PATCH_STATE_OPCODE;
+}
+
+static int parse_header(struct delta_patch_ctx *ctx)
+{
+	if (memcmp(ctx->hdr_buf, DELTA_PATCH_MAGIC, 4) != 0) {
+		return -EBADMSG;
+	}
+
+	ctx->hdr.source_size = sys_get_le32(&ctx->hdr_buf[4]);
+	ctx->hdr.source_crc = sys_get_le32(&ctx->hdr_buf[8]);
+	ctx->hdr.target_size = sys_get_le32(&ctx->hdr_buf[12]);
+	ctx->hdr.target_crc = sys_get_le32(&ctx->hdr_buf[16]);
+
+	if (ctx->cfg.header_cb) {
+		int err = ctx->cfg.header_cb(ctx->cfg.user_data, &ctx->hdr);
+
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	next_op(ctx);
+	return 0;
+}
+
+/* Checks that the operation stays within both images, then starts it. */
+static int start_op(struct delta_patch_ctx *ctx)
+{
+	uint32_t offset = (ctx->op == DELTA_PATCH_OP_INSERT) ? 0 : ctx->args[0];
+	uint32_t len = ctx->args[ctx->arg_count - 1];
+
+	if (len > ctx->hdr.target_size - ctx->written) {
+		return -EBADMSG;
+	}
+	if (ctx->op != DELTA_PATCH_OP_INSERT &&
+	    (offset > ctx->hdr.source_size || len > ctx->hdr.source_size - offset)) {
+		return -EBADMSG;
+	}
+
+	ctx->src_pos = offset;
+	ctx->remaining = len;
+
+	if (ctx->op != DELTA_PATCH_OP_COPY) {
+		ctx->state = DELTA_PATCH_STATE_DATA;
+		if (len == 0) {
+			next_op(ctx);
+		}
+		return 0;
+	}
+
+	/* COPY carries no payload, so it completes right away. */
+	while (ctx->remaining > 0) {
+		size_t chunk = MIN(ctx->remaining, sizeof(ctx->buf));
+		int err = ctx->cfg.read_cb(ctx->cfg.user_data, ctx->src_pos,
+					   ctx->buf, chunk);
+
+		if (err == 0) {
+			err = emit(ctx, ctx->buf, chunk);
+		}
+		if (err != 0) {
+			return err;
+		}
+		ctx->src_pos += chunk;
+		ctx->remaining -= chunk;
+	}
+
+	next_op(ctx);
+	return 0;
+}
+
+/* Consumes payload bytes of an ADD or INSERT; returns bytes used or errno. */
+static int process_data(struct delta_patch_ctx *ctx, const uint8_t *data,
+			size_t len)
+{
+	size_t chunk = MIN(len, ctx->remaining);
+	int err;
+
+	if (ctx->op == DELTA_PATCH_OP_INSERT) {
+		err = emit(ctx, data, chunk);
+	} else {
+		chunk = MIN(chunk, sizeof(ctx->buf));
+		err = ctx->cfg.read_cb(ctx->cfg.user_data, ctx->src_pos,
+				       ctx->buf, chunk);
+		if (err == 0) {
+			for (size_t i = 0; i < chunk; i++) {
+				ctx->buf[i] += data[i];
+			}
+			err = emit(ctx, ctx->buf, chunk);
+		}
+		ctx->src_pos += chunk;
+	}
+	if (err != 0) {
+		return err;
+	}
+
+	ctx->remaining -= chunk;
+	if (ctx->remaining == 0) {
+		next_op(ctx);
+	}
+	return chunk;
+}
+
+int delta_patch_init(struct delta_patch_ctx *ctx,
+		     const struct delta_patch_cfg *cfg)
+{
+	if (!cfg->read_cb || !cfg->write_cb) {
+		return -EINVAL;
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->cfg = *cfg;
+	ctx->state = DELTA_PATCH_STATE_HEADER;
+	return 0;
+}
+
+int delta_patch_write(struct delta_patch_ctx *ctx, const uint8_t *data,
+		      size_t len)
+{
+	int err = 0;
+
+	while (len > 0 && err == 0 && ctx->err == 0) {
+		uint8_t byte;
+		int used;
+
+		switch (ctx->state) {
+		case DELTA_PATCH_STATE_HEADER:
+			used = MIN(len, DELTA_PATCH_HEADER_SIZE - ctx->read);
+			memcpy(&ctx->hdr_buf[ctx->read], data, used);
+			ctx->read += used;
+			if (ctx->read == DELTA_PATCH_HEADER_SIZE) {
+				err = parse_header(ctx);
+			}
+			break;
+
+		case DELTA_PATCH_STATE_OPCODE:
+			ctx->op = *data;
+			used = 1;
+			ctx->arg_idx = 0;
+			ctx->arg_shift = 0;
+			ctx->args[0] = 0;
+			ctx->args[1] = 0;
+			if (ctx->op == DELTA_PATCH_OP_COPY || ctx->op == DELTA_PATCH_OP_ADD) {
+				ctx->arg_count = 2;
+			} else if (ctx->op == DELTA_PATCH_OP_INSERT) {
+				ctx->arg_count = 1;
+			} else {
+				err = -EBADMSG;
+				break;
+			}
+			ctx->state = DELTA_PATCH_STATE_ARGS;
+			break;
+
+		case DELTA_PATCH_STATE_ARGS:
+			byte = *data;
+			used = 1;
+			/* The fifth byte only has room for the top four bits. */
+			if (ctx->arg_shift > 28 || (ctx->arg_shift == 28 && (byte & 0x70))) {
+				err = -EBADMSG;
+				break;
+			}
+			ctx->args[ctx->arg_idx] |= (uint32_t)(byte & 0x7f) << ctx->arg_shift;
+			ctx->arg_shift += 7;
+			if (byte & 0x80) {
+				break;
+			}
+			ctx->arg_shift = 0;
+			if (++ctx->arg_idx == ctx->arg_count) {
+				err = start_op(ctx);
+			}
+			break;
+
+		case DELTA_PATCH_STATE_DATA:
+			used = process_data(ctx, data, len);
+			if (used < 0) {
+				err = used;
+				used = 0;
+			}
+			break;
+
+		case DELTA_PATCH_STATE_DONE:
+		default:
+			/* Trailing bytes after the complete target image. */
+			err = -EBADMSG;
+			used = 0;
+			break;
+		}
+
+		data += used;
+		len -= used;
+	}
+
+	if (err != 0) {
+		ctx->err = err;
+	}
+	return ctx->err;
+}
+
+int delta_patch_finish(struct delta_patch_ctx *ctx)
+{
+	if (ctx->err != 0) {
+		return ctx->err;
+	}
+	if (ctx->state != DELTA_PATCH_STATE_DONE) {
+		return -ENODATA;
+	}
+	if (ctx->crc != ctx->hdr.target_crc) {
+		return -EILSEQ;
+	}
+	return 0;
+}
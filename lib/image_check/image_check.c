@@ -0,0 +1,269 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include <image_check/image_check.h>
+
+#define TLV_INFO_SIZE 4
+#define TLV_HDR_SIZE 4
+
+enum image_check_state {
+	IMAGE_CHECK_STATE_HEADER = 0,
+	IMAGE_CHECK_STATE_VECTOR,
+	IMAGE_CHECK_STATE_BODY,
+	IMAGE_CHECK_STATE_TLV_INFO,
+	IMAGE_CHECK_STATE_TLV_HDR,
+	IMAGE_CHECK_STATE_TLV_VALUE,
+	IMAGE_CHECK_STATE_DONE,
+};
+
+/* Hashes the part of @p len bytes at the current position that is covered
+ * by the SHA-256 TLV, then moves past them.
+ */
+static void advance(struct image_check_ctx *ctx, const uint8_t *data, size_t len)
+{
+	if (ctx->pos < ctx->hashed_end) {
+		tc_sha256_update(&ctx->sha, data, MIN(len, ctx->hashed_end - ctx->pos));
+	}
+	ctx->pos += len;
+}
+
+/* Collects up to @p size bytes into ctx->buf; returns bytes used. */
+static size_t collect(struct image_check_ctx *ctx, const uint8_t *data, size_t len,
+		      size_t size)
+{
+	size_t used = MIN(len, size - ctx->buf_fill);
+
+	memcpy(&ctx->buf[ctx->buf_fill], data, used);
+	ctx->buf_fill += used;
+	return used;
+}
+
+static int parse_header(struct image_check_ctx *ctx)
+{
+	struct image_check_header *hdr = &ctx->hdr;
+
+	if (sys_get_le32(&ctx->buf[0]) != IMAGE_CHECK_MAGIC) {
+		return -EBADMSG;
+	}
+
+	hdr->load_addr = sys_get_le32(&ctx->buf[4]);
+	hdr->hdr_size = sys_get_le16(&ctx->buf[8]);
+	hdr->protect_tlv_size = sys_get_le16(&ctx->buf[10]);
+	hdr->img_size = sys_get_le32(&ctx->buf[12]);
+	hdr->flags = sys_get_le32(&ctx->buf[16]);
+	hdr->ver_major = ctx->buf[20];
+	hdr->ver_minor = ctx->buf[21];
+	hdr->ver_revision = sys_get_le16(&ctx->buf[22]);
+	hdr->ver_build = sys_get_le32(&ctx->buf[24]);
+
+	/* The payload must hold at least the vector words, and the TLV info
+	 * must still fit in the download.
+	 */
+	if (hdr->hdr_size < IMAGE_CHECK_HEADER_SIZE ||
+	    hdr->img_size < sizeof(hdr->vector) ||
+	    hdr->img_size > ctx->image_size) {
+		return -EBADMSG;
+	}
+	ctx->hashed_end = hdr->hdr_size + hdr->img_size + hdr->protect_tlv_size;
+	if (ctx->hashed_end + TLV_INFO_SIZE > ctx->image_size) {
+		return -EBADMSG;
+	}
+
+	ctx->buf_fill = 0;
+	ctx->state = IMAGE_CHECK_STATE_VECTOR;
+	return 0;
+}
+
+static int parse_vector(struct image_check_ctx *ctx)
+{
+	ctx->hdr.vector[0] = sys_get_le32(&ctx->buf[0]);
+	ctx->hdr.vector[1] = sys_get_le32(&ctx->buf[4]);
+	ctx->buf_fill = 0;
+	ctx->state = IMAGE_CHECK_STATE_BODY;
+
+	if (ctx->cfg.header_cb) {
+		return ctx->cfg.header_cb(ctx->cfg.user_data, &ctx->hdr);
+	}
+	return 0;
+}
+
+static void next_tlv(struct image_check_ctx *ctx)
+{
+	ctx->buf_fill = 0;
+	ctx->state = (ctx->pos == ctx->tlv_end) ?
+		IMAGE_CHECK_STATE_DONE : IMAGE_CHECK_STATE_TLV_HDR;
+}
+
+static int parse_tlv_info(struct image_check_ctx *ctx)
+{
+	if (sys_get_le16(&ctx->buf[0]) != IMAGE_CHECK_TLV_INFO_MAGIC) {
+		return -EBADMSG;
+	}
+
+	/* The unprotected TLVs end the image, so the sizes must agree. */
+	ctx->tlv_end = ctx->hashed_end + sys_get_le16(&ctx->buf[2]);
+	if (ctx->tlv_end != ctx->image_size) {
+		return -EBADMSG;
+	}
+
+	next_tlv(ctx);
+	return 0;
+}
+
+static int parse_tlv_hdr(struct image_check_ctx *ctx)
+{
+	ctx->tlv_type = sys_get_le16(&ctx->buf[0]);
+	ctx->tlv_len = sys_get_le16(&ctx->buf[2]);
+
+	if (ctx->tlv_len > ctx->tlv_end - ctx->pos) {
+		return -EBADMSG;
+	}
+	if (ctx->tlv_type == IMAGE_CHECK_TLV_SHA256) {
+		if (ctx->tlv_len != IMAGE_CHECK_HASH_SIZE) {
+			return -EBADMSG;
+		}
+		ctx->tlv_hash_fill = 0;
+	}
+
+	ctx->buf_fill = 0;
+	if (ctx->tlv_len == 0) {
+		next_tlv(ctx);
+	} else {
+		ctx->state = IMAGE_CHECK_STATE_TLV_VALUE;
+	}
+	return 0;
+}
+
+int image_check_init(struct image_check_ctx *ctx, uint32_t image_size,
+		     const struct image_check_cfg *cfg)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->cfg = *cfg;
+	ctx->image_size = image_size;
+	/* Everything is hashed until the header says where hashing stops. */
+	ctx->hashed_end = IMAGE_CHECK_HEADER_SIZE;
+	ctx->state = IMAGE_CHECK_STATE_HEADER;
+	tc_sha256_init(&ctx->sha);
+	return 0;
+}
+
+int image_check_update(struct image_check_ctx *ctx, const uint8_t *data,
+		       size_t len)
+{
+	int err = 0;
+
+	if (ctx->err == 0 && len > ctx->image_size - ctx->pos) {
+		ctx->err = -EFBIG;
+	}
+
+	while (len > 0 && err == 0 && ctx->err == 0) {
+		size_t used;
+		uint32_t vector_start = ctx->hdr.hdr_size;
+
+		switch (ctx->state) {
+		case IMAGE_CHECK_STATE_HEADER:
+			used = collect(ctx, data, len, IMAGE_CHECK_HEADER_SIZE);
+			advance(ctx, data, used);
+			if (ctx->buf_fill == IMAGE_CHECK_HEADER_SIZE) {
+				err = parse_header(ctx);
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_VECTOR:
+			if (ctx->pos < vector_start) {
+				/* Header padding. */
+				used = MIN(len, vector_start - ctx->pos);
+			} else {
+				used = collect(ctx, data, len, sizeof(ctx->hdr.vector));
+			}
+			advance(ctx, data, used);
+			if (ctx->buf_fill == sizeof(ctx->hdr.vector)) {
+				err = parse_vector(ctx);
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_BODY:
+			used = MIN(len, ctx->hashed_end - ctx->pos);
+			advance(ctx, data, used);
+			if (ctx->pos == ctx->hashed_end) {
+				ctx->state = IMAGE_CHECK_STATE_TLV_INFO;
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_TLV_INFO:
+			used = collect(ctx, data, len, TLV_INFO_SIZE);
+			advance(ctx, data, used);
+			if (ctx->buf_fill == TLV_INFO_SIZE) {
+				err = parse_tlv_info(ctx);
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_TLV_HDR:
+			used = collect(ctx, data, len, TLV_HDR_SIZE);
+			advance(ctx, data, used);
+			if (ctx->buf_fill == TLV_HDR_SIZE) {
+				err = parse_tlv_hdr(ctx);
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_TLV_VALUE:
+			used = MIN(len, ctx->tlv_len);
+			if (ctx->tlv_type == IMAGE_CHECK_TLV_SHA256) {
+				memcpy(&ctx->tlv_hash[ctx->tlv_hash_fill], data, used);
+				ctx->tlv_hash_fill += used;
+			}
+			advance(ctx, data, used);
+			ctx->tlv_len -= used;
+			if (ctx->tlv_len == 0) {
+				next_tlv(ctx);
+			}
+			break;
+
+		case IMAGE_CHECK_STATE_DONE:
+		default:
+			err = -EFBIG;
+			used = 0;
+			break;
+		}
+
+		data += used;
+		len -= used;
+	}
+
+	if (err != 0) {
+		ctx->err = err;
+	}
+	return ctx->err;
+}
+
+int image_check_finish(struct image_check_ctx *ctx)
+{
+	uint8_t digest[IMAGE_CHECK_HASH_SIZE];
+
+	if (ctx->err != 0) {
+		return ctx->err;
+	}
+	if (ctx->state != IMAGE_CHECK_STATE_DONE) {
+		return -ENODATA;
+	}
+	if (ctx->tlv_hash_fill != IMAGE_CHECK_HASH_SIZE) {
+		return -EBADMSG;
+	}
+
+	tc_sha256_final(digest, &ctx->sha);
+	if (memcmp(digest, ctx->tlv_hash, sizeof(digest)) != 0) {
+		return -EILSEQ;
+	}
+	if (ctx->cfg.expected_hash &&
+	    memcmp(digest, ctx->cfg.expected_hash, sizeof(digest)) != 0) {
+		return -EILSEQ;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include <lat_hist/lat_hist.h>
+
+#define BUCKET_NAME(n, name) { offsetof(struct stats_lat_hist, bucket[n]), name }
+
+/* Shared by every histogram, since they all have the same entries. */
+STATS_NAME_START(lat_hist)
+STATS_NAME(lat_hist, count)
+STATS_NAME(lat_hist, max_us)
+#if defined(CONFIG_STATS_NAMES)
+BUCKET_NAME(0, "lt2"),
+BUCKET_NAME(1, "lt4"),
+BUCKET_NAME(2, "lt8"),
+BUCKET_NAME(3, "lt16"),
+BUCKET_NAME(4, "lt32"),
+BUCKET_NAME(5, "lt64"),
+BUCKET_NAME(6, "lt128"),
+BUCKET_NAME(7, "lt256"),
+BUCKET_NAME(8, "lt512"),
+BUCKET_NAME(9, "lt1k"),
+BUCKET_NAME(10, "lt2k"),
+BUCKET_NAME(11, "lt4k"),
+BUCKET_NAME(12, "lt8k"),
+BUCKET_NAME(13, "lt16k"),
+BUCKET_NAME(14, "lt32k"),
+BUCKET_NAME(15, "lt64k"),
+BUCKET_NAME(16, "lt128k"),
+BUCKET_NAME(17, "lt256k"),
+BUCKET_NAME(18, "lt512k"),
+BUCKET_NAME(19, "lt1M"),
+BUCKET_NAME(20, "lt2M"),
+BUCKET_NAME(21, "lt4M"),
+BUCKET_NAME(22, "lt8M"),
+BUCKET_NAME(23, "ge8M"),
+#endif
+STATS_NAME_END(lat_hist);
+
+#if defined(CONFIG_STATS_NAMES)
+BUILD_ASSERT(ARRAY_SIZE(STATS_NAME_MAP_NAME(lat_hist)) == 2 + LAT_HIST_BUCKETS,
+	     "every bucket needs a name");
+#endif
+
+/* Without atomic instructions (ARMv6-M), Zephyr's own atomics fall back to
+ * locking interrupts too.
+ */
+static inline void add_one(uint32_t *val)
+{
+#if defined(CONFIG_ATOMIC_OPERATIONS_BUILTIN)
+	(void)__atomic_fetch_add(val, 1, __ATOMIC_RELAXED);
+#else
+	unsigned int key = irq_lock();
+
+	(*val)++;
+	irq_unlock(key);
+#endif
+}
+
+static inline void raise_to(uint32_t *val, uint32_t new_val)
+{
+#if defined(CONFIG_ATOMIC_OPERATIONS_BUILTIN)
+	uint32_t old = __atomic_load_n(val, __ATOMIC_RELAXED);
+
+	while (new_val > old &&
+	       !__atomic_compare_exchange_n(val, &old, new_val, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+#else
+	unsigned int key = irq_lock();
+
+	if (new_val > *val) {
+		*val = new_val;
+	}
+	irq_unlock(key);
+#endif
+}
+
+int lat_hist_register(struct stats_lat_hist *hist, const char *name)
+{
+	memset(hist, 0, sizeof(*hist));
+	return stats_init_and_reg(&hist->s_hdr, STATS_SIZE_32,
+				  (sizeof(*hist) - sizeof(struct stats_hdr)) / sizeof(uint32_t),
+				  STATS_NAME_INIT_PARMS(lat_hist), name);
+}
+
+void lat_hist_record(struct stats_lat_hist *hist, uint32_t us)
+{
+	add_one(&hist->bucket[lat_hist_bucket(us)]);
+	add_one(&hist->count);
+	raise_to(&hist->max_us, us);
+}
@@ -0,0 +1,92 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include <link_frame/link_frame.h>
+
+int link_frame_encode_header(uint8_t *buf, size_t buf_size,
+			     const struct link_frame_header *hdr)
+{
+	if (buf_size < LINK_FRAME_HEADER_SIZE) {
+		return -ENOBUFS;
+	}
+
+	buf[0] = hdr->type;
+	buf[1] = hdr->id;
+	sys_put_le16(hdr->length, &buf[2]);
+	return LINK_FRAME_HEADER_SIZE;
+}
+
+int link_frame_init(struct link_frame_ctx *ctx, const struct link_frame_cfg *cfg)
+{
+	if (!cfg->frame_cb) {
+		return -EINVAL;
+	}
+
+	memset(ctx, 0, offsetof(struct link_frame_ctx, payload));
+	ctx->cfg = *cfg;
+	return 0;
+}
+
+/* Hands a complete frame to the callback and starts the next one. */
+static int deliver(struct link_frame_ctx *ctx)
+{
+	ctx->fill = 0;
+	return ctx->cfg.frame_cb(ctx->cfg.user_data, &ctx->hdr, ctx->payload);
+}
+
+int link_frame_feed(struct link_frame_ctx *ctx, const uint8_t *data, size_t len)
+{
+	int err = 0;
+
+	while (len > 0 && err == 0 && ctx->err == 0) {
+		size_t used;
+
+		if (ctx->fill < LINK_FRAME_HEADER_SIZE) {
+			used = MIN(len, LINK_FRAME_HEADER_SIZE - ctx->fill);
+			memcpy(&ctx->hdr_buf[ctx->fill], data, used);
+			ctx->fill += used;
+			if (ctx->fill == LINK_FRAME_HEADER_SIZE) {
+				ctx->hdr.type = ctx->hdr_buf[0];
+				ctx->hdr.id = ctx->hdr_buf[1];
+				ctx->hdr.length = sys_get_le16(&ctx->hdr_buf[2]);
+				if (ctx->hdr.length > sizeof(ctx->payload)) {
+					err = -EMSGSIZE;
+				} else if (ctx->hdr.length == 0) {
+					err = deliver(ctx);
+				}
+			}
+		} else {
+			uint32_t pos = ctx->fill - LINK_FRAME_HEADER_SIZE;
+
+			used = MIN(len, ctx->hdr.length - pos);
+			memcpy(&ctx->payload[pos], data, used);
+			ctx->fill += used;
+			if (pos + used == ctx->hdr.length) {
+				err = deliver(ctx);
+			}
+		}
+
+		data += used;
+		len -= used;
+	}
+
+	if (err != 0) {
+		ctx->err = err;
+	}
+	return ctx->err;
+}
+
+int link_frame_finish(struct link_frame_ctx *ctx)
+{
+	if (ctx->err != 0) {
+		return ctx->err;
+	}
+	return ctx->fill == 0 ? 0 : -ENODATA;
+}
@@ -0,0 +1,171 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/printk.h>
+
+#include <req_trace/req_trace.h>
+
+static const char *const stage_names[] = {
+	[REQ_TRACE_TRIGGER] = "trigger",
+	[REQ_TRACE_START] = "start",
+	[REQ_TRACE_DNS] = "dns",
+	[REQ_TRACE_DNS_DONE] = "dns_done",
+	[REQ_TRACE_CONNECT] = "connect",
+	[REQ_TRACE_CONNECT_OK] = "connect_ok",
+	[REQ_TRACE_CONNECTED] = "connected",
+	[REQ_TRACE_SEND] = "send",
+	[REQ_TRACE_SEND_PROMPT] = "send_prompt",
+	[REQ_TRACE_SENT] = "sent",
+	[REQ_TRACE_RECV] = "recv",
+	[REQ_TRACE_RECV_WAIT] = "recv_wait",
+	[REQ_TRACE_RECV_READY] = "recv_ready",
+	[REQ_TRACE_RECV_DONE] = "recv_done",
+	[REQ_TRACE_DECODE] = "decode",
+	[REQ_TRACE_DECODED] = "decoded",
+	[REQ_TRACE_END] = "end",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(stage_names) == REQ_TRACE_STAGE_COUNT, "every stage needs a name");
+
+static struct k_spinlock lock;
+/* First trigger since the last trace; source is NULL if there was none. */
+static const char *pending_source;
+static int64_t pending_ticks;
+/* Running trace; owner is NULL when there is none. */
+static k_tid_t owner;
+static int64_t base_ticks;
+static struct req_trace active;
+static struct req_trace last;
+static bool have_last;
+static uint32_t next_id;
+
+const char *req_trace_stage_name(enum req_trace_stage stage)
+{
+	return stage < ARRAY_SIZE(stage_names) ? stage_names[stage] : "?";
+}
+
+int req_trace_format(const struct req_trace *trace, char *buf, size_t len)
+{
+	uint32_t total = trace->count > 0 ? trace->events[trace->count - 1].us : 0;
+	uint32_t prev = 0;
+	size_t pos;
+
+	if (len == 0) {
+		return 0;
+	}
+	pos = snprintk(buf, len, "#%u %s (%s) %u ms:", trace->id, trace->name,
+		       trace->source != NULL ? trace->source : "-", total / 1000);
+	for (uint16_t i = 0; i < trace->count && pos < len; i++) {
+		const struct req_trace_event *event = &trace->events[i];
+
+		if (event->stage == REQ_TRACE_TRIGGER) {
+			continue;
+		}
+		pos += snprintk(buf + pos, len - pos, " %s+%u",
+				req_trace_stage_name(event->stage), (event->us - prev) / 1000);
+		prev = event->us;
+	}
+	if (pos < len && trace->dropped > 0) {
+		pos += snprintk(buf + pos, len - pos, " (%u dropped)", trace->dropped);
+	}
+	if (pos < len && trace->result != 0) {
+		pos += snprintk(buf + pos, len - pos, " err %d", trace->result);
+	}
+	return MIN(pos, len - 1);
+}
+
+void req_trace_trigger(const char *source)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (pending_source == NULL) {
+		pending_source = source;
+		pending_ticks = k_uptime_ticks();
+	}
+	k_spin_unlock(&lock, key);
+}
+
+static void add(enum req_trace_stage stage, int64_t ticks)
+{
+	if (active.count >= ARRAY_SIZE(active.events)) {
+		active.dropped++;
+		return;
+	}
+	active.events[active.count].stage = stage;
+	active.events[active.count].us = k_ticks_to_us_floor64(ticks - base_ticks);
+	active.count++;
+}
+
+void req_trace_begin(const char *name)
+{
+	int64_t now = k_uptime_ticks();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (owner != NULL || k_is_in_isr()) {
+		k_spin_unlock(&lock, key);
+		return;
+	}
+	/* A trigger nothing picked up in time belongs to no trace. */
+	if (pending_source != NULL &&
+	    now - pending_ticks > k_ms_to_ticks_ceil64(CONFIG_REQ_TRACE_TRIGGER_MAX_AGE_MS)) {
+		pending_source = NULL;
+	}
+	memset(&active, 0, sizeof(active));
+	active.id = next_id++;
+	active.name = name;
+	active.source = pending_source;
+	base_ticks = pending_source != NULL ? pending_ticks : now;
+	pending_source = NULL;
+	owner = k_current_get();
+	k_spin_unlock(&lock, key);
+
+	if (active.source != NULL) {
+		add(REQ_TRACE_TRIGGER, base_ticks);
+	}
+	add(REQ_TRACE_START, now);
+}
+
+void req_trace_mark(enum req_trace_stage stage)
+{
+	/* Only the owner changes the running trace, so it needs no lock. */
+	if (k_is_in_isr() || owner != k_current_get()) {
+		return;
+	}
+	add(stage, k_uptime_ticks());
+}
+
+bool req_trace_end(int result)
+{
+	k_spinlock_key_t key;
+
+	if (k_is_in_isr() || owner != k_current_get()) {
+		return false;
+	}
+	add(REQ_TRACE_END, k_uptime_ticks());
+	active.result = result;
+
+	key = k_spin_lock(&lock);
+	last = active;
+	have_last = true;
+	owner = NULL;
+	k_spin_unlock(&lock, key);
+	return true;
+}
+
+int req_trace_last(struct req_trace *trace)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int ret = -ENODATA;
+
+	if (have_last) {
+		*trace = last;
+		ret = 0;
+	}
+	k_spin_unlock(&lock, key);
+	return ret;
+}
@@ -0,0 +1,146 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/sys/util.h>
+
+#include <upload_sched/upload_sched.h>
+
+#define RSSI_FRAC_SHIFT 4
+
+/* Milliseconds from @p since to @p now, across clock wraparound. */
+static uint32_t elapsed(uint32_t now, uint32_t since)
+{
+	return now - since;
+}
+
+int upload_sched_init(struct upload_sched_ctx *ctx, const struct upload_sched_cfg *cfg)
+{
+	if (cfg->classes == NULL || cfg->num_classes == 0 ||
+	    cfg->num_classes > CONFIG_UPLOAD_SCHED_MAX_CLASSES) {
+		return -EINVAL;
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->cfg = *cfg;
+	return 0;
+}
+
+void upload_sched_signal(struct upload_sched_ctx *ctx, int16_t rssi_dbm, uint32_t now_ms)
+{
+	int32_t sample = (int32_t)rssi_dbm * (1 << RSSI_FRAC_SHIFT);
+
+	if (rssi_dbm == UPLOAD_SCHED_RSSI_UNKNOWN) {
+		ctx->have_sample = false;
+		return;
+	}
+
+	if (!ctx->have_sample || upload_sched_rssi(ctx, now_ms) == UPLOAD_SCHED_RSSI_UNKNOWN) {
+		ctx->rssi_avg = sample;
+	} else {
+		ctx->rssi_avg += (sample - ctx->rssi_avg) / (1 << ctx->cfg.smoothing_shift);
+	}
+	ctx->have_sample = true;
+	ctx->sample_ms = now_ms;
+}
+
+int16_t upload_sched_rssi(const struct upload_sched_ctx *ctx, uint32_t now_ms)
+{
+	if (!ctx->have_sample) {
+		return UPLOAD_SCHED_RSSI_UNKNOWN;
+	}
+	if (ctx->cfg.max_sample_age_ms != 0 &&
+	    elapsed(now_ms, ctx->sample_ms) > ctx->cfg.max_sample_age_ms) {
+		return UPLOAD_SCHED_RSSI_UNKNOWN;
+	}
+	/* Round to the nearest dBm, also for negative values. */
+	return (ctx->rssi_avg + (1 << (RSSI_FRAC_SHIFT - 1))) >> RSSI_FRAC_SHIFT;
+}
+
+int upload_sched_request(struct upload_sched_ctx *ctx, uint8_t cls, uint32_t now_ms)
+{
+	if (cls >= ctx->cfg.num_classes) {
+		return -EINVAL;
+	}
+
+	ctx->stats[cls].requests++;
+	if (!(ctx->pending & BIT(cls))) {
+		ctx->pending |= BIT(cls);
+		ctx->requested_ms[cls] = now_ms;
+	}
+	return 0;
+}
+
+static void account(struct upload_sched_ctx *ctx, uint8_t cls, uint32_t now_ms)
+{
+	struct upload_sched_class_stats *stats = &ctx->stats[cls];
+	uint32_t waited = elapsed(now_ms, ctx->requested_ms[cls]);
+
+	stats->wait_ms += waited;
+	stats->max_wait_ms = MAX(stats->max_wait_ms, waited);
+}
+
+uint32_t upload_sched_take(struct upload_sched_ctx *ctx, uint32_t now_ms)
+{
+	int16_t rssi = upload_sched_rssi(ctx, now_ms);
+	uint32_t due = 0;
+
+	for (uint8_t cls = 0; cls < ctx->cfg.num_classes; cls++) {
+		const struct upload_sched_class *class = &ctx->cfg.classes[cls];
+
+		if (!(ctx->pending & BIT(cls))) {
+			continue;
+		}
+		if (rssi != UPLOAD_SCHED_RSSI_UNKNOWN && rssi >= class->min_rssi) {
+			ctx->stats[cls].by_signal++;
+		} else if (elapsed(now_ms, ctx->requested_ms[cls]) >= class->max_delay_ms) {
+			ctx->stats[cls].by_deadline++;
+		} else {
+			continue;
+		}
+		due |= BIT(cls);
+	}
+
+	if (due != 0) {
+		for (uint8_t cls = 0; cls < ctx->cfg.num_classes; cls++) {
+			if ((ctx->pending & ~due & BIT(cls)) &&
+			    ctx->cfg.classes[cls].piggyback) {
+				ctx->stats[cls].by_piggyback++;
+				due |= BIT(cls);
+			}
+		}
+	}
+
+	for (uint8_t cls = 0; cls < ctx->cfg.num_classes; cls++) {
+		if (due & BIT(cls)) {
+			account(ctx, cls, now_ms);
+		}
+	}
+	ctx->pending &= ~due;
+	return due;
+}
+
+int32_t upload_sched_next(const struct upload_sched_ctx *ctx, uint32_t now_ms)
+{
+	int32_t next = -1;
+
+	for (uint8_t cls = 0; cls < ctx->cfg.num_classes; cls++) {
+		uint32_t waited;
+		uint32_t left;
+
+		if (!(ctx->pending & BIT(cls))) {
+			continue;
+		}
+		waited = elapsed(now_ms, ctx->requested_ms[cls]);
+		left = ctx->cfg.classes[cls].max_delay_ms - MIN(waited,
+			ctx->cfg.classes[cls].max_delay_ms);
+		left = MIN(left, (uint32_t)INT32_MAX);
+		if (next < 0 || (int32_t)left < next) {
+			next = left;
+		}
+	}
+	return next;
+}
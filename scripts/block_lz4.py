@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''block_lz4.py
+
+Compresses images into the block LZ4 stream decoded by lib/block_lz4 (see
+include/block_lz4/block_lz4.h). The backend runs
+
+    block_lz4.py compress zephyr.signed.bin zephyr.signed.lz4
+
+and serves the result for OTAImageFormat OTA_IMAGE_FORMAT_COMPRESSED.
+`decompress` reproduces the device side on the host, for checking. Each
+block is a standard raw LZ4 block, so the output also decodes with
+lz4.block.decompress(data, uncompressed_size=block_size).'''
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b'LZB1'
+STORED = 0x80000000
+# Must not exceed CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE on the device.
+DEFAULT_BLOCK_SIZE = 4096
+
+MIN_MATCH = 4
+# LZ4 block rules: the last match starts at least MFLIMIT bytes before the
+# end of the block and the last LAST_LITERALS bytes are always literals.
+MFLIMIT = 12
+LAST_LITERALS = 5
+MAX_OFFSET = 0xffff
+
+
+def length_bytes(value):
+    out = bytearray()
+    while value >= 0xff:
+        out.append(0xff)
+        value -= 0xff
+    out.append(value)
+    return bytes(out)
+
+
+def sequence(literals, offset=None, match_len=0):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if offset is not None:
+        token |= min(match_len - MIN_MATCH, 15)
+    out = bytearray([token])
+    if lit_len >= 15:
+        out += length_bytes(lit_len - 15)
+    out += literals
+    if offset is not None:
+        out += struct.pack('<H', offset)
+        if match_len - MIN_MATCH >= 15:
+            out += length_bytes(match_len - MIN_MATCH - 15)
+    return bytes(out)
+
+
+def compress_block(block):
+    '''Greedy LZ4 compression of one independent block.'''
+    out = bytearray()
+    table = {}
+    anchor = pos = 0
+    limit = len(block) - MFLIMIT
+    while pos < limit:
+        key = block[pos:pos + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = pos
+        if cand is None or pos - cand > MAX_OFFSET:
+            pos += 1
+            continue
+        length = MIN_MATCH
+        while (pos + length < len(block) - LAST_LITERALS
+               and block[cand + length] == block[pos + length]):
+            length += 1
+        out += sequence(block[anchor:pos], pos - cand, length)
+        pos += length
+        anchor = pos
+    out += sequence(block[anchor:])
+    return bytes(out)
+
+
+def compress(image, block_size=DEFAULT_BLOCK_SIZE):
+    out = bytearray(MAGIC + struct.pack('<III', block_size, len(image), zlib.crc32(image)))
+    for start in range(0, len(image), block_size):
+        block = image[start:start + block_size]
+        data = compress_block(block)
+        if len(data) >= len(block):
+            out += struct.pack('<I', len(block) | STORED) + block
+        else:
+            out += struct.pack('<I', len(data)) + data
+    return bytes(out)
+
+
+def decompress_block(data, size):
+    out = bytearray()
+    pos = 0
+    while True:
+        token = data[pos]
+        pos += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                lit_len += byte
+                if byte != 0xff:
+                    break
+        out += data[pos:pos + lit_len]
+        pos += lit_len
+        if pos == len(data):
+            break
+        offset = data[pos] | data[pos + 1] << 8
+        pos += 2
+        match_len = token & 15
+        if match_len == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                match_len += byte
+                if byte != 0xff:
+                    break
+        if offset == 0 or offset > len(out):
+            raise ValueError('bad match offset')
+        for _ in range(match_len + MIN_MATCH):
+            out.append(out[-offset])
+    if len(out) != size:
+        raise ValueError('bad block size')
+    return bytes(out)
+
+
+def decompress(stream):
+    if stream[:4] != MAGIC:
+        raise ValueError('bad magic')
+    block_size, image_size, image_crc = struct.unpack_from('<III', stream, 4)
+    out = bytearray()
+    pos = 16
+    while len(out) < image_size:
+        length, = struct.unpack_from('<I', stream, pos)
+        pos += 4
+        size = min(block_size, image_size - len(out))
+        data = stream[pos:pos + (length & ~STORED)]
+        pos += len(data)
+        out += data if length & STORED else decompress_block(data, size)
+    if zlib.crc32(out) != image_crc:
+        raise ValueError('image CRC mismatch')
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='cmd', required=True)
+    c = sub.add_parser('compress', help='compress an image')
+    c.add_argument('--block-size', type=int, default=DEFAULT_BLOCK_SIZE)
+    c.add_argument('input')
+    c.add_argument('output')
+    d = sub.add_parser('decompress', help='decompress on the host')
+    d.add_argument('input')
+    d.add_argument('output')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+
+    if args.cmd == 'compress':
+        out = compress(data, args.block_size)
+        print(f'{len(data)} -> {len(out)} bytes ({100 * len(out) / max(len(data), 1):.1f}%)')
+    else:
+        out = decompress(data)
+    with open(args.output, 'wb') as f:
+        f.write(out)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,342 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''coap_server.py
+
+Stand-in CoAP backend for CONFIG_APP_BACKEND_COAP (see app/coap.conf).
+
+    coap_server.py serve [--port 5683] [--image zephyr.signed.bin] [--loss 0.1]
+
+answers
+
+    POST /telemetry_series  TelemetrySeries -> 2.04 StatusUpdateResponse
+    POST /ota               OTAUpdateRequest -> 2.04 OTAUpdateResponse
+    GET  /fw/<image name>   the image, in Block2 blocks with Size2 and ETag
+
+Confirmable requests get piggybacked responses, and retransmissions are
+answered from a cache the way RFC 7252 deduplication requires. --loss drops
+that fraction of incoming datagrams to exercise the device's retransmits.
+
+    coap_server.py client --image zephyr.signed.bin [--block 512]
+
+plays the device against a running server: it posts a TelemetrySeries,
+queries /ota, then fetches the offered image with Block2 and compares it
+with the local file. Like link_server.py, the protobuf classes are
+generated from app/api/api.proto with protoc on startup.'''
+
+import argparse
+import asyncio
+import hashlib
+import os
+import random
+import struct
+import sys
+
+from link_server import load_api
+
+DEFAULT_PORT = 5683
+
+CON, NON, ACK, RST = range(4)
+GET, POST = 1, 2
+CREATED, CHANGED, CONTENT = 0x41, 0x44, 0x45
+BAD_REQUEST, NOT_FOUND, NOT_ALLOWED = 0x80, 0x84, 0x85
+
+OPT_ETAG = 4
+OPT_URI_PATH = 11
+OPT_CONTENT_FORMAT = 12
+OPT_BLOCK2 = 23
+OPT_SIZE2 = 28
+
+ACK_TIMEOUT = 2.0
+MAX_RETRANSMIT = 4
+MAX_SZX = 6  # 1024 byte blocks
+
+
+class Message:
+    def __init__(self, mtype, code, mid, token=b'', options=None, payload=b''):
+        self.mtype = mtype
+        self.code = code
+        self.mid = mid
+        self.token = token
+        self.options = options or []
+        self.payload = payload
+
+    def option(self, number):
+        return [value for num, value in self.options if num == number]
+
+    def encode(self):
+        out = bytearray(struct.pack('!BBH', 0x40 | self.mtype << 4 | len(self.token),
+                                    self.code, self.mid))
+        out += self.token
+        last = 0
+        for number, value in sorted(self.options, key=lambda o: o[0]):
+            delta, length = number - last, len(value)
+            last = number
+            ext = b''
+            nibbles = []
+            for field in (delta, length):
+                if field < 13:
+                    nibbles.append(field)
+                elif field < 269:
+                    nibbles.append(13)
+                    ext += bytes([field - 13])
+                else:
+                    nibbles.append(14)
+                    ext += struct.pack('!H', field - 269)
+            out.append(nibbles[0] << 4 | nibbles[1])
+            out += ext + value
+        if self.payload:
+            out += b'\xff' + self.payload
+        return bytes(out)
+
+    @classmethod
+    def decode(cls, data):
+        first, code, mid = struct.unpack_from('!BBH', data)
+        if first >> 6 != 1:
+            raise ValueError('not CoAP version 1')
+        tkl = first & 0xf
+        pos = 4 + tkl
+        msg = cls((first >> 4) & 3, code, mid, data[4:pos])
+        number = 0
+        while pos < len(data):
+            if data[pos] == 0xff:
+                msg.payload = data[pos + 1:]
+                break
+            delta, length = data[pos] >> 4, data[pos] & 0xf
+            pos += 1
+            fields = []
+            for field in (delta, length):
+                if field == 13:
+                    field = data[pos] + 13
+                    pos += 1
+                elif field == 14:
+                    field = struct.unpack_from('!H', data, pos)[0] + 269
+                    pos += 2
+                elif field == 15:
+                    raise ValueError('reserved option nibble')
+                fields.append(field)
+            number += fields[0]
+            msg.options.append((number, data[pos:pos + fields[1]]))
+            pos += fields[1]
+        return msg
+
+
+def uint_option(value):
+    return value.to_bytes((value.bit_length() + 7) // 8, 'big')
+
+
+def option_uint(raw):
+    return int.from_bytes(raw, 'big')
+
+
+def block_option(num, more, szx):
+    return uint_option(num << 4 | more << 3 | szx)
+
+
+def parse_block(raw):
+    value = option_uint(raw)
+    return value >> 4, bool(value & 8), value & 7
+
+
+class Server(asyncio.DatagramProtocol):
+    def __init__(self, api, image, loss):
+        self.api = api
+        self.loss = loss
+        self.image = None
+        self.image_path = ''
+        if image:
+            with open(image, 'rb') as f:
+                self.image = f.read()
+            self.image_path = 'fw/' + os.path.basename(image)
+            self.etag = hashlib.sha256(self.image).digest()[:8]
+        self.cache = {}
+        self.transport = None
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def datagram_received(self, data, addr):
+        if random.random() < self.loss:
+            return
+        try:
+            request = Message.decode(data)
+        except (ValueError, struct.error, IndexError):
+            return
+        if request.mtype not in (CON, NON) or request.code == 0:
+            return
+
+        key = (addr, request.mid)
+        if key in self.cache:
+            self.transport.sendto(self.cache[key], addr)
+            return
+
+        code, options, payload = self.handle(request)
+        mtype = ACK if request.mtype == CON else NON
+        mid = request.mid if mtype == ACK else random.getrandbits(16)
+        reply = Message(mtype, code, mid, request.token, options, payload).encode()
+        self.cache[key] = reply
+        if len(self.cache) > 256:
+            self.cache.pop(next(iter(self.cache)))
+        self.transport.sendto(reply, addr)
+
+    def handle(self, request):
+        api = self.api
+        path = '/'.join(v.decode() for v in request.option(OPT_URI_PATH))
+        try:
+            if request.code == POST and path == 'telemetry_series':
+                series = api.TelemetrySeries.FromString(request.payload)
+                print(f'{series.device_id} boot {series.boot_count}: '
+                      f'{len(series.uptime_delta_ms)} samples in '
+                      f'{len(request.payload)} bytes')
+                for group in series.stats:
+                    counters = ' '.join(f'{c.name}={c.value}' for c in group.counters)
+                    print(f'  {group.name}: {counters}')
+                for thread in series.threads:
+                    print(f'  {thread.name}: {thread.cpu_permille / 10:.1f}% cpu, '
+                          f'stack {thread.stack_used}/{thread.stack_size}')
+                reply = api.StatusUpdateResponse(message='ok')
+                return CHANGED, [], reply.SerializeToString()
+            if request.code == POST and path == 'ota':
+                query = api.OTAUpdateRequest.FromString(request.payload)
+                print(f'{query.device_id}: OTA query from {query.version}')
+                reply = api.OTAUpdateResponse(do_update=self.image is not None,
+                                              path='/' + self.image_path)
+                return CHANGED, [], reply.SerializeToString()
+        except Exception as e:  # noqa: BLE001 - any decode error is a bad request
+            return BAD_REQUEST, [], str(e).encode()
+        if path == self.image_path and self.image is not None:
+            if request.code != GET:
+                return NOT_ALLOWED, [], b''
+            return self.block(request)
+        return NOT_FOUND, [], b''
+
+    def block(self, request):
+        num, szx = 0, MAX_SZX
+        if request.option(OPT_BLOCK2):
+            num, _, szx = parse_block(request.option(OPT_BLOCK2)[0])
+            if szx > MAX_SZX:
+                # A smaller block keeps the same offset at a higher number.
+                num <<= szx - MAX_SZX
+                szx = MAX_SZX
+        size = 16 << szx
+        start = num * size
+        if start >= len(self.image) and len(self.image) > 0:
+            return BAD_REQUEST, [], b'block out of range'
+        chunk = self.image[start:start + size]
+        more = start + size < len(self.image)
+        options = [(OPT_ETAG, self.etag),
+                   (OPT_BLOCK2, block_option(num, more, szx))]
+        if request.option(OPT_SIZE2):
+            options.append((OPT_SIZE2, uint_option(len(self.image))))
+        if num == 0:
+            print(f'serving {self.image_path} ({len(self.image)} bytes)')
+        return CONTENT, options, chunk
+
+
+async def serve(args):
+    loop = asyncio.get_running_loop()
+    await loop.create_datagram_endpoint(
+        lambda: Server(load_api(), args.image, args.loss),
+        local_addr=(args.bind, args.port))
+    print(f'Listening on {args.bind}:{args.port}')
+    await asyncio.Event().wait()
+
+
+class Client(asyncio.DatagramProtocol):
+    def __init__(self):
+        self.queue = asyncio.Queue()
+        self.mid = random.getrandbits(16)
+        self.transport = None
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def datagram_received(self, data, addr):
+        self.queue.put_nowait(Message.decode(data))
+
+    async def request(self, code, path, payload=b'', options=()):
+        self.mid = (self.mid + 1) & 0xffff
+        token = os.urandom(8)
+        opts = [(OPT_URI_PATH, seg.encode()) for seg in path.strip('/').split('/')]
+        opts += list(options)
+        data = Message(CON, code, self.mid, token, opts, payload).encode()
+        timeout = ACK_TIMEOUT
+        for _ in range(MAX_RETRANSMIT + 1):
+            self.transport.sendto(data)
+            try:
+                while True:
+                    reply = await asyncio.wait_for(self.queue.get(), timeout)
+                    if reply.token == token:
+                        return reply
+            except asyncio.TimeoutError:
+                timeout *= 2
+        sys.exit(f'{path}: no response')
+
+
+async def client(args):
+    api = load_api()
+    loop = asyncio.get_running_loop()
+    _, coap = await loop.create_datagram_endpoint(
+        Client, remote_addr=(args.host, args.port))
+
+    series = api.TelemetrySeries(device_id='coap-test', boot_count=1,
+                                 base_uptime_ms=1000)
+    series.uptime_delta_ms.extend([0] + [300000] * 7)
+    reply = await coap.request(POST, '/telemetry_series', series.SerializeToString())
+    if reply.code != CHANGED:
+        sys.exit(f'telemetry_series: code {reply.code:#x}')
+
+    query = api.OTAUpdateRequest(device_id='coap-test', version='0.0.0')
+    reply = await coap.request(POST, '/ota', query.SerializeToString())
+    offer = api.OTAUpdateResponse.FromString(reply.payload)
+    if not offer.do_update:
+        sys.exit('server offered no update')
+
+    szx = (args.block // 16).bit_length() - 1
+    image = bytearray()
+    total = None
+    num = 0
+    while True:
+        options = [(OPT_BLOCK2, block_option(num, False, szx))]
+        if num == 0:
+            options.append((OPT_SIZE2, b''))
+        reply = await coap.request(GET, offer.path, options=options)
+        if reply.code != CONTENT:
+            sys.exit(f'{offer.path}: code {reply.code:#x}')
+        if num == 0:
+            total = option_uint(reply.option(OPT_SIZE2)[0])
+        num, more, szx = parse_block(reply.option(OPT_BLOCK2)[0])
+        image += reply.payload
+        if not more:
+            break
+        num += 1
+
+    with open(args.image, 'rb') as f:
+        expected = f.read()
+    if bytes(image) != expected or total != len(expected):
+        sys.exit(f'image mismatch: got {len(image)} of {total} bytes')
+    print(f'fetched {len(image)} bytes in {num + 1} blocks')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('serve', help='run the stand-in backend')
+    p.add_argument('--bind', default='0.0.0.0')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT)
+    p.add_argument('--image', help='OTA image to offer')
+    p.add_argument('--loss', type=float, default=0.0,
+                   help='fraction of datagrams to drop')
+    p = sub.add_parser('client', help='exercise a server like the device would')
+    p.add_argument('--host', default='127.0.0.1')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT)
+    p.add_argument('--image', required=True, help='image the server offers')
+    p.add_argument('--block', type=int, default=512, choices=[16 << i for i in range(7)])
+    args = parser.parse_args()
+
+    asyncio.run(serve(args) if args.command == 'serve' else client(args))
+
+
+if __name__ == '__main__':
+    main()
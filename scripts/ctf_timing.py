@@ -0,0 +1,457 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''ctf_timing.py
+
+Turns a CTF trace recorded with app/tracing.conf into timing breakdowns and
+a Chrome trace. Capture the stream from the tracing UART (or, on
+native_posix, the -trace-file of zephyr.exe) and run
+
+    ctf_timing.py channel0_0 --chrome trace.json
+
+with the Zephyr tree in $ZEPHYR_BASE, or pass the trace's TSDL metadata
+with --metadata. A directory holding both "metadata" and "channel0_0"
+works too. Only the metadata and the standard library are needed, not
+babeltrace.
+
+The report has the CPU share of every thread and interrupts, and the
+duration of every span of trace points (include/trace_point/trace_point.h)
+by name; AT commands are broken down by command. trace.json opens in
+chrome://tracing or https://ui.perfetto.dev, with the thread schedule and
+the spans on separate tracks.'''
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+# Second argument of the app's named events; see trace_point.h.
+POINT_INSTANT = 0
+POINT_BEGIN = 1
+POINT_END = 2
+
+# Spans whose begin argument is a tag of up to four characters.
+TAGGED_SPANS = {'bg96_cmd'}
+
+ISR_TID = 0xffffffff
+
+
+class MetadataError(Exception):
+    pass
+
+
+class Int:
+    def __init__(self, size, signed, align, encoding):
+        self.size = size
+        self.signed = signed
+        self.align = align
+        self.encoding = encoding
+
+
+class Array:
+    def __init__(self, elem, length):
+        self.elem = elem
+        self.length = length
+
+
+class String:
+    pass
+
+
+TOKEN_RE = re.compile(r'''
+    (?P<ws>\s+|/\*.*?\*/|//[^\n]*)
+  | (?P<str>"[^"]*")
+  | (?P<num>0[xX][0-9a-fA-F]+|\d+)
+  | (?P<id>[A-Za-z_][A-Za-z_0-9.]*)
+  | (?P<op>:=|[{}\[\];=:,<>])
+''', re.S | re.X)
+
+
+def tokenize(text):
+    tokens = []
+    pos = 0
+    while pos < len(text):
+        m = TOKEN_RE.match(text, pos)
+        if not m:
+            raise MetadataError(f'unexpected {text[pos:pos + 20]!r}')
+        pos = m.end()
+        if m.lastgroup != 'ws':
+            tokens.append(m.group())
+    return tokens
+
+
+class Metadata:
+    '''The subset of TSDL that Zephyr's CTF metadata uses: integer type
+    aliases, arrays and strings, one clock, one stream and its events.'''
+
+    def __init__(self, text):
+        self.tokens = tokenize(text)
+        self.pos = 0
+        self.types = {}
+        self.byte_order = '<'
+        self.clock_freq = 1000000000
+        self.packet_header = None
+        self.event_header = None
+        self.events = {}
+        while self.pos < len(self.tokens):
+            self.top_level()
+        if self.event_header is None:
+            raise MetadataError('no stream event.header')
+
+    def peek(self):
+        return self.tokens[self.pos] if self.pos < len(self.tokens) else None
+
+    def take(self, expect=None):
+        tok = self.peek()
+        if tok is None or (expect is not None and tok != expect):
+            raise MetadataError(f'expected {expect!r}, got {tok!r}')
+        self.pos += 1
+        return tok
+
+    def skip_block(self):
+        depth = 0
+        while True:
+            tok = self.take()
+            if tok == '{':
+                depth += 1
+            elif tok == '}':
+                depth -= 1
+                if depth == 0:
+                    return
+
+    def attributes(self):
+        '''Parses { key = value; ... }, returning simple values and leaving
+        "key := type" entries to the caller through a callback list.'''
+        attrs = {}
+        typed = []
+        self.take('{')
+        while self.peek() != '}':
+            key = self.take()
+            op = self.take()
+            if op == '=':
+                value = self.take()
+                attrs[key] = value.strip('"')
+            elif op == ':=':
+                typed.append((key, self.type_spec()))
+            else:
+                raise MetadataError(f'unexpected {op!r} after {key}')
+            self.take(';')
+        self.take('}')
+        return attrs, typed
+
+    def integer(self):
+        self.take('integer')
+        attrs, _ = self.attributes()
+        return Int(int(attrs['size'], 0), attrs.get('signed', 'false') == 'true',
+                   int(attrs.get('align', '8'), 0), attrs.get('encoding', 'none'))
+
+    def struct(self):
+        self.take('struct')
+        self.take('{')
+        fields = []
+        while self.peek() != '}':
+            ftype = self.type_spec()
+            name = self.take()
+            while self.peek() == '[':
+                self.take('[')
+                length = int(self.take(), 0)
+                self.take(']')
+                ftype = Array(ftype, length)
+            self.take(';')
+            fields.append((name, ftype))
+        self.take('}')
+        return fields
+
+    def type_spec(self):
+        tok = self.peek()
+        if tok == 'integer':
+            return self.integer()
+        if tok == 'struct':
+            return self.struct()
+        if tok == 'string':
+            self.take()
+            return String()
+        if tok in self.types:
+            self.take()
+            return self.types[tok]
+        raise MetadataError(f'unknown type {tok!r}')
+
+    def top_level(self):
+        tok = self.take()
+        if tok == 'typealias':
+            ftype = self.type_spec()
+            self.take(':=')
+            name = self.take()
+            # "unsigned int" and the like are single aliases here.
+            while self.peek() != ';':
+                name += ' ' + self.take()
+            self.take(';')
+            self.types[name] = ftype
+        elif tok == 'trace':
+            attrs, typed = self.attributes()
+            self.take(';')
+            if attrs.get('byte_order') == 'be':
+                self.byte_order = '>'
+            for key, ftype in typed:
+                if key == 'packet.header':
+                    self.packet_header = ftype
+        elif tok == 'clock':
+            attrs, _ = self.attributes()
+            self.take(';')
+            self.clock_freq = int(attrs.get('freq', self.clock_freq), 0)
+        elif tok == 'stream':
+            _, typed = self.attributes()
+            self.take(';')
+            for key, ftype in typed:
+                if key == 'event.header':
+                    self.event_header = ftype
+        elif tok == 'event':
+            attrs, typed = self.attributes()
+            self.take(';')
+            fields = dict(typed).get('fields', [])
+            self.events[int(attrs['id'], 0)] = (attrs['name'], fields)
+        elif tok == ';':
+            pass
+        else:
+            # env, callsite and anything else we do not need.
+            while self.peek() not in ('{', ';'):
+                self.take()
+            if self.peek() == '{':
+                self.skip_block()
+            self.take(';')
+
+
+class Reader:
+    def __init__(self, data, byte_order):
+        self.data = data
+        self.pos = 0
+        self.order = byte_order
+
+    def value(self, ftype):
+        if isinstance(ftype, Int):
+            nbytes = ftype.size // 8
+            raw = self.data[self.pos:self.pos + nbytes]
+            if len(raw) < nbytes:
+                raise EOFError
+            self.pos += nbytes
+            return int.from_bytes(raw, 'little' if self.order == '<' else 'big',
+                                  signed=ftype.signed)
+        if isinstance(ftype, Array):
+            if isinstance(ftype.elem, Int) and ftype.elem.size == 8 and \
+                    ftype.elem.encoding.upper() in ('ASCII', 'UTF8'):
+                raw = self.data[self.pos:self.pos + ftype.length]
+                if len(raw) < ftype.length:
+                    raise EOFError
+                self.pos += ftype.length
+                return raw.split(b'\0', 1)[0].decode('ascii', 'replace')
+            return [self.value(ftype.elem) for _ in range(ftype.length)]
+        if isinstance(ftype, String):
+            end = self.data.find(b'\0', self.pos)
+            if end < 0:
+                raise EOFError
+            raw = self.data[self.pos:end]
+            self.pos = end + 1
+            return raw.decode('ascii', 'replace')
+        return {name: self.value(t) for name, t in ftype}
+
+
+def read_events(meta, data):
+    '''Yields (timestamp in ns, event name, fields) for every event.'''
+    reader = Reader(data, meta.byte_order)
+    ts_bits = None
+    for name, ftype in meta.event_header:
+        if name == 'timestamp' and isinstance(ftype, Int):
+            ts_bits = ftype.size
+    if meta.packet_header is not None:
+        reader.value(meta.packet_header)
+
+    wraps = 0
+    last_ts = 0
+    while reader.pos < len(data):
+        start = reader.pos
+        try:
+            header = reader.value(meta.event_header)
+            event_id = header['id']
+            if event_id not in meta.events:
+                raise MetadataError(f'unknown event id {event_id:#x} at offset {start}')
+            name, fields = meta.events[event_id]
+            values = reader.value(fields)
+        except EOFError:
+            print(f'warning: {len(data) - start} trailing bytes', file=sys.stderr)
+            return
+        ts = header.get('timestamp', 0)
+        if ts_bits is not None and ts < last_ts:
+            wraps += 1
+        last_ts = ts
+        if ts_bits is not None:
+            ts += wraps << ts_bits
+        yield ts * 1000000000 // meta.clock_freq, name, values
+
+
+def tag_name(tag):
+    raw = tag.to_bytes(4, 'little').rstrip(b'\0')
+    return raw.decode('ascii', 'replace') or '?'
+
+
+class Analysis:
+    def __init__(self):
+        self.thread_names = {}
+        self.running = None
+        self.run_start = 0
+        self.isr_depth = 0
+        self.isr_start = 0
+        self.busy = {}
+        self.first_ts = None
+        self.last_ts = 0
+        self.open_spans = {}
+        self.spans = {}
+        self.unmatched = 0
+        self.chrome = []
+
+    def current(self):
+        return ISR_TID if self.isr_depth > 0 else (self.running or 0)
+
+    def run(self, tid, start, end):
+        self.busy[tid] = self.busy.get(tid, 0) + end - start
+        self.chrome.append({'ph': 'X', 'pid': 1, 'tid': tid, 'name': 'run',
+                            'ts': start / 1000, 'dur': (end - start) / 1000})
+
+    def span_end(self, tid, name, ts, ret):
+        stack = self.open_spans.get((tid, name))
+        if not stack:
+            self.unmatched += 1
+            return
+        start, arg = stack.pop()
+        key = name
+        if name in TAGGED_SPANS:
+            key = f'{name} {tag_name(arg)}'
+        self.spans.setdefault(key, []).append(ts - start)
+        self.chrome.append({'ph': 'X', 'pid': 2, 'tid': tid, 'name': key,
+                            'ts': start / 1000, 'dur': (ts - start) / 1000,
+                            'args': {'arg': arg, 'ret': ret}})
+
+    def event(self, ts, name, fields):
+        if self.first_ts is None:
+            self.first_ts = ts
+        self.last_ts = ts
+        thread_name = fields.get('name') if isinstance(fields.get('name'), str) else None
+        tid = fields.get('thread_id')
+        if tid is not None and thread_name:
+            self.thread_names[tid] = thread_name
+
+        if name == 'thread_switched_in':
+            self.running = tid
+            self.run_start = ts
+        elif name == 'thread_switched_out':
+            if self.running is not None:
+                self.run(self.running, self.run_start, ts)
+            self.running = None
+        elif name == 'isr_enter':
+            if self.isr_depth == 0:
+                self.isr_start = ts
+            self.isr_depth += 1
+        elif name in ('isr_exit', 'isr_exit_to_scheduler'):
+            if self.isr_depth > 0:
+                self.isr_depth -= 1
+                if self.isr_depth == 0:
+                    self.run(ISR_TID, self.isr_start, ts)
+        elif name == 'named_event':
+            tid = self.current()
+            point = fields.get('name', '?')
+            arg = fields.get('arg0', 0)
+            kind = fields.get('arg1', POINT_INSTANT)
+            if kind == POINT_BEGIN:
+                self.open_spans.setdefault((tid, point), []).append((ts, arg))
+            elif kind == POINT_END:
+                ret = arg - (1 << 32) if arg >= 1 << 31 else arg
+                self.span_end(tid, point, ts, ret)
+            else:
+                self.chrome.append({'ph': 'i', 's': 't', 'pid': 2, 'tid': tid,
+                                    'name': point, 'ts': ts / 1000,
+                                    'args': {'arg': arg}})
+
+    def name_of(self, tid):
+        if tid == ISR_TID:
+            return 'ISR'
+        return self.thread_names.get(tid, f'{tid:#x}')
+
+    def chrome_trace(self):
+        events = [{'ph': 'M', 'pid': 1, 'name': 'process_name',
+                   'args': {'name': 'schedule'}},
+                  {'ph': 'M', 'pid': 2, 'name': 'process_name',
+                   'args': {'name': 'trace points'}}]
+        tids = {e['tid'] for e in self.chrome}
+        for pid in (1, 2):
+            for tid in tids:
+                events.append({'ph': 'M', 'pid': pid, 'tid': tid, 'name': 'thread_name',
+                               'args': {'name': self.name_of(tid)}})
+        return {'traceEvents': events + self.chrome, 'displayTimeUnit': 'ms'}
+
+    def report(self, out):
+        total = max(self.last_ts - (self.first_ts or 0), 1)
+        print(f'{total / 1e6:.3f} ms traced', file=out)
+        print(f'\n{"thread":<20} {"busy ms":>10} {"cpu":>6}', file=out)
+        for tid, busy in sorted(self.busy.items(), key=lambda kv: -kv[1]):
+            print(f'{self.name_of(tid):<20} {busy / 1e6:>10.3f} {100 * busy / total:>5.1f}%',
+                  file=out)
+
+        print(f'\n{"span":<24} {"count":>6} {"total ms":>10} {"mean":>8} {"p50":>8} '
+              f'{"p95":>8} {"max":>8}', file=out)
+        for key, durs in sorted(self.spans.items(), key=lambda kv: -sum(kv[1])):
+            durs = sorted(durs)
+            n = len(durs)
+            p50 = durs[(n - 1) // 2]
+            p95 = durs[min(n - 1, (95 * n) // 100)]
+            print(f'{key:<24} {n:>6} {sum(durs) / 1e6:>10.3f} {sum(durs) / n / 1e6:>8.3f} '
+                  f'{p50 / 1e6:>8.3f} {p95 / 1e6:>8.3f} {durs[-1] / 1e6:>8.3f}', file=out)
+
+        still_open = sum(len(v) for v in self.open_spans.values())
+        if still_open or self.unmatched:
+            print(f'\n{still_open} spans still open at the end, '
+                  f'{self.unmatched} ends without a begin', file=out)
+
+
+def find_inputs(path, metadata):
+    if os.path.isdir(path):
+        stream = os.path.join(path, 'channel0_0')
+        if metadata is None and os.path.exists(os.path.join(path, 'metadata')):
+            metadata = os.path.join(path, 'metadata')
+    else:
+        stream = path
+    if metadata is None:
+        base = os.environ.get('ZEPHYR_BASE')
+        if base is None:
+            raise SystemExit('pass --metadata or set ZEPHYR_BASE')
+        metadata = os.path.join(base, 'subsys', 'tracing', 'ctf', 'tsdl', 'metadata')
+    return stream, metadata
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('trace', help='CTF stream, or a directory with metadata and channel0_0')
+    parser.add_argument('--metadata', help='TSDL metadata the firmware was built with')
+    parser.add_argument('--chrome', metavar='JSON', help='write a Chrome trace here')
+    args = parser.parse_args()
+
+    stream, metadata = find_inputs(args.trace, args.metadata)
+    with open(metadata, encoding='ascii', errors='replace') as f:
+        meta = Metadata(f.read())
+    with open(stream, 'rb') as f:
+        data = f.read()
+
+    analysis = Analysis()
+    for ts, name, fields in read_events(meta, data):
+        analysis.event(ts, name, fields)
+    analysis.report(sys.stdout)
+
+    if args.chrome:
+        with open(args.chrome, 'w') as f:
+            json.dump(analysis.chrome_trace(), f)
+        print(f'\nwrote {args.chrome}')
+
+
+if __name__ == '__main__':
+    sys.exit(main())
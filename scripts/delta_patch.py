@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''delta_patch.py
+
+Creates and applies delta patches in the format decoded by lib/delta_patch
+(see include/delta_patch/delta_patch.h). The backend runs
+
+    delta_patch.py diff old/zephyr.signed.bin new/zephyr.signed.bin out.patch
+
+for each release pair and serves out.patch to devices running the old
+version. `apply` reproduces the device side on the host, for checking.'''
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b'DLT1'
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_INSERT = 0x03
+
+# Matches shorter than this cost more to encode than to send as data.
+BLOCK = 16
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def read_varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def diff(source, target):
+    index = {}
+    for off in range(0, len(source) - BLOCK + 1):
+        index.setdefault(source[off:off + BLOCK], off)
+
+    ops = bytearray()
+    literal = bytearray()
+    # Source offset that lines up with the current target position, assuming
+    # the last match continues. Code that only moved addresses around still
+    # matches most bytes there, which ADD encodes as mostly-zero diffs.
+    aligned = None
+
+    def flush_literal(end):
+        nonlocal aligned
+        if not literal:
+            return
+        start = end - len(literal)
+        src = aligned + start if aligned is not None else None
+        if src is not None and src + len(literal) <= len(source):
+            same = sum(1 for i, b in enumerate(literal) if source[src + i] == b)
+            if same * 2 >= len(literal):
+                delta = bytes((b - source[src + i]) & 0xff for i, b in enumerate(literal))
+                ops.extend(bytes([OP_ADD]) + varint(src) + varint(len(delta)) + delta)
+                literal.clear()
+                return
+        ops.extend(bytes([OP_INSERT]) + varint(len(literal)) + literal)
+        literal.clear()
+
+    pos = 0
+    while pos < len(target):
+        off = index.get(target[pos:pos + BLOCK])
+        if off is None:
+            literal.append(target[pos])
+            pos += 1
+            continue
+
+        length = BLOCK
+        while (pos + length < len(target) and off + length < len(source)
+               and target[pos + length] == source[off + length]):
+            length += 1
+
+        flush_literal(pos)
+        ops.extend(bytes([OP_COPY]) + varint(off) + varint(length))
+        aligned = off - pos
+        pos += length
+
+    flush_literal(pos)
+
+    header = MAGIC + struct.pack('<IIII', len(source), zlib.crc32(source),
+                                 len(target), zlib.crc32(target))
+    return header + bytes(ops)
+
+
+def apply(source, patch):
+    if patch[:4] != MAGIC:
+        raise ValueError('bad magic')
+    src_size, src_crc, dst_size, dst_crc = struct.unpack_from('<IIII', patch, 4)
+    if len(source) < src_size or zlib.crc32(source[:src_size]) != src_crc:
+        raise ValueError('source does not match the patch')
+
+    out = bytearray()
+    pos = 20
+    while len(out) < dst_size:
+        op = patch[pos]
+        pos += 1
+        if op in (OP_COPY, OP_ADD):
+            off, pos = read_varint(patch, pos)
+        length, pos = read_varint(patch, pos)
+        if op == OP_COPY:
+            out += source[off:off + length]
+        elif op == OP_ADD:
+            out += bytes((source[off + i] + patch[pos + i]) & 0xff for i in range(length))
+            pos += length
+        elif op == OP_INSERT:
+            out += patch[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError(f'bad opcode {op:#x}')
+
+    if zlib.crc32(out) != dst_crc:
+        raise ValueError('target CRC mismatch')
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='cmd', required=True)
+    d = sub.add_parser('diff', help='create a patch from two images')
+    d.add_argument('old')
+    d.add_argument('new')
+    d.add_argument('patch')
+    a = sub.add_parser('apply', help='apply a patch on the host')
+    a.add_argument('old')
+    a.add_argument('patch')
+    a.add_argument('new')
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+
+    if args.cmd == 'diff':
+        with open(args.new, 'rb') as f:
+            new = f.read()
+        patch = diff(old, new)
+        with open(args.patch, 'wb') as f:
+            f.write(patch)
+        print(f'{len(new)} -> {len(patch)} bytes ({100 * len(patch) / len(new):.1f}%)')
+    else:
+        with open(args.patch, 'rb') as f:
+            patch = f.read()
+        with open(args.new, 'wb') as f:
+            f.write(apply(old, patch))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
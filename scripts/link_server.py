@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''link_server.py
+
+Stand-in backend for the framed protobuf link (app/link.conf, see
+include/link_frame/link_frame.h). Each frame is
+
+    type:u8 id:u8 length:u16le payload[length]
+
+where type is a LinkMessageType from app/api/api.proto and the response
+echoes the request id.
+
+    link_server.py serve [--port 4242] [--ota-path /zephyr.signed.bin]
+
+answers TelemetrySeries and StatusUpdateRequest frames with a
+StatusUpdateResponse and OTAUpdateRequest frames with an OTAUpdateResponse,
+printing what it decoded.
+
+    link_server.py client --host 127.0.0.1 [--count 8]
+
+plays the device: it pipelines --count TelemetrySeries frames and an
+OTAUpdateRequest on one connection and checks that every response comes
+back with the right id. The Python classes are generated from api.proto
+with protoc on startup, so protoc and the protobuf package must be
+installed.'''
+
+import argparse
+import asyncio
+import importlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+HEADER = struct.Struct('<BBH')
+DEFAULT_PORT = 4242
+PROTO_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         '..', 'app', 'api')
+
+
+def load_api():
+    '''Generates and imports api_pb2 from app/api/api.proto.'''
+    out = tempfile.mkdtemp(prefix='link_server_')
+    subprocess.run(['protoc', f'-I{PROTO_DIR}', f'--python_out={out}',
+                    os.path.join(PROTO_DIR, 'api.proto')], check=True)
+    sys.path.insert(0, out)
+    return importlib.import_module('api_pb2')
+
+
+def frame(msg_type, msg_id, payload):
+    if len(payload) > 0xffff:
+        raise ValueError('payload too large for one frame')
+    return HEADER.pack(msg_type, msg_id, len(payload)) + payload
+
+
+async def read_frame(reader):
+    '''Returns (type, id, payload), or None at a clean end of stream.'''
+    try:
+        header = await reader.readexactly(HEADER.size)
+    except asyncio.IncompleteReadError as e:
+        if e.partial:
+            raise
+        return None
+    msg_type, msg_id, length = HEADER.unpack(header)
+    return msg_type, msg_id, await reader.readexactly(length)
+
+
+class Backend:
+    def __init__(self, api, ota_path):
+        self.api = api
+        self.ota_path = ota_path
+
+    def handle(self, msg_type, payload):
+        '''Returns the (type, payload) to answer a request with.'''
+        api = self.api
+        if msg_type == api.LINK_MESSAGE_TELEMETRY_SERIES:
+            series = api.TelemetrySeries.FromString(payload)
+            uptime = series.base_uptime_ms
+            for delta in series.uptime_delta_ms:
+                uptime += delta
+            print(f'{series.device_id} boot {series.boot_count}: '
+                  f'{len(series.uptime_delta_ms)} samples in {len(payload)} '
+                  f'bytes, up to uptime {uptime} ms')
+            for group in series.stats:
+                counters = ' '.join(f'{c.name}={c.value}' for c in group.counters)
+                print(f'  {group.name}: {counters}')
+            for thread in series.threads:
+                print(f'  {thread.name}: {thread.cpu_permille / 10:.1f}% cpu, '
+                      f'stack {thread.stack_used}/{thread.stack_size}')
+            reply = api.StatusUpdateResponse(message='ok')
+            return api.LINK_MESSAGE_STATUS_UPDATE_RESPONSE, reply
+        if msg_type == api.LINK_MESSAGE_STATUS_UPDATE_REQUEST:
+            update = api.StatusUpdateRequest.FromString(payload)
+            print(f'{update.device_id} boot {update.boot_count}: status')
+            reply = api.StatusUpdateResponse(message='ok')
+            return api.LINK_MESSAGE_STATUS_UPDATE_RESPONSE, reply
+        if msg_type == api.LINK_MESSAGE_OTA_UPDATE_REQUEST:
+            request = api.OTAUpdateRequest.FromString(payload)
+            print(f'{request.device_id}: OTA query from {request.version}')
+            reply = api.OTAUpdateResponse(do_update=bool(self.ota_path),
+                                          path=self.ota_path or '')
+            return api.LINK_MESSAGE_OTA_UPDATE_RESPONSE, reply
+        return api.LINK_MESSAGE_ERROR, f'unknown type {msg_type}'.encode()
+
+    async def serve_connection(self, reader, writer):
+        peer = writer.get_extra_info('peername')
+        print(f'{peer} connected')
+        try:
+            while (request := await read_frame(reader)) is not None:
+                msg_type, msg_id, payload = request
+                try:
+                    reply_type, reply = self.handle(msg_type, payload)
+                    if not isinstance(reply, bytes):
+                        reply = reply.SerializeToString()
+                except Exception as e:  # noqa: BLE001 - report any decode error
+                    reply_type, reply = self.api.LINK_MESSAGE_ERROR, str(e).encode()
+                writer.write(frame(reply_type, msg_id, reply))
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError) as e:
+            print(f'{peer} dropped: {e}')
+        finally:
+            writer.close()
+            print(f'{peer} disconnected')
+
+
+async def serve(args):
+    backend = Backend(load_api(), args.ota_path)
+    server = await asyncio.start_server(backend.serve_connection,
+                                        args.bind, args.port)
+    print(f'Listening on {args.bind}:{args.port}')
+    async with server:
+        await server.serve_forever()
+
+
+async def client(args):
+    api = load_api()
+    reader, writer = await asyncio.open_connection(args.host, args.port)
+
+    expected = {}
+    for i in range(args.count):
+        series = api.TelemetrySeries(device_id='link-test', boot_count=1,
+                                     base_uptime_ms=1000 + i * 300000 * 8)
+        series.uptime_delta_ms.extend([0] + [300000] * 7)
+        series.ticks_delta.extend([1] * 8)
+        series.button_press_delta.extend([0] * 8)
+        payload = series.SerializeToString()
+        writer.write(frame(api.LINK_MESSAGE_TELEMETRY_SERIES, i, payload))
+        expected[i] = api.LINK_MESSAGE_STATUS_UPDATE_RESPONSE
+    ota = api.OTAUpdateRequest(device_id='link-test', version='0.0.0')
+    writer.write(frame(api.LINK_MESSAGE_OTA_UPDATE_REQUEST, args.count,
+                       ota.SerializeToString()))
+    expected[args.count] = api.LINK_MESSAGE_OTA_UPDATE_RESPONSE
+    await writer.drain()
+
+    while expected:
+        response = await read_frame(reader)
+        if response is None:
+            sys.exit(f'connection closed with {len(expected)} responses missing')
+        msg_type, msg_id, payload = response
+        if expected.pop(msg_id, None) != msg_type:
+            sys.exit(f'unexpected response {msg_id} of type {msg_type}')
+    writer.close()
+    print(f'{args.count + 1} pipelined requests answered')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('serve', help='run the stand-in backend')
+    p.add_argument('--bind', default='0.0.0.0')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT)
+    p.add_argument('--ota-path', default='',
+                   help='image path to offer in OTA responses')
+    p = sub.add_parser('client', help='exercise a server like the device would')
+    p.add_argument('--host', default='127.0.0.1')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT)
+    p.add_argument('--count', type=int, default=8)
+    args = parser.parse_args()
+
+    asyncio.run(serve(args) if args.command == 'serve' else client(args))
+
+
+if __name__ == '__main__':
+    main()
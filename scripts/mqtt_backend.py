@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''mqtt_backend.py
+
+Backend side of CONFIG_APP_BACKEND_MQTT (see app/mqtt.conf), talking to the
+device through an MQTT broker such as mosquitto. For device <id>:
+
+    devices/<id>/telemetry    device -> backend  TelemetrySeries
+    devices/<id>/ota/request  device -> backend  OTAUpdateRequest
+    devices/<id>/ota          backend -> device  OTAUpdateResponse
+    devices/<id>/config       backend -> device  DeviceConfig
+
+The device keeps a persistent session (clean_session off, QoS 1), so
+messages pushed while it is offline are delivered when it reconnects.
+
+    mqtt_backend.py listen [--ota-path /zephyr.signed.bin]
+
+prints the telemetry and answers OTA requests, offering --ota-path if set.
+
+    mqtt_backend.py push-ota --device 12345 --ota-path /zephyr.signed.bin
+    mqtt_backend.py push-config --device 12345 [--blink-ms 500] [--telemetry-s 60]
+
+push an offer or a config change with QoS 1.
+
+    mqtt_backend.py selftest
+
+plays the device against the broker: it opens a persistent session,
+disconnects, has the backend push a config change, and checks that the
+change is delivered once the device session is resumed. The protobuf
+classes are generated from app/api/api.proto with protoc on startup.'''
+
+import argparse
+import sys
+import threading
+
+import paho.mqtt.client as mqtt
+
+from link_server import load_api
+
+DEFAULT_PORT = 1883
+
+
+def topic(device, name):
+    return f'devices/{device}/{name}'
+
+
+def connect(args, client_id='', clean_session=True):
+    client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id,
+                         clean_session=clean_session,
+                         protocol=mqtt.MQTTv311)
+    client.connect(args.host, args.port, keepalive=60)
+    return client
+
+
+def publish(client, topic_name, message):
+    info = client.publish(topic_name, message.SerializeToString(), qos=1)
+    info.wait_for_publish(timeout=10)
+    if not info.is_published():
+        sys.exit(f'{topic_name}: not acknowledged')
+
+
+def listen(args):
+    api = load_api()
+    client = connect(args)
+
+    def on_connect(client, userdata, flags, reason, properties):
+        client.subscribe([(topic('+', 'telemetry'), 1),
+                          (topic('+', 'ota/request'), 1)])
+        print(f'Listening on {args.host}:{args.port}')
+
+    def on_message(client, userdata, msg):
+        device = msg.topic.split('/')[1]
+        try:
+            if msg.topic.endswith('/telemetry'):
+                series = api.TelemetrySeries.FromString(msg.payload)
+                print(f'{device} boot {series.boot_count}: '
+                      f'{len(series.uptime_delta_ms)} samples in '
+                      f'{len(msg.payload)} bytes')
+                for group in series.stats:
+                    counters = ' '.join(f'{c.name}={c.value}' for c in group.counters)
+                    print(f'  {group.name}: {counters}')
+                for thread in series.threads:
+                    print(f'  {thread.name}: {thread.cpu_permille / 10:.1f}% cpu, '
+                          f'stack {thread.stack_used}/{thread.stack_size}')
+            elif msg.topic.endswith('/ota/request'):
+                request = api.OTAUpdateRequest.FromString(msg.payload)
+                print(f'{device}: OTA query from {request.version}')
+                reply = api.OTAUpdateResponse(do_update=bool(args.ota_path),
+                                              path=args.ota_path or '')
+                client.publish(topic(device, 'ota'),
+                               reply.SerializeToString(), qos=1)
+        except Exception as e:  # noqa: BLE001 - report any decode error
+            print(f'{msg.topic}: {e}')
+
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.loop_forever()
+
+
+def push_ota(args):
+    api = load_api()
+    client = connect(args)
+    client.loop_start()
+    publish(client, topic(args.device, 'ota'),
+            api.OTAUpdateResponse(do_update=True, path=args.ota_path))
+    client.loop_stop()
+    print(f'offered {args.ota_path} to {args.device}')
+
+
+def push_config(args):
+    api = load_api()
+    client = connect(args)
+    client.loop_start()
+    publish(client, topic(args.device, 'config'),
+            api.DeviceConfig(blink_interval_ms=args.blink_ms,
+                             telemetry_interval_s=args.telemetry_s))
+    client.loop_stop()
+    print(f'pushed config to {args.device}')
+
+
+def selftest(args):
+    api = load_api()
+    device_id = 'mqtt-selftest'
+    received = threading.Event()
+    state = {}
+
+    def on_message(client, userdata, msg):
+        state['config'] = api.DeviceConfig.FromString(msg.payload)
+        received.set()
+
+    # First session: subscribe, then drop off.
+    subscribed = threading.Event()
+    device = connect(args, client_id=device_id, clean_session=False)
+    device.on_subscribe = lambda *_: subscribed.set()
+    device.loop_start()
+    device.subscribe(topic(device_id, 'config'), qos=1)
+    if not subscribed.wait(timeout=10):
+        sys.exit('subscription not acknowledged')
+    device.disconnect()
+    device.loop_stop()
+
+    backend = connect(args)
+    backend.loop_start()
+    publish(backend, topic(device_id, 'config'),
+            api.DeviceConfig(blink_interval_ms=250, telemetry_interval_s=60))
+    backend.disconnect()
+    backend.loop_stop()
+
+    # Resumed session: no new subscription, the queued push must arrive.
+    device = connect(args, client_id=device_id, clean_session=False)
+    device.on_message = on_message
+    device.loop_start()
+    ok = received.wait(timeout=10)
+    device.disconnect()
+    device.loop_stop()
+
+    if not ok:
+        sys.exit('queued config was not delivered to the resumed session')
+    if state['config'].blink_interval_ms != 250:
+        sys.exit(f'wrong config delivered: {state["config"]}')
+    print('queued config delivered to the resumed session')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='127.0.0.1', help='broker address')
+    parser.add_argument('--port', type=int, default=DEFAULT_PORT)
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('listen', help='receive telemetry and answer OTA requests')
+    p.add_argument('--ota-path', default='',
+                   help='image path to offer in OTA responses')
+    p = sub.add_parser('push-ota', help='offer an OTA image to a device')
+    p.add_argument('--device', required=True)
+    p.add_argument('--ota-path', required=True)
+    p = sub.add_parser('push-config', help='push a DeviceConfig to a device')
+    p.add_argument('--device', required=True)
+    p.add_argument('--blink-ms', type=int, default=0)
+    p.add_argument('--telemetry-s', type=int, default=0)
+    sub.add_parser('selftest', help='check session queuing against the broker')
+    args = parser.parse_args()
+
+    {'listen': listen, 'push-ota': push_ota, 'push-config': push_config,
+     'selftest': selftest}[args.command](args)
+
+
+if __name__ == '__main__':
+    main()
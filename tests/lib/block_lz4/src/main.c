@@ -0,0 +1,170 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test block_lz4 library
+ *
+ * This suite verifies that streams are decompressed correctly regardless of
+ * how they are split, and that malformed streams are rejected.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include <block_lz4/block_lz4.h>
+
+#define BLOCK_SIZE 32
+
+static uint8_t image[64];
+static size_t image_len;
+static uint8_t stream[64];
+static size_t stream_len;
+
+/* Offsets into the stream built by build_stream(). */
+#define MATCH_OFFSET_POS (BLOCK_LZ4_HEADER_SIZE + 4 + 5)
+#define MATCH_LEN_POS (MATCH_OFFSET_POS + 2)
+#define STORED_DATA_POS (BLOCK_LZ4_HEADER_SIZE + 4 + 13 + 4)
+
+static int write_image(void *user_data, const uint8_t *buf, size_t len)
+{
+	zassert_true(image_len + len <= sizeof(image), "image overflow");
+	memcpy(&image[image_len], buf, len);
+	image_len += len;
+	return 0;
+}
+
+static const struct block_lz4_cfg cfg = {
+	.write_cb = write_image,
+};
+
+static void put(const void *data, size_t len)
+{
+	memcpy(&stream[stream_len], data, len);
+	stream_len += len;
+}
+
+static void put_le32(uint32_t value)
+{
+	sys_put_le32(value, &stream[stream_len]);
+	stream_len += 4;
+}
+
+/* A compressed block with an overlapping match, then a short stored block. */
+static const char expected[] = "abcdabcdabcdabcdabcdabcdabcdwxyz" "tail!";
+
+static void build_stream(void)
+{
+	stream_len = 0;
+	put(BLOCK_LZ4_MAGIC, 4);
+	put_le32(BLOCK_SIZE);
+	put_le32(sizeof(expected) - 1);
+	put_le32(crc32_ieee((const uint8_t *)expected, sizeof(expected) - 1));
+
+	/* 4 literals, match of 4 + 15 + 5 bytes at offset 4, 4 literals. */
+	put_le32(13);
+	put((uint8_t[]){ 0x4f }, 1);
+	put("abcd", 4);
+	put((uint8_t[]){ 0x04, 0x00, 0x05 }, 3);
+	put((uint8_t[]){ 0x40 }, 1);
+	put("wxyz", 4);
+
+	put_le32(5 | BLOCK_LZ4_STORED);
+	put("tail!", 5);
+}
+
+static void before(void *fixture)
+{
+	memset(image, 0, sizeof(image));
+	image_len = 0;
+	build_stream();
+}
+
+ZTEST(block_lz4, test_decompress)
+{
+	struct block_lz4_ctx ctx;
+
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_ok(block_lz4_write(&ctx, stream, stream_len));
+	zassert_ok(block_lz4_finish(&ctx));
+	zassert_equal(image_len, sizeof(expected) - 1, "wrong image length");
+	zassert_mem_equal(image, expected, image_len, "wrong image data");
+}
+
+ZTEST(block_lz4, test_decompress_byte_by_byte)
+{
+	struct block_lz4_ctx ctx;
+
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	for (size_t i = 0; i < stream_len; i++) {
+		zassert_ok(block_lz4_write(&ctx, &stream[i], 1), "failed at %zu", i);
+	}
+	zassert_ok(block_lz4_finish(&ctx));
+	zassert_mem_equal(image, expected, sizeof(expected) - 1, "wrong image data");
+}
+
+ZTEST(block_lz4, test_truncated)
+{
+	struct block_lz4_ctx ctx;
+
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_ok(block_lz4_write(&ctx, stream, stream_len - 1));
+	zassert_equal(block_lz4_finish(&ctx), -ENODATA, "truncated stream accepted");
+}
+
+ZTEST(block_lz4, test_bad_magic)
+{
+	struct block_lz4_ctx ctx;
+
+	stream[0] = 'X';
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_equal(block_lz4_write(&ctx, stream, stream_len), -EBADMSG,
+		      "bad magic accepted");
+}
+
+ZTEST(block_lz4, test_block_too_large)
+{
+	struct block_lz4_ctx ctx;
+
+	sys_put_le32(CONFIG_BLOCK_LZ4_MAX_BLOCK_SIZE + 1, &stream[4]);
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_equal(block_lz4_write(&ctx, stream, stream_len), -EFBIG,
+		      "oversized block accepted");
+}
+
+ZTEST(block_lz4, test_offset_out_of_bounds)
+{
+	struct block_lz4_ctx ctx;
+
+	/* Reach back before the start of the block. */
+	stream[MATCH_OFFSET_POS] = 5;
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_equal(block_lz4_write(&ctx, stream, stream_len), -EBADMSG,
+		      "out of bounds match accepted");
+}
+
+ZTEST(block_lz4, test_match_overflows_block)
+{
+	struct block_lz4_ctx ctx;
+
+	/* Make the match run past the end of the block. */
+	stream[MATCH_LEN_POS] = 10;
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_equal(block_lz4_write(&ctx, stream, stream_len), -EBADMSG,
+		      "overlong match accepted");
+}
+
+ZTEST(block_lz4, test_crc_mismatch)
+{
+	struct block_lz4_ctx ctx;
+
+	stream[STORED_DATA_POS]++;
+	zassert_ok(block_lz4_init(&ctx, &cfg));
+	zassert_ok(block_lz4_write(&ctx, stream, stream_len));
+	zassert_equal(block_lz4_finish(&ctx), -EILSEQ, "corrupt image accepted");
+}
+
+ZTEST_SUITE(block_lz4, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,178 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test delta_patch library
+ *
+ * This suite verifies that patches are applied correctly regardless of how
+ * the patch stream is split, and that malformed patches are rejected.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include <delta_patch/delta_patch.h>
+
+static const uint8_t source[] = "The quick brown fox jumps over the lazy dog";
+static uint8_t target[64];
+static size_t target_len;
+static uint8_t patch[128];
+static size_t patch_len;
+
+static int read_source(void *user_data, size_t offset, uint8_t *buf, size_t len)
+{
+	memcpy(buf, &source[offset], len);
+	return 0;
+}
+
+static int write_target(void *user_data, const uint8_t *buf, size_t len)
+{
+	zassert_true(target_len + len <= sizeof(target), "target overflow");
+	memcpy(&target[target_len], buf, len);
+	target_len += len;
+	return 0;
+}
+
+static const struct delta_patch_cfg cfg = {
+	.read_cb = read_source,
+	.write_cb = write_target,
+};
+
+static void put_header(const uint8_t *expected, size_t expected_len)
+{
+	memcpy(patch, DELTA_PATCH_MAGIC, 4);
+	sys_put_le32(sizeof(source), &patch[4]);
+	sys_put_le32(crc32_ieee(source, sizeof(source)), &patch[8]);
+	sys_put_le32(expected_len, &patch[12]);
+	sys_put_le32(crc32_ieee(expected, expected_len), &patch[16]);
+	patch_len = DELTA_PATCH_HEADER_SIZE;
+}
+
+static void put(const void *data, size_t len)
+{
+	memcpy(&patch[patch_len], data, len);
+	patch_len += len;
+}
+
+/* "The quick red fox jumps over the lazy cat": a COPY, an INSERT, a COPY
+ * and an ADD that turns "dog" into "cat".
+ */
+static const char expected[] = "The quick red fox jumps over the lazy cat";
+
+static void build_patch(void)
+{
+	const uint8_t diff[] = { 'c' - 'd', 'a' - 'o', 't' - 'g' };
+
+	put_header((const uint8_t *)expected, sizeof(expected) - 1);
+	put((uint8_t[]){ DELTA_PATCH_OP_COPY, 0, 10 }, 3);
+	put((uint8_t[]){ DELTA_PATCH_OP_INSERT, 3 }, 2);
+	put("red", 3);
+	put((uint8_t[]){ DELTA_PATCH_OP_COPY, 15, 25 }, 3);
+	put((uint8_t[]){ DELTA_PATCH_OP_ADD, 40, 3 }, 3);
+	put(diff, sizeof(diff));
+}
+
+static void before(void *fixture)
+{
+	memset(target, 0, sizeof(target));
+	target_len = 0;
+	build_patch();
+}
+
+ZTEST(delta_patch, test_apply)
+{
+	struct delta_patch_ctx ctx;
+
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_ok(delta_patch_write(&ctx, patch, patch_len));
+	zassert_ok(delta_patch_finish(&ctx));
+	zassert_equal(target_len, sizeof(expected) - 1, "wrong target length");
+	zassert_mem_equal(target, expected, target_len, "wrong target data");
+}
+
+ZTEST(delta_patch, test_apply_byte_by_byte)
+{
+	struct delta_patch_ctx ctx;
+
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	for (size_t i = 0; i < patch_len; i++) {
+		zassert_ok(delta_patch_write(&ctx, &patch[i], 1), "failed at %zu", i);
+	}
+	zassert_ok(delta_patch_finish(&ctx));
+	zassert_mem_equal(target, expected, sizeof(expected) - 1, "wrong target data");
+}
+
+ZTEST(delta_patch, test_truncated)
+{
+	struct delta_patch_ctx ctx;
+
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_ok(delta_patch_write(&ctx, patch, patch_len - 1));
+	zassert_equal(delta_patch_finish(&ctx), -ENODATA, "truncated patch accepted");
+}
+
+ZTEST(delta_patch, test_bad_magic)
+{
+	struct delta_patch_ctx ctx;
+
+	patch[0] = 'X';
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_equal(delta_patch_write(&ctx, patch, patch_len), -EBADMSG,
+		      "bad magic accepted");
+}
+
+ZTEST(delta_patch, test_copy_out_of_bounds)
+{
+	struct delta_patch_ctx ctx;
+
+	/* Point the second COPY past the end of the source. */
+	patch[DELTA_PATCH_HEADER_SIZE + 9] = sizeof(source) - 10;
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_equal(delta_patch_write(&ctx, patch, patch_len), -EBADMSG,
+		      "out of bounds copy accepted");
+}
+
+ZTEST(delta_patch, test_varint_overflow)
+{
+	struct delta_patch_ctx ctx;
+
+	/* An offset of 1 << 32, which would wrap to 0 in 32 bits. */
+	put_header((const uint8_t *)expected, sizeof(expected) - 1);
+	put((uint8_t[]){ DELTA_PATCH_OP_COPY, 0x80, 0x80, 0x80, 0x80, 0x10, 10 }, 7);
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_equal(delta_patch_write(&ctx, patch, patch_len), -EBADMSG,
+		      "overlong varint accepted");
+}
+
+ZTEST(delta_patch, test_crc_mismatch)
+{
+	struct delta_patch_ctx ctx;
+
+	patch[patch_len - 1]++;
+	zassert_ok(delta_patch_init(&ctx, &cfg));
+	zassert_ok(delta_patch_write(&ctx, patch, patch_len));
+	zassert_equal(delta_patch_finish(&ctx), -EILSEQ, "corrupt target accepted");
+}
+
+static int reject_header(void *user_data, const struct delta_patch_header *hdr)
+{
+	return -ESTALE;
+}
+
+ZTEST(delta_patch, test_header_cb_rejects)
+{
+	struct delta_patch_ctx ctx;
+	struct delta_patch_cfg reject_cfg = cfg;
+
+	reject_cfg.header_cb = reject_header;
+	zassert_ok(delta_patch_init(&ctx, &reject_cfg));
+	zassert_equal(delta_patch_write(&ctx, patch, patch_len), -ESTALE,
+		      "header callback error not returned");
+	zassert_equal(target_len, 0, "data written after header was rejected");
+}
+
+ZTEST_SUITE(delta_patch, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,222 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test image_check library
+ *
+ * This suite builds a minimal MCUboot image and verifies that valid images
+ * pass regardless of how they are split, and that bad ones are rejected as
+ * early as the layout allows.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <image_check/image_check.h>
+
+#define HDR_SIZE 64
+#define PAYLOAD_SIZE 16
+#define HASHED_SIZE (HDR_SIZE + PAYLOAD_SIZE)
+/* TLV info, the SHA-256 TLV and a 4 byte TLV of another type. */
+#define TLV_SIZE (4 + 4 + IMAGE_CHECK_HASH_SIZE + 4 + 4)
+#define IMAGE_SIZE (HASHED_SIZE + TLV_SIZE)
+
+#define INITIAL_SP 0x20010000
+#define RESET_VECTOR 0x00010201
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t digest[IMAGE_CHECK_HASH_SIZE];
+static struct image_check_header seen_hdr;
+static int header_calls;
+static size_t header_pos;
+static size_t fed;
+static int header_err;
+
+static int header_cb(void *user_data, const struct image_check_header *hdr)
+{
+	seen_hdr = *hdr;
+	header_calls++;
+	header_pos = fed;
+	return header_err;
+}
+
+static const struct image_check_cfg cfg = {
+	.header_cb = header_cb,
+};
+
+static void build_image(void)
+{
+	struct tc_sha256_state_struct sha;
+	uint8_t *p = image;
+
+	memset(image, 0, sizeof(image));
+	sys_put_le32(IMAGE_CHECK_MAGIC, &p[0]);
+	sys_put_le16(HDR_SIZE, &p[8]);
+	sys_put_le32(PAYLOAD_SIZE, &p[12]);
+	p[20] = 1;
+	p[21] = 2;
+	sys_put_le16(3, &p[22]);
+
+	p = &image[HDR_SIZE];
+	sys_put_le32(INITIAL_SP, &p[0]);
+	sys_put_le32(RESET_VECTOR, &p[4]);
+	memcpy(&p[8], "payload!", 8);
+
+	tc_sha256_init(&sha);
+	tc_sha256_update(&sha, image, HASHED_SIZE);
+	tc_sha256_final(digest, &sha);
+
+	p = &image[HASHED_SIZE];
+	sys_put_le16(IMAGE_CHECK_TLV_INFO_MAGIC, &p[0]);
+	sys_put_le16(TLV_SIZE, &p[2]);
+	p[4] = IMAGE_CHECK_TLV_SHA256;
+	sys_put_le16(IMAGE_CHECK_HASH_SIZE, &p[6]);
+	memcpy(&p[8], digest, IMAGE_CHECK_HASH_SIZE);
+	p[8 + IMAGE_CHECK_HASH_SIZE] = 0x01;
+	sys_put_le16(4, &p[8 + IMAGE_CHECK_HASH_SIZE + 2]);
+}
+
+/* Feeds the image one byte at a time; returns the first error. */
+static int feed_bytewise(struct image_check_ctx *ctx, size_t len)
+{
+	for (fed = 0; fed < len; fed++) {
+		int err = image_check_update(ctx, &image[fed], 1);
+
+		if (err != 0) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+static void before(void *fixture)
+{
+	memset(&seen_hdr, 0, sizeof(seen_hdr));
+	header_calls = 0;
+	header_pos = 0;
+	fed = 0;
+	header_err = 0;
+	build_image();
+}
+
+ZTEST(image_check, test_valid_image)
+{
+	struct image_check_ctx ctx;
+
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_ok(image_check_finish(&ctx));
+	zassert_equal(header_calls, 1, "header callback not called once");
+	zassert_equal(seen_hdr.hdr_size, HDR_SIZE, "wrong header size");
+	zassert_equal(seen_hdr.img_size, PAYLOAD_SIZE, "wrong image size");
+	zassert_equal(seen_hdr.ver_major, 1, "wrong version");
+	zassert_equal(seen_hdr.ver_revision, 3, "wrong version");
+	zassert_equal(seen_hdr.vector[0], INITIAL_SP, "wrong initial SP");
+	zassert_equal(seen_hdr.vector[1], RESET_VECTOR, "wrong reset vector");
+}
+
+ZTEST(image_check, test_valid_image_byte_by_byte)
+{
+	struct image_check_ctx ctx;
+
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(feed_bytewise(&ctx, IMAGE_SIZE));
+	zassert_ok(image_check_finish(&ctx));
+	zassert_equal(header_pos, HDR_SIZE + 7, "header callback not called early");
+}
+
+ZTEST(image_check, test_expected_hash)
+{
+	struct image_check_ctx ctx;
+	struct image_check_cfg expect_cfg = cfg;
+	uint8_t other[IMAGE_CHECK_HASH_SIZE];
+
+	expect_cfg.expected_hash = digest;
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &expect_cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_ok(image_check_finish(&ctx));
+
+	memcpy(other, digest, sizeof(other));
+	other[0] ^= 0xff;
+	expect_cfg.expected_hash = other;
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &expect_cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_equal(image_check_finish(&ctx), -EILSEQ, "wrong image accepted");
+}
+
+ZTEST(image_check, test_wide_tlv_type)
+{
+	struct image_check_ctx ctx;
+
+	/* TLV types are 16 bits; only the low byte matches SHA-256. */
+	sys_put_le16(0x0100 | IMAGE_CHECK_TLV_SHA256, &image[HASHED_SIZE + 8 + IMAGE_CHECK_HASH_SIZE]);
+
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_ok(image_check_finish(&ctx));
+}
+
+ZTEST(image_check, test_bad_magic)
+{
+	struct image_check_ctx ctx;
+
+	image[0] ^= 0xff;
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_equal(feed_bytewise(&ctx, IMAGE_SIZE), -EBADMSG, "bad magic accepted");
+	zassert_equal(fed, IMAGE_CHECK_HEADER_SIZE - 1, "bad magic rejected late");
+}
+
+ZTEST(image_check, test_header_cb_rejects)
+{
+	struct image_check_ctx ctx;
+
+	header_err = -ENOEXEC;
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_equal(feed_bytewise(&ctx, IMAGE_SIZE), -ENOEXEC,
+		      "header callback error not returned");
+	zassert_equal(fed, HDR_SIZE + 7, "wrong target rejected late");
+}
+
+ZTEST(image_check, test_size_mismatch)
+{
+	struct image_check_ctx ctx;
+
+	/* A download longer than the image the header describes. */
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE + 4, &cfg));
+	zassert_equal(image_check_update(&ctx, image, IMAGE_SIZE), -EBADMSG,
+		      "size mismatch accepted");
+}
+
+ZTEST(image_check, test_corrupt_payload)
+{
+	struct image_check_ctx ctx;
+
+	image[HDR_SIZE + 9] ^= 0x01;
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_equal(image_check_finish(&ctx), -EILSEQ, "corrupt image accepted");
+}
+
+ZTEST(image_check, test_truncated)
+{
+	struct image_check_ctx ctx;
+
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE - 1));
+	zassert_equal(image_check_finish(&ctx), -ENODATA, "truncated image accepted");
+}
+
+ZTEST(image_check, test_trailing_data)
+{
+	struct image_check_ctx ctx;
+
+	zassert_ok(image_check_init(&ctx, IMAGE_SIZE, &cfg));
+	zassert_ok(image_check_update(&ctx, image, IMAGE_SIZE));
+	zassert_equal(image_check_update(&ctx, image, 1), -EFBIG,
+		      "trailing data accepted");
+}
+
+ZTEST_SUITE(image_check, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,139 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test lat_hist library
+ *
+ * This suite checks the bucket boundaries, that samples recorded from
+ * threads and interrupts all land, and that a histogram reads back as a
+ * named stats group.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/irq_offload.h>
+
+#include <lat_hist/lat_hist.h>
+
+static struct stats_lat_hist hist;
+
+static void *setup(void)
+{
+	zassert_ok(lat_hist_register(&hist, "lat_test"));
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	/* Keep the registered header, clear the entries. */
+	memset((uint8_t *)&hist + sizeof(hist.s_hdr), 0, sizeof(hist) - sizeof(hist.s_hdr));
+}
+
+ZTEST(lat_hist, test_bucket_bounds)
+{
+	static const struct {
+		uint32_t us;
+		int bucket;
+	} cases[] = {
+		{ 0, 0 },
+		{ 1, 0 },
+		{ 2, 1 },
+		{ 3, 1 },
+		{ 4, 2 },
+		{ 1023, 9 },
+		{ 1024, 10 },
+		{ BIT(23) - 1, 22 },
+		{ BIT(23), LAT_HIST_BUCKETS - 1 },
+		{ UINT32_MAX, LAT_HIST_BUCKETS - 1 },
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		zassert_equal(lat_hist_bucket(cases[i].us), cases[i].bucket,
+			      "wrong bucket for %u us", cases[i].us);
+	}
+}
+
+ZTEST(lat_hist, test_record)
+{
+	lat_hist_record(&hist, 100);
+	lat_hist_record(&hist, 120);
+	lat_hist_record(&hist, 5000);
+
+	zassert_equal(hist.count, 3, "wrong count");
+	zassert_equal(hist.max_us, 5000, "wrong max");
+	zassert_equal(hist.bucket[lat_hist_bucket(100)], 2, "wrong bucket count");
+	zassert_equal(hist.bucket[lat_hist_bucket(5000)], 1, "wrong bucket count");
+
+	/* A shorter sample leaves the maximum alone. */
+	lat_hist_record(&hist, 10);
+	zassert_equal(hist.max_us, 5000, "max lowered");
+}
+
+ZTEST(lat_hist, test_timing)
+{
+	uint32_t start = lat_hist_start();
+
+	k_busy_wait(3000);
+	lat_hist_stop(&hist, start);
+
+	zassert_equal(hist.count, 1, "sample not recorded");
+	zassert_true(hist.max_us >= 2900, "measured %u us", hist.max_us);
+	zassert_true(hist.max_us < 100000, "measured %u us", hist.max_us);
+}
+
+static void record_from_isr(const void *arg)
+{
+	lat_hist_record(&hist, (uint32_t)(uintptr_t)arg);
+}
+
+ZTEST(lat_hist, test_record_from_isr)
+{
+	for (int i = 0; i < 10; i++) {
+		lat_hist_record(&hist, 50);
+		irq_offload(record_from_isr, (const void *)(uintptr_t)70000);
+	}
+
+	zassert_equal(hist.count, 20, "samples lost");
+	zassert_equal(hist.bucket[lat_hist_bucket(50)], 10, "thread samples lost");
+	zassert_equal(hist.bucket[lat_hist_bucket(70000)], 10, "ISR samples lost");
+	zassert_equal(hist.max_us, 70000, "wrong max");
+}
+
+struct walk_state {
+	int entries;
+	bool saw_count;
+	bool saw_first;
+	bool saw_last;
+};
+
+static int walk_cb(struct stats_hdr *hdr, void *arg, const char *name, uint16_t off)
+{
+	struct walk_state *state = arg;
+
+	state->entries++;
+	if (strcmp(name, "count") == 0) {
+		state->saw_count = off == offsetof(struct stats_lat_hist, count);
+	} else if (strcmp(name, "lt2") == 0) {
+		state->saw_first = off == offsetof(struct stats_lat_hist, bucket[0]);
+	} else if (strcmp(name, "ge8M") == 0) {
+		state->saw_last = off == offsetof(struct stats_lat_hist,
+						  bucket[LAT_HIST_BUCKETS - 1]);
+	}
+	return 0;
+}
+
+ZTEST(lat_hist, test_stats_group)
+{
+	struct stats_hdr *hdr = stats_group_find("lat_test");
+	struct walk_state state = { 0 };
+
+	zassert_equal_ptr(hdr, &hist.s_hdr, "group not registered");
+	zassert_ok(stats_walk(hdr, walk_cb, &state));
+	zassert_equal(state.entries, 2 + LAT_HIST_BUCKETS, "wrong number of entries");
+	zassert_true(state.saw_count && state.saw_first && state.saw_last,
+		     "entry names do not match their offsets");
+}
+
+ZTEST_SUITE(lat_hist, NULL, setup, before, NULL, NULL);
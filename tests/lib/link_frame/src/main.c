@@ -0,0 +1,165 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test link_frame library
+ *
+ * This suite verifies that frames are delivered intact regardless of how
+ * the stream is split, and that oversized or truncated frames are caught.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+
+#include <link_frame/link_frame.h>
+
+#define MAX_FRAMES 4
+
+struct frame {
+	struct link_frame_header hdr;
+	uint8_t payload[CONFIG_LINK_FRAME_MAX_PAYLOAD];
+};
+
+static struct frame frames[MAX_FRAMES];
+static int frame_count;
+static int frame_err;
+
+static uint8_t stream[64];
+static size_t stream_len;
+
+static int frame_cb(void *user_data, const struct link_frame_header *hdr,
+		    const uint8_t *payload)
+{
+	zassert_true(frame_count < MAX_FRAMES, "too many frames");
+	frames[frame_count].hdr = *hdr;
+	memcpy(frames[frame_count].payload, payload, hdr->length);
+	frame_count++;
+	return frame_err;
+}
+
+static const struct link_frame_cfg cfg = {
+	.frame_cb = frame_cb,
+};
+
+static void put_frame(uint8_t type, uint8_t id, const char *payload, size_t len)
+{
+	struct link_frame_header hdr = {
+		.type = type,
+		.id = id,
+		.length = len,
+	};
+
+	zassert_equal(link_frame_encode_header(&stream[stream_len],
+					       sizeof(stream) - stream_len, &hdr),
+		      LINK_FRAME_HEADER_SIZE, "header not encoded");
+	stream_len += LINK_FRAME_HEADER_SIZE;
+	memcpy(&stream[stream_len], payload, len);
+	stream_len += len;
+}
+
+/* Three pipelined frames, one of them empty. */
+static void build_stream(void)
+{
+	stream_len = 0;
+	put_frame(1, 7, "status", 6);
+	put_frame(2, 8, "", 0);
+	put_frame(3, 255, "0123456789abcdef", 16);
+}
+
+static void check_frames(void)
+{
+	zassert_equal(frame_count, 3, "wrong number of frames");
+	zassert_equal(frames[0].hdr.type, 1, "wrong type");
+	zassert_equal(frames[0].hdr.id, 7, "wrong id");
+	zassert_equal(frames[0].hdr.length, 6, "wrong length");
+	zassert_mem_equal(frames[0].payload, "status", 6, "wrong payload");
+	zassert_equal(frames[1].hdr.id, 8, "wrong id");
+	zassert_equal(frames[1].hdr.length, 0, "wrong length");
+	zassert_equal(frames[2].hdr.id, 255, "wrong id");
+	zassert_mem_equal(frames[2].payload, "0123456789abcdef", 16, "wrong payload");
+}
+
+static void before(void *fixture)
+{
+	memset(frames, 0, sizeof(frames));
+	frame_count = 0;
+	frame_err = 0;
+	build_stream();
+}
+
+ZTEST(link_frame, test_header_layout)
+{
+	static const uint8_t expected[] = { 1, 7, 6, 0 };
+
+	zassert_mem_equal(stream, expected, sizeof(expected), "wrong header bytes");
+}
+
+ZTEST(link_frame, test_decode)
+{
+	struct link_frame_ctx ctx;
+
+	zassert_ok(link_frame_init(&ctx, &cfg));
+	zassert_ok(link_frame_feed(&ctx, stream, stream_len));
+	zassert_ok(link_frame_finish(&ctx));
+	check_frames();
+}
+
+ZTEST(link_frame, test_decode_byte_by_byte)
+{
+	struct link_frame_ctx ctx;
+
+	zassert_ok(link_frame_init(&ctx, &cfg));
+	for (size_t i = 0; i < stream_len; i++) {
+		zassert_ok(link_frame_feed(&ctx, &stream[i], 1), "failed at %zu", i);
+	}
+	zassert_ok(link_frame_finish(&ctx));
+	check_frames();
+}
+
+ZTEST(link_frame, test_truncated)
+{
+	struct link_frame_ctx ctx;
+
+	zassert_ok(link_frame_init(&ctx, &cfg));
+	zassert_ok(link_frame_feed(&ctx, stream, stream_len - 1));
+	zassert_equal(frame_count, 2, "partial frame delivered");
+	zassert_equal(link_frame_finish(&ctx), -ENODATA, "truncated stream accepted");
+}
+
+ZTEST(link_frame, test_oversized)
+{
+	struct link_frame_ctx ctx;
+
+	stream_len = 0;
+	put_frame(1, 1, "0123456789abcdefg", CONFIG_LINK_FRAME_MAX_PAYLOAD + 1);
+	zassert_ok(link_frame_init(&ctx, &cfg));
+	zassert_equal(link_frame_feed(&ctx, stream, LINK_FRAME_HEADER_SIZE), -EMSGSIZE,
+		      "oversized frame accepted");
+	zassert_equal(frame_count, 0, "oversized frame delivered");
+}
+
+ZTEST(link_frame, test_callback_error)
+{
+	struct link_frame_ctx ctx;
+
+	frame_err = -EPROTO;
+	zassert_ok(link_frame_init(&ctx, &cfg));
+	zassert_equal(link_frame_feed(&ctx, stream, stream_len), -EPROTO,
+		      "callback error not returned");
+	zassert_equal(frame_count, 1, "decoding went on after an error");
+	zassert_equal(link_frame_feed(&ctx, stream, stream_len), -EPROTO,
+		      "error not sticky");
+}
+
+ZTEST(link_frame, test_small_header_buffer)
+{
+	struct link_frame_header hdr = { 0 };
+	uint8_t buf[LINK_FRAME_HEADER_SIZE - 1];
+
+	zassert_equal(link_frame_encode_header(buf, sizeof(buf), &hdr), -ENOBUFS,
+		      "header written past the buffer");
+}
+
+ZTEST_SUITE(link_frame, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,169 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test req_trace library
+ *
+ * This suite runs traces from the test thread, marks stages from other
+ * threads and interrupts, and checks the recorded stages, their timing and
+ * the formatted line.
+ */
+
+#include <string.h>
+
+#include <zephyr/ztest.h>
+#include <zephyr/irq_offload.h>
+
+#include <req_trace/req_trace.h>
+
+#define STACK_SIZE (512 + CONFIG_TEST_EXTRA_STACK_SIZE)
+
+static K_THREAD_STACK_DEFINE(other_stack, STACK_SIZE);
+static struct k_thread other_thread;
+
+static struct req_trace trace;
+
+static void before(void *fixture)
+{
+	/* Finish anything a failed test left running, and any trigger. */
+	(void)req_trace_end(0);
+	req_trace_begin("flush");
+	(void)req_trace_end(0);
+	memset(&trace, 0, sizeof(trace));
+}
+
+static void finish(int result)
+{
+	zassert_true(req_trace_end(result), "trace not running");
+	zassert_ok(req_trace_last(&trace), "trace not kept");
+}
+
+ZTEST(req_trace, test_stages)
+{
+	req_trace_begin("test");
+	req_trace_mark(REQ_TRACE_CONNECT);
+	k_busy_wait(20000);
+	req_trace_mark(REQ_TRACE_CONNECTED);
+	finish(0);
+
+	zassert_equal(strcmp(trace.name, "test"), 0, "wrong name");
+	zassert_is_null(trace.source, "source without a trigger");
+	zassert_equal(trace.count, 4, "wrong number of stages");
+	zassert_equal(trace.events[0].stage, REQ_TRACE_START, "wrong first stage");
+	zassert_equal(trace.events[1].stage, REQ_TRACE_CONNECT, "wrong stage");
+	zassert_equal(trace.events[2].stage, REQ_TRACE_CONNECTED, "wrong stage");
+	zassert_equal(trace.events[3].stage, REQ_TRACE_END, "wrong last stage");
+	zassert_true(trace.events[2].us - trace.events[1].us >= 19000,
+		     "measured %u us", trace.events[2].us - trace.events[1].us);
+	zassert_true(trace.events[2].us - trace.events[1].us < 100000,
+		     "measured %u us", trace.events[2].us - trace.events[1].us);
+}
+
+static void trigger_from_isr(const void *arg)
+{
+	req_trace_trigger(arg);
+	/* Interrupts never mark stages, whatever thread they interrupt. */
+	req_trace_mark(REQ_TRACE_SENT);
+}
+
+ZTEST(req_trace, test_trigger)
+{
+	irq_offload(trigger_from_isr, "isr");
+	/* Only the first trigger since the last trace counts. */
+	req_trace_trigger("later");
+	k_busy_wait(10000);
+
+	req_trace_begin("test");
+	finish(0);
+
+	zassert_equal(strcmp(trace.source, "isr"), 0, "wrong source");
+	zassert_equal(trace.count, 3, "wrong number of stages");
+	zassert_equal(trace.events[0].stage, REQ_TRACE_TRIGGER, "trigger not recorded");
+	zassert_equal(trace.events[0].us, 0, "trace does not start at the trigger");
+	zassert_true(trace.events[1].us >= 9000, "start %u us after the trigger",
+		     trace.events[1].us);
+
+	/* The trigger was used up. */
+	req_trace_begin("test");
+	finish(0);
+	zassert_is_null(trace.source, "trigger used twice");
+}
+
+ZTEST(req_trace, test_stale_trigger)
+{
+	req_trace_trigger("stale");
+	k_busy_wait((CONFIG_REQ_TRACE_TRIGGER_MAX_AGE_MS + 10) * 1000);
+
+	req_trace_begin("test");
+	finish(0);
+
+	zassert_is_null(trace.source, "stale trigger used");
+	zassert_equal(trace.events[0].stage, REQ_TRACE_START, "stale trigger recorded");
+}
+
+static void other_entry(void *p1, void *p2, void *p3)
+{
+	req_trace_mark(REQ_TRACE_SEND);
+	req_trace_begin("other");
+	zassert_false(req_trace_end(0), "ended a trace owned by another thread");
+}
+
+ZTEST(req_trace, test_other_thread)
+{
+	req_trace_begin("test");
+	k_thread_create(&other_thread, other_stack, K_THREAD_STACK_SIZEOF(other_stack),
+			other_entry, NULL, NULL, NULL, K_PRIO_PREEMPT(0), 0, K_NO_WAIT);
+	k_thread_join(&other_thread, K_FOREVER);
+	irq_offload(trigger_from_isr, "isr");
+	finish(0);
+
+	zassert_equal(strcmp(trace.name, "test"), 0, "trace taken over");
+	zassert_equal(trace.count, 2, "foreign stages recorded");
+}
+
+ZTEST(req_trace, test_overflow)
+{
+	req_trace_begin("test");
+	for (int i = 0; i < CONFIG_REQ_TRACE_MAX_EVENTS + 2; i++) {
+		req_trace_mark(REQ_TRACE_RECV);
+	}
+	finish(-EIO);
+
+	zassert_equal(trace.count, CONFIG_REQ_TRACE_MAX_EVENTS, "wrong number of stages");
+	/* The start took one slot, and the end is dropped as well. */
+	zassert_equal(trace.dropped, 4, "wrong number of dropped stages");
+	zassert_equal(trace.result, -EIO, "wrong result");
+}
+
+ZTEST(req_trace, test_format)
+{
+	struct req_trace fixed = {
+		.id = 7,
+		.name = "telemetry",
+		.source = "button",
+		.result = -EIO,
+		.count = 4,
+		.dropped = 1,
+		.events = {
+			{ REQ_TRACE_TRIGGER, 0 },
+			{ REQ_TRACE_START, 2500 },
+			{ REQ_TRACE_CONNECT_OK, 45000 },
+			{ REQ_TRACE_END, 1500000 },
+		},
+	};
+	char buf[128];
+	char small[16];
+	int len;
+
+	len = req_trace_format(&fixed, buf, sizeof(buf));
+	zassert_equal(strcmp(buf, "#7 telemetry (button) 1500 ms: start+2 connect_ok+42 "
+			     "end+1455 (1 dropped) err -5"), 0, "got \"%s\"", buf);
+	zassert_equal(len, strlen(buf), "wrong length");
+
+	len = req_trace_format(&fixed, small, sizeof(small));
+	zassert_equal(len, sizeof(small) - 1, "wrong truncated length");
+	zassert_equal(strlen(small), sizeof(small) - 1, "not terminated");
+}
+
+ZTEST_SUITE(req_trace, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,230 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file test upload_sched library
+ *
+ * This suite plays simulated signal traces into the scheduler, one sample
+ * per minute, and checks when each upload class becomes due.
+ */
+
+#include <zephyr/ztest.h>
+
+#include <upload_sched/upload_sched.h>
+
+#define MINUTE_MS (60 * 1000)
+
+enum {
+	CLASS_URGENT,
+	CLASS_TELEMETRY,
+	CLASS_OTA,
+	CLASS_COUNT,
+};
+
+static const struct upload_sched_class classes[CLASS_COUNT] = {
+	[CLASS_URGENT] = { .min_rssi = 0, .max_delay_ms = 0 },
+	[CLASS_TELEMETRY] = { .min_rssi = -95, .max_delay_ms = 30 * MINUTE_MS,
+			      .piggyback = true },
+	[CLASS_OTA] = { .min_rssi = -85, .max_delay_ms = 6 * 60 * MINUTE_MS },
+};
+
+static struct upload_sched_cfg cfg;
+static struct upload_sched_ctx ctx;
+
+/* Minute at which each class became due, or -1. */
+static int due_minute[CLASS_COUNT];
+
+static void before(void *fixture)
+{
+	cfg = (struct upload_sched_cfg) {
+		.classes = classes,
+		.num_classes = CLASS_COUNT,
+	};
+	zassert_ok(upload_sched_init(&ctx, &cfg));
+	for (int i = 0; i < CLASS_COUNT; i++) {
+		due_minute[i] = -1;
+	}
+}
+
+/* Feeds trace[i] at minute start + i and takes what is due after each. */
+static void play(uint32_t start, const int16_t *trace, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		uint32_t now = (start + i) * MINUTE_MS;
+		uint32_t due;
+
+		upload_sched_signal(&ctx, trace[i], now);
+		due = upload_sched_take(&ctx, now);
+		for (int cls = 0; cls < CLASS_COUNT; cls++) {
+			if ((due & BIT(cls)) && due_minute[cls] < 0) {
+				due_minute[cls] = start + i;
+			}
+		}
+	}
+}
+
+/* A trace of @p len minutes at @p rssi. */
+static void play_flat(uint32_t start, int16_t rssi, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		play(start + i, &rssi, 1);
+	}
+}
+
+ZTEST(upload_sched, test_waits_for_signal)
+{
+	static const int16_t trace[] = {
+		-105, -107, -103, -101, -99, -97, -96, -94, -90, -88,
+	};
+
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	play(0, trace, ARRAY_SIZE(trace));
+	zassert_equal(due_minute[CLASS_TELEMETRY], 7, "not sent once the signal was good");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].by_signal, 1, "wrong reason");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].wait_ms, 7 * MINUTE_MS, "wrong wait");
+}
+
+ZTEST(upload_sched, test_deadline)
+{
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	play_flat(0, -110, 60);
+	zassert_equal(due_minute[CLASS_TELEMETRY], 30, "deadline not enforced");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].by_deadline, 1, "wrong reason");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].max_wait_ms, 30 * MINUTE_MS, "wrong wait");
+}
+
+ZTEST(upload_sched, test_deadline_without_signal)
+{
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	play_flat(0, UPLOAD_SCHED_RSSI_UNKNOWN, 40);
+	zassert_equal(due_minute[CLASS_TELEMETRY], 30, "deadline not enforced");
+}
+
+ZTEST(upload_sched, test_urgent_and_piggyback)
+{
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	zassert_ok(upload_sched_request(&ctx, CLASS_OTA, 0));
+	play_flat(0, -110, 5);
+	zassert_equal(due_minute[CLASS_TELEMETRY], -1, "telemetry sent at poor signal");
+
+	/* Telemetry rides along with an urgent upload; the OTA image does not. */
+	zassert_ok(upload_sched_request(&ctx, CLASS_URGENT, 5 * MINUTE_MS));
+	play_flat(5, -110, 1);
+	zassert_equal(due_minute[CLASS_URGENT], 5, "urgent upload held back");
+	zassert_equal(due_minute[CLASS_TELEMETRY], 5, "telemetry did not piggyback");
+	zassert_equal(due_minute[CLASS_OTA], -1, "OTA sent at poor signal");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].by_piggyback, 1, "wrong reason");
+}
+
+ZTEST(upload_sched, test_thresholds_per_class)
+{
+	static const int16_t trace[] = { -100, -92, -92, -84 };
+
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	zassert_ok(upload_sched_request(&ctx, CLASS_OTA, 0));
+	play(0, trace, ARRAY_SIZE(trace));
+	zassert_equal(due_minute[CLASS_TELEMETRY], 1, "telemetry threshold");
+	zassert_equal(due_minute[CLASS_OTA], 3, "OTA threshold");
+}
+
+ZTEST(upload_sched, test_smoothing_ignores_spike)
+{
+	static const int16_t trace[] = { -110, -110, -110, -60, -110, -110 };
+
+	cfg.smoothing_shift = 2;
+	zassert_ok(upload_sched_init(&ctx, &cfg));
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	play(0, trace, ARRAY_SIZE(trace));
+	zassert_equal(due_minute[CLASS_TELEMETRY], -1, "sent on a single spike");
+
+	/* A lasting improvement gets through within a few samples. */
+	play_flat(ARRAY_SIZE(trace), -80, 4);
+	zassert_true(due_minute[CLASS_TELEMETRY] > (int)ARRAY_SIZE(trace),
+		     "sent before the average moved");
+	zassert_true(due_minute[CLASS_TELEMETRY] <= (int)ARRAY_SIZE(trace) + 3,
+		     "average too slow");
+}
+
+ZTEST(upload_sched, test_stale_sample)
+{
+	int16_t good = -70;
+
+	cfg.max_sample_age_ms = 5 * MINUTE_MS;
+	zassert_ok(upload_sched_init(&ctx, &cfg));
+	upload_sched_signal(&ctx, good, 0);
+	zassert_equal(upload_sched_rssi(&ctx, 5 * MINUTE_MS), -70, "fresh sample ignored");
+	zassert_equal(upload_sched_rssi(&ctx, 6 * MINUTE_MS), UPLOAD_SCHED_RSSI_UNKNOWN,
+		      "stale sample used");
+
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 6 * MINUTE_MS));
+	zassert_equal(upload_sched_take(&ctx, 6 * MINUTE_MS), 0, "sent on a stale sample");
+
+	/* A new sample starts the average over instead of blending in. */
+	upload_sched_signal(&ctx, -90, 7 * MINUTE_MS);
+	zassert_equal(upload_sched_rssi(&ctx, 7 * MINUTE_MS), -90, "stale sample blended");
+}
+
+ZTEST(upload_sched, test_unknown_forgets)
+{
+	upload_sched_signal(&ctx, -70, 0);
+	upload_sched_signal(&ctx, UPLOAD_SCHED_RSSI_UNKNOWN, MINUTE_MS);
+	zassert_equal(upload_sched_rssi(&ctx, MINUTE_MS), UPLOAD_SCHED_RSSI_UNKNOWN,
+		      "signal still known");
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, MINUTE_MS));
+	zassert_equal(upload_sched_take(&ctx, MINUTE_MS), 0, "sent without signal");
+}
+
+ZTEST(upload_sched, test_rerequest_keeps_deadline)
+{
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 0));
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 20 * MINUTE_MS));
+	play_flat(0, -110, 40);
+	zassert_equal(due_minute[CLASS_TELEMETRY], 30, "deadline moved");
+	zassert_equal(ctx.stats[CLASS_TELEMETRY].requests, 2, "request not counted");
+}
+
+ZTEST(upload_sched, test_next)
+{
+	zassert_equal(upload_sched_next(&ctx, 0), -1, "nothing should be pending");
+
+	zassert_ok(upload_sched_request(&ctx, CLASS_OTA, 0));
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, 10 * MINUTE_MS));
+	zassert_equal(upload_sched_next(&ctx, 10 * MINUTE_MS), 30 * MINUTE_MS,
+		      "wrong next deadline");
+	zassert_equal(upload_sched_next(&ctx, 25 * MINUTE_MS), 15 * MINUTE_MS,
+		      "wrong next deadline");
+	zassert_equal(upload_sched_next(&ctx, 50 * MINUTE_MS), 0, "overdue not reported");
+
+	zassert_equal(upload_sched_take(&ctx, 50 * MINUTE_MS), BIT(CLASS_TELEMETRY),
+		      "wrong classes due");
+	zassert_equal(upload_sched_next(&ctx, 50 * MINUTE_MS), 310 * MINUTE_MS,
+		      "wrong next deadline");
+}
+
+ZTEST(upload_sched, test_clock_wraparound)
+{
+	uint32_t start = UINT32_MAX - 5 * MINUTE_MS;
+
+	zassert_ok(upload_sched_request(&ctx, CLASS_TELEMETRY, start));
+	upload_sched_signal(&ctx, -110, start);
+	zassert_equal(upload_sched_take(&ctx, start + 20 * MINUTE_MS), 0, "sent early");
+	zassert_equal(upload_sched_next(&ctx, start + 20 * MINUTE_MS), 10 * MINUTE_MS,
+		      "wrong next deadline");
+	zassert_equal(upload_sched_take(&ctx, start + 30 * MINUTE_MS), BIT(CLASS_TELEMETRY),
+		      "deadline lost across wraparound");
+}
+
+ZTEST(upload_sched, test_bad_config)
+{
+	struct upload_sched_cfg bad = cfg;
+
+	bad.num_classes = 0;
+	zassert_equal(upload_sched_init(&ctx, &bad), -EINVAL, "no classes accepted");
+	bad.num_classes = CONFIG_UPLOAD_SCHED_MAX_CLASSES + 1;
+	zassert_equal(upload_sched_init(&ctx, &bad), -EINVAL, "too many classes accepted");
+	zassert_equal(upload_sched_request(&ctx, CLASS_COUNT, 0), -EINVAL,
+		      "unknown class accepted");
+}
+
+ZTEST_SUITE(upload_sched, NULL, NULL, before, NULL, NULL);